@@ -21,6 +21,7 @@
 #include <common/cmdlib.hh>
 #include <common/bspfile.hh>
 #include <common/log.hh>
+#include <common/profiler.hh>
 #include <common/settings.hh>
 
 #include <fstream>
@@ -81,23 +82,58 @@ static void FindInfiniteChains(const mbsp_t &bsp)
     }
 }
 
-// TODO
-settings::common_settings bspinfo_options;
+namespace settings
+{
+setting_group output_group{"Output", 100, expected_source::commandline};
+
+class bspinfo_settings : public common_settings
+{
+public:
+    setting_set json_sections{this, "jsonsection", "\"name\" <multiple allowed>", &output_group,
+        "only write this top-level section (\"models\", \"faces\", \"textures\", ...) to the .bsp.json"};
+    setting_set json_exclude_sections{this, "nojsonsection", "\"name\" <multiple allowed>", &output_group,
+        "leave this top-level section out of the .bsp.json"};
+    setting_int32 atlassize{this, "atlassize", DEFAULT_LIGHTMAP_ATLAS_SIZE, 64, DEFAULT_LIGHTMAP_ATLAS_SIZE,
+        &output_group, "maximum width/height of the lightmap atlases packed for the .obj export"};
+
+    void set_parameters(int argc, const char **argv) override
+    {
+        common_settings::set_parameters(argc, argv);
+        program_description = "bspinfo prints information about .BSP files and converts them to JSON\n\n";
+        remainder_name = "bspfile [bspfiles]";
+    }
+};
+} // namespace settings
+
+settings::bspinfo_settings bspinfo_options;
 
-int main(int argc, char **argv)
+int main(int argc, const char **argv)
 {
     try {
         logging::preinitialize();
 
-        fmt::print("---- bspinfo / ericw-tools {} ----\n", ERICWTOOLS_VERSION);
-        if (argc == 1) {
-            printf("usage: bspinfo bspfile [bspfiles]\n");
-            exit(1);
+        bspinfo_options.preinitialize(argc, argv);
+        bspinfo_options.initialize(argc - 1, argv + 1);
+        bspinfo_options.postinitialize(argc, argv);
+
+        if (bspinfo_options.remainder.empty()) {
+            bspinfo_options.print_help(true);
+            return 1;
         }
 
-        for (int32_t i = 1; i < argc; i++) {
+        serialize_bsp_options_t json_options;
+        json_options.max_atlas_size = bspinfo_options.atlassize.value();
+
+        for (auto &section : bspinfo_options.json_sections.values()) {
+            json_options.sections.insert(section);
+        }
+        for (auto &section : bspinfo_options.json_exclude_sections.values()) {
+            json_options.exclude_sections.insert(section);
+        }
+
+        for (auto &arg : bspinfo_options.remainder) {
             printf("---------------------\n");
-            fs::path source = DefaultExtension(argv[i], ".bsp");
+            fs::path source = DefaultExtension(arg, ".bsp");
             fmt::print("{}\n", source);
 
             bspdata_t bsp;
@@ -111,7 +147,8 @@ int main(int argc, char **argv)
 
             ConvertBSPFormat(&bsp, &bspver_generic);
 
-            serialize_bsp(bsp, std::get<mbsp_t>(bsp.bsp), fs::path(source).replace_extension("bsp.json"));
+            serialize_bsp(
+                bsp, std::get<mbsp_t>(bsp.bsp), fs::path(source).replace_extension("bsp.json"), json_options);
 
             PrintBSPTextureUsage(std::get<mbsp_t>(bsp.bsp));
 
@@ -122,6 +159,8 @@ int main(int argc, char **argv)
             fs::clear();
         }
 
+        profiler::close();
+
         return 0;
     } catch (const std::exception &e) {
         exit_on_exception(e);
@@ -32,6 +32,7 @@
 #include <common/bsputils.hh>
 #include <common/decompile.hh>
 #include <common/mathlib.hh>
+#include <common/profiler.hh>
 #include <common/fs.hh>
 #include <common/settings.hh>
 #include <common/ostream.hh>
@@ -1562,5 +1563,7 @@ int bsputil_main(int _argc, const char **_argv)
         }
     }
 
+    profiler::close();
+
     return 0;
 }
@@ -24,12 +24,20 @@
 #include <common/ostream.hh>
 
 #include <fstream>
-#include <iomanip>
+#include <functional>
+#include <limits>
+#include <map>
+#include <optional>
+#include <set>
 #include <fmt/core.h>
 #include <common/json.hh>
 #include "common/fs.hh"
 #include "common/imglib.hh"
 #include "common/litfile.hh"
+#include "common/parallel.hh"
+
+#include <tbb/parallel_pipeline.h>
+#include <tbb/task_arena.h>
 
 #define STB_IMAGE_WRITE_STATIC
 #define STB_IMAGE_WRITE_IMPLEMENTATION
@@ -224,8 +232,103 @@ static faceextents_t get_face_extents(const mbsp_t &bsp, const bspxentries_t &bs
         (float)nth_bit(reinterpret_cast<const char *>(bspx.at("LMSHIFT").data())[&face - bsp.dfaces.data()])};
 }
 
+namespace
+{
+/**
+ * Skyline bottom-left rectangle packer. The skyline is the top edge of the
+ * area filled so far, stored as horizontal segments from left to right; each
+ * rectangle goes where its top edge ends up lowest.
+ */
+class skyline_packer_t
+{
+    struct segment_t
+    {
+        size_t x, y, width;
+    };
+
+    size_t width, height;
+    std::vector<segment_t> skyline;
+
+    // y a rectangle of the given width would sit at if its left edge was at
+    // skyline[i], or nullopt if it doesn't fit there
+    std::optional<size_t> fit(size_t i, size_t w, size_t h) const
+    {
+        if (skyline[i].x + w > width) {
+            return std::nullopt;
+        }
+
+        size_t y = 0;
+
+        for (size_t left = w; left > 0; i++) {
+            y = std::max(y, skyline[i].y);
+
+            if (y + h > height) {
+                return std::nullopt;
+            }
+
+            left -= std::min(left, skyline[i].width);
+        }
+
+        return y;
+    }
+
+public:
+    skyline_packer_t(size_t width, size_t height)
+        : width(width),
+          height(height),
+          skyline{{0, 0, width}}
+    {
+    }
+
+    std::optional<qvec2i> insert(size_t w, size_t h)
+    {
+        size_t best = skyline.size();
+        size_t best_top = std::numeric_limits<size_t>::max();
+        size_t best_y = 0;
+
+        for (size_t i = 0; i < skyline.size(); i++) {
+            if (auto y = fit(i, w, h); y && *y + h < best_top) {
+                best = i;
+                best_top = *y + h;
+                best_y = *y;
+            }
+        }
+
+        if (best == skyline.size()) {
+            return std::nullopt;
+        }
+
+        const size_t x = skyline[best].x;
+
+        // replace the segments under the rectangle with its top edge
+        size_t end = best;
+        while (end < skyline.size() && skyline[end].x + skyline[end].width <= x + w) {
+            end++;
+        }
+        if (end < skyline.size() && skyline[end].x < x + w) {
+            skyline[end].width -= x + w - skyline[end].x;
+            skyline[end].x = x + w;
+        }
+        skyline.erase(skyline.begin() + best, skyline.begin() + end);
+        skyline.insert(skyline.begin() + best, segment_t{x, best_top, w});
+
+        // merge neighbours at the same height
+        for (size_t i = 1; i < skyline.size();) {
+            if (skyline[i - 1].y == skyline[i].y) {
+                skyline[i - 1].width += skyline[i].width;
+                skyline.erase(skyline.begin() + i);
+            } else {
+                i++;
+            }
+        }
+
+        return qvec2i{static_cast<int>(x), static_cast<int>(best_y)};
+    }
+};
+} // namespace
+
 full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx, const std::vector<uint8_t> &litdata,
-    const std::vector<uint32_t> &hdr_litdata, bool use_bspx, bool use_decoupled)
+    const std::vector<uint32_t> &hdr_litdata, bool use_bspx, bool use_decoupled, size_t max_atlas_size)
 {
     struct face_rect
     {
@@ -233,17 +336,10 @@ full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx,
         faceextents_t extents;
         int32_t lightofs;
 
-        // lightmap data for this face
-        int width = 0, height = 0;
-        std::vector<qvec4b> rgba8_samples;
-        std::vector<uint32_t> e5brg9_samples;
-
         size_t atlas = 0;
         size_t x = 0, y = 0;
     };
 
-    constexpr size_t atlas_size = 512;
-
     bool is_hdr = false;
     const uint32_t *hdr_lightdata_source = nullptr; // 1 packed uint32 (e5brg9) per sample
     const uint8_t *lightdata_source = nullptr; // either greyscale (1 byte per sample) or rgb (3 bytes per sample)
@@ -267,15 +363,7 @@ full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx,
         lightdata_source = bsp.dlightdata.data();
     }
 
-    struct atlas
-    {
-        size_t current_x = 0, current_y = 0;
-        size_t tallest = 0;
-    };
-
-    std::vector<atlas> atlasses;
     std::vector<face_rect> rectangles;
-    size_t current_atlas = 0;
     rectangles.reserve(bsp.dfaces.size());
 
     imemstream bspx_lmoffset(nullptr, 0);
@@ -337,149 +425,152 @@ full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx,
         return a_height > b_height;
     });
 
-    // pack
+    // start with the smallest power of two atlas that could hold all of the faces,
+    // and grow it (up to max_atlas_size) until they fit in one
+    size_t used_samples = 0;
+    size_t largest_face = 1;
+
     for (auto &rect : rectangles) {
-        while (true) {
-            if (current_atlas == atlasses.size()) {
-                atlasses.emplace_back();
-            }
+        used_samples += rect.extents.width() * rect.extents.height();
+        largest_face = std::max({largest_face, (size_t)rect.extents.width(), (size_t)rect.extents.height()});
+    }
+
+    size_t atlas_size = std::max<size_t>(64, largest_face);
+    while (atlas_size < max_atlas_size && atlas_size * atlas_size < used_samples) {
+        atlas_size *= 2;
+    }
+    atlas_size = std::max(largest_face, std::min(atlas_size, max_atlas_size));
+
+    std::vector<skyline_packer_t> atlasses;
+
+    // pack
+    while (true) {
+        atlasses.clear();
 
-            atlas &atl = atlasses[current_atlas];
+        for (auto &rect : rectangles) {
+            const size_t width = rect.extents.width(), height = rect.extents.height();
+            std::optional<qvec2i> pos;
 
-            if (atl.current_x + rect.extents.width() >= atlas_size) {
-                atl.current_x = 0;
-                atl.current_y += atl.tallest;
-                atl.tallest = 0;
+            for (rect.atlas = 0; rect.atlas < atlasses.size(); rect.atlas++) {
+                if ((pos = atlasses[rect.atlas].insert(width, height))) {
+                    break;
+                }
             }
 
-            if (atl.current_y + rect.extents.height() >= atlas_size) {
-                current_atlas++;
-                continue;
+            if (!pos) {
+                pos = atlasses.emplace_back(atlas_size, atlas_size).insert(width, height);
             }
 
-            atl.tallest = std::max(atl.tallest, (size_t)rect.extents.height());
-            rect.x = atl.current_x;
-            rect.y = atl.current_y;
-            rect.atlas = current_atlas;
+            rect.x = (*pos)[0];
+            rect.y = (*pos)[1];
+        }
 
-            atl.current_x += rect.extents.width();
+        if (atlasses.size() == 1 || atlas_size >= max_atlas_size) {
             break;
         }
+
+        atlas_size = std::min(atlas_size * 2, max_atlas_size);
     }
 
     // calculate final atlas texture size
-    single_style_atlas_t full_atlas;
-    size_t sqrt_count = ceil(sqrt(atlasses.size()));
+    const size_t sqrt_count = ceil(sqrt(atlasses.size()));
     size_t trimmed_width = 0, trimmed_height = 0;
 
-    for (size_t i = 0; i < atlasses.size(); i++) {
-        size_t atlas_x = (i % sqrt_count) * atlas_size;
-        size_t atlas_y = (i / sqrt_count) * atlas_size;
-
-        for (auto &rect : rectangles) {
-            if (rect.atlas == i) {
-                rect.x += atlas_x;
-                rect.y += atlas_y;
-                trimmed_width = std::max(trimmed_width, rect.x + rect.extents.width());
-                trimmed_height = std::max(trimmed_height, rect.y + rect.extents.height());
-            }
-#if 0
-            for (size_t x = 0; x < rect.texture->width; x++) {
-                for (size_t y = 0; y < rect.texture->height; y++) {
-                    auto &src_pixel = rect.texture->pixels[(y * rect.texture->width) + x];
-                    auto &dst_pixel = full_atlas.pixels[((atlas_y + y + rect.y) * full_atlas.width) + (atlas_x + x + rect.x)];
-                    dst_pixel = src_pixel;
-                }
-            }
-#endif
-        }
+    for (auto &rect : rectangles) {
+        rect.x += (rect.atlas % sqrt_count) * atlas_size;
+        rect.y += (rect.atlas / sqrt_count) * atlas_size;
+        trimmed_width = std::max(trimmed_width, rect.x + rect.extents.width());
+        trimmed_height = std::max(trimmed_height, rect.y + rect.extents.height());
     }
 
-    full_atlas.width = trimmed_width;
-    full_atlas.height = trimmed_height;
-    if (is_hdr)
-        full_atlas.e5brg9_samples.resize(full_atlas.width * full_atlas.height);
-    else
-        full_atlas.rgba8_samples.resize(full_atlas.width * full_atlas.height);
-
     full_atlas_t result;
+    result.num_atlases = atlasses.size();
+    result.atlas_size = atlas_size;
+    result.width = trimmed_width;
+    result.height = trimmed_height;
+    result.used_samples = used_samples;
 
-    // compile all of the styles that are available
+    // find the styles that are used, so each only needs one pass over the faces
     // TODO: LMSTYLE16
-    for (size_t i = 0; i < INVALID_LIGHTSTYLE_OLD - 1; i++) {
-        bool any_written = false;
+    std::set<int> styles;
 
+    if (!bsp.dlightdata.empty()) {
         for (auto &rect : rectangles) {
-            int32_t style_index = -1;
-
             for (size_t s = 0; s < MAXLIGHTMAPS; s++) {
-                if (rect.face->styles[s] == i) {
-                    style_index = s;
-                    break;
+                if (rect.face->styles[s] < INVALID_LIGHTSTYLE_OLD - 1) {
+                    styles.insert(rect.face->styles[s]);
                 }
             }
+        }
+    }
 
-            if (style_index == -1) {
-                continue;
-            }
-
-            if (bsp.dlightdata.empty()) {
-                continue;
-            }
-
-            if (!is_hdr) {
-                auto in_pixel = lightdata_source + ((is_lit ? 3 : 1) * rect.lightofs) +
-                                (rect.extents.numsamples() * (is_rgb ? 3 : 1) * style_index);
-
-                for (size_t y = 0; y < rect.extents.height(); y++) {
-                    for (size_t x = 0; x < rect.extents.width(); x++) {
-                        size_t ox = rect.x + x;
-                        size_t oy = rect.y + y;
+    for (const int i : styles) {
+        single_style_atlas_t &full_atlas = result.style_to_lightmap_atlas[i];
+        full_atlas.width = trimmed_width;
+        full_atlas.height = trimmed_height;
+        if (is_hdr)
+            full_atlas.e5brg9_samples.resize(full_atlas.width * full_atlas.height);
+        else
+            full_atlas.rgba8_samples.resize(full_atlas.width * full_atlas.height);
+
+        // faces don't overlap, so they can be decoded in parallel
+        logging::parallel_for_each(
+            rectangles,
+            [&](const face_rect &rect) {
+                int32_t style_index = -1;
+
+                for (size_t s = 0; s < MAXLIGHTMAPS; s++) {
+                    if (rect.face->styles[s] == i) {
+                        style_index = s;
+                        break;
+                    }
+                }
 
-                        auto &out_pixel = full_atlas.rgba8_samples[(oy * full_atlas.width) + ox];
-                        out_pixel[3] = 255;
+                if (style_index == -1) {
+                    return;
+                }
 
-                        if (is_rgb) {
-                            out_pixel[0] = *in_pixel++;
-                            out_pixel[1] = *in_pixel++;
-                            out_pixel[2] = *in_pixel++;
-                        } else {
-                            out_pixel[0] = out_pixel[1] = out_pixel[2] = *in_pixel++;
+                if (!is_hdr) {
+                    auto in_pixel = lightdata_source + ((is_lit ? 3 : 1) * rect.lightofs) +
+                                    (rect.extents.numsamples() * (is_rgb ? 3 : 1) * style_index);
+
+                    for (size_t y = 0; y < rect.extents.height(); y++) {
+                        for (size_t x = 0; x < rect.extents.width(); x++) {
+                            size_t ox = rect.x + x;
+                            size_t oy = rect.y + y;
+
+                            auto &out_pixel = full_atlas.rgba8_samples[(oy * full_atlas.width) + ox];
+                            out_pixel[3] = 255;
+
+                            if (is_rgb) {
+                                out_pixel[0] = *in_pixel++;
+                                out_pixel[1] = *in_pixel++;
+                                out_pixel[2] = *in_pixel++;
+                            } else {
+                                out_pixel[0] = out_pixel[1] = out_pixel[2] = *in_pixel++;
+                            }
                         }
                     }
-                }
-            } else {
-                // hdr
+                } else {
+                    // hdr
 
-                auto in_pixel = hdr_lightdata_source + rect.lightofs + (rect.extents.numsamples() * style_index);
+                    auto in_pixel = hdr_lightdata_source + rect.lightofs + (rect.extents.numsamples() * style_index);
 
-                for (size_t y = 0; y < rect.extents.height(); y++) {
-                    for (size_t x = 0; x < rect.extents.width(); x++) {
-                        size_t ox = rect.x + x;
-                        size_t oy = rect.y + y;
+                    for (size_t y = 0; y < rect.extents.height(); y++) {
+                        for (size_t x = 0; x < rect.extents.width(); x++) {
+                            size_t ox = rect.x + x;
+                            size_t oy = rect.y + y;
 
-                        auto &out_pixel = full_atlas.e5brg9_samples[(oy * full_atlas.width) + ox];
-                        out_pixel = *in_pixel++;
+                            auto &out_pixel = full_atlas.e5brg9_samples[(oy * full_atlas.width) + ox];
+                            out_pixel = *in_pixel++;
+                        }
                     }
                 }
-            }
-
-            any_written = true;
-        }
-
-        if (!any_written) {
-            continue;
-        }
-
-        // copy out the atlas texture
-        result.style_to_lightmap_atlas[i] = full_atlas;
-
-        std::fill(full_atlas.rgba8_samples.begin(), full_atlas.rgba8_samples.end(), qvec4b{});
-
-        std::fill(full_atlas.e5brg9_samples.begin(), full_atlas.e5brg9_samples.end(), uint32_t{});
+            },
+            logging::progress_t::NONE);
     }
 
-    auto ExportLightmapUVs = [&full_atlas, &result](const mbsp_t *bsp, const face_rect &face) {
+    auto ExportLightmapUVs = [&result](const mbsp_t *bsp, const face_rect &face) {
         std::vector<qvec2f> face_lightmap_uvs;
 
         for (int i = 0; i < face.face->numedges; i++) {
@@ -494,8 +585,8 @@ full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx,
             tc[0] += 0.5;
             tc[1] += 0.5;
 
-            tc[0] /= full_atlas.width;
-            tc[1] /= full_atlas.height;
+            tc[0] /= result.width;
+            tc[1] /= result.height;
 
             face_lightmap_uvs.push_back(tc);
         }
@@ -511,16 +602,20 @@ full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx,
 }
 
 static void export_obj_and_lightmaps(const mbsp_t &bsp, const bspxentries_t &bspx, bool use_bspx, bool use_decoupled,
-    fs::path obj_path, const fs::path &lightmaps_path_base)
+    size_t max_atlas_size, fs::path obj_path, const fs::path &lightmaps_path_base)
 {
     // FIXME: pass in .lit
     // FIXME: pass in hdr .lit
-    const auto atlas = build_lightmap_atlas(bsp, bspx, {}, {}, use_bspx, use_decoupled);
+    const auto atlas = build_lightmap_atlas(bsp, bspx, {}, {}, use_bspx, use_decoupled, max_atlas_size);
 
     if (atlas.facenum_to_lightmap_uvs.empty()) {
         return;
     }
 
+    logging::print("lightmap atlas: {} faces in {} {}x{} atlas(es), {}x{} texels, {:.1f}% occupied\n",
+        atlas.facenum_to_lightmap_uvs.size(), atlas.num_atlases, atlas.atlas_size, atlas.atlas_size, atlas.width,
+        atlas.height, atlas.occupancy() * 100.0);
+
     // e.g. mapname.bsp.lm
     const std::string stem = lightmaps_path_base.stem().string();
 
@@ -607,15 +702,183 @@ static void export_obj_and_lightmaps(const mbsp_t &bsp, const bspxentries_t &bsp
     logging::print("wrote {}\n", obj_path);
 }
 
-void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &name)
+namespace
+{
+/**
+ * Writes a json object with one key per section of the .bsp, laid out exactly
+ * as `std::setw(4) << j` prints the equivalent json, without ever holding the
+ * whole document. Each section is split into pieces of text which are rendered
+ * in parallel and written to the file in order as they finish.
+ */
+class json_stream_writer_t
 {
-    json j = json::object();
+    static constexpr int INDENT = 4;
+    // array elements / bytes rendered per piece
+    static constexpr size_t ELEMENTS_PER_PIECE = 1024;
+    static constexpr size_t BYTES_PER_PIECE = 1024 * 1024;
 
-    if (!bsp.dmodels.empty()) {
-        json &models = (j.emplace("models", json::array())).first.value();
+    using piece_t = std::function<std::string()>;
+
+    const serialize_bsp_options_t &options;
+
+    // same ordering as json::object_t, so the sections come out in the same order
+    std::map<std::string, std::vector<piece_t>> sections;
+
+    // appends value as dump(INDENT) prints it nested `depth` levels deep;
+    // strings are escaped, so the only raw newlines are the ones dump() adds
+    static void append_json(std::string &out, const json &value, int depth)
+    {
+        for (char c : value.dump(INDENT)) {
+            out.push_back(c);
+
+            if (c == '\n') {
+                out.append(depth * INDENT, ' ');
+            }
+        }
+    }
 
-        for (auto &src_model : bsp.dmodels) {
-            json &model = models.insert(models.end(), json::object()).value();
+    static piece_t literal(std::string text)
+    {
+        return [text = std::move(text)]() { return text; };
+    }
+
+public:
+    explicit json_stream_writer_t(const serialize_bsp_options_t &options)
+        : options(options)
+    {
+    }
+
+    bool wants(const std::string &key) const
+    {
+        return (options.sections.empty() || options.sections.contains(key)) &&
+               !options.exclude_sections.contains(key);
+    }
+
+    // a section whose value is small enough to be built as json in one go
+    void add_value(const std::string &key, std::function<json()> make)
+    {
+        if (!wants(key)) {
+            return;
+        }
+
+        sections[key].push_back([make = std::move(make)]() {
+            std::string out;
+            append_json(out, make(), 1);
+            return out;
+        });
+    }
+
+    // a section with one array element per entry of src, built by make_element.
+    // src must outlive write()
+    template<typename Container, typename F>
+    void add_array(const std::string &key, const Container &src, F make_element)
+    {
+        if (!wants(key)) {
+            return;
+        }
+
+        auto &pieces = sections[key];
+
+        if (src.empty()) {
+            pieces.push_back(literal("[]"));
+            return;
+        }
+
+        pieces.push_back(literal("["));
+
+        for (size_t first = 0; first < src.size(); first += ELEMENTS_PER_PIECE) {
+            const size_t last = std::min(first + ELEMENTS_PER_PIECE, src.size());
+
+            pieces.push_back([&src, make_element, first, last]() {
+                std::string out;
+
+                for (size_t i = first; i < last; i++) {
+                    out += (i == 0) ? "\n" : ",\n";
+                    out.append(2 * INDENT, ' ');
+                    append_json(out, make_element(src[i]), 2);
+                }
+
+                return out;
+            });
+        }
+
+        pieces.push_back(literal("\n" + std::string(INDENT, ' ') + "]"));
+    }
+
+    // a section containing hex_string(bytes). bytes must outlive write()
+    void add_hex_string(const std::string &key, const std::vector<uint8_t> &bytes)
+    {
+        if (!wants(key)) {
+            return;
+        }
+
+        auto &pieces = sections[key];
+
+        // hex digits never need escaping, so the string can be split anywhere
+        pieces.push_back(literal("\""));
+
+        for (size_t first = 0; first < bytes.size(); first += BYTES_PER_PIECE) {
+            const size_t count = std::min(BYTES_PER_PIECE, bytes.size() - first);
+
+            pieces.push_back([&bytes, first, count]() { return hex_string(bytes.data() + first, count); });
+        }
+
+        pieces.push_back(literal("\""));
+    }
+
+    void write(const fs::path &name) const
+    {
+        std::vector<piece_t> pieces;
+
+        for (auto &[key, section] : sections) {
+            pieces.push_back(
+                literal((pieces.empty() ? "{\n" : ",\n") + std::string(INDENT, ' ') + json(key).dump() + ": "));
+            pieces.insert(pieces.end(), section.begin(), section.end());
+        }
+
+        pieces.push_back(literal(pieces.empty() ? "{}" : "\n}"));
+
+        std::ofstream stream(name, std::fstream::out | std::fstream::trunc);
+        size_t next = 0;
+
+        // render up to a few pieces per thread ahead of the one being written
+        tbb::parallel_pipeline(4 * tbb::this_task_arena::max_concurrency(),
+            tbb::make_filter<void, size_t>(tbb::filter_mode::serial_in_order,
+                [&](tbb::flow_control &fc) -> size_t {
+                    if (next == pieces.size()) {
+                        fc.stop();
+                        return 0;
+                    }
+                    return next++;
+                }) &
+                tbb::make_filter<size_t, std::string>(
+                    tbb::filter_mode::parallel, [&](size_t i) { return pieces[i](); }) &
+                tbb::make_filter<std::string, void>(
+                    tbb::filter_mode::serial_in_order, [&](const std::string &text) { stream << text; }));
+    }
+};
+} // namespace
+
+const std::array<const char *, 19> bsp_json_sections = {"bspxentries", "brushes", "brushsides", "clipnodes", "edges",
+    "entdata", "faces", "leafbrushes", "leaffaces", "leafs", "lightdata", "models", "nodes", "planes", "surfedges",
+    "texinfo", "textures", "vertexes", "visdata"};
+
+void serialize_bsp(
+    const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &name, const serialize_bsp_options_t &options)
+{
+    for (auto *requested : {&options.sections, &options.exclude_sections}) {
+        for (auto &section : *requested) {
+            if (std::find(bsp_json_sections.begin(), bsp_json_sections.end(), section) == bsp_json_sections.end()) {
+                FError("unknown .json section \"{}\"", section);
+            }
+        }
+    }
+
+    json_stream_writer_t writer(options);
+
+    if (!bsp.dmodels.empty()) {
+        writer.add_array("models", bsp.dmodels, [](const dmodelh2_t &src_model) {
+            json model = json::object();
 
             model.push_back({"mins", src_model.mins});
             model.push_back({"maxs", src_model.maxs});
@@ -624,41 +887,46 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
             model.push_back({"visleafs", src_model.visleafs});
             model.push_back({"firstface", src_model.firstface});
             model.push_back({"numfaces", src_model.numfaces});
-        }
+
+            return model;
+        });
     }
 
     if (bsp.dvis.bits.size()) {
 
         if (bsp.dvis.bit_offsets.size()) {
-            json &visdata = (j.emplace("visdata", json::object())).first.value();
+            writer.add_value("visdata", [&bsp]() {
+                json visdata = json::object();
 
-            json &pvs = (visdata.emplace("pvs", json::array())).first.value();
-            json &phs = (visdata.emplace("pvs", json::array())).first.value();
+                // NOTE: both of these are "pvs", so the PHS offsets are interleaved with the PVS ones
+                json &pvs = (visdata.emplace("pvs", json::array())).first.value();
+                json &phs = (visdata.emplace("pvs", json::array())).first.value();
 
-            for (auto &offset : bsp.dvis.bit_offsets) {
-                pvs.push_back(offset[VIS_PVS]);
-                phs.push_back(offset[VIS_PHS]);
-            }
+                for (auto &offset : bsp.dvis.bit_offsets) {
+                    pvs.push_back(offset[VIS_PVS]);
+                    phs.push_back(offset[VIS_PHS]);
+                }
+
+                visdata["bits"] = hex_string(bsp.dvis.bits.data(), bsp.dvis.bits.size());
 
-            visdata["bits"] = hex_string(bsp.dvis.bits.data(), bsp.dvis.bits.size());
+                return visdata;
+            });
         } else {
-            j["visdata"] = hex_string(bsp.dvis.bits.data(), bsp.dvis.bits.size());
+            writer.add_hex_string("visdata", bsp.dvis.bits);
         }
     }
 
     if (bsp.dlightdata.size()) {
-        j["lightdata"] = hex_string(bsp.dlightdata.data(), bsp.dlightdata.size());
+        writer.add_hex_string("lightdata", bsp.dlightdata);
     }
 
     if (!bsp.dentdata.empty()) {
-        j["entdata"] = bsp.dentdata + '\0';
+        writer.add_value("entdata", [&bsp]() { return json(bsp.dentdata + '\0'); });
     }
 
     if (!bsp.dleafs.empty()) {
-        json &leafs = (j.emplace("leafs", json::array())).first.value();
-
-        for (auto &src_leaf : bsp.dleafs) {
-            json &leaf = leafs.insert(leafs.end(), json::object()).value();
+        writer.add_array("leafs", bsp.dleafs, [](const mleaf_t &src_leaf) {
+            json leaf = json::object();
 
             leaf.push_back({"contents", src_leaf.contents});
             leaf.push_back({"visofs", src_leaf.visofs});
@@ -671,34 +939,30 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
             leaf.push_back({"area", src_leaf.area});
             leaf.push_back({"firstleafbrush", src_leaf.firstleafbrush});
             leaf.push_back({"numleafbrushes", src_leaf.numleafbrushes});
-        }
+
+            return leaf;
+        });
     }
 
     if (!bsp.dplanes.empty()) {
-        json &planes = (j.emplace("planes", json::array())).first.value();
-
-        for (auto &src_plane : bsp.dplanes) {
-            json &plane = planes.insert(planes.end(), json::object()).value();
+        writer.add_array("planes", bsp.dplanes, [](const dplane_t &src_plane) {
+            json plane = json::object();
 
             plane.push_back({"normal", src_plane.normal});
             plane.push_back({"dist", src_plane.dist});
             plane.push_back({"type", src_plane.type});
-        }
+
+            return plane;
+        });
     }
 
     if (!bsp.dvertexes.empty()) {
-        json &vertexes = (j.emplace("vertexes", json::array())).first.value();
-
-        for (auto &src_vertex : bsp.dvertexes) {
-            vertexes.insert(vertexes.end(), src_vertex);
-        }
+        writer.add_array("vertexes", bsp.dvertexes, [](const qvec3f &src_vertex) { return json(src_vertex); });
     }
 
     if (!bsp.dnodes.empty()) {
-        json &nodes = (j.emplace("nodes", json::array())).first.value();
-
-        for (auto &src_node : bsp.dnodes) {
-            json &node = nodes.insert(nodes.end(), json::object()).value();
+        writer.add_array("nodes", bsp.dnodes, [&bsp](const bsp2_dnode_t &src_node) {
+            json node = json::object();
 
             node.push_back({"planenum", src_node.planenum});
             node.push_back({"children", json::array({src_node.children[0], src_node.children[1]})});
@@ -710,14 +974,14 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
             // human-readable plane
             auto &plane = bsp.dplanes.at(src_node.planenum);
             node.push_back({"plane", json::array({plane.normal[0], plane.normal[1], plane.normal[2], plane.dist})});
-        }
+
+            return node;
+        });
     }
 
     if (!bsp.texinfo.empty()) {
-        json &texinfos = (j.emplace("texinfo", json::array())).first.value();
-
-        for (auto &src_texinfo : bsp.texinfo) {
-            json &texinfo = texinfos.insert(texinfos.end(), json::object()).value();
+        writer.add_array("texinfo", bsp.texinfo, [&bspdata](const mtexinfo_t &src_texinfo) {
+            json texinfo = json::object();
 
             texinfo.push_back({"vecs", json::array({json::array({src_texinfo.vecs.at(0, 0), src_texinfo.vecs.at(0, 1),
                                                         src_texinfo.vecs.at(0, 2), src_texinfo.vecs.at(0, 3)}),
@@ -729,14 +993,14 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
             texinfo.push_back({"value", src_texinfo.value});
             texinfo.push_back({"texture", std::string(src_texinfo.texture.data())});
             texinfo.push_back({"nexttexinfo", src_texinfo.nexttexinfo});
-        }
+
+            return texinfo;
+        });
     }
 
     if (!bsp.dfaces.empty()) {
-        json &faces = (j.emplace("faces", json::array())).first.value();
-
-        for (auto &src_face : bsp.dfaces) {
-            json &face = faces.insert(faces.end(), json::object()).value();
+        writer.add_array("faces", bsp.dfaces, [&bsp](const mface_t &src_face) {
+            json face = json::object();
 
             face.push_back({"planenum", src_face.planenum});
             face.push_back({"side", src_face.side});
@@ -760,85 +1024,70 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
                 face.push_back({"lightmap", serialize_image(lm)});
             }
 #endif
-        }
+
+            return face;
+        });
     }
 
     if (!bsp.dclipnodes.empty()) {
-        json &clipnodes = (j.emplace("clipnodes", json::array())).first.value();
-
-        for (auto &src_clipnodes : bsp.dclipnodes) {
-            json &clipnode = clipnodes.insert(clipnodes.end(), json::object()).value();
+        writer.add_array("clipnodes", bsp.dclipnodes, [](const bsp2_dclipnode_t &src_clipnodes) {
+            json clipnode = json::object();
 
             clipnode.push_back({"planenum", src_clipnodes.planenum});
             clipnode.push_back({"children", json::array({src_clipnodes.children[0], src_clipnodes.children[1]})});
-        }
+
+            return clipnode;
+        });
     }
 
     if (!bsp.dedges.empty()) {
-        json &edges = (j.emplace("edges", json::array())).first.value();
-
-        for (auto &src_edge : bsp.dedges) {
-            edges.insert(edges.end(), src_edge);
-        }
+        writer.add_array("edges", bsp.dedges, [](const bsp2_dedge_t &src_edge) { return json(src_edge); });
     }
 
     if (!bsp.dleaffaces.empty()) {
-        json &leaffaces = (j.emplace("leaffaces", json::array())).first.value();
-
-        for (auto &src_leafface : bsp.dleaffaces) {
-            leaffaces.insert(leaffaces.end(), src_leafface);
-        }
+        writer.add_array("leaffaces", bsp.dleaffaces, [](uint32_t src_leafface) { return json(src_leafface); });
     }
 
     if (!bsp.dsurfedges.empty()) {
-        json &surfedges = (j.emplace("surfedges", json::array())).first.value();
-
-        for (auto &src_surfedges : bsp.dsurfedges) {
-            surfedges.insert(surfedges.end(), src_surfedges);
-        }
+        writer.add_array("surfedges", bsp.dsurfedges, [](int32_t src_surfedges) { return json(src_surfedges); });
     }
 
     if (!bsp.dbrushsides.empty()) {
-        json &brushsides = (j.emplace("brushsides", json::array())).first.value();
-
-        for (auto &src_brushside : bsp.dbrushsides) {
-            json &brushside = brushsides.insert(brushsides.end(), json::object()).value();
+        writer.add_array("brushsides", bsp.dbrushsides, [](const q2_dbrushside_qbism_t &src_brushside) {
+            json brushside = json::object();
 
             brushside.push_back({"planenum", src_brushside.planenum});
             brushside.push_back({"texinfo", src_brushside.texinfo});
-        }
+
+            return brushside;
+        });
     }
 
     if (!bsp.dbrushes.empty()) {
-        json &brushes = (j.emplace("brushes", json::array())).first.value();
-
-        for (auto &src_brush : bsp.dbrushes) {
-            json &brush = brushes.insert(brushes.end(), json::object()).value();
+        writer.add_array("brushes", bsp.dbrushes, [](const dbrush_t &src_brush) {
+            json brush = json::object();
 
             brush.push_back({"firstside", src_brush.firstside});
             brush.push_back({"numsides", src_brush.numsides});
             brush.push_back({"contents", src_brush.contents});
-        }
+
+            return brush;
+        });
     }
 
     if (!bsp.dleafbrushes.empty()) {
-        json &leafbrushes = (j.emplace("leafbrushes", json::array())).first.value();
-
-        for (auto &src_leafbrush : bsp.dleafbrushes) {
-            leafbrushes.push_back(src_leafbrush);
-        }
+        writer.add_array(
+            "leafbrushes", bsp.dleafbrushes, [](uint32_t src_leafbrush) { return json(src_leafbrush); });
     }
 
     if (bsp.dtex.textures.size()) {
-        json &textures = (j.emplace("textures", json::array())).first.value();
-
-        for (auto &src_tex : bsp.dtex.textures) {
+        writer.add_array("textures", bsp.dtex.textures, [&bspdata](const miptex_t &src_tex) {
             if (src_tex.null_texture) {
                 // use json null to indicate offset -1
-                textures.insert(textures.end(), json(nullptr));
-                continue;
+                return json(nullptr);
             }
-            json &tex = textures.insert(textures.end(), json::object()).value();
+
+            json tex = json::object();
 
             tex.push_back({"name", src_tex.name});
             tex.push_back({"width", src_tex.width});
@@ -849,25 +1098,34 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
                 mips.push_back(
                     serialize_image(img::load_mip(src_tex.name, src_tex.data, false, bspdata.loadversion->game)));
             }
-        }
+
+            return tex;
+        });
     }
 
-    if (!bspdata.bspx.entries.empty()) {
-        json &bspxentries = (j.emplace("bspxentries", json::array())).first.value();
+    // BSPX lumps are stored in a map, so index them through a vector
+    std::vector<const bspxentries_t::value_type *> bspx_lumps;
+
+    for (auto &lump : bspdata.bspx.entries) {
+        bspx_lumps.push_back(&lump);
+    }
 
-        for (auto &lump : bspdata.bspx.entries) {
-            json &entry = bspxentries.insert(bspxentries.end(), json::object()).value();
-            entry["lumpname"] = lump.first;
+    if (!bspx_lumps.empty()) {
+        writer.add_array("bspxentries", bspx_lumps, [](const bspxentries_t::value_type *lump) {
+            json entry = json::object();
+            entry["lumpname"] = lump->first;
 
-            if (lump.first == "BRUSHLIST") {
-                entry["models"] = serialize_bspxbrushlist(lump.second);
-            } else if (lump.first == "DECOUPLED_LM") {
-                entry["faces"] = serialize_bspx_decoupled_lm(lump.second);
+            if (lump->first == "BRUSHLIST") {
+                entry["models"] = serialize_bspxbrushlist(lump->second);
+            } else if (lump->first == "DECOUPLED_LM") {
+                entry["faces"] = serialize_bspx_decoupled_lm(lump->second);
             } else {
                 // unhandled BSPX lump, just write the raw data
-                entry["lumpdata"] = hex_string(lump.second.data(), lump.second.size());
+                entry["lumpdata"] = hex_string(lump->second.data(), lump->second.size());
             }
-        }
+
+            return entry;
+        });
     }
 
     // lightmap atlas
@@ -884,10 +1142,10 @@ void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &
         }
     }
 #endif
-    export_obj_and_lightmaps(bsp, bspdata.bspx.entries, false, true, fs::path(name).replace_extension(".geometry.obj"),
-        fs::path(name).replace_extension(".lm.png"));
+    export_obj_and_lightmaps(bsp, bspdata.bspx.entries, false, true, options.max_atlas_size,
+        fs::path(name).replace_extension(".geometry.obj"), fs::path(name).replace_extension(".lm.png"));
 
-    std::ofstream(name, std::fstream::out | std::fstream::trunc) << std::setw(4) << j;
+    writer.write(name);
 
     logging::print("wrote {}\n", name);
 }
@@ -0,0 +1,211 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/bspquery.hh>
+#include <common/bspfile.hh>
+
+#include <cmath>
+
+bsp_point_query_t::bsp_point_query_t(const mbsp_t *bsp)
+    : _bsp(bsp)
+{
+    const bool is_q2 = bsp->loadversion->game->id == GAME_QUAKE_II;
+
+    _leaf_solid.reserve(bsp->dleafs.size());
+
+    for (auto &leaf : bsp->dleafs) {
+        if (is_q2) {
+            _leaf_solid.push_back((leaf.contents & Q2_CONTENTS_SOLID) != 0);
+        } else {
+            _leaf_solid.push_back(leaf.contents == CONTENTS_SOLID || leaf.contents == CONTENTS_SKY);
+        }
+    }
+
+    // original node number -> flattened node number
+    std::vector<int32_t> remap(bsp->dnodes.size(), -1);
+    std::vector<int32_t> queue;
+
+    _nodes.reserve(bsp->dnodes.size());
+    _roots.reserve(bsp->dmodels.size());
+
+    auto add_node = [&](int32_t nodenum) {
+        if (remap[nodenum] == -1) {
+            remap[nodenum] = static_cast<int32_t>(_nodes.size());
+            _nodes.emplace_back();
+            queue.push_back(nodenum);
+        }
+        return remap[nodenum];
+    };
+
+    for (auto &model : bsp->dmodels) {
+        const int32_t headnode = model.headnode[0];
+
+        if (headnode < 0) {
+            _roots.push_back(headnode);
+            continue;
+        }
+
+        queue.clear();
+        _roots.push_back(add_node(headnode));
+
+        // breadth-first; queue grows as children are added
+        for (size_t i = 0; i < queue.size(); i++) {
+            const bsp2_dnode_t &src = bsp->dnodes[queue[i]];
+            const dplane_t &plane = bsp->dplanes[src.planenum];
+            std::array<int32_t, 2> children;
+
+            for (size_t side = 0; side < 2; side++) {
+                children[side] = src.children[side] >= 0 ? add_node(src.children[side]) : src.children[side];
+            }
+
+            node_t &dst = _nodes[remap[queue[i]]];
+            dst.children = children;
+            dst.dist = plane.dist;
+
+            switch (static_cast<plane_type_t>(plane.type)) {
+                case plane_type_t::PLANE_X: dst.normal = {1, 0, 0}; break;
+                case plane_type_t::PLANE_Y: dst.normal = {0, 1, 0}; break;
+                case plane_type_t::PLANE_Z: dst.normal = {0, 0, 1}; break;
+                default: dst.normal = plane.normal; break;
+            }
+        }
+    }
+}
+
+const mleaf_t *bsp_point_query_t::leaf(int32_t leafnum) const
+{
+    return &_bsp->dleafs[leafnum];
+}
+
+bool bsp_point_query_t::point_in_solid_r(int32_t nodenum, const qvec3d &point) const
+{
+    while (nodenum >= 0) {
+        const node_t &node = _nodes[nodenum];
+        const double dist = node.distance_to(point);
+
+        if (dist > SOLID_EPSILON) {
+            nodenum = node.children[0];
+        } else if (dist < -SOLID_EPSILON) {
+            nodenum = node.children[1];
+        } else {
+            // too close to the plane, check both sides
+            if (point_in_solid_r(node.children[1], point)) {
+                return true;
+            }
+            nodenum = node.children[0];
+        }
+    }
+
+    return _leaf_solid[-1 - nodenum];
+}
+
+bool bsp_point_query_t::point_in_solid(size_t modelnum, const qvec3d &point) const
+{
+    std::array<int32_t, STACK_SIZE> stack;
+    size_t stack_size = 0;
+    int32_t nodenum = _roots[modelnum];
+
+    while (true) {
+        while (nodenum >= 0) {
+            const node_t &node = _nodes[nodenum];
+            const double dist = node.distance_to(point);
+
+            if (dist > SOLID_EPSILON) {
+                nodenum = node.children[0];
+            } else if (dist < -SOLID_EPSILON) {
+                nodenum = node.children[1];
+            } else {
+                // too close to the plane, check both sides
+                if (stack_size < STACK_SIZE) {
+                    stack[stack_size++] = node.children[1];
+                } else if (point_in_solid_r(node.children[1], point)) {
+                    return true;
+                }
+                nodenum = node.children[0];
+            }
+        }
+
+        if (_leaf_solid[-1 - nodenum]) {
+            return true;
+        }
+
+        if (!stack_size) {
+            return false;
+        }
+
+        nodenum = stack[--stack_size];
+    }
+}
+
+void bsp_point_query_t::points_in_solid(
+    size_t modelnum, std::span<const qvec3d> points, std::span<bool> results) const
+{
+    std::array<int32_t, BATCH_SIZE> nums;
+    // other sides of the planes each point was too close to
+    std::array<std::array<int32_t, STACK_SIZE>, BATCH_SIZE> stacks;
+    std::array<size_t, BATCH_SIZE> stack_sizes;
+
+    for (size_t first = 0; first < points.size(); first += BATCH_SIZE) {
+        const size_t count = std::min(BATCH_SIZE, points.size() - first);
+        const qvec3d *batch = points.data() + first;
+
+        nums.fill(_roots[modelnum]);
+        stack_sizes.fill(0);
+
+        // walk all of the points down to a leaf together, one node per pass
+        for (bool any = true; any;) {
+            any = false;
+
+            for (size_t i = 0; i < count; i++) {
+                if (nums[i] < 0) {
+                    continue;
+                }
+
+                const node_t &node = _nodes[nums[i]];
+                const double dist = node.distance_to(batch[i]);
+
+                // points within the epsilon go to the front first, like point_in_solid
+                nums[i] = node.children[dist < -SOLID_EPSILON];
+
+                if (std::abs(dist) <= SOLID_EPSILON) {
+                    // overflowing entries are handled below, by finishing the walk one point at a time
+                    stacks[i][std::min(stack_sizes[i], STACK_SIZE - 1)] = node.children[1];
+                    stack_sizes[i]++;
+                }
+
+                any = true;
+            }
+        }
+
+        for (size_t i = 0; i < count; i++) {
+            bool solid = _leaf_solid[-1 - nums[i]];
+
+            if (!solid && stack_sizes[i]) {
+                if (stack_sizes[i] > STACK_SIZE) {
+                    // deeper than the stack; rare enough to just start over
+                    solid = point_in_solid(modelnum, batch[i]);
+                } else {
+                    while (!solid && stack_sizes[i]) {
+                        solid = point_in_solid_r(stacks[i][--stack_sizes[i]], batch[i]);
+                    }
+                }
+            }
+
+            results[first + i] = solid;
+        }
+    }
+}
@@ -697,6 +697,17 @@ time_point I_FloatTime()
     return qclock::now();
 }
 
+uint64_t fnv1a_64(const void *data, size_t size, uint64_t hash)
+{
+    const uint8_t *bytes = reinterpret_cast<const uint8_t *>(data);
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ull;
+    }
+
+    return hash;
+}
+
 namespace detail
 {
 int32_t endian_i()
@@ -232,33 +232,110 @@ struct decomp_plane_t : qplane3d
 
 // brush creation
 
+// the exact test: whether a face on `plane` is clipped away by the others
 template<typename T>
-void RemoveRedundantPlanes(std::vector<T> &planes)
+static bool IsRedundantPlane(const std::vector<T> &planes, const T &plane)
 {
-    auto removed = std::remove_if(planes.begin(), planes.end(), [&planes](const T &plane) {
-        // outward-facing plane
-        std::optional<polylib::winding_t> winding = polylib::winding_t::from_plane(plane, 10e6);
+    // outward-facing plane
+    std::optional<polylib::winding_t> winding = polylib::winding_t::from_plane(plane, 10e6);
 
-        // clip `winding` by all of the other planes, flipped
-        for (const T &plane2 : planes) {
-            if (&plane2 == &plane)
-                continue;
+    // clip `winding` by all of the other planes, flipped
+    for (const T &plane2 : planes) {
+        if (&plane2 == &plane)
+            continue;
 
-            // get flipped plane
-            // frees winding.
-            // discard the back, continue clipping the front part
-            winding = winding->clip_front(-plane2);
+        // get flipped plane
+        // frees winding.
+        // discard the back, continue clipping the front part
+        winding = winding->clip_front(-plane2);
 
-            // check if everything was clipped away
-            if (!winding)
-                break;
+        // check if everything was clipped away
+        if (!winding)
+            break;
+    }
+
+    return !winding;
+}
+
+/**
+ * Quick answer to IsRedundantPlane, or std::nullopt if `plane` is too close
+ * to call.
+ *
+ * The planes of a leaf's stack come from the root down, so the ones that
+ * bound the leaf are mostly at the end; clipping by those first empties the
+ * winding of a redundant plane in a few steps. Since the order changes how
+ * the on-epsilon works out, every plane is pushed out by DEFAULT_ON_EPSILON:
+ * what survives is then a superset of anything IsRedundantPlane could keep.
+ *
+ * - If that is still clipped away, with room to spare, so is the exact
+ *   test's winding.
+ * - If not, and the center of what's left is well inside all of the other
+ *   planes, no clip in the exact test can remove it.
+ */
+template<typename T>
+static std::optional<bool> IsRedundantPlaneFast(const std::vector<T> &planes, const T &plane)
+{
+    constexpr double margin = DEFAULT_ON_EPSILON;
+
+    polylib::winding_t winding = polylib::winding_t::from_plane(plane, 10e6);
+
+    for (auto it = planes.rbegin(); it != planes.rend(); ++it) {
+        const T &plane2 = *it;
+
+        if (&plane2 == &plane)
+            continue;
+
+        // flipped, and pushed out by the epsilon
+        const qplane3d pushed{-plane2.normal, -plane2.dist - DEFAULT_ON_EPSILON};
+
+        // clip_front leaves `winding` alone when it clips everything away
+        std::optional<polylib::winding_t> front = winding.clip_front(pushed);
+
+        if (!front) {
+            for (auto &point : winding) {
+                if (pushed.distance_to(point) > -margin) {
+                    return std::nullopt;
+                }
+            }
+
+            return true;
+        }
+
+        winding = std::move(*front);
+    }
+
+    const qvec3d center = winding.center();
+
+    for (const T &plane2 : planes) {
+        if (&plane2 == &plane)
+            continue;
+
+        if (plane2.distance_to(center) > -(DEFAULT_ON_EPSILON + margin)) {
+            return std::nullopt;
+        }
+    }
+
+    return false;
+}
+
+template<typename T>
+void RemoveRedundantPlanes(std::vector<T> &planes)
+{
+    auto removed = std::remove_if(planes.begin(), planes.end(), [&planes](const T &plane) {
+        if (std::optional<bool> redundant = IsRedundantPlaneFast(planes, plane)) {
+            return *redundant;
         }
 
-        return !winding;
+        return IsRedundantPlane(planes, plane);
     });
     planes.erase(removed, planes.end());
 }
 
+void RemoveRedundantPlanes(std::vector<qplane3d> &planes)
+{
+    RemoveRedundantPlanes<qplane3d>(planes);
+}
+
 // structures representing a brush
 
 struct decomp_brush_face_t
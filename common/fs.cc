@@ -24,6 +24,7 @@
 #include "common/log.hh"
 #include <fstream>
 #include <memory>
+#include <mutex>
 #include <array>
 #include <list>
 #include <stdexcept>
@@ -65,6 +66,8 @@ struct directory_archive : archive_like
 struct pak_archive : archive_like
 {
     std::ifstream pakstream;
+    // textures are loaded from several threads at once
+    std::mutex pakstream_mutex;
 
     struct pak_header
     {
@@ -126,9 +129,10 @@ struct pak_archive : archive_like
             return std::nullopt;
         }
 
-        pakstream.seekg(std::get<0>(it->second));
         uintmax_t size = std::get<1>(it->second);
         std::vector<uint8_t> data(size);
+        std::scoped_lock lock(pakstream_mutex);
+        pakstream.seekg(std::get<0>(it->second));
         pakstream.read(reinterpret_cast<char *>(data.data()), size);
         return data;
     }
@@ -137,6 +141,8 @@ struct pak_archive : archive_like
 struct wad_archive : archive_like
 {
     std::ifstream wadstream;
+    // textures are loaded from several threads at once
+    std::mutex wadstream_mutex;
 
     // WAD Format
     struct wad_header
@@ -225,9 +231,10 @@ struct wad_archive : archive_like
             return std::nullopt;
         }
 
-        wadstream.seekg(std::get<0>(it->second));
         uintmax_t size = std::get<1>(it->second);
         std::vector<uint8_t> data(size);
+        std::scoped_lock lock(wadstream_mutex);
+        wadstream.seekg(std::get<0>(it->second));
         wadstream.read(reinterpret_cast<char *>(data.data()), size);
         return data;
     }
@@ -1,9 +1,12 @@
 #include <vector>
+#include <fstream>
+#include <thread>
 #include <common/fs.hh>
 #include <common/imglib.hh>
 #include <common/entdata.h>
 #include <common/json.hh>
 #include <common/log.hh>
+#include <common/parallel.hh>
 #include <common/settings.hh>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -20,6 +23,28 @@ namespace img
 // current palette
 std::vector<qvec3b> palette;
 
+// while a texture is loaded on a worker thread, the loaders' warnings go to
+// that texture's pending entry instead of the log, so they can be printed in
+// order once loading finishes. null means print straight away.
+static thread_local std::vector<std::string> *loader_warnings = nullptr;
+
+template<typename... T>
+static void loader_warning(fmt::format_string<T...> format, T &&...args)
+{
+    if (loader_warnings) {
+        loader_warnings->push_back(fmt::format(format, std::forward<T>(args)...));
+    } else {
+        logging::print(format, std::forward<T>(args)...);
+    }
+}
+
+// loader_warning with the function name in front, like logging::funcprint
+#ifdef _MSC_VER
+#define loader_funcprint(fmt, ...) loader_warning("{}: " fmt, __FUNCTION__, ##__VA_ARGS__)
+#else
+#define loader_funcprint(fmt, ...) loader_warning("{}: " fmt, __func__, ##__VA_ARGS__)
+#endif
+
 /*
 ============================================================================
 PCX IMAGE
@@ -179,7 +204,7 @@ std::optional<texture> load_mip(std::string_view name, const fs::data &file, boo
 
     // must be able to at least read the header
     if (!stream) {
-        logging::funcprint("Failed to fully load mip {}. Header incomplete.\n", name);
+        loader_funcprint("Failed to fully load mip {}. Header incomplete.\n", name);
         return std::nullopt;
     }
 
@@ -203,7 +228,7 @@ std::optional<texture> load_mip(std::string_view name, const fs::data &file, boo
         // convert the data into RGBA.
         // sanity check
         if (header.offsets[0] + (header.width * header.height) > file->size()) {
-            logging::funcprint("mip offset0 overrun for {}\n", name);
+            loader_funcprint("mip offset0 overrun for {}\n", name);
             return tex;
         }
 
@@ -225,10 +250,10 @@ std::optional<texture> load_mip(std::string_view name, const fs::data &file, boo
             size_t palette_size = sizeof(uint16_t) + (sizeof(qvec3b) * 256);
 
             if (header.offsets[3] <= 0) {
-                logging::funcprint("mip palette needs offset3 to work, for {}\n", name);
+                loader_funcprint("mip palette needs offset3 to work, for {}\n", name);
                 valid_mip_palette = false;
             } else if (header.offsets[3] + mip3_size + palette_size > file->size()) {
-                logging::funcprint("mip palette overrun for {}\n", name);
+                loader_funcprint("mip palette overrun for {}\n", name);
                 valid_mip_palette = false;
             }
 
@@ -239,7 +264,7 @@ std::optional<texture> load_mip(std::string_view name, const fs::data &file, boo
                 stream >= num_colors;
 
                 if (num_colors != 256) {
-                    logging::funcprint("mip palette color num should be 256 for {}\n", name);
+                    loader_funcprint("mip palette color num should be 256 for {}\n", name);
                     valid_mip_palette = false;
                 } else {
                     std::vector<qvec3b> mip_palette(256);
@@ -262,7 +287,7 @@ std::optional<texture> load_stb(std::string_view name, const fs::data &file, boo
     stbi_uc *rgba_data = stbi_load_from_memory(file->data(), file->size(), &x, &y, &channels_in_file, 4);
 
     if (!rgba_data) {
-        logging::funcprint("stbi error: {}\n", stbi_failure_reason());
+        loader_funcprint("stbi error: {}\n", stbi_failure_reason());
         return {};
     }
 
@@ -327,6 +352,112 @@ qvec3b calculate_average(const std::vector<qvec4b> &pixels)
     return avg /= n;
 }
 
+/*
+============================================================================
+DECODED TEXTURE CACHE
+Optional on-disk cache (-texturecache) of the RGBA pixels of textures
+that are expensive to decode (png/jpg/tga), keyed by a hash of the
+file contents so edited or replaced files are never stale.
+============================================================================
+*/
+
+struct texture_cache_header
+{
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint32_t width, height;
+    qvec3b average; // calculate_average of the pixels
+
+    auto stream_data() { return std::tie(magic, version, width, height, average); }
+};
+
+constexpr std::array<char, 4> TEXTURE_CACHE_MAGIC{'R', 'G', 'B', 'A'};
+constexpr uint32_t TEXTURE_CACHE_VERSION = 2;
+
+static fs::path texture_cache_path(const settings::common_settings &options, const std::vector<uint8_t> &data)
+{
+    return options.texturecache.value() /
+           fmt::format("{:016x}-{}.rgba", fnv1a_64(data.data(), data.size()), data.size());
+}
+
+static std::optional<texture> load_cached_texture(std::string_view name, const fs::path &path)
+{
+    std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+
+    if (!stream) {
+        return std::nullopt;
+    }
+
+    stream >> endianness<std::endian::little>;
+
+    texture_cache_header header;
+    stream >= header;
+
+    if (!stream || header.magic != TEXTURE_CACHE_MAGIC || header.version != TEXTURE_CACHE_VERSION) {
+        return std::nullopt;
+    }
+
+    // the size comes from the file, so check the pixels are all there
+    // before allocating them
+    const size_t num_pixels = static_cast<size_t>(header.width) * header.height;
+    const std::optional<size_t> remaining = stream_remaining(stream);
+
+    if (!remaining || num_pixels > *remaining / sizeof(qvec4b)) {
+        return std::nullopt;
+    }
+
+    // same as what load_stb produces
+    texture tex;
+    tex.meta.extension = ext::STB;
+    tex.meta.name = name;
+    tex.meta.width = tex.width = header.width;
+    tex.meta.height = tex.height = header.height;
+    tex.pixels.resize(num_pixels);
+    tex.pixelsAverage = header.average;
+
+    stream.read(reinterpret_cast<char *>(tex.pixels.data()), tex.pixels.size() * sizeof(qvec4b));
+
+    if (!stream) {
+        return std::nullopt;
+    }
+
+    return tex;
+}
+
+static void save_cached_texture(const fs::path &path, const texture &tex)
+{
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+
+    // write to a temporary name first, so concurrent runs never see a
+    // partial file
+    fs::path temp_path = path;
+    temp_path += fmt::format(".{}.tmp", std::hash<std::thread::id>{}(std::this_thread::get_id()));
+
+    {
+        std::ofstream stream(temp_path, std::ios_base::out | std::ios_base::binary);
+
+        if (!stream) {
+            return;
+        }
+
+        stream << endianness<std::endian::little>;
+
+        texture_cache_header header{TEXTURE_CACHE_MAGIC, TEXTURE_CACHE_VERSION, tex.width, tex.height,
+            tex.pixelsAverage ? *tex.pixelsAverage : calculate_average(tex.pixels)};
+        stream <= header;
+        stream.write(reinterpret_cast<const char *>(tex.pixels.data()), tex.pixels.size() * sizeof(qvec4b));
+
+        if (!stream) {
+            stream.close();
+            fs::remove(temp_path, ec);
+            return;
+        }
+    }
+
+    fs::rename(temp_path, path, ec);
+}
+
 std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_texture(std::string_view name,
     bool meta_only, const gamedef_t *game, const settings::common_settings &options, bool no_prefix, bool mip_only)
 {
@@ -351,7 +482,23 @@ std::tuple<std::optional<img::texture>, fs::resolve_result, fs::data> load_textu
 
         if (auto pos = fs::where(p, options.filepriority.value() == settings::search_priority_t::LOOSE)) {
             if (auto data = fs::load(pos)) {
+                const bool cached = !meta_only && ext.loader == load_stb && !options.texturecache.value().empty();
+                fs::path cache_path;
+
+                if (cached) {
+                    cache_path = texture_cache_path(options, *data);
+
+                    if (auto texture = load_cached_texture(name, cache_path)) {
+                        return {texture, pos, data};
+                    }
+                }
+
                 if (auto texture = ext.loader(name.data(), data, meta_only, game)) {
+                    if (cached) {
+                        texture->pixelsAverage = calculate_average(texture->pixels);
+                        save_cached_texture(cache_path, *texture);
+                    }
+
                     return {texture, pos, data};
                 }
             }
@@ -455,7 +602,7 @@ std::optional<texture_meta> load_wal_json_meta(std::string_view name, const fs::
 
         return meta;
     } catch (json::exception e) {
-        logging::funcprint("{}, invalid JSON: {}\n", name, e.what());
+        loader_funcprint("{}, invalid JSON: {}\n", name, e.what());
         return std::nullopt;
     }
 }
@@ -535,57 +682,98 @@ static qvec3b increase_saturation(const qvec3b &color)
     return color_int;
 }
 
-// Load the specified texture from the BSP
-static void AddTextureName(std::string_view textureName, const mbsp_t *bsp, const settings::common_settings &options)
+static void SetAverageColor(texture &tex, const settings::common_settings &options)
 {
-    if (img::find(textureName)) {
-        return;
+    if (tex.meta.color_override) {
+        tex.averageColor = *tex.meta.color_override;
+    } else {
+        tex.averageColor = tex.pixelsAverage ? *tex.pixelsAverage : img::calculate_average(tex.pixels);
+
+        if (options.tex_saturation_boost.value() > 0.0f) {
+            tex.averageColor =
+                mix(tex.averageColor, increase_saturation(tex.averageColor), options.tex_saturation_boost.value());
+        }
+    }
+
+    if (tex.meta.width && tex.meta.height) {
+        tex.width_scale = (float)tex.width / (float)tex.meta.width;
+        tex.height_scale = (float)tex.height / (float)tex.meta.height;
+    }
+}
+
+// a texture to load into the texture cache. the cache entries are all
+// added before loading starts, so the loading threads only ever write to
+// their own entry; warnings are kept and printed in order afterwards, so
+// the log doesn't depend on thread scheduling.
+struct pending_texture_t
+{
+    std::string name;
+    texture *tex;
+    const miptex_t *miptex = nullptr;
+    std::vector<std::string> warnings;
+};
+
+// routes loader_warning into an entry for the lifetime of the scope
+struct scoped_loader_warnings_t
+{
+    scoped_loader_warnings_t(std::vector<std::string> &warnings) { loader_warnings = &warnings; }
+    ~scoped_loader_warnings_t() { loader_warnings = nullptr; }
+};
+
+static void PrintTextureWarnings(const std::vector<pending_texture_t> &pending)
+{
+    for (auto &entry : pending) {
+        for (auto &warning : entry.warnings) {
+            logging::print("{}", warning);
+        }
     }
+}
 
-    // always add entry
-    auto &tex = img::textures.emplace(textureName, img::texture{}).first->second;
+// Load the specified texture from the BSP
+static void LoadTextureName(pending_texture_t &entry, const mbsp_t *bsp, const settings::common_settings &options)
+{
+    texture &tex = *entry.tex;
+    scoped_loader_warnings_t scoped_warnings(entry.warnings);
 
     // find texture & meta
-    auto [texture, _0, _1] = img::load_texture(textureName, false, bsp->loadversion->game, options);
+    auto [texture, _0, _1] = img::load_texture(entry.name, false, bsp->loadversion->game, options);
 
     if (!texture) {
-        logging::funcprint("WARNING: can't find pixel data for {}\n", textureName);
+        loader_funcprint("WARNING: can't find pixel data for {}\n", entry.name);
     } else {
         tex = std::move(texture.value());
     }
 
-    auto [texture_meta, __0, __1] = img::load_texture_meta(textureName, bsp->loadversion->game, options);
+    auto [texture_meta, __0, __1] = img::load_texture_meta(entry.name, bsp->loadversion->game, options);
 
     if (!texture_meta) {
-        logging::funcprint("WARNING: can't find meta data for {}\n", textureName);
+        loader_funcprint("WARNING: can't find meta data for {}\n", entry.name);
     } else {
         tex.meta = std::move(texture_meta.value());
     }
 
-    if (tex.meta.color_override) {
-        tex.averageColor = *tex.meta.color_override;
-    } else {
-        tex.averageColor = img::calculate_average(tex.pixels);
-
-        if (options.tex_saturation_boost.value() > 0.0f) {
-            tex.averageColor =
-                mix(tex.averageColor, increase_saturation(tex.averageColor), options.tex_saturation_boost.value());
-        }
-    }
-
-    if (tex.meta.width && tex.meta.height) {
-        tex.width_scale = (float)tex.width / (float)tex.meta.width;
-        tex.height_scale = (float)tex.height / (float)tex.meta.height;
-    }
+    SetAverageColor(tex, options);
 }
 
 // Load all of the referenced textures from the BSP texinfos into
 // the texture cache.
 static void LoadTextures(const mbsp_t *bsp, const settings::common_settings &options)
 {
+    std::vector<pending_texture_t> pending;
+
+    auto add_texture_name = [&](std::string_view textureName) {
+        if (img::find(textureName)) {
+            return;
+        }
+
+        // always add entry
+        auto &tex = img::textures.emplace(textureName, img::texture{}).first->second;
+        pending.push_back({std::string(textureName), &tex});
+    };
+
     // gather all loadable textures...
     for (auto &texinfo : bsp->texinfo) {
-        AddTextureName(texinfo.texture.data(), bsp, options);
+        add_texture_name(texinfo.texture.data());
     }
 
     // gather textures used by _project_texture.
@@ -595,10 +783,43 @@ static void LoadTextures(const mbsp_t *bsp, const settings::common_settings &opt
         if (entdict.get("classname").find("light") == 0) {
             const auto &tex = entdict.get("_project_texture");
             if (!tex.empty()) {
-                AddTextureName(tex.c_str(), bsp, options);
+                add_texture_name(tex.c_str());
             }
         }
     }
+
+    logging::parallel_for_each(pending, [&](pending_texture_t &entry) { LoadTextureName(entry, bsp, options); });
+
+    PrintTextureWarnings(pending);
+}
+
+static void ConvertTexture(pending_texture_t &entry, const mbsp_t *bsp, const settings::common_settings &options)
+{
+    texture &tex = *entry.tex;
+    scoped_loader_warnings_t scoped_warnings(entry.warnings);
+    const miptex_t &miptex = *entry.miptex;
+
+    // if the miptex entry isn't a dummy, use it as our base
+    if (miptex.data.size() >= sizeof(dmiptex_t)) {
+        if (auto loaded_tex = img::load_mip(miptex.name, miptex.data, false, bsp->loadversion->game)) {
+            tex = std::move(loaded_tex.value());
+        }
+    }
+
+    // find replacement texture
+    if (auto [texture, _0, _1] = img::load_texture(miptex.name, false, bsp->loadversion->game, options); texture) {
+        tex.width = texture->width;
+        tex.height = texture->height;
+        tex.pixels = std::move(texture->pixels);
+        tex.pixelsAverage = texture->pixelsAverage;
+    }
+
+    if (!tex.pixels.size() || !tex.width || !tex.meta.width) {
+        loader_funcprint("WARNING: invalid size data for {}\n", miptex.name);
+        return;
+    }
+
+    SetAverageColor(tex, options);
 }
 
 // Load all of the paletted textures from the BSP into
@@ -609,6 +830,8 @@ static void ConvertTextures(const mbsp_t *bsp, const settings::common_settings &
         return;
     }
 
+    std::vector<pending_texture_t> pending;
+
     for (auto &miptex : bsp->dtex.textures) {
         if (img::find(miptex.name)) {
             logging::funcprint("WARNING: Texture {} duplicated\n", miptex.name);
@@ -617,42 +840,12 @@ static void ConvertTextures(const mbsp_t *bsp, const settings::common_settings &
 
         // always add entry
         auto &tex = img::textures.emplace(miptex.name, img::texture{}).first->second;
+        pending.push_back({miptex.name, &tex, &miptex});
+    }
 
-        // if the miptex entry isn't a dummy, use it as our base
-        if (miptex.data.size() >= sizeof(dmiptex_t)) {
-            if (auto loaded_tex = img::load_mip(miptex.name, miptex.data, false, bsp->loadversion->game)) {
-                tex = std::move(loaded_tex.value());
-            }
-        }
-
-        // find replacement texture
-        if (auto [texture, _0, _1] = img::load_texture(miptex.name, false, bsp->loadversion->game, options); texture) {
-            tex.width = texture->width;
-            tex.height = texture->height;
-            tex.pixels = std::move(texture->pixels);
-        }
-
-        if (!tex.pixels.size() || !tex.width || !tex.meta.width) {
-            logging::funcprint("WARNING: invalid size data for {}\n", miptex.name);
-            continue;
-        }
-
-        if (tex.meta.color_override) {
-            tex.averageColor = *tex.meta.color_override;
-        } else {
-            tex.averageColor = img::calculate_average(tex.pixels);
+    logging::parallel_for_each(pending, [&](pending_texture_t &entry) { ConvertTexture(entry, bsp, options); });
 
-            if (options.tex_saturation_boost.value() > 0.0f) {
-                tex.averageColor =
-                    mix(tex.averageColor, increase_saturation(tex.averageColor), options.tex_saturation_boost.value());
-            }
-        }
-
-        if (tex.meta.width && tex.meta.height) {
-            tex.width_scale = (float)tex.width / (float)tex.meta.width;
-            tex.height_scale = (float)tex.height / (float)tex.meta.height;
-        }
-    }
+    PrintTextureWarnings(pending);
 }
 
 void load_textures(const mbsp_t *bsp, const settings::common_settings &options)
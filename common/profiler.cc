@@ -0,0 +1,350 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <common/profiler.hh>
+#include <common/settings.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+namespace profiler
+{
+std::atomic_bool enabled = false;
+
+struct event_t
+{
+    std::string name;
+    // "/"-separated names of the enclosing scopes on the same thread
+    std::string path;
+    duration start, length;
+    size_t depth;
+};
+
+struct memory_sample_t
+{
+    std::string label;
+    duration time;
+    uint64_t peak;
+};
+
+struct thread_data_t
+{
+    size_t tid;
+    std::vector<event_t> events;
+    std::vector<std::string> stack;
+};
+
+static std::mutex data_mutex;
+// std::list so the per-thread pointers stay valid; entries are
+// only ever cleared, never removed.
+static std::list<thread_data_t> thread_data;
+static std::vector<memory_sample_t> memory_samples;
+static time_point start_time;
+static fs::path output_path;
+static settings::profile_format_t output_format;
+static std::string program_name;
+
+static std::vector<counter *> &counters()
+{
+    static std::vector<counter *> list;
+    return list;
+}
+
+/*
+ * Allocations are counted by the replacement operator new in
+ * profiler_new.cc, which can't allocate, or rely on anything with a
+ * destructor that may already have run, so threads count in a fixed set of
+ * slots rather than in a counter.
+ */
+struct alignas(64) allocation_slot_t
+{
+    std::atomic<uint64_t> count;
+};
+
+static allocation_slot_t allocation_slots[64];
+static std::atomic<size_t> next_allocation_slot = 0;
+
+bool allocations_counted = false;
+
+void count_allocation()
+{
+    if (enabled.load(std::memory_order_relaxed)) {
+        thread_local const size_t slot = next_allocation_slot++ % std::size(allocation_slots);
+        allocation_slots[slot].count.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+static uint64_t allocations_total()
+{
+    uint64_t total = 0;
+
+    for (auto &slot : allocation_slots) {
+        total += slot.count.load(std::memory_order_relaxed);
+    }
+
+    return total;
+}
+
+static void reset_allocations()
+{
+    for (auto &slot : allocation_slots) {
+        slot.count = 0;
+    }
+}
+
+static thread_data_t &local_thread_data()
+{
+    thread_local thread_data_t *data = nullptr;
+
+    if (!data) {
+        std::scoped_lock lock(data_mutex);
+        data = &thread_data.emplace_back();
+        data->tid = thread_data.size() - 1;
+    }
+
+    return *data;
+}
+
+void init(const settings::common_settings &settings)
+{
+    std::scoped_lock lock(data_mutex);
+
+    for (auto &data : thread_data) {
+        data.events.clear();
+        data.stack.clear();
+    }
+
+    memory_samples.clear();
+
+    for (auto *c : counters()) {
+        c->reset();
+    }
+
+    reset_allocations();
+
+    output_path = settings.profile.value();
+    output_format = settings.profileformat.value();
+    program_name = settings.program_name;
+    start_time = I_FloatTime();
+    enabled = !output_path.empty();
+}
+
+uint64_t peak_memory()
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return pmc.PeakWorkingSetSize;
+    }
+    return 0;
+#else
+    rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0) {
+        return 0;
+    }
+#ifdef __APPLE__
+    return usage.ru_maxrss; // bytes
+#else
+    return static_cast<uint64_t>(usage.ru_maxrss) * 1024; // kilobytes
+#endif
+#endif
+}
+
+void sample_memory(const char *label)
+{
+    if (!enabled) {
+        return;
+    }
+
+    const uint64_t peak = peak_memory();
+    const duration time = I_FloatTime() - start_time;
+
+    std::scoped_lock lock(data_mutex);
+    memory_samples.push_back({label, time, peak});
+}
+
+// scope
+
+scope::scope(std::string name)
+    : _name(std::move(name)),
+      _active(enabled)
+{
+    if (!_active) {
+        return;
+    }
+
+    local_thread_data().stack.push_back(_name);
+    _start = I_FloatTime();
+}
+
+scope::~scope()
+{
+    if (!_active) {
+        return;
+    }
+
+    const time_point end = I_FloatTime();
+    thread_data_t &data = local_thread_data();
+
+    std::string path;
+    for (auto &name : data.stack) {
+        if (!path.empty()) {
+            path += '/';
+        }
+        path += name;
+    }
+
+    data.stack.pop_back();
+    data.events.push_back(
+        {std::move(_name), std::move(path), _start - start_time, end - _start, data.stack.size()});
+
+    // only sample memory at the end of the outer two levels of stages;
+    // getrusage isn't free, and these are enough to see which stage
+    // raised the peak
+    if (data.stack.size() <= 1) {
+        sample_memory(data.events.back().name.c_str());
+    }
+}
+
+// counter
+
+counter::counter(const char *name)
+    : _name(name)
+{
+    counters().push_back(this);
+}
+
+uint64_t counter::total() const
+{
+    return _values.combine([](uint64_t a, uint64_t b) { return a + b; });
+}
+
+void counter::reset()
+{
+    _values.clear();
+}
+
+static json build_summary_json()
+{
+    json stages = json::array();
+    std::map<std::string, size_t> stage_index;
+
+    for (auto &data : thread_data) {
+        for (auto &event : data.events) {
+            auto [it, inserted] = stage_index.try_emplace(event.path, stages.size());
+
+            if (inserted) {
+                stages.push_back({{"name", event.path}, {"calls", 0}, {"seconds", 0.0}});
+            }
+
+            auto &stage = stages[it->second];
+            stage["calls"] = stage["calls"].get<size_t>() + 1;
+            stage["seconds"] = stage["seconds"].get<double>() + event.length.count();
+        }
+    }
+
+    json counter_values = json::object();
+    for (auto *c : counters()) {
+        counter_values[c->name()] = c->total();
+    }
+    if (allocations_counted) {
+        counter_values["allocations"] = allocations_total();
+    }
+
+    json memory = json::array();
+    for (auto &sample : memory_samples) {
+        memory.push_back({{"label", sample.label}, {"seconds", sample.time.count()}, {"peak_memory", sample.peak}});
+    }
+
+    return {{"program", program_name}, {"version", ERICWTOOLS_VERSION},
+        {"wall_time", (I_FloatTime() - start_time).count()}, {"peak_memory", peak_memory()}, {"stages", stages},
+        {"counters", counter_values}, {"memory", memory}};
+}
+
+static json build_trace_json()
+{
+    auto us = [](duration d) { return std::chrono::duration_cast<std::chrono::microseconds>(d).count(); };
+
+    json events = json::array();
+
+    for (auto &data : thread_data) {
+        for (auto &event : data.events) {
+            events.push_back({{"name", event.name}, {"cat", program_name}, {"ph", "X"}, {"ts", us(event.start)},
+                {"dur", us(event.length)}, {"pid", 0}, {"tid", data.tid}});
+        }
+    }
+
+    for (auto &sample : memory_samples) {
+        events.push_back({{"name", "peak memory"}, {"ph", "C"}, {"ts", us(sample.time)}, {"pid", 0},
+            {"args", {{"bytes", sample.peak}}}});
+    }
+
+    // counters only have a final value
+    const auto end = us(I_FloatTime() - start_time);
+
+    for (auto *c : counters()) {
+        events.push_back({{"name", c->name()}, {"ph", "C"}, {"ts", end}, {"pid", 0}, {"args", {{"count", c->total()}}}});
+    }
+    if (allocations_counted) {
+        events.push_back(
+            {{"name", "allocations"}, {"ph", "C"}, {"ts", end}, {"pid", 0}, {"args", {{"count", allocations_total()}}}});
+    }
+
+    return {{"traceEvents", events}, {"displayTimeUnit", "ms"},
+        {"otherData", {{"program", program_name}, {"version", ERICWTOOLS_VERSION}}}};
+}
+
+void close()
+{
+    if (!enabled) {
+        return;
+    }
+
+    sample_memory("end");
+
+    enabled = false;
+
+    std::scoped_lock lock(data_mutex);
+
+    std::ofstream f(output_path);
+
+    if (!f) {
+        logging::print("WARNING: can't write profile to {}\n", output_path.string());
+        return;
+    }
+
+    if (output_format == settings::profile_format_t::TRACE) {
+        f << build_trace_json().dump();
+    } else {
+        f << build_summary_json().dump(4);
+    }
+
+    logging::print("wrote profile to {}\n", output_path.string());
+}
+} // namespace profiler
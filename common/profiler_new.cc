@@ -0,0 +1,63 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * common/profiler_new.cc
+ *
+ * Replaces the global operator new to count allocations for -profile.
+ * It isn't part of the common library: only the qbsp, vis and light
+ * executables link it, so the other tools, lightpreview and the tests keep
+ * the default allocator.
+ */
+
+#include <common/profiler.hh>
+
+#include <cstdlib>
+#include <new>
+
+static const bool allocations_counted = (profiler::allocations_counted = true);
+
+// new[] and the nothrow forms go through this one (over-aligned types
+// don't), and delete has to match it
+void *operator new(std::size_t size)
+{
+    profiler::count_allocation();
+
+    for (;;) {
+        if (void *p = std::malloc(size ? size : 1)) {
+            return p;
+        }
+
+        std::new_handler handler = std::get_new_handler();
+
+        if (!handler) {
+            throw std::bad_alloc();
+        }
+
+        handler();
+    }
+}
+
+void operator delete(void *p) noexcept
+{
+    std::free(p);
+}
+
+void operator delete(void *p, std::size_t) noexcept
+{
+    std::free(p);
+}
@@ -24,6 +24,7 @@
 #include <common/bspfile.hh>
 #include <common/ostream.hh>
 
+#include <array>
 #include <fstream>
 #include <map>
 
@@ -33,8 +34,158 @@ constexpr const char *PORTALFILEAM = "PRT1-AM";
 
 constexpr size_t PRT_MAX_WINDING = 64;
 
+/*
+ * Binary portal file, written by qbsp -binaryprt. Little-endian:
+ *
+ * header
+ * numportals x { uint32 numpoints; int32 leafnums[2]; }
+ * numpoints x { double x, y, z; }     (all portals' points, in order)
+ * numleafclusters x int32 cluster     (Q1 detail only: cluster of each real leaf)
+ */
+struct prtfile_binary_header_t
+{
+    std::array<char, 4> magic;
+    uint32_t version;
+    int32_t portalleafs;
+    int32_t portalleafs_real;
+    uint32_t numportals;
+    uint32_t numpoints;
+    uint32_t numleafclusters;
+
+    auto stream_data()
+    {
+        return std::tie(magic, version, portalleafs, portalleafs_real, numportals, numpoints, numleafclusters);
+    }
+};
+
+constexpr std::array<char, 4> PORTALFILEBINARY{'P', 'R', 'T', 'B'};
+constexpr uint32_t PORTALFILEBINARY_VERSION = 1;
+
+constexpr size_t PRTB_HEADER_SIZE = 4 + sizeof(uint32_t) * 6;
+constexpr size_t PRTB_PORTAL_SIZE = sizeof(uint32_t) + sizeof(int32_t) * 2;
+constexpr size_t PRTB_POINT_SIZE = sizeof(double) * 3;
+
+static bool IsBinaryPrtFile(const fs::path &name)
+{
+    std::ifstream f(name, std::ios_base::in | std::ios_base::binary);
+    std::array<char, 4> magic{};
+
+    f.read(magic.data(), magic.size());
+
+    return f && magic == PORTALFILEBINARY;
+}
+
+static prtfile_t LoadBinaryPrtFile(const fs::path &name, const bspversion_t *loadversion)
+{
+    // read the whole file at once, and parse it from memory
+    std::vector<uint8_t> data;
+
+    {
+        std::ifstream f(name, std::ios_base::in | std::ios_base::binary);
+
+        if (!f)
+            FError("can't open {}\n", name);
+
+        f.seekg(0, std::ios_base::end);
+        data.resize(f.tellg());
+        f.seekg(0, std::ios_base::beg);
+        f.read(reinterpret_cast<char *>(data.data()), data.size());
+
+        if (!f)
+            FError("can't read {}\n", name);
+    }
+
+    imemstream stream(data.data(), data.size());
+    stream >> endianness<std::endian::little>;
+
+    prtfile_binary_header_t header;
+
+    if (data.size() < PRTB_HEADER_SIZE)
+        FError("{} is too short\n", name);
+
+    stream >= header;
+
+    if (header.version != PORTALFILEBINARY_VERSION)
+        FError("{} has unsupported version {}\n", name, header.version);
+
+    if (data.size() != PRTB_HEADER_SIZE + header.numportals * PRTB_PORTAL_SIZE + header.numpoints * PRTB_POINT_SIZE +
+                           header.numleafclusters * sizeof(int32_t))
+        FError("{} is truncated or corrupt\n", name);
+
+    prtfile_t result{};
+    result.portalleafs = header.portalleafs;
+    result.portalleafs_real = header.portalleafs_real;
+
+    if (loadversion->game->id == GAME_QUAKE_II) {
+        // since q2bsp has native cluster support, we shouldn't look at portalleafs_real at all.
+        result.portalleafs_real = 0;
+    } else if (result.portalleafs != result.portalleafs_real && header.numleafclusters != result.portalleafs_real) {
+        FError("{} is missing its cluster map\n", name);
+    }
+
+    result.portals.resize(header.numportals);
+
+    size_t numpoints = 0;
+
+    for (size_t i = 0; i < header.numportals; i++) {
+        auto &p = result.portals[i];
+        uint32_t n;
+
+        stream >= n >= p.leafnums[0] >= p.leafnums[1];
+
+        if (n > PRT_MAX_WINDING)
+            FError("portal {} has too many points", i);
+        if ((unsigned)p.leafnums[0] > (unsigned)result.portalleafs ||
+            (unsigned)p.leafnums[1] > (unsigned)result.portalleafs)
+            FError("out of bounds leaf in portal {}", i);
+
+        p.winding.resize(n);
+        numpoints += n;
+    }
+
+    if (numpoints != header.numpoints)
+        FError("{} has {} points, expected {}\n", name, numpoints, header.numpoints);
+
+    for (auto &p : result.portals) {
+        for (auto &point : p.winding) {
+            stream >= point;
+        }
+    }
+
+    // Q2 doesn't need this, it's PRT1 has the data we need
+    if (loadversion->game->id == GAME_QUAKE_II) {
+        return result;
+    }
+
+    result.dleafinfos.resize(result.portalleafs_real + 1);
+
+    if (!header.numleafclusters) {
+        // no clusters; assign the identity cluster numbers for consistency
+        for (int i = 0; i < result.portalleafs_real; i++) {
+            result.dleafinfos[i + 1].cluster = i;
+        }
+        return result;
+    }
+
+    for (int i = 0; i < result.portalleafs_real; i++) {
+        int32_t clusternum;
+        stream >= clusternum;
+        if (clusternum < 0 || clusternum >= result.portalleafs) {
+            FError("Invalid cluster number {} in cluster map, number of clusters: {}\n", clusternum,
+                result.portalleafs);
+        }
+        result.dleafinfos[i + 1].cluster = clusternum;
+    }
+
+    return result;
+}
+
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion)
 {
+    if (IsBinaryPrtFile(name)) {
+        return LoadBinaryPrtFile(name, loadversion);
+    }
+
     std::ifstream f(name);
 
     /*
@@ -240,14 +391,69 @@ static void WritePTR2ClusterMapping(std::ofstream &portalFile, const prtfile_t &
     }
 }
 
+static void WriteBinaryPortalfile(
+    const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion, bool uses_detail)
+{
+    std::ofstream portalFile(name, std::ios_base::out | std::ios_base::binary);
+    if (!portalFile)
+        FError("Failed to open {}: {}", name, strerror(errno));
+
+    portalFile << endianness<std::endian::little>;
+
+    // Q1 with detail needs the leaf -> cluster mapping, like PRT2
+    const bool clusters = loadversion->game->id != GAME_QUAKE_II && uses_detail;
+
+    prtfile_binary_header_t header{PORTALFILEBINARY, PORTALFILEBINARY_VERSION, prtfile.portalleafs, 0,
+        static_cast<uint32_t>(prtfile.portals.size()), 0, 0};
+
+    if (clusters) {
+        header.portalleafs_real = prtfile.portalleafs_real;
+        header.numleafclusters = prtfile.portalleafs_real;
+    } else if (loadversion->game->id != GAME_QUAKE_II) {
+        header.portalleafs_real = prtfile.portalleafs;
+    }
+
+    for (auto &portal : prtfile.portals) {
+        header.numpoints += portal.winding.size();
+    }
+
+    portalFile <= header;
+
+    for (auto &portal : prtfile.portals) {
+        portalFile <= static_cast<uint32_t>(portal.winding.size()) <= static_cast<int32_t>(portal.leafnums[0])
+                   <= static_cast<int32_t>(portal.leafnums[1]);
+    }
+
+    for (auto &portal : prtfile.portals) {
+        for (auto &point : portal.winding) {
+            portalFile <= point;
+        }
+    }
+
+    if (clusters) {
+        for (int leafnum = 0; leafnum < prtfile.portalleafs_real; ++leafnum) {
+            portalFile <= static_cast<int32_t>(prtfile.dleafinfos[leafnum + 1].cluster);
+        }
+    }
+
+    if (!portalFile)
+        FError("Failed to write {}: {}", name, strerror(errno));
+}
+
 /*
 ================
 WritePortalfile
 ================
 */
-void WritePortalfile(
-    const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion, bool uses_detail, bool forceprt1)
+void WritePortalfile(const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion,
+    bool uses_detail, bool forceprt1, bool binary)
 {
+    // -forceprt1 is for map editors, which can only read the text formats
+    if (binary && !forceprt1) {
+        WriteBinaryPortalfile(name, prtfile, loadversion, uses_detail);
+        return;
+    }
+
     std::ofstream portalFile(name, std::ios_base::out); // .prt files are intentionally text mode
     if (!portalFile)
         FError("Failed to open {}: {}", name, strerror(errno));
@@ -21,6 +21,7 @@
 #include "common/threads.hh"
 #include "common/fs.hh"
 #include <common/log.hh>
+#include <common/profiler.hh>
 
 namespace settings
 {
@@ -744,9 +745,16 @@ common_settings::common_settings()
           "whether the compiler should attempt to automatically derive game/base paths for games that support it"},
       tex_saturation_boost{this, "tex_saturation_boost", 0.0f, 0.0f, 1.0f, &game_group,
           "increase texture saturation to match original Q2 tools"},
+      texturecache{this, "texturecache", "", &game_group,
+          "directory to cache decoded png/jpg/tga textures in, to speed up loading them again"},
       logfile{this, "logfile", "auto", "\"path\"", &logging_group,
           "File to output logging data to. If unchanged, it is set by the tool."},
-      logappend{this, "logappend", false, &logging_group, "Whether to append to log file or replace"}
+      logappend{this, "logappend", false, &logging_group, "Whether to append to log file or replace"},
+      profile{this, "profile", "", &logging_group,
+          "write per-stage timings, counters and peak memory usage to this file"},
+      profileformat{this, "profileformat", profile_format_t::JSON,
+          {{"json", profile_format_t::JSON}, {"trace", profile_format_t::TRACE}}, &logging_group,
+          "format of the -profile file: a json summary, or Chrome trace events (chrome://tracing, Perfetto)"}
 {
 }
 
@@ -790,5 +798,7 @@ void common_settings::postinitialize(int argc, const char **argv)
     if (nocolor.value()) {
         logging::enable_color_codes = false;
     }
+
+    profiler::init(*this);
 }
 } // namespace settings
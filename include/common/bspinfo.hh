@@ -24,7 +24,10 @@
 #include "common/imglib.hh"
 #include "common/qvec.hh"
 
+#include <array>
 #include <map>
+#include <string>
+#include <unordered_set>
 #include <vector>
 
 struct bspdata_t;
@@ -48,9 +51,45 @@ struct full_atlas_t
     std::map<int, std::vector<qvec2f>> facenum_to_lightmap_uvs;
 
     std::map<int, single_style_atlas_t> style_to_lightmap_atlas;
+
+    // packing statistics; the faces are packed into num_atlases square
+    // atlases of atlas_size, which are tiled (and trimmed) into one
+    // width x height texture
+    size_t num_atlases = 0;
+    size_t atlas_size = 0;
+    int width = 0, height = 0;
+    // texels covered by faces
+    size_t used_samples = 0;
+
+    inline double occupancy() const
+    {
+        return width && height ? static_cast<double>(used_samples) / (static_cast<size_t>(width) * height) : 0.0;
+    }
 };
 
+constexpr size_t DEFAULT_LIGHTMAP_ATLAS_SIZE = 4096;
+
+/**
+ * packs the lightmaps of all faces into atlases of at most max_atlas_size squared
+ * (larger faces get an atlas of their own size), using the smallest size that
+ * fits everything in one atlas where possible
+ */
 full_atlas_t build_lightmap_atlas(const mbsp_t &bsp, const bspxentries_t &bspx, const std::vector<uint8_t> &litdata,
-    const std::vector<uint32_t> &hdr_litdata, bool use_bspx, bool use_decoupled);
+    const std::vector<uint32_t> &hdr_litdata, bool use_bspx, bool use_decoupled,
+    size_t max_atlas_size = DEFAULT_LIGHTMAP_ATLAS_SIZE);
+
+// top-level keys of the .json written by serialize_bsp
+extern const std::array<const char *, 19> bsp_json_sections;
+
+struct serialize_bsp_options_t
+{
+    // if not empty, only these sections are written
+    std::unordered_set<std::string> sections;
+    // sections to leave out
+    std::unordered_set<std::string> exclude_sections;
+    // maximum size of the lightmap atlases written alongside the .json
+    size_t max_atlas_size = DEFAULT_LIGHTMAP_ATLAS_SIZE;
+};
 
-void serialize_bsp(const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &name);
+void serialize_bsp(
+    const bspdata_t &bspdata, const mbsp_t &bsp, const fs::path &name, const serialize_bsp_options_t &options = {});
@@ -0,0 +1,153 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * common/bspquery.hh
+ *
+ * Flattened copy of the hull 0 BSP trees of a .bsp, for tools that
+ * classify lots of points (light sample points, lightgrid points, light
+ * entities) against the BSP.
+ *
+ * The nodes of each model are stored breadth-first with the plane
+ * inline, so the top levels of the tree that every query walks share
+ * cache lines. Axial planes are stored with a unit axis normal, so all
+ * planes use the same branch-free distance test; this gives the same
+ * result as dplane_t::distance_to_fast.
+ */
+
+#pragma once
+
+#include <common/qvec.hh>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <span>
+#include <vector>
+
+struct mbsp_t;
+struct mleaf_t;
+
+class bsp_point_query_t
+{
+public:
+    struct node_t
+    {
+        qvec3f normal;
+        float dist;
+        // >= 0 is an index into nodes, < 0 is -1 - leafnum (same as bsp2_dnode_t)
+        std::array<int32_t, 2> children;
+
+        template<typename T>
+        inline T distance_to(const qvec<T, 3> &point) const
+        {
+            return qv::dot(point, normal) - dist;
+        }
+    };
+
+    // number of points the batched queries walk the tree with at once;
+    // interleaving the walks lets the memory accesses of different points overlap
+    static constexpr size_t BATCH_SIZE = 8;
+
+    // points closer than this to a plane are tested against both sides
+    // by point_in_solid (same as Light_PointInSolid)
+    static constexpr double SOLID_EPSILON = 0.1;
+
+private:
+    // per-point explicit stack depth for point_in_solid; deeper
+    // both-sides splits fall back to recursion
+    static constexpr size_t STACK_SIZE = 32;
+
+    const mbsp_t *_bsp = nullptr;
+    std::vector<node_t> _nodes;
+    // root per model; same encoding as node_t::children
+    std::vector<int32_t> _roots;
+    // per leaf; solid or sky for Q1, Q2_CONTENTS_SOLID for Q2
+    std::vector<uint8_t> _leaf_solid;
+
+    bool point_in_solid_r(int32_t nodenum, const qvec3d &point) const;
+
+public:
+    bsp_point_query_t() = default;
+    explicit bsp_point_query_t(const mbsp_t *bsp);
+
+    inline const mbsp_t *bsp() const { return _bsp; }
+    inline const std::vector<node_t> &nodes() const { return _nodes; }
+
+    // same as Light_PointInSolid, tests hull 0 of the given model
+    bool point_in_solid(size_t modelnum, const qvec3d &point) const;
+
+    // same as point_in_solid, for each of points
+    void points_in_solid(size_t modelnum, std::span<const qvec3d> points, std::span<bool> results) const;
+
+    // same as BSP_FindLeafAtPoint; the point type sets the precision
+    // the plane distances are calculated in
+    template<typename T>
+    int32_t find_leafnum(size_t modelnum, const qvec<T, 3> &point) const
+    {
+        int32_t num = _roots[modelnum];
+
+        while (num >= 0) {
+            const node_t &node = _nodes[num];
+
+            // branch rather than index by the comparison, so the next node can be
+            // fetched speculatively (single queries are usually spatially coherent)
+            if (node.distance_to(point) < 0) {
+                num = node.children[1];
+            } else {
+                num = node.children[0];
+            }
+        }
+
+        return -1 - num;
+    }
+
+    template<typename T>
+    const mleaf_t *find_leaf(size_t modelnum, const qvec<T, 3> &point) const
+    {
+        return leaf(find_leafnum(modelnum, point));
+    }
+
+    // same as find_leaf, for each of points
+    template<typename T>
+    void find_leafs(size_t modelnum, std::span<const qvec<T, 3>> points, std::span<const mleaf_t *> results) const
+    {
+        for (size_t first = 0; first < points.size(); first += BATCH_SIZE) {
+            const size_t count = std::min(BATCH_SIZE, points.size() - first);
+            std::array<int32_t, BATCH_SIZE> nums;
+            nums.fill(_roots[modelnum]);
+
+            for (bool any = true; any;) {
+                any = false;
+
+                for (size_t i = 0; i < count; i++) {
+                    if (nums[i] >= 0) {
+                        const node_t &node = _nodes[nums[i]];
+                        nums[i] = node.children[node.distance_to(points[first + i]) < 0];
+                        any = true;
+                    }
+                }
+            }
+
+            for (size_t i = 0; i < count; i++) {
+                results[first + i] = leaf(-1 - nums[i]);
+            }
+        }
+    }
+
+    const mleaf_t *leaf(int32_t leafnum) const;
+};
@@ -31,6 +31,8 @@
 #include <istream>
 #include <ostream>
 #include <tuple> // for std::apply()
+#include <optional>
+#include <type_traits>
 
 char Q_tolower(char x);
 int32_t Q_strncasecmp(std::string_view a, std::string_view b, size_t maxcount);
@@ -107,6 +109,12 @@ using time_point = std::chrono::time_point<qclock, duration>;
 
 time_point I_FloatTime();
 
+// 64-bit FNV-1a hash of a block of memory; pass a previous result as
+// `hash` to continue hashing. Used to key on-disk caches by content.
+constexpr uint64_t FNV1A_64_INIT = 0xcbf29ce484222325ull;
+
+uint64_t fnv1a_64(const void *data, size_t size, uint64_t hash = FNV1A_64_INIT);
+
 /*
  * ============================================================================
  *                            BYTE ORDER FUNCTIONS
@@ -512,6 +520,57 @@ inline std::enable_if_t<std::is_enum_v<T>, std::istream &> operator>=(std::istre
     return s;
 }
 
+// bytes left to read in the stream, or nullopt if it can't seek
+inline std::optional<size_t> stream_remaining(std::istream &s)
+{
+    std::streambuf *buf = s.rdbuf();
+    const auto pos = buf->pubseekoff(0, std::ios_base::cur, std::ios_base::in);
+    const auto end = buf->pubseekoff(0, std::ios_base::end, std::ios_base::in);
+
+    if (pos == std::streampos(-1) || end == std::streampos(-1)) {
+        return std::nullopt;
+    }
+
+    buf->pubseekpos(pos, std::ios_base::in);
+    return static_cast<size_t>(end - pos);
+}
+
+// a vector of plain data, preceded by its element count
+template<typename T>
+inline void WriteVector(std::ostream &s, const std::vector<T> &v)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    s <= static_cast<uint32_t>(v.size());
+    s.write(reinterpret_cast<const char *>(v.data()), v.size() * sizeof(T));
+}
+
+// reads a vector written by WriteVector. the count comes from the file, so
+// it's checked against the bytes left in the stream before anything is
+// allocated; the stream fails if it doesn't fit.
+template<typename T>
+inline void ReadVector(std::istream &s, std::vector<T> &v)
+{
+    static_assert(std::is_trivially_copyable_v<T>);
+
+    uint32_t size;
+    s >= size;
+
+    if (!s) {
+        return;
+    }
+
+    const std::optional<size_t> remaining = stream_remaining(s);
+
+    if (!remaining || size > *remaining / sizeof(T)) {
+        s.setstate(std::ios_base::failbit);
+        return;
+    }
+
+    v.resize(size);
+    s.read(reinterpret_cast<char *>(v.data()), v.size() * sizeof(T));
+}
+
 // Memory streams, because C++ doesn't supply these.
 struct membuf : std::streambuf
 {
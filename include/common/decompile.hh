@@ -30,6 +30,12 @@ struct decomp_options
 
 void DecompileBSP(const mbsp_t *bsp, const decomp_options &options, std::ofstream &file);
 
+/**
+ * Removes the planes that don't have a face on the convex volume all of them enclose.
+ * Exposed for tests.
+ */
+void RemoveRedundantPlanes(std::vector<qplane3d> &planes);
+
 struct leaf_visualization_t
 {
     std::vector<polylib::winding_t> windings;
@@ -50,6 +50,7 @@ public:
     void set(std::string_view key, std::string_view value);
     void remove(std::string_view key);
     void rename(std::string_view from, std::string_view to);
+    inline void erase(keyvalues_t::const_iterator it) { keyvalues.erase(it); }
 
     keyvalues_t::iterator find(std::string_view key);
     keyvalues_t::const_iterator find(std::string_view key) const;
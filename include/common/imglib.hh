@@ -80,6 +80,11 @@ struct texture
     // This member is only set before insertion into the table
     // and not calculated by individual load functions.
     qvec3b averageColor{0};
+
+    // calculate_average(pixels), if the loader already knows it; the
+    // texture cache stores it, so loading from it doesn't go over the
+    // pixels again.
+    std::optional<qvec3b> pixelsAverage;
 };
 
 extern std::unordered_map<std::string, texture, case_insensitive_hash, case_insensitive_equal> textures;
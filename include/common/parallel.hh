@@ -21,53 +21,160 @@
 #pragma once
 
 #include "common/log.hh"
+#include <tbb/blocked_range.h>
+#include <tbb/enumerable_thread_specific.h>
 #include <tbb/parallel_for.h>
 #include <tbb/parallel_for_each.h>
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <iterator>
+#include <ranges>
+#include <type_traits>
 
 // parallel extensions to logging
 namespace logging
 {
-template<typename TS, typename TE, typename Body>
-void parallel_for(const TS &start, const TE &end, const Body &func)
+// how the parallel helpers below report progress
+enum class progress_t
 {
-    auto length = end - start;
-    std::atomic<uint64_t> progress = 0;
-
-    tbb::parallel_for(start, end, [&](const auto &it) {
-        percent(progress++, length);
-        func(it);
-    });
-
-    percent(progress, length);
-}
-
-template<typename Container, typename Body>
-void parallel_for_each(Container &container, const Body &func)
+    // completed chunks are added to a shared counter, and percent()
+    // is called at most once per report interval
+    CHUNKED,
+    // no progress output at all; for fine-grained loops (where even
+    // per-chunk accounting shows up) or loops nested in another one
+    NONE
+};
+
+namespace detail
 {
-    auto length = std::size(container);
-    std::atomic<uint64_t> progress = 0;
+// shared progress state for one parallel loop. workers only touch
+// it once per chunk of items, and only one of them per interval
+// pays for percent() and its lock.
+class parallel_progress_t
+{
+    using clock = std::chrono::steady_clock;
+
+    static constexpr clock::duration report_interval = std::chrono::milliseconds(5);
+
+    const uint64_t max;
+    std::atomic<uint64_t> count = 0;
+    std::atomic<clock::rep> next_report;
+
+public:
+    inline parallel_progress_t(uint64_t max)
+        : max(max),
+          next_report((clock::now() + report_interval).time_since_epoch().count())
+    {
+        // starts the timer; percent(0, 0) would print completion
+        if (max) {
+            percent(0, max);
+        }
+    }
+
+    inline void add(uint64_t n)
+    {
+        const uint64_t done = count.fetch_add(n, std::memory_order_relaxed) + n;
+        const clock::rep now = clock::now().time_since_epoch().count();
+        clock::rep next = next_report.load(std::memory_order_relaxed);
+
+        if (now < next || done >= max) {
+            return;
+        }
+
+        if (next_report.compare_exchange_strong(next, now + report_interval.count(), std::memory_order_relaxed)) {
+            percent(done, max);
+        }
+    }
+
+    inline void finish() { percent(max, max); }
+};
+
+// items to complete per thread before reporting, for containers that
+// can't be split into index ranges
+constexpr uint64_t parallel_progress_batch = 64;
+} // namespace detail
 
-    tbb::parallel_for_each(container, [&](auto &f) {
-        percent(progress++, length);
-        func(f);
+template<typename TS, typename TE, typename Body>
+void parallel_for(const TS &start, const TE &end, const Body &func, progress_t progress = progress_t::CHUNKED)
+{
+    using index_t = std::common_type_t<TS, TE>;
+
+    const index_t first = start, last = std::max<index_t>(start, end);
+    tbb::blocked_range<index_t> range(first, last);
+
+    if (progress == progress_t::NONE) {
+        tbb::parallel_for(range, [&](const tbb::blocked_range<index_t> &r) {
+            for (index_t i = r.begin(); i != r.end(); i++) {
+                func(i);
+            }
+        });
+        return;
+    }
+
+    detail::parallel_progress_t reporter(last - first);
+
+    tbb::parallel_for(range, [&](const tbb::blocked_range<index_t> &r) {
+        for (index_t i = r.begin(); i != r.end(); i++) {
+            func(i);
+        }
+        reporter.add(r.size());
     });
 
-    percent(progress, length);
+    reporter.finish();
 }
 
+// also accepts const containers; Container is deduced as const
 template<typename Container, typename Body>
-void parallel_for_each(const Container &container, const Body &func)
+void parallel_for_each(Container &container, const Body &func, progress_t progress = progress_t::CHUNKED)
 {
-    auto length = std::size(container);
-    std::atomic<uint64_t> progress = 0;
-
-    tbb::parallel_for_each(container, [&](const auto &f) {
-        percent(progress++, length);
-        func(f);
-    });
-
-    percent(progress, length);
+    const uint64_t length = std::size(container);
+
+    if constexpr (std::ranges::random_access_range<Container>) {
+        const auto first = std::begin(container);
+        tbb::blocked_range<size_t> range(0, length);
+
+        if (progress == progress_t::NONE) {
+            tbb::parallel_for(range, [&](const tbb::blocked_range<size_t> &r) {
+                for (size_t i = r.begin(); i != r.end(); i++) {
+                    func(first[i]);
+                }
+            });
+            return;
+        }
+
+        detail::parallel_progress_t reporter(length);
+
+        tbb::parallel_for(range, [&](const tbb::blocked_range<size_t> &r) {
+            for (size_t i = r.begin(); i != r.end(); i++) {
+                func(first[i]);
+            }
+            reporter.add(r.size());
+        });
+
+        reporter.finish();
+    } else {
+        if (progress == progress_t::NONE) {
+            tbb::parallel_for_each(container, func);
+            return;
+        }
+
+        detail::parallel_progress_t reporter(length);
+        tbb::enumerable_thread_specific<uint64_t> pending(0);
+
+        tbb::parallel_for_each(container, [&](auto &f) {
+            func(f);
+
+            uint64_t &local = pending.local();
+
+            if (++local == detail::parallel_progress_batch) {
+                reporter.add(local);
+                local = 0;
+            }
+        });
+
+        reporter.finish();
+    }
 }
-} // namespace logging
\ No newline at end of file
+} // namespace logging
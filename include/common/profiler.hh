@@ -0,0 +1,111 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * common/profiler.hh
+ *
+ * Structured instrumentation for the compile tools: nested timing
+ * scopes, per-thread counters, a count of allocations and peak memory
+ * samples, written out as JSON or Chrome trace-event format
+ * (chrome://tracing, Perfetto) when -profile is given.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <common/cmdlib.hh>
+#include <tbb/enumerable_thread_specific.h>
+
+// forward declaration
+namespace settings
+{
+class common_settings;
+}
+
+namespace profiler
+{
+// true between init() and close() if -profile was specified;
+// scopes and counters are no-ops otherwise.
+extern std::atomic_bool enabled;
+
+// start collecting, if requested by the settings. clears any
+// data from a previous run in the same process (tests, lightpreview)
+void init(const settings::common_settings &settings);
+
+// write the collected data to the -profile file and stop collecting
+void close();
+
+// peak resident set size of the process, in bytes (0 if unsupported)
+uint64_t peak_memory();
+
+// records the current peak memory usage under the given label
+void sample_memory(const char *label);
+
+// set by the replacement operator new in common/profiler_new.cc, which only
+// the tools that write profiles link in; the allocation count is left out
+// of the profile without it
+extern bool allocations_counted;
+
+// counts an allocation if profiling; called by that operator new
+void count_allocation();
+
+// times the enclosing C++ scope. scopes nest per-thread; only use
+// these around coarse stages (not per-face / per-portal work), since
+// every scope is stored as an event.
+class scope
+{
+    std::string _name;
+    time_point _start;
+    bool _active;
+
+public:
+    explicit scope(std::string name);
+    ~scope();
+
+    scope(const scope &) = delete;
+    scope &operator=(const scope &) = delete;
+};
+
+// a named counter that threads can increment without contention;
+// the per-thread values are summed when the profile is written.
+// counters are expected to be globals with static lifetime.
+class counter
+{
+    const char *_name;
+    mutable tbb::enumerable_thread_specific<uint64_t> _values;
+
+public:
+    explicit counter(const char *name);
+
+    inline void operator+=(uint64_t v)
+    {
+        if (enabled.load(std::memory_order_relaxed)) {
+            _values.local() += v;
+        }
+    }
+
+    inline void operator++(int) { *this += 1; }
+
+    inline const char *name() const { return _name; }
+
+    uint64_t total() const;
+
+    void reset();
+};
+} // namespace profiler
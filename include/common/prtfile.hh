@@ -50,8 +50,11 @@ struct prtfile_t
 };
 
 struct bspversion_t;
+// reads the text PRT1, PRT2 and PRT1-AM formats, as well as the binary format
 prtfile_t LoadPrtFile(const fs::path &name, const bspversion_t *loadversion);
-void WritePortalfile(
-    const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion, bool uses_detail, bool forceprt1);
+// binary writes the binary format (not with forceprt1), which keeps the exact winding points and
+// is quicker for vis to load, but can't be read by map editors
+void WritePortalfile(const fs::path &name, const prtfile_t &prtfile, const bspversion_t *loadversion,
+    bool uses_detail, bool forceprt1, bool binary = false);
 
 void WriteDebugPortals(const std::vector<polylib::winding_t> &portals, fs::path name);
@@ -603,6 +603,12 @@ enum class search_priority_t
     ARCHIVE
 };
 
+enum class profile_format_t
+{
+    JSON,
+    TRACE
+};
+
 class common_settings : public virtual setting_container
 {
 public:
@@ -624,8 +630,11 @@ public:
     setting_bool q2rtx;
     setting_invertible_bool defaultpaths;
     setting_scalar tex_saturation_boost;
+    setting_path texturecache;
     setting_string logfile;
     setting_bool logappend;
+    setting_path profile;
+    setting_enum<profile_format_t> profileformat;
 
     common_settings();
 
@@ -0,0 +1,121 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * light/checkpoint.hh
+ *
+ * -checkpoint support: LightWorld's progress (which phases are done, and
+ * how many faces of the current one) and the per-face state the later
+ * phases read (lightmaps, bounce accumulators, dirt, bounce lights) are
+ * saved to a .lightstate file next to the .bsp, so an interrupted run can
+ * pick up where it left off.
+ *
+ * The phases are numbered 0 = direct lighting, 1..N = indirect pass
+ * 0..N-1, N+1 = post-processing. Within a phase faces are only written
+ * by their own task, so a prefix of finished faces is a valid state.
+ *
+ * The file is keyed by a hash of the input .bsp, the textures and the
+ * options that affect lighting; a mismatching file is ignored. Stored in native byte
+ * order; it's only meant to be reused on the same machine.
+ */
+
+#pragma once
+
+#include <light/light.hh>
+#include <light/surflight.hh>
+
+#include <common/cmdlib.hh>
+#include <common/fs.hh>
+
+#include <cstdint>
+#include <iosfwd>
+#include <memory>
+#include <optional>
+#include <span>
+#include <vector>
+
+namespace settings
+{
+class setting_container;
+}
+
+struct light_progress_t
+{
+    // number of finished phases
+    uint32_t phases_done = 0;
+    // number of faces of phase `phases_done` that are finished
+    uint32_t faces_done = 0;
+};
+
+class light_checkpoint_t
+{
+    fs::path _path;
+    uint64_t _key;
+    duration _interval;
+    time_point _last_save;
+
+public:
+    light_checkpoint_t(const fs::path &path, uint64_t key, duration interval);
+
+    inline const fs::path &path() const { return _path; }
+
+    // restores the per-face state saved in the file into surfaces, and
+    // returns the progress it was saved at; std::nullopt (and surfaces
+    // untouched) if there's no usable file
+    std::optional<light_progress_t> load(std::span<lightsurf_t> surfaces) const;
+
+    // saves the state if the interval has passed since the last save, or if force is set
+    void save(const light_progress_t &progress, std::span<const lightsurf_t> surfaces, bool force = false);
+
+    // deletes the file, once the lighting it was for has been written
+    void remove() const;
+};
+
+// hash of the options that change the lighting, continuing from `hash`
+uint64_t HashLightOptions(const settings::setting_container &options, uint64_t hash);
+
+// hash of the textures light loaded (img::textures), continuing from `hash`
+uint64_t HashLoadedTextures(uint64_t hash);
+
+// hash of the .bsp file, the loaded textures and the options that change the lighting
+uint64_t LightCheckpointKey(const fs::path &bsp_path, const settings::setting_container &options);
+
+// the parts of a lightsurf_t that the phases of LightWorld change; everything
+// else is rebuilt by CreateLightmapSurfaces. read completely before it's
+// applied, so a truncated file doesn't leave faces half restored
+struct light_surface_state_t
+{
+    lightmapdict_t lightmapsByStyle;
+    std::vector<float> occlusion;
+    std::vector<uint8_t> occluded;
+    std::unique_ptr<surfacelight_t> vpl;
+};
+
+void WriteLightSurfaceState(std::ostream &stream, const lightsurf_t &surf);
+// false if the stream ends early, or the state doesn't fit surf
+bool ReadLightSurfaceState(std::istream &stream, const lightsurf_t &surf, light_surface_state_t &state);
+void ApplyLightSurfaceState(lightsurf_t &surf, light_surface_state_t &&state);
+
+// the file format the checkpoint is stored in, which -workers also uses to
+// pass faces between processes. writes the state of the faces in facenums
+// (or all of them, if it's null); returns false if the file can't be written
+bool SaveLightState(const fs::path &path, uint64_t key, const light_progress_t &progress,
+    std::span<const lightsurf_t> surfaces, const std::vector<uint32_t> *facenums = nullptr);
+
+// restores the faces stored in the file into surfaces. std::nullopt (and
+// surfaces untouched) if the file is missing, incomplete or has a different key
+std::optional<light_progress_t> LoadLightState(const fs::path &path, uint64_t key, std::span<lightsurf_t> surfaces);
@@ -78,6 +78,9 @@ public:
 
     aabb3f bounds;
 
+    // index into GetLightShadowGroups(), or -1 if this light traces its own shadow rays
+    int32_t shadow_group = -1;
+
     settings::setting_scalar light;
     settings::setting_scalar atten;
     settings::setting_enum<light_formula_t> formula;
@@ -142,6 +145,8 @@ void ResetLightEntities();
 std::string TargetnameForLightStyle(int style);
 std::vector<std::unique_ptr<light_t>> &GetLights();
 const std::vector<entdict_t> &GetEntdicts();
+// groups of positive lights sharing an origin and shadow channel mask; set up by SetupLights
+const std::vector<std::vector<const light_t *>> &GetLightShadowGroups();
 std::vector<sun_t> &GetSuns();
 std::vector<entdict_t> &GetRadLights();
 /**
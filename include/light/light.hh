@@ -23,6 +23,7 @@
 
 #include <common/settings.hh>
 #include <common/bsputils.hh> // for faceextents_t
+#include <common/bspquery.hh>
 
 #include <common/qvec.hh>
 
@@ -144,6 +145,12 @@ struct lightsurf_t
 
     lightmapdict_t lightmapsByStyle;
 
+    // -extraadaptive, only while DirectLightFace runs: the samples lit in
+    // the current pass (empty = all of them), and per sample an XOR of the
+    // ids of the lights and suns whose shadow ray was blocked
+    std::vector<uint8_t> adaptive_mask;
+    std::vector<uint64_t> adaptive_shadows;
+
     // surface light stuff
     std::unique_ptr<surfacelight_t> vpl;
 };
@@ -182,6 +189,9 @@ extern std::vector<const modelinfo_t *> selfshadowlist;
 extern std::vector<const modelinfo_t *> shadowworldonlylist;
 extern std::vector<const modelinfo_t *> switchableshadowlist;
 
+/* flattened hull 0 of all models, for point-in-solid / point-in-leaf tests */
+extern bsp_point_query_t point_query;
+
 extern int numDirtVectors;
 
 // other flags
@@ -250,6 +260,14 @@ enum class emissivequality_t
     HIGH
 };
 
+enum class tracequality_t
+{
+    AUTO,
+    LOW,
+    MEDIUM,
+    HIGH
+};
+
 enum class lightgrid_format_t
 {
     OCTREE
@@ -388,7 +406,16 @@ public:
     setting_set radlights;
     setting_int32 lightmap_scale;
     setting_extra extra;
+    setting_scalar extraadaptive;
     setting_enum<emissivequality_t> emissivequality;
+    setting_scalar emissivecluster;
+    setting_bool tracecache;
+    setting_int32 checkpoint;
+    setting_int32 workers;
+    setting_int32 worker;
+    setting_string workercommand;
+    setting_bool incremental;
+    setting_enum<tracequality_t> tracequality;
     setting_enum<visapprox_t> visapprox;
     setting_func lit;
     setting_func lit2;
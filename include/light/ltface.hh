@@ -23,6 +23,7 @@
 
 #include <atomic>
 #include <memory>
+#include <vector>
 
 struct mface_t;
 struct mbsp_t;
@@ -37,11 +38,6 @@ class faceextents_t;
 class light_t;
 struct facesup_t;
 
-#if 0
-extern std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
-extern std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
-extern std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
-#endif
 extern std::atomic<uint32_t> fully_transparent_lightmaps; // write.cc
 
 void PrintFaceInfo(const mface_t *face, const mbsp_t *bsp);
@@ -51,6 +47,7 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
 bool Face_IsLightmapped(const mbsp_t *bsp, const mface_t *face);
 bool Face_IsEmissive(const mbsp_t *bsp, const mface_t *face);
 void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
+std::vector<const light_t *> DirectLightFace_Lights(const mbsp_t *bsp, const lightsurf_t &lightsurf);
 void IndirectLightFace(
     const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg, size_t bounce_depth);
 void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg);
@@ -86,4 +83,3 @@ struct lightgrid_samples_t
 };
 
 lightgrid_samples_t CalcLightgridAtPoint(const mbsp_t *bsp, const qvec3f &world_point);
-void ResetLtFace();
@@ -0,0 +1,86 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * light/relight.hh
+ *
+ * -incremental support: after the direct lighting, the state of every face
+ * (see checkpoint.hh) is saved to a .lightcache file next to the .bsp,
+ * along with a hash of each light entity that reached the face (i.e. got
+ * past CullLight / VisCullEntity). On the next run, faces whose list of
+ * hashes is unchanged get their direct lighting from the cache instead of
+ * tracing it again; only faces a moved, added, removed or edited light
+ * reaches (before or after the edit) are relit.
+ *
+ * Everything else that feeds the direct lighting -- the geometry, the
+ * textures and extended texinfo flags, the options, worldspawn, suns,
+ * surface lights, and every entity that isn't a plain point light -- goes
+ * into a single key, and any change to it relights the whole map.
+ *
+ * The bounce passes and post-processing read every face, so they're
+ * always run in full.
+ */
+
+#pragma once
+
+#include <common/fs.hh>
+#include <common/profiler.hh>
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+struct bspdata_t;
+struct mbsp_t;
+struct lightsurf_t;
+
+namespace settings
+{
+class setting_container;
+}
+
+// lightmapped faces light_relight_t::load restored from the cache, for -profile
+extern profiler::counter c_faces_restored;
+
+class light_relight_t
+{
+    fs::path _path;
+    uint64_t _key;
+    // per face, the hashes of the lights DirectLightFace uses on it
+    std::vector<std::vector<uint64_t>> _lights;
+    // per face, whether its direct lighting was restored from the cache
+    std::vector<uint8_t> _cached;
+
+public:
+    light_relight_t(const fs::path &path, uint64_t key);
+
+    inline const fs::path &path() const { return _path; }
+
+    // works out which lights reach each face, and restores the faces
+    // whose lights are the same as when the cache was saved; returns the
+    // number of faces that still need lighting
+    size_t load(const mbsp_t *bsp, std::span<lightsurf_t> surfaces);
+
+    inline bool cached(size_t facenum) const { return _cached[facenum]; }
+
+    // saves the faces, once the direct lighting is done
+    void save(std::span<const lightsurf_t> surfaces) const;
+};
+
+// hash of everything besides the point lights that changes the direct lighting;
+// call once the entities are loaded and the lightmap surfaces are set up
+uint64_t LightRelightKey(const bspdata_t &bspdata, const fs::path &bsp_path, const settings::setting_container &options);
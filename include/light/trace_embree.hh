@@ -20,8 +20,10 @@
 #pragma once
 
 #include <common/aligned_allocator.hh>
+#include <common/fs.hh>
 #include <common/qvec.hh>
 #include <common/log.hh> // for FError
+#include <common/profiler.hh>
 
 #include <vector>
 #include <set>
@@ -46,7 +48,8 @@ struct texture;
 }
 
 void ResetEmbree();
-void Embree_TraceInit(const mbsp_t *bsp);
+// if cache_path is set, the triangles are loaded from/saved to it (-tracecache)
+void Embree_TraceInit(const mbsp_t *bsp, const fs::path &cache_path = {});
 const std::set<const mface_t *> &ShadowCastingSolidFacesSet();
 
 struct ray_io
@@ -92,26 +95,33 @@ public:
 
     void clearPushedRays() { _rays.clear(); }
 
+    // reorders the pushed rays by direction and length, so that large
+    // streams mixing many origins are traced coherently. ray_io::index
+    // is kept, so results should be looked up through getRay(j).index.
+    void sortPushedRays();
+
     inline qvec3f getPushedRayColor(size_t j) const
     {
         const ray_io &ray = getRay(j);
         qvec3f result = ray.color;
 
         if (ray.hit_glass) {
-            const qvec3f glasscolor = ray.glass_color;
-            const float opacity = ray.glass_opacity;
-
-            // multiply ray color by glass color
-            const qvec3f tinted = result * glasscolor;
-
-            // lerp ray color between original ray color and fully tinted by the glass texture color, based on the glass
-            // opacity
-            result = mix(result, tinted, opacity);
+            result = GlassTintedColor(result, ray.glass_color, ray.glass_opacity);
         }
 
         return result;
     }
 
+    static inline qvec3f GlassTintedColor(const qvec3f &color, const qvec3f &glasscolor, float opacity)
+    {
+        // multiply ray color by glass color
+        const qvec3f tinted = color * glasscolor;
+
+        // lerp ray color between original ray color and fully tinted by the glass texture color, based on the glass
+        // opacity
+        return mix(color, tinted, opacity);
+    }
+
 protected:
     static inline RTCRayHit SetupRay(
         unsigned int rayindex, const aligned_vec3 &start, const aligned_vec3 &dir, float dist)
@@ -141,6 +151,9 @@ protected:
 
 extern RTCScene scene;
 
+// all rays traced through raystreams, for -profile
+extern profiler::counter c_rays_traced;
+
 struct ray_source_info : public
 #ifdef HAVE_EMBREE4
                          RTCRayQueryContext
@@ -231,6 +244,8 @@ public:
         if (!_rays.size())
             return;
 
+        c_rays_traced += _rays.size();
+
         ray_source_info ctx2(this, self, shadowmask);
 
 #ifdef HAVE_EMBREE4
@@ -296,6 +311,8 @@ public:
         if (!_rays.size())
             return;
 
+        c_rays_traced += _rays.size();
+
         ray_source_info ctx2(this, self, shadowmask);
 #ifdef HAVE_EMBREE4
         RTCOccludedArguments embree4_args = ctx2.setup_occluded_arguments();
@@ -0,0 +1,66 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+/*
+ * light/worker.hh
+ *
+ * -workers n: the direct lighting and the bounce passes of LightWorld are
+ * split across n light processes. For each of these phases the light that
+ * was started (the coordinator) writes the state of every face (see
+ * checkpoint.hh) to a .lightwork directory next to the .bsp, and runs the
+ * workers with its own command line plus -worker k. Each worker sets up
+ * the map as usual, reads the state, lights its share of the faces and
+ * writes them back; the coordinator merges them and carries on with the
+ * next phase, so bounce lights are still made from every face.
+ *
+ * Workers are started with -workercommand (default: the light executable
+ * the coordinator was started with), so they can run on other machines
+ * (e.g. through ssh) as long as the .bsp directory is shared.
+ */
+
+#pragma once
+
+#include <common/fs.hh>
+
+#include <cstdint>
+#include <span>
+#include <vector>
+
+struct light_progress_t;
+struct lightsurf_t;
+
+// remembers the command line light was started with, to start workers with
+void SetLightWorkerArgs(int argc, const char **argv);
+
+// the faces in [first, num_faces) that worker `worker` of `num_workers` lights
+std::vector<uint32_t> LightWorkerFaces(size_t first, size_t num_faces, int32_t worker, int32_t num_workers);
+
+// where the coordinator writes the state of all faces for a phase
+fs::path LightWorkerStatePath(const fs::path &bsp_path);
+// where worker `worker` writes the faces it lit
+fs::path LightWorkerResultPath(const fs::path &bsp_path, int32_t worker);
+// where worker `worker` writes its log
+fs::path LightWorkerLogPath(const fs::path &bsp_path, int32_t worker);
+
+// coordinator: runs phase `progress.phases_done` on the faces from
+// `progress.faces_done` onwards in -workers processes, and merges the
+// results into surfaces. Exits with an error if a worker fails.
+void RunLightWorkers(
+    const fs::path &bsp_path, uint64_t key, const light_progress_t &progress, std::span<lightsurf_t> surfaces);
+
+// removes the .lightwork directory, with the workers' logs
+void CleanLightWorkers(const fs::path &bsp_path);
@@ -19,4 +19,8 @@ See file, 'COPYING', for details.
 
 #pragma once
 
+#include <string>
+#include <vector>
+
 int maputil_main(int argc, const char **argv);
+int maputil_main(const std::vector<std::string> &args);
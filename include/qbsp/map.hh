@@ -32,6 +32,7 @@
 #include <vector>
 #include <utility>
 #include <unordered_map>
+#include <limits>
 #include <list>
 #include <mutex>
 #include <shared_mutex>
@@ -180,6 +181,26 @@ struct hashedge_t
     bool has_been_reused;
 };
 
+// flat hash of hashedge_t by (v1, v2); open addressing with linear probing
+class edgehash_t
+{
+    static constexpr size_t EMPTY = std::numeric_limits<size_t>::max();
+
+    // unused slots have v1 == EMPTY
+    std::vector<hashedge_t> slots;
+    size_t count = 0;
+
+    size_t slot_for(size_t v1, size_t v2) const;
+    void grow();
+
+public:
+    hashedge_t *find(size_t v1, size_t v2);
+    // does nothing if (v1, v2) is already present, like std::map::emplace
+    void emplace(const hashedge_t &edge);
+    inline bool empty() const { return count == 0; }
+    void clear();
+};
+
 struct mapdata_t
 {
     /* Arrays of actual items */
@@ -224,13 +245,14 @@ struct mapdata_t
     std::unique_ptr<vertexhash_t> hashverts;
 
     // find output index for specified already-output vector.
+    // if several are within the epsilon, returns the lowest index.
     std::optional<size_t> find_emitted_hash_vector(const qvec3d &vert);
 
     // add vector to hash
     void add_hash_vector(const qvec3d &point, size_t num);
 
     // hashed edges; generated by EmitEdges
-    std::map<std::pair<size_t, size_t>, hashedge_t> hashedges;
+    edgehash_t hashedges;
 
     void add_hash_edge(size_t v1, size_t v2, int64_t edge_index, const face_t *face);
 
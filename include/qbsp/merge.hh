@@ -28,6 +28,7 @@
 struct face_t;
 struct node_t;
 
-void MergeFaceToList(face_t *face, std::list<face_t *> &list);
+void MergeFaceToList(
+    std::unique_ptr<face_t> face, std::list<std::unique_ptr<face_t>> &list, logging::stat_tracker_t::stat &num_merged);
 std::list<std::unique_ptr<face_t>> MergeFaceList(
     std::list<std::unique_ptr<face_t>> input, logging::stat_tracker_t::stat &num_merged);
@@ -26,7 +26,9 @@
 #include <qbsp/qbsp.hh>
 
 #include <atomic>
+#include <list>
 #include <memory>
+#include <vector>
 
 struct side_t;
 struct tree_t;
@@ -61,6 +63,11 @@ struct buildportal_t
     winding_t winding;
 };
 
+using buildportal_list_t = std::vector<buildportal_t>;
+// the finished portals of a subtree, in one contiguous chunk per leaf and
+// node portal; the subtrees' lists are spliced together
+using buildportal_chunks_t = std::list<buildportal_list_t>;
+
 struct portalstats_t : logging::stat_tracker_t
 {
     stat &c_tinyportals = register_stat("tiny portals");
@@ -75,10 +82,10 @@ enum class portaltype_t
     TREE,
     VIS
 };
-std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std::list<buildportal_t> boundary_portals,
+buildportal_chunks_t MakeTreePortals_r(node_t *node, portaltype_t type, buildportal_list_t boundary_portals,
     portalstats_t &stats, logging::percent_clock &clock);
 void MakeTreePortals(tree_t &tree);
-std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree);
-void MakePortalsFromBuildportals(tree_t &tree, std::list<buildportal_t> &buildportals);
+buildportal_list_t MakeHeadnodePortals(tree_t &tree);
+void MakePortalsFromBuildportals(tree_t &tree, buildportal_chunks_t &buildportals);
 void EmitAreaPortals(tree_t &tree);
 void MarkVisibleSides(tree_t &tree, bspbrush_t::container &brushes);
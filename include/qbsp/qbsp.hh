@@ -208,6 +208,9 @@ public:
     setting_scalar worldextent;
     setting_int32 leakdist;
     setting_bool forceprt1;
+    setting_bool binaryprt;
+    setting_scalar autocluster;
+    setting_scalar autoclusterportal;
     setting_tjunc tjunc;
     setting_bool objexport;
     setting_bool noextendedsurfflags;
@@ -26,6 +26,9 @@
 #include <common/prtfile.hh>
 #include <vis/leafbits.hh>
 
+#include <atomic>
+#include <functional>
+
 constexpr double VIS_ON_EPSILON = 0.1;
 constexpr double VIS_EQUAL_EPSILON = 0.001;
 
@@ -188,6 +191,7 @@ struct visstats_t
     int64_t c_leafskip = 0;
     int64_t c_portalskip = 0;
     int64_t c_targetcheck = 0;
+    int64_t c_splitflows = 0;
 
     visstats_t operator+(const visstats_t &other) const
     {
@@ -203,6 +207,7 @@ struct visstats_t
         result.c_leafskip = this->c_leafskip + other.c_leafskip;
         result.c_portalskip = this->c_portalskip + other.c_portalskip;
         result.c_targetcheck = this->c_targetcheck + other.c_targetcheck;
+        result.c_splitflows = this->c_splitflows + other.c_splitflows;
         return result;
     }
 };
@@ -211,6 +216,8 @@ viswinding_t *AllocStackWinding(pstack_t &stack);
 void FreeStackWinding(viswinding_t *&w, pstack_t &stack);
 viswinding_t *ClipStackWinding(visstats_t &stats, viswinding_t *in, pstack_t &stack, const qplane3d &split);
 
+struct flowsplit_t;
+
 struct threaddata_t
 {
     leafbits_t &leafvis;
@@ -219,11 +226,13 @@ struct threaddata_t
     visstats_t stats;
     unsigned numsteps;
     unsigned numtargetchecks;
+    flowsplit_t *split; // set if branches are spawned as tasks
 };
 
 extern int numportals;
 extern int portalleafs;
 extern int portalleafs_real;
+extern bool nonconvex_clusters;
 
 extern std::vector<visportal_t> portals; // always numportals * 2; front and back
 extern std::vector<leaf_t> leafs;
@@ -233,11 +242,18 @@ extern int leafbytes;
 extern int leafbytes_real;
 extern int leaflongs;
 
-extern fs::path portalfile, statefile, statetmpfile;
+extern fs::path portalfile, statefile, statetmpfile, statejournalfile;
+
+// set once -timelimit has passed; flows in progress stop as soon as they see it
+extern std::atomic_bool timelimit_reached;
+
+// if set, called after each portal's flow, before timelimit_reached is
+// checked; the tests use it to stop a -timelimit run part way through
+extern std::function<void(const visportal_t &)> portal_flowed_callback;
 
 void BasePortalVis();
 
-visstats_t PortalFlow(visportal_t *p);
+visstats_t PortalFlow(visportal_t *p, bool split = false);
 
 void CalcAmbientSounds(mbsp_t *bsp);
 
@@ -245,6 +261,7 @@ void CalcPHS(mbsp_t *bsp);
 
 extern time_point starttime, endtime, statetime;
 
+bool AppendVisState(const visportal_t &p);
 void SaveVisState();
 bool LoadVisState();
 void CleanVisState();
@@ -275,6 +292,10 @@ public:
         this, "phsonly", false, &vis_advanced_group, "re-calculate the PHS of a Quake II BSP without touching the PVS"};
     setting_invertible_bool autoclean{
         this, "autoclean", true, &vis_output_group, "remove any extra files on successful completion"};
+    setting_scalar timelimit{this, "timelimit", 0.0, &performance_group,
+        "stop after this many seconds, using the -fast result for the portals not done yet (0 = no limit)"};
+    setting_int32 splitdepth{this, "splitdepth", 2, 0, 16, &performance_group,
+        "once fewer portals are left than threads, split each one's flow into tasks at this depth (0 = never)"};
     setting_scalar targetratio{this, "targetchecks", 0.5, 0.0, 9999.0, &performance_group,
         "target ratio of target checks to regular checks (0.0 = no target checks, 1.0 = equal amounts of regular and target checks)"};
 
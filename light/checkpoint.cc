@@ -0,0 +1,390 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/checkpoint.hh>
+
+#include <light/light.hh>
+#include <light/surflight.hh>
+
+#include <common/imglib.hh>
+#include <common/log.hh>
+#include <common/settings.hh>
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+struct light_state_header
+{
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t num_faces;
+    // faces stored in the file; each is preceded by its face number
+    uint32_t num_entries;
+    uint32_t phases_done;
+    uint32_t faces_done;
+
+    auto stream_data() { return std::tie(magic, version, key, num_faces, num_entries, phases_done, faces_done); }
+};
+
+constexpr std::array<char, 4> LIGHT_STATE_MAGIC{'L', 'S', 'T', 'A'};
+constexpr uint32_t LIGHT_STATE_VERSION = 2;
+
+// options that only change how the lighting is computed, not the result
+static const std::array<const char *, 9> LIGHT_STATE_IGNORED_OPTIONS{"threads", "lowpriority", "checkpoint",
+    "tracecache", "tracequality", "workers", "worker", "workercommand", "incremental"};
+
+uint64_t HashLightOptions(const settings::setting_container &options, uint64_t hash)
+{
+    // settings are stored in a set of pointers; sort them by name
+    // so the key doesn't depend on where they were allocated
+    std::map<std::string, std::string> values;
+
+    for (const settings::setting_base *setting : options) {
+        if (!setting->is_changed() || setting->group() == &settings::logging_group) {
+            continue;
+        }
+
+        if (std::find(LIGHT_STATE_IGNORED_OPTIONS.begin(), LIGHT_STATE_IGNORED_OPTIONS.end(),
+                setting->primary_name()) != LIGHT_STATE_IGNORED_OPTIONS.end()) {
+            continue;
+        }
+
+        values[setting->primary_name()] = setting->string_value();
+    }
+
+    for (auto &[name, value] : values) {
+        hash = fnv1a_64(name.data(), name.size() + 1, hash);
+        hash = fnv1a_64(value.data(), value.size() + 1, hash);
+    }
+
+    return hash;
+}
+
+uint64_t HashLoadedTextures(uint64_t hash)
+{
+    // img::textures is unordered; sort it by name
+    std::map<std::string, const img::texture *> textures;
+
+    for (auto &[name, texture] : img::textures) {
+        textures[name] = &texture;
+    }
+
+    for (auto &[name, texture] : textures) {
+        const std::array<uint32_t, 2> size{texture->width, texture->height};
+
+        hash = fnv1a_64(name.data(), name.size() + 1, hash);
+        hash = fnv1a_64(size.data(), sizeof(size), hash);
+        hash = fnv1a_64(&texture->averageColor, sizeof(texture->averageColor), hash);
+        hash = fnv1a_64(texture->pixels.data(), texture->pixels.size() * sizeof(qvec4b), hash);
+    }
+
+    return hash;
+}
+
+uint64_t LightCheckpointKey(const fs::path &bsp_path, const settings::setting_container &options)
+{
+    uint64_t hash = FNV1A_64_INIT;
+
+    {
+        std::ifstream stream(bsp_path, std::ios_base::in | std::ios_base::binary);
+        std::vector<char> buffer(1 << 16);
+
+        while (stream) {
+            stream.read(buffer.data(), buffer.size());
+            hash = fnv1a_64(buffer.data(), stream.gcount(), hash);
+        }
+    }
+
+    // Quake 2 textures come from disk rather than the .bsp
+    hash = HashLoadedTextures(hash);
+
+    return HashLightOptions(options, hash);
+}
+
+light_checkpoint_t::light_checkpoint_t(const fs::path &path, uint64_t key, duration interval)
+    : _path(path),
+      _key(key),
+      _interval(interval),
+      _last_save(I_FloatTime())
+{
+}
+
+template<typename T>
+static void WriteOptional(std::ostream &stream, const std::optional<T> &v)
+{
+    stream <= static_cast<uint8_t>(v.has_value());
+
+    if (v) {
+        stream <= *v;
+    }
+}
+
+template<typename T>
+static void ReadOptional(std::istream &stream, std::optional<T> &v)
+{
+    uint8_t has_value = 0;
+    stream >= has_value;
+
+    if (has_value) {
+        T value;
+        stream >= value;
+        v = value;
+    } else {
+        v = std::nullopt;
+    }
+}
+
+static void WriteSurfaceLight(std::ostream &stream, const surfacelight_t &vpl)
+{
+    stream <= vpl.pos <= vpl.surfnormal <= static_cast<uint64_t>(vpl.points_before_culling) <= vpl.bounds;
+    WriteOptional(stream, vpl.minlight_scale);
+    WriteVector(stream, vpl.points);
+
+    stream <= static_cast<uint32_t>(vpl.styles.size());
+
+    for (auto &style : vpl.styles) {
+        WriteOptional(stream, style.bounce_level ? std::optional<uint64_t>(*style.bounce_level) : std::nullopt);
+        stream <= static_cast<uint8_t>(style.omnidirectional) <= static_cast<uint8_t>(style.rescale);
+        stream <= style.style <= style.intensity <= style.totalintensity <= style.atten <= style.color;
+    }
+}
+
+static void ReadSurfaceLight(std::istream &stream, surfacelight_t &vpl)
+{
+    uint64_t points_before_culling;
+    stream >= std::tie(vpl.pos, vpl.surfnormal, points_before_culling, vpl.bounds);
+    vpl.points_before_culling = points_before_culling;
+    ReadOptional(stream, vpl.minlight_scale);
+    ReadVector(stream, vpl.points);
+
+    uint32_t num_styles;
+    stream >= num_styles;
+
+    if (!stream) {
+        return;
+    }
+
+    // num_styles comes from the file; grow as styles are read rather than
+    // trusting it up front
+    for (uint32_t i = 0; i < num_styles && stream; i++) {
+        auto &style = vpl.styles.emplace_back();
+        std::optional<uint64_t> bounce_level;
+        uint8_t omnidirectional, rescale;
+
+        ReadOptional(stream, bounce_level);
+        stream >= std::tie(omnidirectional, rescale);
+        stream >= std::tie(style.style, style.intensity, style.totalintensity, style.atten, style.color);
+
+        style.bounce_level = bounce_level ? std::optional<size_t>(*bounce_level) : std::nullopt;
+        style.omnidirectional = omnidirectional;
+        style.rescale = rescale;
+    }
+}
+
+void WriteLightSurfaceState(std::ostream &stream, const lightsurf_t &surf)
+{
+    stream <= static_cast<uint32_t>(surf.lightmapsByStyle.size());
+
+    for (auto &lightmap : surf.lightmapsByStyle) {
+        stream <= static_cast<int32_t>(lightmap.style) <= lightmap.bounce_color;
+        WriteVector(stream, lightmap.samples);
+    }
+
+    std::vector<float> occlusion;
+    std::vector<uint8_t> occluded;
+    occlusion.reserve(surf.samples.size());
+    occluded.reserve(surf.samples.size());
+
+    for (auto &sample : surf.samples) {
+        occlusion.push_back(sample.occlusion);
+        occluded.push_back(sample.occluded);
+    }
+
+    WriteVector(stream, occlusion);
+    WriteVector(stream, occluded);
+
+    stream <= static_cast<uint8_t>(surf.vpl != nullptr);
+
+    if (surf.vpl) {
+        WriteSurfaceLight(stream, *surf.vpl);
+    }
+}
+
+bool ReadLightSurfaceState(std::istream &stream, const lightsurf_t &surf, light_surface_state_t &restored)
+{
+    uint32_t num_lightmaps;
+    stream >= num_lightmaps;
+
+    if (!stream) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < num_lightmaps; i++) {
+        auto &lightmap = restored.lightmapsByStyle.emplace_back();
+        int32_t style;
+        stream >= style >= lightmap.bounce_color;
+        lightmap.style = style;
+        ReadVector(stream, lightmap.samples);
+
+        if (!stream || lightmap.samples.size() != surf.samples.size()) {
+            return false;
+        }
+    }
+
+    ReadVector(stream, restored.occlusion);
+    ReadVector(stream, restored.occluded);
+
+    if (!stream || restored.occlusion.size() != surf.samples.size() ||
+        restored.occluded.size() != surf.samples.size()) {
+        return false;
+    }
+
+    uint8_t has_vpl = 0;
+    stream >= has_vpl;
+
+    if (has_vpl) {
+        restored.vpl = std::make_unique<surfacelight_t>();
+        ReadSurfaceLight(stream, *restored.vpl);
+    }
+
+    return !!stream;
+}
+
+void ApplyLightSurfaceState(lightsurf_t &surf, light_surface_state_t &&state)
+{
+    surf.lightmapsByStyle = std::move(state.lightmapsByStyle);
+    surf.vpl = std::move(state.vpl);
+
+    for (size_t j = 0; j < surf.samples.size(); j++) {
+        surf.samples[j].occlusion = state.occlusion[j];
+        surf.samples[j].occluded = state.occluded[j];
+    }
+}
+
+std::optional<light_progress_t> LoadLightState(
+    const fs::path &path, uint64_t key, std::span<lightsurf_t> surfaces)
+{
+    std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+
+    if (!stream) {
+        return std::nullopt;
+    }
+
+    light_state_header header;
+    stream >= header;
+
+    if (!stream || header.magic != LIGHT_STATE_MAGIC || header.version != LIGHT_STATE_VERSION ||
+        header.key != key || header.num_faces != surfaces.size() || header.num_entries > surfaces.size()) {
+        return std::nullopt;
+    }
+
+    // read everything first, so a truncated file leaves the surfaces as they were
+    std::vector<uint32_t> facenums(header.num_entries);
+    std::vector<light_surface_state_t> restored(header.num_entries);
+
+    for (size_t i = 0; i < header.num_entries; i++) {
+        stream >= facenums[i];
+
+        if (!stream || facenums[i] >= surfaces.size() || !ReadLightSurfaceState(stream, surfaces[facenums[i]], restored[i])) {
+            return std::nullopt;
+        }
+    }
+
+    for (size_t i = 0; i < header.num_entries; i++) {
+        ApplyLightSurfaceState(surfaces[facenums[i]], std::move(restored[i]));
+    }
+
+    return light_progress_t{header.phases_done, header.faces_done};
+}
+
+bool SaveLightState(const fs::path &path, uint64_t key, const light_progress_t &progress,
+    std::span<const lightsurf_t> surfaces, const std::vector<uint32_t> *facenums)
+{
+    fs::path tmp_path = fs::path(path).concat(".tmp");
+
+    {
+        std::ofstream stream(tmp_path, std::ios_base::out | std::ios_base::binary);
+
+        if (!stream) {
+            return false;
+        }
+
+        const size_t num_entries = facenums ? facenums->size() : surfaces.size();
+
+        light_state_header header{LIGHT_STATE_MAGIC, LIGHT_STATE_VERSION, key, static_cast<uint32_t>(surfaces.size()),
+            static_cast<uint32_t>(num_entries), progress.phases_done, progress.faces_done};
+        stream <= header;
+
+        for (size_t i = 0; i < num_entries; i++) {
+            const uint32_t facenum = facenums ? (*facenums)[i] : static_cast<uint32_t>(i);
+            stream <= facenum;
+            WriteLightSurfaceState(stream, surfaces[facenum]);
+        }
+
+        if (!stream) {
+            return false;
+        }
+    }
+
+    // only replace the previous file once the new one is complete
+    std::error_code ec;
+    fs::remove(path, ec);
+    fs::rename(tmp_path, path, ec);
+
+    return !ec;
+}
+
+std::optional<light_progress_t> light_checkpoint_t::load(std::span<lightsurf_t> surfaces) const
+{
+    if (!fs::exists(_path)) {
+        return std::nullopt;
+    }
+
+    auto progress = LoadLightState(_path, _key, surfaces);
+
+    if (!progress) {
+        logging::print("{} is from a different .bsp or options, or incomplete; ignoring it\n", _path.string());
+    }
+
+    return progress;
+}
+
+void light_checkpoint_t::save(const light_progress_t &progress, std::span<const lightsurf_t> surfaces, bool force)
+{
+    const time_point now = I_FloatTime();
+
+    if (!force && now - _last_save < _interval) {
+        return;
+    }
+
+    _last_save = now;
+
+    if (!SaveLightState(_path, _key, progress, surfaces)) {
+        logging::print("WARNING: can't write checkpoint {}\n", _path.string());
+    }
+}
+
+void light_checkpoint_t::remove() const
+{
+    std::error_code ec;
+    fs::remove(_path, ec);
+}
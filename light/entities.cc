@@ -22,6 +22,8 @@
 #include <algorithm>
 #include <cstring>
 #include <fstream>
+#include <map>
+#include <tuple>
 #include <common/imglib.hh> // for img::find
 #include <common/log.hh>
 #include <common/cmdlib.hh>
@@ -43,6 +45,7 @@ static std::vector<std::unique_ptr<light_t>> surfacelight_templates;
 static std::ofstream surflights_dump_file;
 static fs::path surflights_dump_filename;
 static std::map<std::string, light_t *> lights_by_switchableshadow_target;
+static std::vector<std::vector<const light_t *>> light_shadow_groups;
 
 /**
  * Resets global data in this file
@@ -60,6 +63,7 @@ void ResetLightEntities()
     surflights_dump_file = {};
     surflights_dump_filename.clear();
     lights_by_switchableshadow_target.clear();
+    light_shadow_groups.clear();
 }
 
 std::vector<std::unique_ptr<light_t>> &GetLights()
@@ -72,6 +76,11 @@ const std::vector<entdict_t> &GetEntdicts()
     return entdicts;
 }
 
+const std::vector<std::vector<const light_t *>> &GetLightShadowGroups()
+{
+    return light_shadow_groups;
+}
+
 std::vector<sun_t> &GetSuns()
 {
     return all_suns;
@@ -680,13 +689,23 @@ static std::unique_ptr<light_t> DuplicateEntity(const light_t &src)
  * From q3map2
  * =============
  */
-static void JitterEntity(const light_t &entity)
+// lights stacked at the same origin with the same _samples and _deviance
+// (e.g. one per style) get the same jittered copies, so the copies are
+// co-located too and can share shadow rays (see GroupLightShadows)
+using jitter_key_t = std::tuple<float, float, float, float, int32_t>;
+using jitter_sets_t = std::map<jitter_key_t, std::vector<qvec3f>>;
+
+static void JitterEntity(const light_t &entity, jitter_sets_t &jitter_sets)
 {
     // don't jitter suns
     if (entity.sun.value()) {
         return;
     }
 
+    const qvec3f &origin = entity.origin.value();
+    std::vector<qvec3f> &offsets = jitter_sets[{
+        origin[0], origin[1], origin[2], entity.deviance.value(), entity.samples.value()}];
+
     std::vector<std::unique_ptr<light_t>> new_lights;
 
     /* jitter the light */
@@ -696,10 +715,12 @@ static void JitterEntity(const light_t &entity)
         light2->generated = true; // don't write generated light to bsp
 
         /* jitter it */
-        qvec3f neworigin = {(entity.origin.value())[0] + (Random() * 2.0f - 1.0f) * entity.deviance.value(),
-            (entity.origin.value())[1] + (Random() * 2.0f - 1.0f) * entity.deviance.value(),
-            (entity.origin.value())[2] + (Random() * 2.0f - 1.0f) * entity.deviance.value()};
-        light2->origin.set_value(neworigin, settings::source::MAP);
+        if (offsets.size() < static_cast<size_t>(j)) {
+            offsets.push_back({(Random() * 2.0f - 1.0f) * entity.deviance.value(),
+                (Random() * 2.0f - 1.0f) * entity.deviance.value(), (Random() * 2.0f - 1.0f) * entity.deviance.value()});
+        }
+
+        light2->origin.set_value(origin + offsets[j - 1], settings::source::MAP);
     }
 
     // move the new lights into all_lights
@@ -714,9 +735,58 @@ static void JitterEntities()
 {
     // We will append to the list during iteration.
     const size_t starting_size = all_lights.size();
+    jitter_sets_t jitter_sets;
     for (size_t i = 0; i < starting_size; i++) {
-        JitterEntity(*all_lights.at(i));
+        JitterEntity(*all_lights.at(i), jitter_sets);
+    }
+}
+
+/*
+ * =============
+ * GroupLightShadows
+ *
+ * Positive lights at the same (final) origin with the same shadow channel
+ * mask trace exactly the same shadow rays from a given sample point; they
+ * are put in a shadow group, so LightFace_Entity can trace them once per
+ * face and reuse the result for each light's style. Lights that don't
+ * share their origin are left with shadow_group -1.
+ * =============
+ */
+static void GroupLightShadows()
+{
+    light_shadow_groups.clear();
+
+    std::map<std::tuple<float, float, float, int32_t>, std::vector<light_t *>> by_origin;
+
+    for (auto &entity : all_lights) {
+        entity->shadow_group = -1;
+
+        if (entity->getFormula() == LF_LOCALMIN || entity->nostaticlight.value() || entity->light.value() <= 0) {
+            continue;
+        }
+
+        const qvec3f &origin = entity->origin.value();
+        by_origin[{origin[0], origin[1], origin[2], entity->shadow_channel_mask.value()}].push_back(entity.get());
     }
+
+    size_t num_grouped = 0;
+
+    for (auto &[key, lights] : by_origin) {
+        if (lights.size() < 2) {
+            continue;
+        }
+
+        auto &group = light_shadow_groups.emplace_back();
+
+        for (light_t *entity : lights) {
+            entity->shadow_group = light_shadow_groups.size() - 1;
+            group.push_back(entity);
+        }
+
+        num_grouped += lights.size();
+    }
+
+    logging::print("{} lights share shadow rays in {} groups\n", num_grouped, light_shadow_groups.size());
 }
 
 template<typename T>
@@ -1092,7 +1162,7 @@ void LoadEntities(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
 std::tuple<qvec3f, bool> FixLightOnFace(const mbsp_t *bsp, const qvec3f &point, bool warn, float max_dist)
 {
     // FIXME: Check all shadow casters
-    if (!Light_PointInWorld(bsp, point)) {
+    if (!point_query.point_in_solid(0, point)) {
         return {point, true};
     }
 
@@ -1106,7 +1176,7 @@ std::tuple<qvec3f, bool> FixLightOnFace(const mbsp_t *bsp, const qvec3f &point,
         testpoint[axis] += (add ? max_dist : -max_dist);
 
         // FIXME: Check all shadow casters
-        if (!Light_PointInWorld(bsp, testpoint)) {
+        if (!point_query.point_in_solid(0, testpoint)) {
             return {testpoint, true};
         }
     }
@@ -1242,6 +1312,8 @@ void SetupLights(const settings::worldspawn_keys &cfg, const mbsp_t *bsp)
         SetupLightLeafnums(bsp);
     }
 
+    GroupLightShadows();
+
     logging::print("Final count: {} lights, {} suns in use.\n", all_lights.size(), all_suns.size());
 
     Q_assert(final_lightcount == all_lights.size());
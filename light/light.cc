@@ -26,10 +26,13 @@
 #include <light/lightgrid.hh>
 #include <light/phong.hh>
 #include <light/bounce.hh>
+#include <light/checkpoint.hh>
+#include <light/relight.hh>
 #include <light/surflight.hh> //mxd
 #include <light/entities.hh>
 #include <light/ltface.hh>
 #include <light/write.hh> // for facesup_t
+#include <light/worker.hh>
 #include <light/trace_embree.hh>
 
 #include <common/log.hh>
@@ -39,6 +42,7 @@
 #include <common/imglib.hh>
 #include <common/parallel.hh>
 #include <common/ostream.hh>
+#include <common/profiler.hh>
 
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
 #include <xmmintrin.h>
@@ -106,6 +110,7 @@ std::vector<const modelinfo_t *> tracelist;
 std::vector<const modelinfo_t *> selfshadowlist;
 std::vector<const modelinfo_t *> shadowworldonlylist;
 std::vector<const modelinfo_t *> switchableshadowlist;
+bsp_point_query_t point_query;
 
 std::vector<surfflags_t> extended_texinfo_flags;
 
@@ -306,10 +311,36 @@ light_settings::light_settings()
           this, "lightmap_scale", 0, &experimental_group, "force change lightmap scale; vanilla engines only allow 16"},
       extra{
           this, {"extra", "extra4"}, 1, &performance_group, "supersampling; 2x2 (extra) or 4x4 (extra4) respectively"},
+      extraadaptive{this, "extraadaptive", 0.0, 0.0, 1.0, settings::can_omit_argument_tag(), 0.05, &performance_group,
+          "with -extra or -extra4, only supersample luxels at shadow edges or where the brightness changes by more "
+          "than this fraction (default 0.05); the rest are lit once. 0 = off"},
       emissivequality{this, "emissivequality", emissivequality_t::LOW,
           {{"LOW", emissivequality_t::LOW}, {"MEDIUM", emissivequality_t::MEDIUM}, {"HIGH", emissivequality_t::HIGH}},
           &performance_group,
           "low = one point in the center of the face, med = center + all verts, high = spread points out for antialiasing"},
+      emissivecluster{this, "emissivecluster", 0.0, 0.0, std::numeric_limits<float>::infinity(), &performance_group,
+          "treat emissive surfaces further than this many times their size from a face as a single point; 0 = off"},
+      tracecache{this, "tracecache", false, &performance_group,
+          "reuse the ray tracing triangles from a .embree file next to the .bsp if the geometry is unchanged"},
+      checkpoint{this, "checkpoint", 0, 0, std::numeric_limits<int32_t>::max(), settings::can_omit_argument_tag(), 600,
+          &performance_group,
+          "save lighting progress to a .lightstate file every n seconds (default 600), and resume from it if "
+          "the .bsp and options are unchanged; 0 = off"},
+      workers{this, "workers", 0, 0, 1024, &performance_group,
+          "split the direct and indirect lighting across n light processes; see -workercommand"},
+      worker{this, "worker", -1, -1, 1023, &performance_group,
+          "used internally by -workers: light this worker's share of the faces"},
+      workercommand{this, "workercommand", "", "\"command\"", &performance_group,
+          "command to start -workers with, followed by light's arguments. defaults to this light executable"},
+      incremental{this, "incremental", false, &performance_group,
+          "keep the direct lighting in a .lightcache file, and on the next run only relight the faces reached by "
+          "lights that were added, removed or changed"},
+      tracequality{this, "tracequality", tracequality_t::MEDIUM,
+          {{"auto", tracequality_t::AUTO}, {"low", tracequality_t::LOW}, {"medium", tracequality_t::MEDIUM},
+              {"high", tracequality_t::HIGH}},
+          &performance_group,
+          "embree geometry build quality (default medium). auto = high, or medium for very large maps. low "
+          "builds fastest but traces slowest"},
       visapprox{this, "visapprox", visapprox_t::AUTO,
           {{"auto", visapprox_t::AUTO}, {"none", visapprox_t::NONE}, {"vis", visapprox_t::VIS},
               {"rays", visapprox_t::RAYS}},
@@ -504,6 +535,10 @@ void light_settings::light_postinitialize(int argc, const char **argv)
         }
     }
 
+    if (extraadaptive.value() > 0 && extra.value() == 1) {
+        logging::print("WARNING: -extraadaptive has no effect without -extra or -extra4\n");
+    }
+
     if (debugmode != debugmodes::none) {
         write_litfile |= lightfile::external;
     }
@@ -783,10 +818,11 @@ static void FindModelInfo(const mbsp_t *bsp)
  *  LightWorld
  * =============
  */
-static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedscale)
-{
-    logging::funcheader();
 
+// sets up the lightmap surfaces and surface lights the lighting phases start
+// from; shared by LightWorld and -worker
+static void SetupLightWorld(bspdata_t *bspdata, bool forcedscale)
+{
     mbsp_t &bsp = std::get<mbsp_t>(bspdata->bsp);
 
     ClearLightmapSurfaces();
@@ -836,63 +872,219 @@ static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedsc
     // create lightmap surfaces
     CreateLightmapSurfaces(&bsp);
 
-    const bool bouncerequired =
-        light_options.bounce.value() &&
-        (light_options.debugmode == debugmodes::none || light_options.debugmode == debugmodes::bounce ||
-            light_options.debugmode == debugmodes::bouncelights); // mxd
-
     MakeRadiositySurfaceLights(light_options, &bsp);
     UpdateEmissiveLightSurfacesList();
+}
+
+/*
+ * =============
+ *  LightWorker
+ *
+ * -worker n: lights this worker's share of the faces for the phase the
+ * -workers coordinator wrote the state for, and writes them back
+ * =============
+ */
+static void LightWorker(bspdata_t *bspdata, const fs::path &source, bool forcedscale)
+{
+    logging::funcheader();
+    profiler::scope scope(__func__);
+
+    mbsp_t &bsp = std::get<mbsp_t>(bspdata->bsp);
+    const int32_t worker = light_options.worker.value();
+
+    if (worker >= light_options.workers.value()) {
+        FError("-worker {} needs -workers {} or more", worker, worker + 1);
+    }
+
+    SetupLightWorld(bspdata, forcedscale);
+
+    const uint64_t key = LightCheckpointKey(source, light_options);
+    auto progress = LoadLightState(LightWorkerStatePath(source), key, light_surfaces_span);
+
+    if (!progress) {
+        FError("can't read {}, or it's for a different .bsp or options", LightWorkerStatePath(source).string());
+    }
+
+    UpdateEmissiveLightSurfacesList();
+
+    // phase 0 is the direct lighting, 1..bounce the indirect passes
+    const uint32_t phase = progress->phases_done;
+    const std::vector<uint32_t> facenums =
+        LightWorkerFaces(progress->faces_done, bsp.dfaces.size(), worker, light_options.workers.value());
+
+    logging::print("worker {}: phase {}, {} faces\n", worker, phase, facenums.size());
 
-    logging::header("Direct Lighting"); // mxd
-    logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
+    logging::parallel_for_each(facenums, [&bsp, phase](uint32_t i) {
         if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
             _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
-            DirectLightFace(&bsp, light_surfaces[i], light_options);
+            if (phase == 0) {
+                DirectLightFace(&bsp, light_surfaces[i], light_options);
+            } else {
+                IndirectLightFace(&bsp, light_surfaces[i], light_options, phase - 1);
+            }
         }
     });
 
-    if (bouncerequired && !light_options.nolighting.value()) {
+    if (!SaveLightState(LightWorkerResultPath(source, worker), key, *progress, light_surfaces_span, &facenums)) {
+        FError("can't write {}", LightWorkerResultPath(source, worker).string());
+    }
+}
 
-        for (size_t i = 0; i < light_options.bounce.value(); i++) {
+static void LightWorld(bspdata_t *bspdata, const fs::path &source, bool forcedscale)
+{
+    logging::funcheader();
+    profiler::scope scope(__func__);
 
-            if (!MakeBounceLights(light_options, &bsp, i)) {
-                logging::header("No bounces; indirect lighting halted");
-                break;
-            }
-            UpdateEmissiveLightSurfacesList();
+    mbsp_t &bsp = std::get<mbsp_t>(bspdata->bsp);
 
-            logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+    SetupLightWorld(bspdata, forcedscale);
 
-            logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [i, &bsp](size_t f) {
-                if (Face_IsLightmapped(&bsp, &bsp.dfaces[f])) {
-#if defined(HAVE_EMBREE) && defined(__SSE2__)
-                    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
-#endif
+    const bool bouncerequired =
+        light_options.bounce.value() &&
+        (light_options.debugmode == debugmodes::none || light_options.debugmode == debugmodes::bounce ||
+            light_options.debugmode == debugmodes::bouncelights); // mxd
 
-                    IndirectLightFace(&bsp, light_surfaces[f], light_options, i);
-                }
-            });
+    // phases: 0 = direct, 1..bounce = indirect passes, then post-processing
+    std::optional<light_checkpoint_t> checkpoint;
+    light_progress_t progress;
+
+    // key of the files -checkpoint and -workers write
+    const uint64_t state_key = (light_options.checkpoint.value() || light_options.workers.value())
+                                   ? LightCheckpointKey(source, light_options)
+                                   : 0;
+
+    if (light_options.checkpoint.value()) {
+        checkpoint.emplace(fs::path(source).replace_extension("lightstate"), state_key,
+            duration(light_options.checkpoint.value()));
+
+        if (auto resumed = checkpoint->load(light_surfaces_span)) {
+            progress = *resumed;
+            UpdateEmissiveLightSurfacesList();
+            logging::print("resuming from {}: {} phases done, {} faces into the next\n", checkpoint->path().string(),
+                progress.phases_done, progress.faces_done);
         }
     }
 
-    if (!light_options.nolighting.value()) {
-        logging::header("Post-Processing"); // mxd
-        logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), [&bsp](size_t i) {
+    // runs func over the lightmapped faces, for the faces of the phase that
+    // aren't done yet. with -checkpoint the faces are split into batches, and
+    // progress is saved between batches every -checkpoint seconds. with
+    // -workers, phases that can be distributed are run by the workers instead
+    auto light_phase = [&bsp, &source, state_key, &checkpoint, &progress](bool distribute, auto &&func) {
+        auto body = [&bsp, &func](size_t i) {
             if (Face_IsLightmapped(&bsp, &bsp.dfaces[i])) {
 #if defined(HAVE_EMBREE) && defined(__SSE2__)
                 _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
 #endif
+                func(i);
+            }
+        };
+
+        if (distribute && light_options.workers.value()) {
+            RunLightWorkers(source, state_key, progress, light_surfaces_span);
+        } else if (!checkpoint) {
+            logging::parallel_for(static_cast<size_t>(0), bsp.dfaces.size(), body);
+        } else {
+            const size_t num_faces = bsp.dfaces.size();
+            const size_t batch_size = std::max<size_t>(256, num_faces / 64);
+
+            while (progress.faces_done < num_faces) {
+                logging::percent(progress.faces_done, num_faces);
 
-                PostProcessLightFace(&bsp, light_surfaces[i], light_options);
+                const size_t first = progress.faces_done;
+                const size_t last = std::min(num_faces, first + batch_size);
+                logging::parallel_for(first, last, body, logging::progress_t::NONE);
+
+                progress.faces_done = last;
+                checkpoint->save(progress, light_surfaces_span);
+            }
+
+            logging::percent(num_faces, num_faces);
+        }
+
+        progress.phases_done++;
+        progress.faces_done = 0;
+
+        if (checkpoint) {
+            checkpoint->save(progress, light_surfaces_span, true);
+        }
+    };
+
+    // -incremental only applies to a run that starts from scratch; a resumed
+    // checkpoint has its direct lighting already
+    std::optional<light_relight_t> relight;
+
+    if (light_options.incremental.value() && progress.phases_done == 0 && progress.faces_done == 0) {
+        relight.emplace(
+            fs::path(source).replace_extension("lightcache"), LightRelightKey(*bspdata, source, light_options));
+
+        const size_t num_relit = relight->load(&bsp, light_surfaces_span);
+        logging::print("{}: {} of {} faces need relighting\n", relight->path().string(), num_relit,
+            bsp.dfaces.size());
+    }
+
+    if (progress.phases_done == 0) {
+        logging::header("Direct Lighting"); // mxd
+        profiler::scope scope("Direct Lighting");
+
+        // the workers don't have the cache, so -incremental lights here
+        light_phase(!relight, [&bsp, &relight](size_t i) {
+            if (!relight || !relight->cached(i)) {
+                DirectLightFace(&bsp, light_surfaces[i], light_options);
             }
         });
+
+        if (relight) {
+            relight->save(light_surfaces_span);
+        }
+    }
+
+    if (bouncerequired && !light_options.nolighting.value()) {
+
+        for (size_t i = 0; i < light_options.bounce.value(); i++) {
+            if (progress.phases_done > i + 1) {
+                continue;
+            }
+
+            profiler::scope scope(fmt::format("Indirect Lighting (pass {})", i));
+
+            // a pass that was interrupted has its bounce lights in the checkpoint already
+            if (progress.faces_done == 0) {
+                if (!MakeBounceLights(light_options, &bsp, i)) {
+                    logging::header("No bounces; indirect lighting halted");
+                    break;
+                }
+                UpdateEmissiveLightSurfacesList();
+            }
+
+            logging::header(fmt::format("Indirect Lighting (pass {0})", i).c_str()); // mxd
+
+            light_phase(
+                true, [i, &bsp](size_t f) { IndirectLightFace(&bsp, light_surfaces[f], light_options, i); });
+        }
+    }
+
+    // post-processing follows the last indirect pass, even if bouncing stopped early
+    const uint32_t postprocess_phase = light_options.bounce.value() + 1;
+
+    if (!light_options.nolighting.value() && progress.phases_done <= postprocess_phase) {
+        logging::header("Post-Processing"); // mxd
+        profiler::scope scope("Post-Processing");
+        progress.phases_done = postprocess_phase;
+        light_phase(false, [&bsp](size_t i) { PostProcessLightFace(&bsp, light_surfaces[i], light_options); });
     }
 
     SaveLightmapSurfaces(bspdata, source);
 
+    if (checkpoint) {
+        checkpoint->remove();
+    }
+
+    if (light_options.workers.value()) {
+        CleanLightWorkers(source);
+    }
+
     // kill this stuff if its somehow found.
     bspdata->bspx.entries.erase("LMSTYLE16");
     bspdata->bspx.entries.erase("LMSTYLE");
@@ -1276,6 +1468,7 @@ static void ResetLight()
     selfshadowlist.clear();
     shadowworldonlylist.clear();
     switchableshadowlist.clear();
+    point_query = {};
 
     extended_texinfo_flags.clear();
 
@@ -1287,7 +1480,6 @@ void light_reset()
 {
     ResetLightEntities();
     ResetLight();
-    ResetLtFace();
     ResetPhong();
     ResetSurflight();
     ResetEmbree();
@@ -1311,11 +1503,18 @@ int light_main(int argc, const char **argv)
     light_options.initialize(argc, argv);
     light_options.postinitialize(argc, argv);
 
+    SetLightWorkerArgs(argc, argv);
+
     auto start = I_FloatTime();
     fs::path source = light_options.sourceMap;
 
-    logging::init(
-        fs::path(source).replace_filename(source.stem().string() + "-light").replace_extension("log"), light_options);
+    // workers log to the .lightwork directory, which goes away with their other files
+    if (light_options.worker.value() >= 0) {
+        logging::init(LightWorkerLogPath(source, light_options.worker.value()), light_options);
+    } else {
+        logging::init(fs::path(source).replace_filename(source.stem().string() + "-light").replace_extension("log"),
+            light_options);
+    }
 
     // delete previous litfile
     if (!light_options.onlyents.value()) {
@@ -1374,7 +1573,10 @@ int light_main(int argc, const char **argv)
         }
     }
 
-    img::load_textures(&bsp, light_options);
+    {
+        profiler::scope scope("load_textures");
+        img::load_textures(&bsp, light_options);
+    }
 
     LoadExtendedTexinfoFlags(source, &bsp);
 
@@ -1387,22 +1589,31 @@ int light_main(int argc, const char **argv)
 
     all_uncompressed_vis = DecompressAllVis(&bsp, true);
     FindModelInfo(&bsp);
+    point_query = bsp_point_query_t(&bsp);
 
     FindDebugFace(&bsp);
     FindDebugVert(&bsp);
 
-    Embree_TraceInit(&bsp);
+    {
+        profiler::scope scope("Embree_TraceInit");
+        Embree_TraceInit(
+            &bsp, light_options.tracecache.value() ? fs::path(source).replace_extension("embree") : fs::path());
+    }
 
     if (light_options.debugmode == debugmodes::phong_obj) {
         CalculateVertexNormals(&bsp);
         source.replace_extension("obj");
         ExportObj(source, &bsp);
 
+        profiler::close();
         logging::close();
         return 0;
     }
 
-    SetupLights(light_options, &bsp);
+    {
+        profiler::scope scope("SetupLights");
+        SetupLights(light_options, &bsp);
+    }
 
     // PrintLights();
 
@@ -1413,9 +1624,20 @@ int light_main(int argc, const char **argv)
 
         SetupDirt(light_options);
 
+        if (light_options.worker.value() >= 0) {
+            LightWorker(&bspdata, source, light_options.lightmap_scale.is_changed());
+
+            profiler::close();
+            logging::close();
+            return 0;
+        }
+
         LightWorld(&bspdata, source, light_options.lightmap_scale.is_changed());
 
-        LightGrid(&bspdata);
+        {
+            profiler::scope scope("LightGrid");
+            LightGrid(&bspdata);
+        }
 
         ClearLightmapSurfaces();
 
@@ -1427,6 +1649,7 @@ int light_main(int argc, const char **argv)
         }
 
         if (light_options.write_litfile == lightfile::lit2) {
+            profiler::close();
             return 0; // run away before any files are written
         }
     }
@@ -1450,20 +1673,8 @@ int light_main(int argc, const char **argv)
 
     auto end = I_FloatTime();
     logging::print("{:.3} seconds elapsed\n", (end - start));
-#if 0
-    logging::print("\n");
-    logging::print("stats:\n");
-    logging::print("{} lights tested, {} hits per sample point\n",
-        static_cast<float>(total_light_rays) / static_cast<float>(total_samplepoints),
-        static_cast<float>(total_light_ray_hits) / static_cast<float>(total_samplepoints));
-    logging::print("{} surface lights tested, {} hits per sample point\n",
-        static_cast<float>(total_surflight_rays) / static_cast<float>(total_samplepoints),
-        static_cast<float>(total_surflight_ray_hits) / static_cast<float>(total_samplepoints)); // mxd
-    logging::print("{} bounce lights tested, {} hits per sample point\n",
-        static_cast<float>(total_bounce_rays) / static_cast<float>(total_samplepoints),
-        static_cast<float>(total_bounce_ray_hits) / static_cast<float>(total_samplepoints));
-#endif
     logging::print("{} empty lightmaps\n", static_cast<int>(fully_transparent_lightmaps));
+    profiler::close();
     logging::close();
 
     return 0;
@@ -366,7 +366,7 @@ static std::vector<uint8_t> MakeOctreeLump(const mbsp_t &bsp, const lightgrid_ra
 
 std::tuple<lightgrid_samples_t, bool> FixPointAndCalcLightgrid(const mbsp_t *bsp, qvec3f world_point)
 {
-    bool occluded = Light_PointInWorld(bsp, world_point);
+    bool occluded = point_query.point_in_solid(0, world_point);
     if (occluded) {
         // search for a nearby point
         auto [fixed_pos, success] = FixLightOnFace(bsp, world_point, false, 2.0f);
@@ -33,18 +33,23 @@
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
 #include <common/ostream.hh>
+#include <common/profiler.hh>
 
 #include <atomic>
 #include <cassert>
 #include <cmath>
 #include <algorithm>
 #include <fstream>
+#include <span>
 
-#if 0
-std::atomic<uint32_t> total_light_rays, total_light_ray_hits, total_samplepoints;
-std::atomic<uint32_t> total_bounce_rays, total_bounce_ray_hits;
-std::atomic<uint32_t> total_surflight_rays, total_surflight_ray_hits; // mxd
-#endif
+// for -profile
+static profiler::counter c_samplepoints{"sample points"};
+static profiler::counter c_light_rays{"light rays"};
+static profiler::counter c_sky_rays{"sky rays"};
+static profiler::counter c_surflight_rays{"surface light rays"};
+static profiler::counter c_dirt_rays{"dirt rays"};
+static profiler::counter c_adaptive_luxels{"extraadaptive luxels"};
+static profiler::counter c_adaptive_refined{"extraadaptive luxels supersampled"};
 
 thread_local static raystream_occlusion_t occlusion_stream;
 thread_local static raystream_intersection_t intersection_stream;
@@ -300,12 +305,12 @@ static void CalcPoints_Debug(const lightsurf_t *surf, const mbsp_t *bsp)
 /// This is used for marking sample points as occluded.
 static bool Light_PointInAnySolid(const mbsp_t *bsp, const dmodelh2_t *self, const qvec3f &point)
 {
-    if (Light_PointInSolid(bsp, self, point))
+    if (point_query.point_in_solid(self - bsp->dmodels.data(), point))
         return true;
 
     auto *self_modelinfo = ModelInfoForModel(bsp, self - bsp->dmodels.data());
     if (self_modelinfo->object_channel_mask.value() == CHANNEL_MASK_DEFAULT) {
-        if (Light_PointInWorld(bsp, point))
+        if (point_query.point_in_solid(0, point))
             return true;
     }
 
@@ -313,16 +318,59 @@ static bool Light_PointInAnySolid(const mbsp_t *bsp, const dmodelh2_t *self, con
         if (modelinfo->object_channel_mask.value() != self_modelinfo->object_channel_mask.value())
             continue;
 
-        if (Light_PointInSolid(bsp, modelinfo->model, point - modelinfo->offset)) {
-            // Only mark occluded if the bmodel is fully opaque
-            if (modelinfo->alpha.value() == 1.0f)
-                return true;
-        }
+        // Only mark occluded if the bmodel is fully opaque
+        if (modelinfo->alpha.value() != 1.0f)
+            continue;
+
+        if (point_query.point_in_solid(modelinfo->model - bsp->dmodels.data(), point - modelinfo->offset))
+            return true;
     }
 
     return false;
 }
 
+/// Light_PointInAnySolid for a batch of up to bsp_point_query_t::BATCH_SIZE points
+static void Light_PointsInAnySolid(
+    const mbsp_t *bsp, const dmodelh2_t *self, std::span<const qvec3f> points, std::span<bool> results)
+{
+    Q_assert(points.size() <= bsp_point_query_t::BATCH_SIZE);
+
+    std::array<qvec3d, bsp_point_query_t::BATCH_SIZE> model_points;
+    std::array<bool, bsp_point_query_t::BATCH_SIZE> in_model;
+
+    auto test_model = [&](const dmodelh2_t *model, const qvec3f &offset) {
+        for (size_t i = 0; i < points.size(); i++) {
+            model_points[i] = points[i] - offset;
+        }
+
+        point_query.points_in_solid(model - bsp->dmodels.data(), std::span(model_points).first(points.size()),
+            std::span(in_model).first(points.size()));
+
+        for (size_t i = 0; i < points.size(); i++) {
+            results[i] = results[i] || in_model[i];
+        }
+    };
+
+    std::fill(results.begin(), results.end(), false);
+    test_model(self, {});
+
+    auto *self_modelinfo = ModelInfoForModel(bsp, self - bsp->dmodels.data());
+    if (self_modelinfo->object_channel_mask.value() == CHANNEL_MASK_DEFAULT) {
+        test_model(&bsp->dmodels[0], {});
+    }
+
+    for (const auto &modelinfo : tracelist) {
+        if (modelinfo->object_channel_mask.value() != self_modelinfo->object_channel_mask.value())
+            continue;
+
+        // Only mark occluded if the bmodel is fully opaque
+        if (modelinfo->alpha.value() != 1.0f)
+            continue;
+
+        test_model(modelinfo->model, modelinfo->offset);
+    }
+}
+
 // precondition: `point` is on the same plane as `face` and within the bounds.
 static position_t PositionSamplePointOnFace(
     const mbsp_t *bsp, const mface_t *face, const bool phongShaded, const qvec3f &point, const qvec3f &modelOffset)
@@ -371,20 +419,30 @@ static position_t PositionSamplePointOnFace(
     const bool inSolid = Light_PointInAnySolid(bsp, mi->model, point + modelOffset);
     if (inSolid) {
 #if 1
-        // try +/- 0.5 units in X/Y/Z (8 tests)
+        // try +/- 0.5 units in X/Y/Z (8 tests), classified as one batch
+        std::array<qvec3f, 8> new_points;
+        std::array<qvec3f, 8> test_points;
+        std::array<bool, 8> in_solid;
+        size_t n = 0;
 
         for (int x = -1; x <= 1; x += 2) {
             for (int y = -1; y <= 1; y += 2) {
                 for (int z = -1; z <= 1; z += 2) {
                     const qvec3f jitter = qvec3f(x, y, z) * 0.5;
-                    const qvec3f new_point = point + jitter;
-
-                    if (!Light_PointInAnySolid(bsp, mi->model, new_point + modelOffset)) {
-                        return position_t(face, new_point, pointNormal);
-                    }
+                    new_points[n] = point + jitter;
+                    test_points[n] = new_points[n] + modelOffset;
+                    n++;
                 }
             }
         }
+
+        Light_PointsInAnySolid(bsp, mi->model, test_points, in_solid);
+
+        for (size_t i = 0; i < new_points.size(); i++) {
+            if (!in_solid[i]) {
+                return position_t(face, new_points[i], pointNormal);
+            }
+        }
 #else
         // this has issues with narrow sliver-shaped faces moving the sample points a lot into vastly different lighting
 
@@ -526,9 +584,16 @@ static void CalcPvs(const mbsp_t *bsp, lightsurf_t *lightsurf)
             }
         }
     } else {
-        for (auto &sample : lightsurf->samples) {
-            const mleaf_t *leaf = Light_PointInLeaf(bsp, sample.point);
+        std::vector<qvec3f> points(lightsurf->samples.size());
+        std::vector<const mleaf_t *> leafs(lightsurf->samples.size());
+
+        for (size_t i = 0; i < points.size(); i++) {
+            points[i] = lightsurf->samples[i].point;
+        }
 
+        point_query.find_leafs<float>(0, points, leafs);
+
+        for (const mleaf_t *leaf : leafs) {
             if (std::find(lightsurf->leaves.begin(), lightsurf->leaves.end(), leaf) == lightsurf->leaves.end()) {
                 lightsurf->leaves.push_back(leaf);
             }
@@ -1197,14 +1262,14 @@ static bool VisCullEntity(const mbsp_t *bsp, const std::vector<uint8_t> &pvs, co
 
 /*
  * ================
- * LightFace_Entity
+ * LightFace_EntityCulled
+ *
+ * Returns true if LightFace_Entity can skip the given light without
+ * tracing any rays.
  * ================
  */
-static void LightFace_Entity(
-    const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+static bool LightFace_EntityCulled(const mbsp_t *bsp, const light_t *entity, const lightsurf_t *lightsurf)
 {
-    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
-    const modelinfo_t *modelinfo = lightsurf->modelinfo;
     const qplane3f &plane = lightsurf->plane;
 
     /* vis cull */
@@ -1212,7 +1277,7 @@ static void LightFace_Entity(
         entity->light_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
         entity->shadow_channel_mask.value() == CHANNEL_MASK_DEFAULT &&
         VisCullEntity(bsp, lightsurf->pvs, entity->leaf)) {
-        return;
+        return true;
     }
 
     const float planedist = plane.distance_to(entity->origin.value());
@@ -1225,16 +1290,230 @@ static void LightFace_Entity(
        test in the curved case.
     */
     if (planedist < 0 && !entity->bleed.value() && !lightsurf->curved && !lightsurf->twosided) {
-        return;
+        return true;
     }
 
     /* sphere cull surface and light */
     if (CullLight(entity, lightsurf)) {
-        return;
+        return true;
     }
 
     // check lighting channels
     if (!(entity->light_channel_mask.value() & lightsurf->object_channel_mask)) {
+        return true;
+    }
+
+    return false;
+}
+
+// samples the lighting functions skip: the ones in solid, and with
+// -extraadaptive the ones that aren't part of the current pass
+static inline bool Sample_Skipped(const lightsurf_t *lightsurf, int i)
+{
+    return lightsurf->samples[i].occluded || (!lightsurf->adaptive_mask.empty() && !lightsurf->adaptive_mask[i]);
+}
+
+// -extraadaptive: notes that the shadow ray from sample i to light was blocked
+static inline void Sample_AddShadow(lightsurf_t *lightsurf, int i, const void *light)
+{
+    if (!lightsurf->adaptive_shadows.empty()) {
+        lightsurf->adaptive_shadows[i] ^= reinterpret_cast<uintptr_t>(light) * 0x9E3779B97F4A7C15ull;
+    }
+}
+
+// a shadow ray traced for a light shadow group, by sample
+struct shadow_ray_t
+{
+    // false if no light of the group reaches the sample
+    bool traced = false;
+    bool occluded = false;
+    bool hit_glass = false;
+    int dynamic_style = 0;
+    qvec3f glass_color{};
+    float glass_opacity = 0;
+};
+
+// per face, the shadow rays of each light shadow group; empty until traced
+using shadow_group_cache_t = std::vector<std::vector<shadow_ray_t>>;
+
+// the contribution of entity to sample i of lightsurf, before shadowing;
+// false if it's below -gate
+static bool LightFace_EntitySample(const settings::worldspawn_keys &cfg, const light_t *entity,
+    const lightsurf_t *lightsurf, int i, qvec3f &surfpointToLightDir, float &surfpointToLightDist, qvec3f &color,
+    qvec3f &normalcontrib)
+{
+    const auto &sample = lightsurf->samples[i];
+
+    GetLightContrib(cfg, entity, sample.normal, true, sample.point, lightsurf->twosided, color, surfpointToLightDir,
+        normalcontrib, &surfpointToLightDist);
+
+    const float occlusion = Dirt_GetScaleFactor(cfg, sample.occlusion, entity, surfpointToLightDist, lightsurf);
+    color *= occlusion;
+
+    /* Quick distance check first */
+    return fabs(LightSample_Brightness(color)) > light_options.gate.value();
+}
+
+// adds an unoccluded shadow ray's contribution to sample i
+static void LightFace_EntityAdd(const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf,
+    lightmapdict_t *lightmaps, int i, const qvec3f &color, const qvec3f &normalcontrib, int dynamic_style,
+    int &cached_style, lightmap_t *&cached_lightmap)
+{
+    // check if we hit a dynamic shadow caster (only applies to style 0 lights)
+    //
+    // note, this still works even though we're doing an occlusion trace - closest
+    // hit doesn't matter. All that matters is whether there is a real (solid) occluder
+    // between the ray start and end.
+    //
+    // If there is, the light is fully blocked and we bail out above, regardless of any
+    // dynamic shadow casters that also might be along the ray.
+    //
+    // If not, then we are guaranteed to detect the dynamic shadow caster in the ray filter
+    // (if any), and handle it here.
+    int desired_style = entity->style.value();
+    if (desired_style == 0) {
+        desired_style = dynamic_style;
+    }
+
+    // if necessary, switch which lightmap we are writing to.
+    if (desired_style != cached_style) {
+        cached_style = desired_style;
+        cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+    }
+
+    lightsample_t &sample = cached_lightmap->samples[i];
+
+    sample.color += color;
+    cached_lightmap->bounce_color += color;
+    sample.direction += normalcontrib;
+
+    Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
+}
+
+/*
+ * ================
+ * LightFace_TraceShadowGroup
+ *
+ * Traces the shadow rays of a light shadow group (see GroupLightShadows)
+ * for one face: one ray per sample that any light of the group reaches.
+ * The lights share their origin, so the ray is the same for all of them.
+ * The result doesn't depend on the light's style: the dynamic shadow
+ * caster a ray passed through is recorded, and each style 0 light of the
+ * group applies it in LightFace_EntityAdd.
+ * ================
+ */
+static std::vector<shadow_ray_t> LightFace_TraceShadowGroup(
+    const mbsp_t *bsp, const std::vector<const light_t *> &group, const lightsurf_t *lightsurf)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+
+    std::vector<const light_t *> lights;
+
+    for (const light_t *entity : group) {
+        if (!LightFace_EntityCulled(bsp, entity, lightsurf)) {
+            lights.push_back(entity);
+        }
+    }
+
+    raystream_occlusion_t &rs = occlusion_stream;
+    rs.clearPushedRays();
+
+    for (int i = 0; i < lightsurf->samples.size(); i++) {
+        if (Sample_Skipped(lightsurf, i))
+            continue;
+
+        for (const light_t *entity : lights) {
+            qvec3f surfpointToLightDir;
+            float surfpointToLightDist;
+            qvec3f color;
+            qvec3f normalcontrib;
+
+            if (LightFace_EntitySample(
+                    cfg, entity, lightsurf, i, surfpointToLightDir, surfpointToLightDist, color, normalcontrib)) {
+                rs.pushRay(i, lightsurf->samples[i].point, surfpointToLightDir, surfpointToLightDist);
+                break;
+            }
+        }
+    }
+
+    rs.tracePushedRaysOcclusion(lightsurf->modelinfo, group.front()->shadow_channel_mask.value());
+    c_light_rays += rs.numPushedRays();
+
+    std::vector<shadow_ray_t> result(lightsurf->samples.size());
+
+    const int N = rs.numPushedRays();
+    for (int j = 0; j < N; j++) {
+        const ray_io &ray = rs.getRay(j);
+
+        result[ray.index] = {.traced = true,
+            .occluded = rs.getPushedRayOccluded(j),
+            .hit_glass = ray.hit_glass,
+            .dynamic_style = ray.dynamic_style,
+            .glass_color = ray.glass_color,
+            .glass_opacity = ray.glass_opacity};
+    }
+
+    return result;
+}
+
+/*
+ * ================
+ * LightFace_Entity
+ *
+ * If shadow_groups is given, lights in a shadow group take their shadow
+ * rays from it, tracing them for the whole group on first use.
+ * ================
+ */
+static void LightFace_Entity(const mbsp_t *bsp, const light_t *entity, lightsurf_t *lightsurf,
+    lightmapdict_t *lightmaps, shadow_group_cache_t *shadow_groups = nullptr)
+{
+    const settings::worldspawn_keys &cfg = *lightsurf->cfg;
+    const modelinfo_t *modelinfo = lightsurf->modelinfo;
+
+    if (LightFace_EntityCulled(bsp, entity, lightsurf)) {
+        return;
+    }
+
+    int cached_style = entity->style.value();
+
+    if (shadow_groups && entity->shadow_group != -1) {
+        std::vector<shadow_ray_t> &shadows = (*shadow_groups)[entity->shadow_group];
+
+        if (shadows.empty()) {
+            shadows = LightFace_TraceShadowGroup(bsp, GetLightShadowGroups()[entity->shadow_group], lightsurf);
+        }
+
+        lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+
+        for (int i = 0; i < lightsurf->samples.size(); i++) {
+            const shadow_ray_t &shadow = shadows[i];
+
+            if (!shadow.traced)
+                continue;
+
+            qvec3f surfpointToLightDir;
+            float surfpointToLightDist;
+            qvec3f color;
+            qvec3f normalcontrib;
+
+            // the group traced the ray for another light
+            if (!LightFace_EntitySample(
+                    cfg, entity, lightsurf, i, surfpointToLightDir, surfpointToLightDist, color, normalcontrib))
+                continue;
+
+            if (shadow.occluded) {
+                Sample_AddShadow(lightsurf, i, entity);
+                continue;
+            }
+
+            if (shadow.hit_glass) {
+                color = raystream_occlusion_t::GlassTintedColor(color, shadow.glass_color, shadow.glass_opacity);
+            }
+
+            LightFace_EntityAdd(bsp, entity, lightsurf, lightmaps, i, color, normalcontrib, shadow.dynamic_style,
+                cached_style, cached_lightmap);
+        }
+
         return;
     }
 
@@ -1247,83 +1526,38 @@ static void LightFace_Entity(
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         const auto &sample = lightsurf->samples[i];
 
-        if (sample.occluded)
+        if (Sample_Skipped(lightsurf, i))
             continue;
 
-        const qvec3f &surfpoint = sample.point;
-        const qvec3f &surfnorm = sample.normal;
-
         qvec3f surfpointToLightDir;
         float surfpointToLightDist;
         qvec3f color;
         qvec3f normalcontrib;
 
-        GetLightContrib(cfg, entity, surfnorm, true, surfpoint, lightsurf->twosided, color, surfpointToLightDir,
-            normalcontrib, &surfpointToLightDist);
-
-        const float occlusion = Dirt_GetScaleFactor(cfg, sample.occlusion, entity, surfpointToLightDist, lightsurf);
-        color *= occlusion;
-
-        /* Quick distance check first */
-        if (fabs(LightSample_Brightness(color)) <= light_options.gate.value()) {
+        if (!LightFace_EntitySample(
+                cfg, entity, lightsurf, i, surfpointToLightDir, surfpointToLightDist, color, normalcontrib))
             continue;
-        }
 
-        rs.pushRay(i, surfpoint, surfpointToLightDir, surfpointToLightDist, &color, &normalcontrib);
+        rs.pushRay(i, sample.point, surfpointToLightDir, surfpointToLightDist, &color, &normalcontrib);
     }
 
     // don't need closest hit, just checking for occlusion between light and surface point
     rs.tracePushedRaysOcclusion(modelinfo, entity->shadow_channel_mask.value());
-#if 0
-    total_light_rays += rs.numPushedRays();
-#endif
+    c_light_rays += rs.numPushedRays();
 
-    int cached_style = entity->style.value();
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
 
     const int N = rs.numPushedRays();
     for (int j = 0; j < N; j++) {
-        if (rs.getPushedRayOccluded(j)) {
-            continue;
-        }
-
-#if 0
-        total_light_ray_hits++;
-#endif
-
         const ray_io &ray = rs.getRay(j);
 
-        int i = ray.index;
-
-        // check if we hit a dynamic shadow caster (only applies to style 0 lights)
-        //
-        // note, this still works even though we're doing an occlusion trace - closest
-        // hit doesn't matter. All that matters is whether there is a real (solid) occluder
-        // between the ray start and end.
-        //
-        // If there is, the light is fully blocked and we bail out above, regardless of any
-        // dynamic shadow casters that also might be along the ray.
-        //
-        // If not, then we are guaranteed to detect the dynamic shadow caster in the ray filter
-        // (if any), and handle it here.
-        int desired_style = entity->style.value();
-        if (desired_style == 0) {
-            desired_style = ray.dynamic_style;
-        }
-
-        // if necessary, switch which lightmap we are writing to.
-        if (desired_style != cached_style) {
-            cached_style = desired_style;
-            cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
+        if (rs.getPushedRayOccluded(j)) {
+            Sample_AddShadow(lightsurf, ray.index, entity);
+            continue;
         }
 
-        lightsample_t &sample = cached_lightmap->samples[i];
-
-        sample.color += rs.getPushedRayColor(j);
-        cached_lightmap->bounce_color += rs.getPushedRayColor(j);
-        sample.direction += ray.normalcontrib;
-
-        Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
+        LightFace_EntityAdd(bsp, entity, lightsurf, lightmaps, ray.index, rs.getPushedRayColor(j), ray.normalcontrib,
+            ray.dynamic_style, cached_style, cached_lightmap);
     }
 }
 
@@ -1418,7 +1652,7 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     for (int i = 0; i < lightsurf->samples.size(); i++) {
         const auto &sample = lightsurf->samples[i];
 
-        if (sample.occluded)
+        if (Sample_Skipped(lightsurf, i))
             continue;
 
         const qvec3f &surfpoint = sample.point;
@@ -1461,12 +1695,14 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
     lightmap_t *cached_lightmap = Lightmap_ForStyle(lightmaps, cached_style, lightsurf);
 
     const int N = rs.numPushedRays();
-#if 0
-    total_light_rays += N;
-#endif
+    c_sky_rays += N;
 
     for (int j = 0; j < N; j++) {
+        const ray_io &ray = rs.getRay(j);
+        const int i = ray.index;
+
         if (rs.getPushedRayHitType(j) != hittype_t::SKY) {
+            Sample_AddShadow(lightsurf, i, sun);
             continue;
         }
 
@@ -1474,13 +1710,11 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
         if (sun->suntexture_value) {
             const triinfo *face = rs.getPushedRayHitFaceInfo(j);
             if (sun->suntexture_value != face->texture) {
+                Sample_AddShadow(lightsurf, i, sun);
                 continue;
             }
         }
 
-        const ray_io &ray = rs.getRay(j);
-        const int i = ray.index;
-
         // check if we hit a dynamic shadow caster
         int desired_style = sun->style;
         if (desired_style == 0) {
@@ -1498,9 +1732,6 @@ static void LightFace_Sky(const mbsp_t *bsp, const sun_t *sun, lightsurf_t *ligh
         sample.color += rs.getPushedRayColor(j);
         cached_lightmap->bounce_color += rs.getPushedRayColor(j);
         sample.direction += ray.normalcontrib;
-#if 0
-        total_light_ray_hits++;
-#endif
 
         Lightmap_Save(bsp, lightmaps, lightsurf, cached_lightmap, cached_style);
     }
@@ -1711,33 +1942,19 @@ static void LightFace_Min(const mbsp_t *bsp, const mface_t *face, const qvec3f &
     }
 }
 
-static void LightFace_LocalMin(
-    const mbsp_t *bsp, const mface_t *face, lightsurf_t *lightsurf, lightmapdict_t *lightmaps)
+// `lights` is DirectLightFace_Lights, which leaves out the local minlights
+// that don't reach the face and all of them on faces excluded from minlight
+static void LightFace_LocalMin(const mbsp_t *bsp, const mface_t *face, lightsurf_t *lightsurf,
+    lightmapdict_t *lightmaps, const std::vector<const light_t *> &lights)
 {
     const settings::worldspawn_keys &cfg = *lightsurf->cfg;
     const modelinfo_t *modelinfo = lightsurf->modelinfo;
 
-    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
-    if (extended_flags.no_minlight) {
-        return; /* this face is excluded from minlight */
-    }
-
-    // FIXME: Refactor this?
-    if (lightsurf->modelinfo->lightignore.value() || extended_flags.light_ignore)
-        return;
-
     /* Cast rays for local minlight entities */
-    for (const auto &entity : GetLights()) {
+    for (const light_t *entity : lights) {
         if (entity->getFormula() != LF_LOCALMIN) {
             continue;
         }
-        if (entity->nostaticlight.value()) {
-            continue;
-        }
-
-        if (CullLight(entity.get(), lightsurf)) {
-            continue;
-        }
 
         raystream_occlusion_t &rs = occlusion_stream;
         rs.clearPushedRays();
@@ -1748,7 +1965,7 @@ static void LightFace_LocalMin(
         for (int i = 0; i < lightsurf->samples.size(); i++) {
             const auto &surf_sample = lightsurf->samples[i];
 
-            if (surf_sample.occluded)
+            if (Sample_Skipped(lightsurf, i))
                 continue;
 
             const lightsample_t &sample = lightmap->samples[i];
@@ -1763,9 +1980,7 @@ static void LightFace_LocalMin(
 
         // local minlight just needs occlusion, not closest hit
         rs.tracePushedRaysOcclusion(modelinfo, CHANNEL_MASK_DEFAULT);
-#if 0
-        total_light_rays += rs.numPushedRays();
-#endif
+        c_light_rays += rs.numPushedRays();
 
         const int N = rs.numPushedRays();
         for (int j = 0; j < N; j++) {
@@ -1779,17 +1994,13 @@ static void LightFace_LocalMin(
             lightsample_t &sample = lightmap->samples[i];
 
             value *= Dirt_GetScaleFactor(
-                cfg, lightsurf->samples[i].occlusion, entity.get(), 0.0 /* TODO: pass distance */, lightsurf);
+                cfg, lightsurf->samples[i].occlusion, entity, 0.0 /* TODO: pass distance */, lightsurf);
             if (cfg.addminlight.value()) {
                 sample.color += entity->color.value() * (value / 255.0f);
                 hit = true;
             } else {
                 hit = Light_ClampMin(sample, value, entity->color.value()) || hit;
             }
-
-#if 0
-            total_light_ray_hits++;
-#endif
         }
 
         if (hit) {
@@ -2011,6 +2222,56 @@ static bool SurfaceLight_VisCull(const mbsp_t *bsp, const std::vector<uint8_t> *
     return false;
 }
 
+// the surface light ray stream is traced once it holds this many
+// rays, which bounds the size of the thread-local stream
+constexpr size_t MAX_SURFLIGHT_STREAM_RAYS = 16384;
+
+struct surflight_emitter_t
+{
+    const surfacelight_t *vpl;
+    // copied, since clustering scales the intensity
+    surfacelight_t::per_style_t setting;
+    // set if the emitter is approximated by a single point
+    std::optional<qvec3f> cluster_point = std::nullopt;
+};
+
+/*
+ * SurfaceLight_Cluster
+ *
+ * Lightcuts-style approximation for distant emitters: if the emitter is
+ * small compared to its distance from the face, light the face from a
+ * single point carrying the intensity of all of the emitter's points.
+ */
+static void SurfaceLight_Cluster(surflight_emitter_t &emitter, const lightsurf_t *lightsurf, float cluster_ratio)
+{
+    const surfacelight_t &vpl = *emitter.vpl;
+
+    float radius = 0;
+    const qvec3f *nearest = nullptr;
+    float nearest_dist = std::numeric_limits<float>::infinity();
+
+    for (const qvec3f &point : vpl.points) {
+        const float dist = qv::distance(point, vpl.pos);
+
+        radius = std::max(radius, dist);
+
+        if (dist < nearest_dist) {
+            nearest_dist = dist;
+            nearest = &point;
+        }
+    }
+
+    const float dist = qv::distance(lightsurf->extents.origin, vpl.pos) - lightsurf->extents.radius;
+
+    if (dist < radius * cluster_ratio) {
+        return;
+    }
+
+    // use a real point rather than vpl.pos, which may be in a wall
+    emitter.cluster_point = *nearest;
+    emitter.setting.intensity *= vpl.points.size();
+}
+
 static void // mxd
 LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t *lightmaps,
     std::optional<size_t> bounce_depth, float standard_scale, float sky_scale, float hotspot_clamp)
@@ -2023,6 +2284,14 @@ LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t
         return;
     }
 
+    // gather every emitter that survives culling, so the rays to all of
+    // them can be traced in a few large, sorted streams per style rather
+    // than one small stream per VPL point
+    thread_local std::vector<surflight_emitter_t> emitters;
+    emitters.clear();
+
+    const float cluster_ratio = light_options.emissivecluster.value();
+
     for (const auto &surf_ptr : EmissiveLightSurfaces()) {
         auto &vpl = *surf_ptr->vpl.get();
 
@@ -2035,86 +2304,116 @@ LightFace_SurfaceLight(const mbsp_t *bsp, lightsurf_t *lightsurf, lightmapdict_t
             else if (SurfaceLight_VisCull(bsp, &lightsurf->pvs, surf_ptr))
                 continue;
 
-            raystream_occlusion_t &rs = occlusion_stream;
+            surflight_emitter_t &emitter = emitters.emplace_back(surflight_emitter_t{&vpl, vpl_setting});
 
-            for (int c = 0; c < vpl.points.size(); c++) {
-                rs.clearPushedRays();
+            if (cluster_ratio > 0 && vpl.points.size() > 1) {
+                SurfaceLight_Cluster(emitter, lightsurf, cluster_ratio);
+            }
+        }
+    }
 
-                for (int i = 0; i < lightsurf->samples.size(); i++) {
-                    const auto &sample = lightsurf->samples[i];
+    if (emitters.empty()) {
+        return;
+    }
 
-                    if (sample.occluded)
-                        continue;
+    // stable, so rays are pushed in the same order on every run
+    std::stable_sort(emitters.begin(), emitters.end(),
+        [](const surflight_emitter_t &a, const surflight_emitter_t &b) { return a.setting.style < b.setting.style; });
 
-                    const qvec3f &lightsurf_pos = sample.point;
-                    const qvec3f &lightsurf_normal = sample.normal;
-
-                    const qvec3f &pos = vpl.points[c];
-                    qvec3f dir = lightsurf_pos - pos;
-                    float dist = std::max(0.01f, qv::length(dir));
-                    bool use_normal = true;
-
-                    if (lightsurf->twosided) {
-                        use_normal = false;
-                        dir /= dist;
-                    } else if (dist == 0.0f) {
-                        dir = lightsurf_normal;
-                        use_normal = false;
-                    } else {
-                        dir /= dist;
-                    }
+    raystream_occlusion_t &rs = occlusion_stream;
+    rs.clearPushedRays();
 
-                    const qvec3f indirect = GetSurfaceLighting(cfg, vpl, vpl_setting, dir, dist, lightsurf_normal,
-                        use_normal, standard_scale, sky_scale, hotspot_clamp);
-                    if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
-                        rs.pushRay(i, pos, dir, dist, &indirect);
-                    }
-                }
+    auto flush = [&](int lightmapstyle) {
+        if (!rs.numPushedRays())
+            return;
 
-                if (!rs.numPushedRays())
-                    continue;
+        c_surflight_rays += rs.numPushedRays();
+        rs.sortPushedRays();
+        rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
 
-#if 0
-                total_surflight_rays += rs.numPushedRays();
-#endif
-                rs.tracePushedRaysOcclusion(lightsurf->modelinfo, CHANNEL_MASK_DEFAULT);
+        lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
 
-                const int lightmapstyle = vpl_setting.style;
-                lightmap_t *lightmap = Lightmap_ForStyle(lightmaps, lightmapstyle, lightsurf);
+        bool hit = false;
+        const int numrays = rs.numPushedRays();
+        for (int j = 0; j < numrays; j++) {
+            if (rs.getPushedRayOccluded(j))
+                continue;
 
-                bool hit = false;
-                const int numrays = rs.numPushedRays();
-                for (int j = 0; j < numrays; j++) {
-                    if (rs.getPushedRayOccluded(j))
-                        continue;
+            const ray_io &ray = rs.getRay(j);
+            const int i = ray.index;
+            qvec3f indirect = rs.getPushedRayColor(j);
 
-                    const ray_io &ray = rs.getRay(j);
-                    const int i = ray.index;
-                    qvec3f indirect = rs.getPushedRayColor(j);
+            // Q_assert(!std::isnan(indirect[0]));
 
-                    // Q_assert(!std::isnan(indirect[0]));
+            // Use dirt scaling on the surface lighting.
+            const float dirtscale =
+                Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
+            indirect *= dirtscale;
+
+            lightsample_t &sample = lightmap->samples[i];
+            sample.color += indirect;
+            lightmap->bounce_color += indirect;
 
-                    // Use dirt scaling on the surface lighting.
-                    const float dirtscale =
-                        Dirt_GetScaleFactor(cfg, lightsurf->samples[i].occlusion, nullptr, 0.0, lightsurf);
-                    indirect *= dirtscale;
+            hit = true;
+        }
 
-                    lightsample_t &sample = lightmap->samples[i];
-                    sample.color += indirect;
-                    lightmap->bounce_color += indirect;
+        // If surface light contributed anything, save.
+        if (hit)
+            Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
 
-                    hit = true;
-#if 0
-                    ++total_surflight_ray_hits;
-#endif
+        rs.clearPushedRays();
+    };
+
+    int lightmapstyle = emitters.front().setting.style;
+
+    for (const surflight_emitter_t &emitter : emitters) {
+        if (emitter.setting.style != lightmapstyle) {
+            flush(lightmapstyle);
+            lightmapstyle = emitter.setting.style;
+        }
+
+        const surfacelight_t &vpl = *emitter.vpl;
+        const std::span<const qvec3f> points =
+            emitter.cluster_point ? std::span<const qvec3f>(&*emitter.cluster_point, 1) : std::span(vpl.points);
+
+        for (const qvec3f &pos : points) {
+            for (int i = 0; i < lightsurf->samples.size(); i++) {
+                const auto &sample = lightsurf->samples[i];
+
+                if (Sample_Skipped(lightsurf, i))
+                    continue;
+
+                const qvec3f &lightsurf_pos = sample.point;
+                const qvec3f &lightsurf_normal = sample.normal;
+
+                qvec3f dir = lightsurf_pos - pos;
+                float dist = std::max(0.01f, qv::length(dir));
+                bool use_normal = true;
+
+                if (lightsurf->twosided) {
+                    use_normal = false;
+                    dir /= dist;
+                } else if (dist == 0.0f) {
+                    dir = lightsurf_normal;
+                    use_normal = false;
+                } else {
+                    dir /= dist;
                 }
 
-                // If surface light contributed anything, save.
-                if (hit)
-                    Lightmap_Save(bsp, lightmaps, lightsurf, lightmap, lightmapstyle);
+                const qvec3f indirect = GetSurfaceLighting(cfg, vpl, emitter.setting, dir, dist, lightsurf_normal,
+                    use_normal, standard_scale, sky_scale, hotspot_clamp);
+                if (!qv::gate(indirect, surflight_gate)) { // Each point contributes very little to the final result
+                    rs.pushRay(i, pos, dir, dist, &indirect);
+                }
+            }
+
+            if (rs.numPushedRays() >= MAX_SURFLIGHT_STREAM_RAYS) {
+                flush(lightmapstyle);
             }
         }
     }
+
+    flush(lightmapstyle);
 }
 
 static void // mxd
@@ -2408,6 +2707,7 @@ static void LightFace_CalculateDirt(lightsurf_t *lightsurf)
         // use the model's own channel mask as the shadow mask, e.g. so a model in channel 2's AO rays will only hit
         // other things in channel 2
         rs.tracePushedRaysIntersection(lightsurf->modelinfo, lightsurf->object_channel_mask);
+        c_dirt_rays += rs.numPushedRays();
 
         // accumulate hitdists
         for (int k = 0; k < rs.numPushedRays(); k++) {
@@ -2589,6 +2889,199 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
     return Lightsurf_Init(modelinfo, cfg, face, bsp, facesup, facesup_decoupled);
 }
 
+// the positive lights, suns, surface lights and local minlight; with
+// -extraadaptive, for the samples in lightsurf.adaptive_mask
+static void DirectLightFace_Lighting(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    auto face = lightsurf.face;
+    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
+
+    lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
+
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+
+    // -incremental caches faces by this same list, so it has to be the
+    // one place that decides which light entities reach the face
+    const std::vector<const light_t *> lights = DirectLightFace_Lights(bsp, lightsurf);
+
+    /* positive lights */
+    if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
+        shadow_group_cache_t shadow_groups(GetLightShadowGroups().size());
+
+        for (const light_t *entity : lights) {
+            if (entity->getFormula() != LF_LOCALMIN)
+                LightFace_Entity(bsp, entity, &lightsurf, lightmaps, &shadow_groups);
+        }
+        for (const sun_t &sun : GetSuns())
+            if (sun.sunlight > 0)
+                LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
+
+        // mxd. Add surface lights...
+        // FIXME: negative surface lights
+        LightFace_SurfaceLight(bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(),
+            cfg.surflightskyscale.value(), 16.0f);
+    }
+
+    LightFace_LocalMin(bsp, face, &lightsurf, lightmaps, lights);
+}
+
+/*
+ * ============
+ * DirectLightFace_Adaptive
+ *
+ * -extraadaptive: lights one sample per output luxel first (the one
+ * nearest the middle of the -extra block), then the rest of the block only
+ * where the lighting changes: the luxel is partly in solid or on another
+ * face, its dirt varies, a light or sun is blocked at it but not at a
+ * neighbouring luxel (or the other way around), or its brightness differs
+ * from a neighbour's by more than the threshold. The other blocks get
+ * their middle sample copied to the rest.
+ * ============
+ */
+static void DirectLightFace_Adaptive(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
+{
+    const int extra = light_options.extra.value();
+    const int blocks_w = lightsurf.width / extra;
+    const int blocks_h = lightsurf.height / extra;
+    const float threshold = light_options.extraadaptive.value();
+
+    auto block_sample = [&](int bs, int bt, int s, int t) {
+        return (bt * extra + t) * lightsurf.width + bs * extra + s;
+    };
+    auto middle_sample = [&](int bs, int bt) { return block_sample(bs, bt, extra / 2, extra / 2); };
+
+    // pass 1: the middle samples
+    lightsurf.adaptive_mask.assign(lightsurf.samples.size(), 0);
+    lightsurf.adaptive_shadows.assign(lightsurf.samples.size(), 0);
+
+    for (int bt = 0; bt < blocks_h; bt++) {
+        for (int bs = 0; bs < blocks_w; bs++) {
+            lightsurf.adaptive_mask[middle_sample(bs, bt)] = 1;
+        }
+    }
+
+    DirectLightFace_Lighting(bsp, lightsurf, cfg);
+
+    // find the blocks that need all their samples
+    std::vector<uint8_t> refine(blocks_w * blocks_h, 0);
+
+    auto differs = [&](int a, int b) {
+        if (lightsurf.samples[a].occluded || lightsurf.samples[b].occluded) {
+            return false;
+        }
+
+        if (lightsurf.adaptive_shadows[a] != lightsurf.adaptive_shadows[b]) {
+            return true;
+        }
+
+        for (const lightmap_t &lightmap : lightsurf.lightmapsByStyle) {
+            if (lightmap.style == INVALID_LIGHTSTYLE) {
+                continue;
+            }
+
+            const float ba = LightSample_Brightness(lightmap.samples[a].color);
+            const float bb = LightSample_Brightness(lightmap.samples[b].color);
+            const float diff = std::abs(ba - bb);
+
+            if (diff > 1.0f && diff > threshold * std::max(std::abs(ba), std::abs(bb))) {
+                return true;
+            }
+        }
+
+        return false;
+    };
+
+    for (int bt = 0; bt < blocks_h; bt++) {
+        for (int bs = 0; bs < blocks_w; bs++) {
+            const int middle = middle_sample(bs, bt);
+            uint8_t &r = refine[bt * blocks_w + bs];
+
+            for (int t = 0; t < extra && !r; t++) {
+                for (int s = 0; s < extra && !r; s++) {
+                    const auto &sample = lightsurf.samples[block_sample(bs, bt, s, t)];
+
+                    if (sample.occluded != lightsurf.samples[middle].occluded) {
+                        r = 1;
+                    } else if (sample.realfacenum != lightsurf.samples[middle].realfacenum) {
+                        // some of the samples were moved onto a neighbouring face, where
+                        // light the middle sample can't see may reach them
+                        r = 1;
+                    } else if (dirt_in_use &&
+                               std::abs(sample.occlusion - lightsurf.samples[middle].occlusion) > threshold) {
+                        r = 1;
+                    }
+                }
+            }
+
+            if (bs + 1 < blocks_w && differs(middle, middle_sample(bs + 1, bt))) {
+                r = 1;
+                refine[bt * blocks_w + bs + 1] = 1;
+            }
+
+            if (bt + 1 < blocks_h && differs(middle, middle_sample(bs, bt + 1))) {
+                r = 1;
+                refine[(bt + 1) * blocks_w + bs] = 1;
+            }
+        }
+    }
+
+    // pass 2: the rest of the samples of those blocks
+    size_t num_refined = 0;
+
+    for (int bt = 0; bt < blocks_h; bt++) {
+        for (int bs = 0; bs < blocks_w; bs++) {
+            const bool r = refine[bt * blocks_w + bs];
+            num_refined += r;
+
+            for (int t = 0; t < extra; t++) {
+                for (int s = 0; s < extra; s++) {
+                    const int i = block_sample(bs, bt, s, t);
+                    lightsurf.adaptive_mask[i] = r && !lightsurf.adaptive_mask[i];
+                }
+            }
+        }
+    }
+
+    if (num_refined) {
+        DirectLightFace_Lighting(bsp, lightsurf, cfg);
+    }
+
+    c_adaptive_luxels += blocks_w * blocks_h;
+    c_adaptive_refined += num_refined;
+
+    // copy the middle samples to the rest of the other blocks
+    for (lightmap_t &lightmap : lightsurf.lightmapsByStyle) {
+        if (lightmap.style == INVALID_LIGHTSTYLE) {
+            continue;
+        }
+
+        for (int bt = 0; bt < blocks_h; bt++) {
+            for (int bs = 0; bs < blocks_w; bs++) {
+                if (refine[bt * blocks_w + bs]) {
+                    continue;
+                }
+
+                const int middle = middle_sample(bs, bt);
+                const lightsample_t value = lightmap.samples[middle];
+
+                for (int t = 0; t < extra; t++) {
+                    for (int s = 0; s < extra; s++) {
+                        const int i = block_sample(bs, bt, s, t);
+
+                        if (i != middle && !lightsurf.samples[i].occluded) {
+                            lightmap.samples[i] = value;
+                            lightmap.bounce_color += value.color;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    lightsurf.adaptive_mask.clear();
+    lightsurf.adaptive_shadows.clear();
+}
+
 /*
  * ============
  * LightFace
@@ -2597,7 +3090,6 @@ lightsurf_t CreateLightmapSurface(const mbsp_t *bsp, const mface_t *face, const
 void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::worldspawn_keys &cfg)
 {
     auto face = lightsurf.face;
-    const modelinfo_t *modelinfo = ModelInfoForFace(bsp, Face_GetNum(bsp, face));
 
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
@@ -2612,33 +3104,13 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
      */
 
     if (light_options.debugmode == debugmodes::none) {
-#if 0
-        total_samplepoints += lightsurf.samples.size();
-#endif
-
-        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+        c_samplepoints += lightsurf.samples.size();
 
-        /* positive lights */
-        if (!(modelinfo->lightignore.value() || extended_flags.light_ignore)) {
-            for (const auto &entity : GetLights()) {
-                if (entity->getFormula() == LF_LOCALMIN)
-                    continue;
-                if (entity->nostaticlight.value())
-                    continue;
-                if (entity->light.value() > 0)
-                    LightFace_Entity(bsp, entity.get(), &lightsurf, lightmaps);
-            }
-            for (const sun_t &sun : GetSuns())
-                if (sun.sunlight > 0)
-                    LightFace_Sky(bsp, &sun, &lightsurf, lightmaps);
-
-            // mxd. Add surface lights...
-            // FIXME: negative surface lights
-            LightFace_SurfaceLight(bsp, &lightsurf, lightmaps, std::nullopt, cfg.surflightscale.value(),
-                cfg.surflightskyscale.value(), 16.0f);
+        if (light_options.extraadaptive.value() > 0 && light_options.extra.value() > 1) {
+            DirectLightFace_Adaptive(bsp, lightsurf, cfg);
+        } else {
+            DirectLightFace_Lighting(bsp, lightsurf, cfg);
         }
-
-        LightFace_LocalMin(bsp, face, &lightsurf, lightmaps);
     }
 
     /* replace lightmaps with AO for debugging */
@@ -2655,6 +3127,49 @@ void DirectLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const settings::
         LightFace_DebugNeighbours(bsp, &lightsurf, lightmaps);
 }
 
+/*
+ * ============
+ * DirectLightFace_Lights
+ *
+ * The light entities DirectLightFace traces rays for on the given face,
+ * i.e. the ones that get past the culling, in GetLights() order.
+ * DirectLightFace lights the face with these, and -incremental compares
+ * them to decide which faces to relight.
+ * ============
+ */
+std::vector<const light_t *> DirectLightFace_Lights(const mbsp_t *bsp, const lightsurf_t &lightsurf)
+{
+    std::vector<const light_t *> lights;
+
+    if (light_options.debugmode != debugmodes::none) {
+        return lights;
+    }
+
+    const modelinfo_t *modelinfo = lightsurf.modelinfo;
+    const surfflags_t &extended_flags = extended_texinfo_flags[lightsurf.face->texinfo];
+
+    if (modelinfo->lightignore.value() || extended_flags.light_ignore) {
+        return lights;
+    }
+
+    for (const auto &entity : GetLights()) {
+        if (entity->nostaticlight.value()) {
+            continue;
+        }
+
+        if (entity->getFormula() == LF_LOCALMIN) {
+            // see LightFace_LocalMin
+            if (!extended_flags.no_minlight && !CullLight(entity.get(), &lightsurf)) {
+                lights.push_back(entity.get());
+            }
+        } else if (entity->light.value() > 0 && !LightFace_EntityCulled(bsp, entity.get(), &lightsurf)) {
+            lights.push_back(entity.get());
+        }
+    }
+
+    return lights;
+}
+
 /*
  * ============
  * IndirectLightFace
@@ -2694,10 +3209,6 @@ void PostProcessLightFace(const mbsp_t *bsp, lightsurf_t &lightsurf, const setti
     lightmapdict_t *lightmaps = &lightsurf.lightmapsByStyle;
 
     if (light_options.debugmode == debugmodes::none) {
-#if 0
-        total_samplepoints += lightsurf.samples.size();
-#endif
-
         const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
         float minlight = 0;
@@ -2883,7 +3394,7 @@ lightgrid_samples_t CalcLightgridAtPoint(const mbsp_t *bsp, const qvec3f &world_
     raystream_occlusion_t rs(1);
     raystream_intersection_t rsi(1);
 
-    const auto *pvs = Mod_LeafPvs(bsp, BSP_FindLeafAtPoint(bsp, &bsp->dmodels[0], world_point));
+    const auto *pvs = Mod_LeafPvs(bsp, point_query.find_leaf(0, qvec3d(world_point)));
 
     auto &cfg = light_options;
 
@@ -2952,17 +3463,3 @@ lightgrid_samples_t CalcLightgridAtPoint(const mbsp_t *bsp, const qvec3f &world_
 
     return result;
 }
-
-void ResetLtFace()
-{
-#if 0
-    total_light_rays = 0;
-    total_light_ray_hits = 0;
-    total_samplepoints = 0;
-
-    total_bounce_rays = 0;
-    total_bounce_ray_hits = 0;
-    total_surflight_rays = 0;
-    total_surflight_ray_hits = 0;
-#endif
-}
@@ -0,0 +1,359 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/relight.hh>
+
+#include <light/checkpoint.hh>
+#include <light/entities.hh>
+#include <light/light.hh>
+#include <light/ltface.hh>
+
+#include <common/bspfile.hh>
+#include <common/bsputils.hh>
+#include <common/log.hh>
+#include <common/parallel.hh>
+#include <common/settings.hh>
+
+#include <algorithm>
+#include <array>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <sstream>
+#include <string>
+
+struct light_relight_header
+{
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint64_t key;
+    uint32_t num_faces;
+
+    auto stream_data() { return std::tie(magic, version, key, num_faces); }
+};
+
+profiler::counter c_faces_restored{"faces restored from the cache"};
+
+constexpr std::array<char, 4> LIGHT_RELIGHT_MAGIC{'L', 'C', 'A', 'C'};
+constexpr uint32_t LIGHT_RELIGHT_VERSION = 1;
+
+// BSPX lumps light writes itself; LMSHIFT is left out too, since light may
+// rewrite it, but the lightmap sizes are checked per face when reading
+static const std::array<const char *, 10> LIGHT_RELIGHT_OUTPUT_LUMPS{"RGBLIGHTING", "LIGHTINGDIR",
+    "LIGHTING_E5BGR9", "LMOFFSET", "LMSTYLE", "LMSTYLE16", "LMSHIFT", "DECOUPLED_LM", "FACENORMALS",
+    "LIGHTGRID_OCTREE"};
+
+static void WriteString(std::ostream &stream, const std::string &s)
+{
+    stream.write(s.c_str(), s.size() + 1);
+}
+
+static void WriteEntdict(std::ostream &stream, const entdict_t &entdict)
+{
+    stream <= static_cast<uint32_t>(std::distance(entdict.begin(), entdict.end()));
+
+    for (auto &[key, value] : entdict) {
+        WriteString(stream, key);
+        WriteString(stream, value);
+    }
+}
+
+template<typename T>
+static void WriteLump(std::ostream &stream, const std::vector<T> &lump)
+{
+    stream <= static_cast<uint32_t>(lump.size());
+
+    for (auto &v : lump) {
+        stream <= v;
+    }
+}
+
+static uint64_t HashStream(const std::ostringstream &stream, uint64_t hash = FNV1A_64_INIT)
+{
+    const std::string data = stream.str();
+    return fnv1a_64(data.data(), data.size(), hash);
+}
+
+// the light's resolved settings (which include the jittered origin of -extra
+// duplicates), its keys, and the values LoadEntities computes from them
+static uint64_t LightHash(const light_t &light)
+{
+    std::ostringstream stream(std::ios_base::out | std::ios_base::binary);
+
+    // settings are stored in a set of pointers; sort them by name
+    std::map<std::string, std::string> values;
+
+    for (const settings::setting_base *setting : light) {
+        values[setting->primary_name()] = setting->string_value();
+    }
+
+    for (auto &[name, value] : values) {
+        WriteString(stream, name);
+        WriteString(stream, value);
+    }
+
+    if (light.epairs) {
+        WriteEntdict(stream, *light.epairs);
+    }
+
+    stream <= static_cast<uint8_t>(light.spotlight) <= light.spotvec <= light.spotfalloff <= light.spotfalloff2
+           <= light.projectionmatrix <= static_cast<uint8_t>(light.projectedmip != nullptr);
+
+    return HashStream(stream);
+}
+
+// a light entity that only lights faces through LightFace_Entity /
+// LightFace_LocalMin, so a change to it only affects the faces it reaches
+static bool IsLocalLight(const light_t &light)
+{
+    return light.epairs && !light.sun.value() && light.epairs->get("_surface").empty();
+}
+
+uint64_t LightRelightKey(const bspdata_t &bspdata, const fs::path &bsp_path, const settings::setting_container &options)
+{
+    const mbsp_t &bsp = std::get<mbsp_t>(bspdata.bsp);
+    std::ostringstream stream(std::ios_base::out | std::ios_base::binary);
+
+    // geometry and textures; not the entities or the lighting lumps
+    WriteLump(stream, bsp.dmodels);
+    stream <= bsp.dvis <= bsp.dtex;
+    WriteLump(stream, bsp.dplanes);
+    WriteLump(stream, bsp.dvertexes);
+    WriteLump(stream, bsp.dnodes);
+    WriteLump(stream, bsp.dedges);
+    WriteLump(stream, bsp.dleaffaces);
+    WriteLump(stream, bsp.dsurfedges);
+
+    for (auto &leaf : bsp.dleafs) {
+        stream <= std::tie(leaf.contents, leaf.visofs, leaf.mins, leaf.maxs, leaf.firstmarksurface,
+                      leaf.nummarksurfaces, leaf.ambient_level, leaf.cluster, leaf.area);
+    }
+
+    for (auto &texinfo : bsp.texinfo) {
+        stream <= texinfo.vecs <= texinfo.flags.native_q2 <= texinfo.flags.native_q1;
+        stream <= std::tie(texinfo.miptex, texinfo.value, texinfo.texture, texinfo.nexttexinfo);
+    }
+
+    for (auto &face : bsp.dfaces) {
+        stream <= std::tie(face.planenum, face.side, face.firstedge, face.numedges, face.texinfo);
+    }
+
+    std::map<std::string, const std::vector<uint8_t> *> lumps;
+
+    for (auto &[name, lump] : bspdata.bspx.entries) {
+        if (std::find(LIGHT_RELIGHT_OUTPUT_LUMPS.begin(), LIGHT_RELIGHT_OUTPUT_LUMPS.end(), name) ==
+            LIGHT_RELIGHT_OUTPUT_LUMPS.end()) {
+            lumps[name] = &lump;
+        }
+    }
+
+    for (auto &[name, lump] : lumps) {
+        WriteString(stream, name);
+        WriteLump(stream, *lump);
+    }
+
+    // extended texinfo flags
+    {
+        std::ifstream texinfofile(
+            fs::path(bsp_path).replace_extension("texinfo.json"), std::ios_base::in | std::ios_base::binary);
+        stream << texinfofile.rdbuf();
+        stream.clear();
+    }
+
+    // the textures light loaded, which for Quake 2 come from disk rather than
+    // the .bsp; translucent surfaces tint light with their pixels, and
+    // surface lights take their color from them
+    stream <= HashLoadedTextures(FNV1A_64_INIT);
+
+    // every entity that isn't a local light, including worldspawn and the
+    // entities lights target; the local lights are compared per face
+    std::set<const entdict_t *> local_entdicts;
+
+    for (auto &light : GetLights()) {
+        if (IsLocalLight(*light)) {
+            local_entdicts.insert(light->epairs);
+        }
+    }
+
+    for (auto &entdict : GetEntdicts()) {
+        if (!local_entdicts.count(&entdict)) {
+            WriteEntdict(stream, entdict);
+        }
+    }
+
+    for (auto &entdict : GetRadLights()) {
+        WriteEntdict(stream, entdict);
+    }
+
+    for (auto &light : GetSurfaceLightTemplates()) {
+        stream <= LightHash(*light);
+    }
+
+    // suns use Random() for -sunsamples, so they're compared after it
+    for (auto &sun : GetSuns()) {
+        stream <= sun.sunvec <= sun.sunlight <= sun.sunlight_color <= static_cast<uint8_t>(sun.dirt)
+               <= sun.anglescale <= static_cast<int32_t>(sun.style);
+        WriteString(stream, sun.suntexture);
+    }
+
+    stream <= static_cast<uint8_t>(dirt_in_use);
+
+    return HashLightOptions(options, HashStream(stream));
+}
+
+light_relight_t::light_relight_t(const fs::path &path, uint64_t key)
+    : _path(path),
+      _key(key)
+{
+}
+
+size_t light_relight_t::load(const mbsp_t *bsp, std::span<lightsurf_t> surfaces)
+{
+    _lights.clear();
+    _lights.resize(surfaces.size());
+    _cached.assign(surfaces.size(), 0);
+
+    // an edited light is its own entry with a new hash, so a face it reached
+    // before or after the edit gets a different list
+    std::map<const light_t *, uint64_t> light_hashes;
+
+    for (auto &light : GetLights()) {
+        if (IsLocalLight(*light)) {
+            light_hashes[light.get()] = LightHash(*light);
+        }
+    }
+
+    logging::parallel_for(static_cast<size_t>(0), surfaces.size(), [&](size_t i) {
+        if (!Face_IsLightmapped(bsp, &bsp->dfaces[i])) {
+            return;
+        }
+
+        for (const light_t *light : DirectLightFace_Lights(bsp, surfaces[i])) {
+            auto it = light_hashes.find(light);
+
+            // a light that isn't local is in the key
+            _lights[i].push_back(it != light_hashes.end() ? it->second : 0);
+        }
+    }, logging::progress_t::NONE);
+
+    std::ifstream stream(_path, std::ios_base::in | std::ios_base::binary);
+
+    if (!stream) {
+        return surfaces.size();
+    }
+
+    light_relight_header header;
+    stream >= header;
+
+    if (!stream || header.magic != LIGHT_RELIGHT_MAGIC || header.version != LIGHT_RELIGHT_VERSION ||
+        header.key != _key || header.num_faces != surfaces.size()) {
+        logging::print("{} is from a different .bsp or options; relighting everything\n", _path.string());
+        return surfaces.size();
+    }
+
+    // read everything first, so a truncated file leaves the surfaces as they were
+    std::vector<light_surface_state_t> restored(surfaces.size());
+
+    // the counts come from the file, so they're checked against what's left
+    // of it before anything is allocated
+    std::vector<uint64_t> lights;
+    std::vector<char> state;
+
+    for (size_t i = 0; i < surfaces.size(); i++) {
+        ReadVector(stream, lights);
+
+        // each face's state is stored as a sized blob, so a face that no
+        // longer fits can be skipped
+        ReadVector(stream, state);
+
+        if (!stream) {
+            break;
+        }
+
+        if (lights != _lights[i]) {
+            continue;
+        }
+
+        imemstream state_stream(state.data(), state.size());
+
+        if (ReadLightSurfaceState(state_stream, surfaces[i], restored[i])) {
+            _cached[i] = 1;
+        }
+    }
+
+    if (!stream) {
+        logging::print("{} is incomplete; relighting everything\n", _path.string());
+        _cached.assign(surfaces.size(), 0);
+        return surfaces.size();
+    }
+
+    size_t num_cached = 0;
+
+    for (size_t i = 0; i < surfaces.size(); i++) {
+        if (_cached[i]) {
+            ApplyLightSurfaceState(surfaces[i], std::move(restored[i]));
+            num_cached++;
+
+            if (Face_IsLightmapped(bsp, &bsp->dfaces[i])) {
+                c_faces_restored++;
+            }
+        }
+    }
+
+    return surfaces.size() - num_cached;
+}
+
+void light_relight_t::save(std::span<const lightsurf_t> surfaces) const
+{
+    fs::path tmp_path = fs::path(_path).concat(".tmp");
+
+    {
+        std::ofstream stream(tmp_path, std::ios_base::out | std::ios_base::binary);
+
+        if (stream) {
+            light_relight_header header{
+                LIGHT_RELIGHT_MAGIC, LIGHT_RELIGHT_VERSION, _key, static_cast<uint32_t>(surfaces.size())};
+            stream <= header;
+
+            for (size_t i = 0; i < surfaces.size(); i++) {
+                WriteVector(stream, _lights[i]);
+
+                std::ostringstream state(std::ios_base::out | std::ios_base::binary);
+                WriteLightSurfaceState(state, surfaces[i]);
+
+                const std::string data = state.str();
+                stream <= static_cast<uint32_t>(data.size());
+                stream.write(data.data(), data.size());
+            }
+        }
+
+        if (!stream) {
+            logging::print("WARNING: can't write {}\n", tmp_path.string());
+            return;
+        }
+    }
+
+    // only replace the previous file once the new one is complete
+    std::error_code ec;
+    fs::remove(_path, ec);
+    fs::rename(tmp_path, _path, ec);
+
+    if (ec) {
+        logging::print("WARNING: can't write {}\n", _path.string());
+    }
+}
@@ -18,6 +18,7 @@
 */
 
 #include <light/trace.hh>
+#include <light/light.hh>
 
 #include <common/imglib.hh>
 #include <common/bsputils.hh>
@@ -31,6 +32,11 @@ from hmap2
 */
 const mleaf_t *Light_PointInLeaf(const mbsp_t *bsp, const qvec3f &point)
 {
+    // the flattened tree is only built for the .bsp being lit
+    if (point_query.bsp() == bsp) {
+        return point_query.find_leaf(0, point);
+    }
+
     int num = 0;
 
     while (num >= 0)
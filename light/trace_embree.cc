@@ -24,6 +24,9 @@
 
 #include <common/bsputils.hh>
 #include <common/polylib.hh>
+#include <algorithm>
+#include <cmath>
+#include <fstream>
 #include <vector>
 #include <climits>
 #include <set>
@@ -38,6 +41,8 @@ std::set<const mface_t *> shadow_casting_solid_faces;
 static RTCDevice device;
 RTCScene scene;
 
+profiler::counter c_rays_traced{"rays traced"};
+
 static const mbsp_t *bsp_static;
 
 void ResetEmbree()
@@ -98,83 +103,82 @@ static float Face_Alpha(const mbsp_t *bsp, const modelinfo_t *modelinfo, const m
     return 1.0f;
 }
 
-sceneinfo CreateGeometry(
-    const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const std::vector<const mface_t *> &faces)
+struct embree_vertex_t
 {
-    unsigned int geomID;
-    RTCGeometry geom_0 = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-    // we're not using masks, but they need to be set to something or else all rays miss
-    // if embree is compiled with them
-    rtcSetGeometryMask(geom_0, 1);
-    rtcSetGeometryBuildQuality(geom_0, RTC_BUILD_QUALITY_MEDIUM);
-    rtcSetGeometryTimeStepCount(geom_0, 1);
-    geomID = rtcAttachGeometry(scene, geom_0);
-    rtcReleaseGeometry(geom_0);
+    float point[4]; // 4th element is padding
+};
 
-    struct Vertex
-    {
-        float point[4];
-    }; // 4th element is padding
-    struct Triangle
-    {
-        int v0, v1, v2;
-    };
+struct embree_triangle_t
+{
+    int v0, v1, v2;
+};
 
-    // temprary buffers used while gathering faces
-    std::vector<Vertex> vertices_temp;
-    std::vector<Triangle> tris_temp;
+// the triangles of one embree geometry, before they're handed to embree.
+// this is what the -tracecache file stores.
+struct triangle_soup_t
+{
+    std::vector<embree_vertex_t> vertices;
+    std::vector<embree_triangle_t> triangles;
+    // the bsp face of each triangle; empty for skip bmodel windings
+    std::vector<int32_t> faces;
+};
 
-    sceneinfo s;
-    s.geomID = geomID;
+static triinfo MakeTriInfo(const mbsp_t *bsp, const mface_t *face, const modelinfo_t *modelinfo)
+{
+    const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
 
-    auto add_vert = [&](const qvec3f &pos) { vertices_temp.push_back({.point{pos[0], pos[1], pos[2], 0.0f}}); };
+    triinfo info;
 
-    // FIXME: reuse vertices
-    auto add_tri = [&](const mface_t *face, int bsp_vert0, int bsp_vert1, int bsp_vert2, const modelinfo_t *modelinfo) {
-        const qvec3f final_pos0 = Vertex_GetPos(bsp, bsp_vert0) + modelinfo->offset;
-        const qvec3f final_pos1 = Vertex_GetPos(bsp, bsp_vert1) + modelinfo->offset;
-        const qvec3f final_pos2 = Vertex_GetPos(bsp, bsp_vert2) + modelinfo->offset;
+    info.face = face;
+    info.modelinfo = modelinfo;
+    info.texinfo = &bsp->texinfo[face->texinfo];
 
-        // push the 3 vertices
-        int first_vert_index = vertices_temp.size();
-        add_vert(final_pos0);
-        add_vert(final_pos1);
-        add_vert(final_pos2);
+    info.texture = Face_Texture(bsp, face);
 
-        tris_temp.push_back({first_vert_index, first_vert_index + 1, first_vert_index + 2});
+    // FIXME: don't these need to check extended_flags?
+    info.shadowworldonly = modelinfo->shadowworldonly.boolValue();
+    info.shadowself = modelinfo->shadowself.boolValue();
+    info.switchableshadow = modelinfo->switchableshadow.boolValue();
+    info.switchshadstyle = modelinfo->switchshadstyle.value();
 
-        const surfflags_t &extended_flags = extended_texinfo_flags[face->texinfo];
+    info.channelmask = extended_flags.object_channel_mask.value_or(modelinfo->object_channel_mask.value());
 
-        triinfo info;
+    info.alpha = Face_Alpha(bsp, modelinfo, face);
 
-        info.face = face;
-        info.modelinfo = modelinfo;
-        info.texinfo = &bsp->texinfo[face->texinfo];
+    // mxd
+    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+        const int surf_flags = Face_ContentsOrSurfaceFlags(bsp, face);
+        info.is_fence = surf_flags & Q2_SURF_ALPHATEST;
+        info.is_glass = !info.is_fence && (surf_flags & (Q2_SURF_TRANS33 | Q2_SURF_TRANS66));
+    } else {
+        const char *name = Face_TextureName(bsp, face);
+        info.is_fence = (name[0] == '{');
+        info.is_glass = (info.alpha < 1.0f);
+    }
 
-        info.texture = Face_Texture(bsp, face);
+    return info;
+}
 
-        // FIXME: don't these need to check extended_flags?
-        info.shadowworldonly = modelinfo->shadowworldonly.boolValue();
-        info.shadowself = modelinfo->shadowself.boolValue();
-        info.switchableshadow = modelinfo->switchableshadow.boolValue();
-        info.switchshadstyle = modelinfo->switchshadstyle.value();
+static triangle_soup_t TrianglesFromFaces(const mbsp_t *bsp, const std::vector<const mface_t *> &faces)
+{
+    triangle_soup_t soup;
 
-        info.channelmask = extended_flags.object_channel_mask.value_or(modelinfo->object_channel_mask.value());
+    auto add_vert = [&](const qvec3f &pos) { soup.vertices.push_back({.point{pos[0], pos[1], pos[2], 0.0f}}); };
 
-        info.alpha = Face_Alpha(bsp, modelinfo, face);
+    // FIXME: reuse vertices
+    auto add_tri = [&](const mface_t *face, int bsp_vert0, int bsp_vert1, int bsp_vert2, const modelinfo_t *modelinfo) {
+        const qvec3f final_pos0 = Vertex_GetPos(bsp, bsp_vert0) + modelinfo->offset;
+        const qvec3f final_pos1 = Vertex_GetPos(bsp, bsp_vert1) + modelinfo->offset;
+        const qvec3f final_pos2 = Vertex_GetPos(bsp, bsp_vert2) + modelinfo->offset;
 
-        // mxd
-        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-            const int surf_flags = Face_ContentsOrSurfaceFlags(bsp, face);
-            info.is_fence = surf_flags & Q2_SURF_ALPHATEST;
-            info.is_glass = !info.is_fence && (surf_flags & (Q2_SURF_TRANS33 | Q2_SURF_TRANS66));
-        } else {
-            const char *name = Face_TextureName(bsp, face);
-            info.is_fence = (name[0] == '{');
-            info.is_glass = (info.alpha < 1.0f);
-        }
+        // push the 3 vertices
+        int first_vert_index = soup.vertices.size();
+        add_vert(final_pos0);
+        add_vert(final_pos1);
+        add_vert(final_pos2);
 
-        s.triInfo.push_back(info);
+        soup.triangles.push_back({first_vert_index, first_vert_index + 1, first_vert_index + 2});
+        soup.faces.push_back(Face_GetNum(bsp, face));
     };
 
     auto add_face = [&](const mface_t *face, const modelinfo_t *modelinfo) {
@@ -199,85 +203,248 @@ sceneinfo CreateGeometry(
         }
     }
 
-    // copy vertices, triangles from temporary buffers to embree-managed memory
-    Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(
-        geom_0, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 4 * sizeof(float), vertices_temp.size());
+    return soup;
+}
+
+static triangle_soup_t TrianglesFromWindings(const std::vector<polylib::winding3f_t> &windings)
+{
+    triangle_soup_t soup;
+
+    for (const auto &winding : windings) {
+        Q_assert(winding.size() >= 3);
+
+        const int first_vert_index = soup.vertices.size();
+
+        for (int j = 0; j < winding.size(); j++) {
+            soup.vertices.push_back({.point{winding.at(j)[0], winding.at(j)[1], winding.at(j)[2], 0.0f}});
+        }
+
+        for (int j = 2; j < winding.size(); j++) {
+            soup.triangles.push_back({first_vert_index + (j - 1), first_vert_index + j, first_vert_index + 0});
+        }
+    }
+
+    return soup;
+}
+
+static unsigned AttachGeometry(RTCDevice g_device, RTCScene scene, const triangle_soup_t &soup, RTCBuildQuality quality)
+{
+    RTCGeometry geom_0 = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
+    // we're not using masks, but they need to be set to something or else all rays miss
+    // if embree is compiled with them
+    rtcSetGeometryMask(geom_0, 1);
+    rtcSetGeometryBuildQuality(geom_0, quality);
+    rtcSetGeometryTimeStepCount(geom_0, 1);
+    const unsigned geomID = rtcAttachGeometry(scene, geom_0);
+    rtcReleaseGeometry(geom_0);
+
+    // copy vertices, triangles to embree-managed memory
+    embree_vertex_t *vertices = (embree_vertex_t *)rtcSetNewGeometryBuffer(
+        geom_0, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 4 * sizeof(float), soup.vertices.size());
 
-    Triangle *triangles = (Triangle *)rtcSetNewGeometryBuffer(
-        geom_0, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(int), tris_temp.size());
+    embree_triangle_t *triangles = (embree_triangle_t *)rtcSetNewGeometryBuffer(
+        geom_0, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(int), soup.triangles.size());
 
-    memcpy(vertices, vertices_temp.data(), sizeof(Vertex) * vertices_temp.size());
-    memcpy(triangles, tris_temp.data(), sizeof(Triangle) * tris_temp.size());
+    memcpy(vertices, soup.vertices.data(), sizeof(embree_vertex_t) * soup.vertices.size());
+    memcpy(triangles, soup.triangles.data(), sizeof(embree_triangle_t) * soup.triangles.size());
 
     rtcCommitGeometry(geom_0);
+    return geomID;
+}
+
+static sceneinfo CreateGeometry(
+    const mbsp_t *bsp, RTCDevice g_device, RTCScene scene, const triangle_soup_t &soup, RTCBuildQuality quality)
+{
+    sceneinfo s;
+    s.geomID = AttachGeometry(g_device, scene, soup, quality);
+    s.triInfo.reserve(soup.faces.size());
+
+    for (int32_t facenum : soup.faces) {
+        const mface_t *face = BSP_GetFace(bsp, facenum);
+        s.triInfo.push_back(MakeTriInfo(bsp, face, ModelInfoForFace(bsp, facenum)));
+    }
+
     return s;
 }
 
-static void CreateGeometryFromWindings(
-    RTCDevice g_device, RTCScene scene, const std::vector<polylib::winding3f_t> &windings)
+/*
+============================================================================
+TRACE CACHE
+-tracecache keeps the triangle soups in a file next to the .bsp, keyed by
+a hash of the geometry lumps and of the face classification (which
+depends on entity keys), so a relight with unchanged geometry skips the
+triangulation and the skip bmodel windings. The face classification still
+runs, since it's part of the key, and so does MakeTriInfo: triinfo points
+at this run's modelinfo and textures. Both are a single pass over the
+faces, cheaper than hashing the key. Stored in native byte order; the
+file is only meant to be reused on the same machine.
+============================================================================
+*/
+
+struct trace_cache_header
 {
-    if (windings.empty())
-        return;
+    std::array<char, 4> magic;
+    uint32_t version;
+    uint64_t key;
 
-    // count triangles
-    int numtris = 0;
-    int numverts = 0;
-    for (const auto &winding : windings) {
-        Q_assert(winding.size() >= 3);
-        numtris += (winding.size() - 2);
-        numverts += winding.size();
-    }
-
-    RTCGeometry geom_1 = rtcNewGeometry(g_device, RTC_GEOMETRY_TYPE_TRIANGLE);
-    rtcSetGeometryBuildQuality(geom_1, RTC_BUILD_QUALITY_MEDIUM);
-    rtcSetGeometryMask(geom_1, 1);
-    rtcSetGeometryTimeStepCount(geom_1, 1);
-    rtcAttachGeometry(scene, geom_1);
-    rtcReleaseGeometry(geom_1);
-
-    struct Vertex
-    {
-        float point[4];
-    }; // 4th element is padding
-    struct Triangle
-    {
-        int v0, v1, v2;
-    };
+    auto stream_data() { return std::tie(magic, version, key); }
+};
 
-    // fill in vertices
-    Vertex *vertices = (Vertex *)rtcSetNewGeometryBuffer(
-        geom_1, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, 4 * sizeof(float), numverts);
-    {
-        int vert_index = 0;
-        for (const auto &winding : windings) {
-            for (int j = 0; j < winding.size(); j++) {
-                for (int k = 0; k < 3; k++) {
-                    vertices[vert_index + j].point[k] = winding.at(j)[k];
-                }
+constexpr std::array<char, 4> TRACE_CACHE_MAGIC{'E', 'W', 'T', 'C'};
+constexpr uint32_t TRACE_CACHE_VERSION = 1;
+
+// sky, solid, filter, skip
+using trace_soups_t = std::array<triangle_soup_t, 4>;
+
+template<typename T>
+static uint64_t HashVector(const std::vector<T> &v, uint64_t hash)
+{
+    const uint64_t size = v.size();
+    hash = fnv1a_64(&size, sizeof(size), hash);
+    return fnv1a_64(v.data(), v.size() * sizeof(T), hash);
+}
+
+static uint64_t TraceCacheKey(const mbsp_t *bsp, const std::array<const std::vector<const mface_t *> *, 3> &face_lists,
+    const std::vector<const modelinfo_t *> &skip_models)
+{
+    uint64_t hash = FNV1A_64_INIT;
+
+    hash = HashVector(bsp->dvertexes, hash);
+    hash = HashVector(bsp->dedges, hash);
+    hash = HashVector(bsp->dsurfedges, hash);
+
+    for (auto &face : bsp->dfaces) {
+        const std::array<int32_t, 2> data{face.firstedge, face.numedges};
+        hash = fnv1a_64(data.data(), sizeof(data), hash);
+    }
+
+    // skip bmodel windings are made from the tree
+    for (auto &plane : bsp->dplanes) {
+        const std::array<float, 4> data{plane.normal[0], plane.normal[1], plane.normal[2], plane.dist};
+        hash = fnv1a_64(data.data(), sizeof(data), hash);
+    }
+
+    for (auto &node : bsp->dnodes) {
+        const std::array<int32_t, 3> data{node.planenum, node.children[0], node.children[1]};
+        hash = fnv1a_64(data.data(), sizeof(data), hash);
+    }
+
+    for (auto &leaf : bsp->dleafs) {
+        hash = fnv1a_64(&leaf.contents, sizeof(leaf.contents), hash);
+    }
+
+    // the face classification, and the offsets of the models the faces belong to
+    for (auto *faces : face_lists) {
+        std::vector<int32_t> facenums;
+        facenums.reserve(faces->size());
+
+        for (const mface_t *face : *faces) {
+            const int32_t facenum = Face_GetNum(bsp, face);
+            facenums.push_back(facenum);
+
+            if (const modelinfo_t *modelinfo = ModelInfoForFace(bsp, facenum)) {
+                hash = fnv1a_64(&modelinfo->offset, sizeof(modelinfo->offset), hash);
             }
-            vert_index += winding.size();
         }
+
+        hash = HashVector(facenums, hash);
     }
 
-    // fill in triangles
-    Triangle *triangles = (Triangle *)rtcSetNewGeometryBuffer(
-        geom_1, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, 3 * sizeof(int), numtris);
-    int tri_index = 0;
-    int vert_index = 0;
-    for (const auto &winding : windings) {
-        for (int j = 2; j < winding.size(); j++) {
-            Triangle *tri = &triangles[tri_index];
-            tri->v0 = vert_index + (j - 1);
-            tri->v1 = vert_index + j;
-            tri->v2 = vert_index + 0;
-            tri_index++;
+    for (const modelinfo_t *modelinfo : skip_models) {
+        hash = fnv1a_64(&modelinfo->model->headnode[0], sizeof(modelinfo->model->headnode[0]), hash);
+        hash = fnv1a_64(&modelinfo->offset, sizeof(modelinfo->offset), hash);
+    }
+
+    return hash;
+}
+
+static std::optional<trace_soups_t> LoadTraceCache(const fs::path &path, uint64_t key)
+{
+    std::ifstream stream(path, std::ios_base::in | std::ios_base::binary);
+
+    if (!stream) {
+        return std::nullopt;
+    }
+
+    trace_cache_header header;
+    stream >= header;
+
+    if (!stream || header.magic != TRACE_CACHE_MAGIC || header.version != TRACE_CACHE_VERSION || header.key != key) {
+        return std::nullopt;
+    }
+
+    trace_soups_t soups;
+
+    for (auto &soup : soups) {
+        ReadVector(stream, soup.vertices);
+        ReadVector(stream, soup.triangles);
+        ReadVector(stream, soup.faces);
+    }
+
+    if (!stream) {
+        return std::nullopt;
+    }
+
+    return soups;
+}
+
+static void SaveTraceCache(const fs::path &path, uint64_t key, const trace_soups_t &soups)
+{
+    // written beside the cache and renamed over it once complete, so another
+    // light run never loads a half written file
+    fs::path tmp_path = fs::path(path).concat(".tmp");
+
+    std::ofstream stream(tmp_path, std::ios_base::out | std::ios_base::binary);
+
+    if (stream) {
+        trace_cache_header header{TRACE_CACHE_MAGIC, TRACE_CACHE_VERSION, key};
+        stream <= header;
+
+        for (auto &soup : soups) {
+            WriteVector(stream, soup.vertices);
+            WriteVector(stream, soup.triangles);
+            WriteVector(stream, soup.faces);
         }
-        vert_index += winding.size();
+
+        stream.close();
     }
-    Q_assert(vert_index == numverts);
-    Q_assert(tri_index == numtris);
 
-    rtcCommitGeometry(geom_1);
+    if (!stream) {
+        logging::print("WARNING: can't write trace cache {}\n", path.string());
+        std::error_code ec;
+        fs::remove(tmp_path, ec);
+        return;
+    }
+
+    std::error_code ec;
+    fs::remove(path, ec);
+    fs::rename(tmp_path, path, ec);
+
+    if (ec) {
+        logging::print("WARNING: can't write trace cache {}: {}\n", path.string(), ec.message());
+        fs::remove(tmp_path, ec);
+    }
+}
+
+// the build quality of the geometries; the scene itself is always built at
+// high quality, as it was before -tracequality
+static RTCBuildQuality TraceBuildQuality(const trace_soups_t &soups)
+{
+    switch (light_options.tracequality.value()) {
+        case tracequality_t::LOW: return RTC_BUILD_QUALITY_LOW;
+        case tracequality_t::MEDIUM: return RTC_BUILD_QUALITY_MEDIUM;
+        case tracequality_t::HIGH: return RTC_BUILD_QUALITY_HIGH;
+        default: break;
+    }
+
+    size_t num_triangles = 0;
+    for (auto &soup : soups) {
+        num_triangles += soup.triangles.size();
+    }
+
+    // the high quality (spatial split) build pays for itself on normal maps,
+    // but its build time dominates on very large ones
+    return num_triangles > 500'000 ? RTC_BUILD_QUALITY_MEDIUM : RTC_BUILD_QUALITY_HIGH;
 }
 
 void ErrorCallback(void *userptr, const RTCError code, const char *str)
@@ -540,7 +707,7 @@ static void MakeFaces(
     Q_assert(planes.empty());
 }
 
-void Embree_TraceInit(const mbsp_t *bsp)
+void Embree_TraceInit(const mbsp_t *bsp, const fs::path &cache_path)
 {
     bsp_static = bsp;
     Q_assert(device == nullptr);
@@ -646,11 +813,37 @@ void Embree_TraceInit(const mbsp_t *bsp)
     }
 
     /* Special handling of skip-textured bmodels */
-    std::vector<polylib::winding3f_t> skipwindings;
+    std::vector<const modelinfo_t *> skip_models;
     for (const modelinfo_t *modelinfo : tracelist) {
         if (modelinfo->model->numfaces == 0) {
+            skip_models.push_back(modelinfo);
+        }
+    }
+
+    std::optional<trace_soups_t> soups;
+    uint64_t cache_key = 0;
+
+    if (!cache_path.empty()) {
+        cache_key = TraceCacheKey(bsp, {&skyfaces, &solidfaces, &filterfaces}, skip_models);
+        soups = LoadTraceCache(cache_path, cache_key);
+
+        if (soups) {
+            logging::funcprint("loaded triangles from {}\n", cache_path.string());
+        }
+    }
+
+    if (!soups) {
+        std::vector<polylib::winding3f_t> skipwindings;
+        for (const modelinfo_t *modelinfo : skip_models) {
             MakeFaces(bsp, modelinfo, modelinfo->model, skipwindings);
         }
+
+        soups = trace_soups_t{TrianglesFromFaces(bsp, skyfaces), TrianglesFromFaces(bsp, solidfaces),
+            TrianglesFromFaces(bsp, filterfaces), TrianglesFromWindings(skipwindings)};
+
+        if (!cache_path.empty()) {
+            SaveTraceCache(cache_path, cache_key, *soups);
+        }
     }
 
     device = rtcNewDevice(NULL);
@@ -677,11 +870,14 @@ void Embree_TraceInit(const mbsp_t *bsp)
     // (see q1_light_sun_artifact test)
     rtcSetSceneFlags(scene, RTC_SCENE_FLAG_ROBUST);
 #endif
+    const RTCBuildQuality quality = TraceBuildQuality(*soups);
     rtcSetSceneBuildQuality(scene, RTC_BUILD_QUALITY_HIGH);
-    skygeom = CreateGeometry(bsp, device, scene, skyfaces);
-    solidgeom = CreateGeometry(bsp, device, scene, solidfaces);
-    filtergeom = CreateGeometry(bsp, device, scene, filterfaces);
-    CreateGeometryFromWindings(device, scene, skipwindings);
+    skygeom = CreateGeometry(bsp, device, scene, (*soups)[0], quality);
+    solidgeom = CreateGeometry(bsp, device, scene, (*soups)[1], quality);
+    filtergeom = CreateGeometry(bsp, device, scene, (*soups)[2], quality);
+    if (!(*soups)[3].triangles.empty()) {
+        AttachGeometry(device, scene, (*soups)[3], quality);
+    }
 
     rtcSetGeometryIntersectFilterFunction(rtcGetGeometry(scene, filtergeom.geomID), Embree_FilterFuncN);
     rtcSetGeometryOccludedFilterFunction(rtcGetGeometry(scene, filtergeom.geomID), Embree_FilterFuncN);
@@ -697,7 +893,7 @@ void Embree_TraceInit(const mbsp_t *bsp)
     logging::print("\t{} sky faces\n", skyfaces.size());
     logging::print("\t{} solid faces\n", solidfaces.size());
     logging::print("\t{} filtered faces\n", filterfaces.size());
-    logging::print("\t{} shadow-casting skip faces\n", skipwindings.size());
+    logging::print("\t{} shadow-casting skip triangles\n", (*soups)[3].triangles.size());
 }
 
 static void AddGlassToRay(ray_source_info *ctx, unsigned rayIndex, float opacity, const qvec3f &glasscolor)
@@ -732,6 +928,49 @@ static void AddDynamicOccluderToRay(ray_source_info *ctx, unsigned rayIndex, int
     }
 }
 
+// sort key for raystream_embree_common_t::sortPushedRays: direction
+// octant, then the x/y direction quantized to 8 bits each, then the
+// power of two of the ray length
+static uint32_t RaySortKey(const RTCRay &ray)
+{
+    const uint32_t octant = (ray.dir_x < 0.0f ? 1 : 0) | (ray.dir_y < 0.0f ? 2 : 0) | (ray.dir_z < 0.0f ? 4 : 0);
+
+    auto quantize = [](float v) -> uint32_t { return static_cast<uint32_t>(std::clamp(v * 127.5f + 127.5f, 0.0f, 255.0f)); };
+
+    int exponent;
+    std::frexp(std::max(ray.tfar, 1.0f), &exponent);
+
+    return (octant << 21) | (quantize(ray.dir_x) << 13) | (quantize(ray.dir_y) << 5) |
+           static_cast<uint32_t>(std::clamp(exponent, 0, 31));
+}
+
+void raystream_embree_common_t::sortPushedRays()
+{
+    thread_local std::vector<std::pair<uint32_t, uint32_t>> keys;
+    thread_local aligned_vector<ray_io> sorted;
+
+    keys.clear();
+    keys.reserve(_rays.size());
+
+    for (uint32_t i = 0; i < _rays.size(); i++) {
+        keys.emplace_back(RaySortKey(_rays[i].ray.ray), i);
+    }
+
+    // sorting the pairs keeps ties in push order, so the result is deterministic
+    std::sort(keys.begin(), keys.end());
+
+    sorted.clear();
+    sorted.reserve(_rays.size());
+
+    for (auto &[key, i] : keys) {
+        ray_io &ray = sorted.emplace_back(_rays[i]);
+        // the filter callbacks use the embree ray id to find the ray_io
+        ray.ray.ray.id = sorted.size() - 1;
+    }
+
+    std::swap(_rays, sorted);
+}
+
 ray_source_info::ray_source_info(raystream_embree_common_t *raystream_, const modelinfo_t *self_, int shadowmask_)
     : raystream(raystream_),
       self(self_),
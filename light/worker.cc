@@ -0,0 +1,190 @@
+/*  This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307 USA
+
+    See file, 'COPYING', for details.
+*/
+
+#include <light/worker.hh>
+
+#include <light/checkpoint.hh>
+#include <light/light.hh>
+
+#include <common/log.hh>
+
+#include <cstdlib>
+#include <string>
+#include <thread>
+
+// faces are handed out to the workers in blocks of this many, round-robin;
+// neighbouring faces tend to cost about the same, so this evens out the work
+// without splitting the map into a few big chunks
+constexpr size_t LIGHT_WORKER_BLOCK_SIZE = 64;
+
+static std::vector<std::string> light_worker_args;
+
+void SetLightWorkerArgs(int argc, const char **argv)
+{
+    light_worker_args.assign(argv, argv + argc);
+}
+
+std::vector<uint32_t> LightWorkerFaces(size_t first, size_t num_faces, int32_t worker, int32_t num_workers)
+{
+    std::vector<uint32_t> facenums;
+
+    for (size_t i = first; i < num_faces; i++) {
+        if (((i - first) / LIGHT_WORKER_BLOCK_SIZE) % num_workers == worker) {
+            facenums.push_back(i);
+        }
+    }
+
+    return facenums;
+}
+
+static fs::path LightWorkDir(const fs::path &bsp_path)
+{
+    return fs::path(bsp_path).replace_extension("lightwork");
+}
+
+fs::path LightWorkerStatePath(const fs::path &bsp_path)
+{
+    return LightWorkDir(bsp_path) / "state";
+}
+
+fs::path LightWorkerResultPath(const fs::path &bsp_path, int32_t worker)
+{
+    return LightWorkDir(bsp_path) / fmt::format("worker{}", worker);
+}
+
+fs::path LightWorkerLogPath(const fs::path &bsp_path, int32_t worker)
+{
+    return LightWorkDir(bsp_path) / fmt::format("worker{}.log", worker);
+}
+
+// quotes an argument for std::system
+static std::string QuoteArg(const std::string &arg)
+{
+#ifdef _WIN32
+    // CommandLineToArgvW rules: backslashes are only special before a
+    // quote, where 2n of them become n; so double any run of them that
+    // is followed by a quote, including the closing one
+    std::string quoted = "\"";
+    size_t backslashes = 0;
+
+    for (char c : arg) {
+        if (c == '\\') {
+            backslashes++;
+        } else if (c == '"') {
+            quoted.append(backslashes + 1, '\\');
+            backslashes = 0;
+        } else {
+            backslashes = 0;
+        }
+        quoted += c;
+    }
+
+    quoted.append(backslashes, '\\');
+
+    return quoted + "\"";
+#else
+    std::string quoted = "'";
+
+    for (char c : arg) {
+        if (c == '\'') {
+            quoted += "'\\''";
+        } else {
+            quoted += c;
+        }
+    }
+
+    return quoted + "'";
+#endif
+}
+
+static std::string LightWorkerCommand(int32_t worker)
+{
+    // -workercommand is used as-is, so it can be e.g. "ssh host /path/to/light"
+    std::string command = light_options.workercommand.value();
+
+    if (command.empty()) {
+        if (light_worker_args.empty() || light_worker_args[0].empty()) {
+            FError("-workers needs -workercommand, the path of the light executable isn't known");
+        }
+
+        command = QuoteArg(light_worker_args[0]);
+    }
+
+    command += fmt::format(" -worker {} -nopercent", worker);
+
+    for (size_t i = 1; i < light_worker_args.size(); i++) {
+        command += " " + QuoteArg(light_worker_args[i]);
+    }
+
+#ifdef _WIN32
+    // cmd.exe strips the outer quotes if the command starts with one
+    command = "\"" + command + "\"";
+#endif
+
+    return command;
+}
+
+void RunLightWorkers(
+    const fs::path &bsp_path, uint64_t key, const light_progress_t &progress, std::span<lightsurf_t> surfaces)
+{
+    const int32_t num_workers = light_options.workers.value();
+
+    fs::create_directories(LightWorkDir(bsp_path));
+
+    if (!SaveLightState(LightWorkerStatePath(bsp_path), key, progress, surfaces)) {
+        FError("can't write {}", LightWorkerStatePath(bsp_path).string());
+    }
+
+    // build the commands first; errors can't be thrown from the threads
+    std::vector<std::string> commands;
+
+    for (int32_t i = 0; i < num_workers; i++) {
+        std::error_code ec;
+        fs::remove(LightWorkerResultPath(bsp_path, i), ec);
+
+        commands.push_back(LightWorkerCommand(i));
+    }
+
+    std::vector<int> status(num_workers);
+    std::vector<std::thread> threads;
+
+    logging::print("running {} light workers\n", num_workers);
+
+    for (int32_t i = 0; i < num_workers; i++) {
+        threads.emplace_back([&command = commands[i], &result = status[i]]() { result = std::system(command.c_str()); });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+
+    for (int32_t i = 0; i < num_workers; i++) {
+        if (status[i] != 0) {
+            FError("light worker {} failed (status {}), see {}", i, status[i], LightWorkerLogPath(bsp_path, i).string());
+        }
+
+        if (!LoadLightState(LightWorkerResultPath(bsp_path, i), key, surfaces)) {
+            FError("light worker {} didn't write {}", i, LightWorkerResultPath(bsp_path, i).string());
+        }
+    }
+}
+
+void CleanLightWorkers(const fs::path &bsp_path)
+{
+    std::error_code ec;
+    fs::remove_all(LightWorkDir(bsp_path), ec);
+}
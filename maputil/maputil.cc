@@ -18,10 +18,18 @@ See file, 'COPYING', for details.
 */
 
 #include <cstdint>
+#include <cstring>
+#include <map>
+#include <new>
+#include <set>
+#include <stdexcept>
+
+#include <maputil/maputil.hh>
 
 #include <common/entdata.h>
 #include <common/parser.hh>
 #include <common/log.hh>
+#include <common/profiler.hh>
 #include <common/mapfile.hh>
 #include <common/settings.hh>
 #include <common/imglib.hh>
@@ -40,8 +48,8 @@ extern "C"
 using namespace mapfile;
 
 // global map file state
-map_file_t map_file;
-const gamedef_t *current_game = nullptr;
+static map_file_t map_file;
+static const gamedef_t *current_game = nullptr;
 
 struct maputil_settings : public settings::common_settings
 {
@@ -63,6 +71,12 @@ private:
     }
 
 public:
+    void reset() override
+    {
+        common_settings::reset();
+        operations.clear();
+    }
+
     settings::setting_func load{this, "load",
         [&](const std::string &name, parser_base_t &parser, settings::source src) {
             return this->load_setting<settings::setting_string>(name, parser, src, "");
@@ -103,9 +117,9 @@ public:
     std::vector<std::unique_ptr<settings::setting_base>> operations;
 };
 
-maputil_settings maputil_options;
+static maputil_settings maputil_options;
 
-map_file_t LoadMapOrEntFile(const fs::path &source)
+static map_file_t LoadMapOrEntFile(const fs::path &source)
 {
     logging::funcheader();
 
@@ -127,7 +141,7 @@ map_file_t LoadMapOrEntFile(const fs::path &source)
 #ifdef USE_LUA
 using array_iterate_callback = std::function<bool(lua_State *state, size_t index)>;
 
-void lua_iterate_array(lua_State *state, array_iterate_callback cb)
+static void lua_iterate_array(lua_State *state, array_iterate_callback cb)
 {
     size_t n = 0;
 
@@ -148,7 +162,7 @@ void lua_iterate_array(lua_State *state, array_iterate_callback cb)
     } while (keep_iterating);
 }
 
-size_t lua_count_array(lua_State *state)
+static size_t lua_count_array(lua_State *state)
 {
     size_t num = 0;
 
@@ -240,10 +254,11 @@ static int l_load_json(lua_State *state)
 
 /*
  * Lua layout:
- * entities = table[]
+ * entities = array
  *  [E].dict = array
  *      [D] = [ key, value ]
- *  [E].brushes = table[]
+ *      .<key> = value
+ *  [E].brushes = array
  *   [S].texture = string
  *   [S].plane_points = [ [ x, y, z ] [ x, y, z ] [ x, y, z ] ]
  *   [S].raw = table (can only contain ONE member:)
@@ -269,14 +284,192 @@ static int l_load_json(lua_State *state)
  *       .flags = number
  *   [S].plane = [ x, y, z, d ] (read-only)
  *   [S].vecs = [ [ x, y, z, d ] [ x, y, z, d ] ] (read-only)
+ *
+ * Every array down to the sides is a proxy (userdata) that reads and
+ * writes map_file when it's accessed, so a script only pays for what it
+ * touches. Proxies hold indices, not pointers, so setting an element to
+ * nil only marks it as removed: the indices don't shift until the script
+ * is done (see maputil_finish_script), a removed element reads as nil like
+ * a hole in a table would, and using a proxy of one raises an error.
+ * Setting element #array + 1 appends one.
+ *
+ * A side's plane_points, raw and info are plain tables, built on first
+ * access and then kept, so editing them in place edits the side; they're
+ * written back whenever C++ reads the side, and when the script is done.
  */
 
-static void maputil_make_brush_side(lua_State *state, const brush_side_t &side)
+enum class maputil_proxy_type_t : uint8_t
 {
-    // make side
-    lua_createtable(state, 0, 4);
+    entities, // map_file.entities
+    entity, // map_file.entities[entity]
+    dict, // the epairs of an entity, as [ key, value ] pairs
+    pair, // pair `index` of an entity's epairs
+    brushes, // the brushes of an entity
+    brush, // brush `index` of an entity
+    side, // side `side` of brush `index` of an entity
+    keys // the epairs of an entity, by key (the -query `entity` global)
+};
+
+static constexpr const char *maputil_proxy_names[] = {"maputil.entities", "maputil.entity", "maputil.dict",
+    "maputil.pair", "maputil.brushes", "maputil.brush", "maputil.side", "maputil.keys"};
+
+struct maputil_proxy_t
+{
+    maputil_proxy_type_t type;
+    size_t entity = 0;
+    size_t index = 0;
+    size_t side = 0;
+
+    auto operator<=>(const maputil_proxy_t &) const = default;
+};
+
+// the references, in the registry, to the field tables of a side
+struct maputil_side_fields_t
+{
+    int plane_points = LUA_NOREF;
+    int raw = LUA_NOREF;
+    int info = LUA_NOREF;
+};
+
+// the entity, pair, brush and side proxies of the elements set to nil
+static std::set<maputil_proxy_t> maputil_removed;
+// the field tables handed out, by side proxy
+static std::map<maputil_proxy_t, maputil_side_fields_t> maputil_side_fields;
+
+/*
+ * Lua is built as C, so luaL_error longjmps out of the function that raised
+ * it without running the destructors of the C++ objects on the way. Errors
+ * found while elements are looked up or copied are thrown as
+ * maputil_error_t instead, and maputil_lua_function, which wraps the
+ * functions handed to Lua, raises them once those objects are gone.
+ * luaL_check* and luaL_error are only used before a function makes any.
+ */
+struct maputil_error_t : std::runtime_error
+{
+    using std::runtime_error::runtime_error;
+};
+
+template<typename... T>
+[[noreturn]] static void maputil_error(fmt::format_string<T...> format, T &&...args)
+{
+    throw maputil_error_t(fmt::format(format, std::forward<T>(args)...));
+}
+
+template<lua_CFunction f>
+static int maputil_lua_function(lua_State *state)
+{
+    try {
+        return f(state);
+    } catch (const maputil_error_t &e) {
+        // what luaL_error would have raised
+        luaL_where(state, 1);
+        lua_pushstring(state, e.what());
+        lua_concat(state, 2);
+    }
+
+    return lua_error(state);
+}
+
+static void maputil_push_proxy(lua_State *state, const maputil_proxy_t &proxy)
+{
+    new (lua_newuserdata(state, sizeof(maputil_proxy_t))) maputil_proxy_t(proxy);
+    luaL_setmetatable(state, maputil_proxy_names[static_cast<size_t>(proxy.type)]);
+}
+
+static maputil_proxy_t *maputil_test_proxy(lua_State *state, int index, maputil_proxy_type_t type)
+{
+    return static_cast<maputil_proxy_t *>(
+        luaL_testudata(state, index, maputil_proxy_names[static_cast<size_t>(type)]));
+}
+
+static maputil_proxy_t &maputil_check_proxy(lua_State *state, int index, maputil_proxy_type_t type)
+{
+    return *static_cast<maputil_proxy_t *>(
+        luaL_checkudata(state, index, maputil_proxy_names[static_cast<size_t>(type)]));
+}
+
+static bool maputil_is_removed(const maputil_proxy_t &element)
+{
+    return maputil_removed.contains(element);
+}
+
+static map_entity_t &maputil_entity(lua_State *state, const maputil_proxy_t &proxy)
+{
+    if (proxy.entity >= map_file.entities.size()) {
+        maputil_error("entity {} no longer exists", proxy.entity + 1);
+    } else if (maputil_is_removed({maputil_proxy_type_t::entity, proxy.entity})) {
+        maputil_error("entity {} was removed", proxy.entity + 1);
+    }
+
+    return map_file.entities[proxy.entity];
+}
+
+static keyvalue_t &maputil_pair(lua_State *state, const maputil_proxy_t &proxy)
+{
+    map_entity_t &entity = maputil_entity(state, proxy);
+
+    if (proxy.index >= entity.epairs.size()) {
+        maputil_error("key {} of entity {} no longer exists", proxy.index + 1, proxy.entity + 1);
+    } else if (maputil_is_removed({maputil_proxy_type_t::pair, proxy.entity, proxy.index})) {
+        maputil_error("key {} of entity {} was removed", proxy.index + 1, proxy.entity + 1);
+    }
+
+    return *(entity.epairs.begin() + proxy.index);
+}
+
+static brush_t &maputil_brush(lua_State *state, const maputil_proxy_t &proxy)
+{
+    map_entity_t &entity = maputil_entity(state, proxy);
+
+    if (proxy.index >= entity.brushes.size()) {
+        maputil_error("brush {} of entity {} no longer exists", proxy.index + 1, proxy.entity + 1);
+    } else if (maputil_is_removed({maputil_proxy_type_t::brush, proxy.entity, proxy.index})) {
+        maputil_error("brush {} of entity {} was removed", proxy.index + 1, proxy.entity + 1);
+    }
+
+    return entity.brushes[proxy.index];
+}
+
+static void maputil_flush_side(lua_State *state, const maputil_proxy_t &proxy, brush_side_t &side);
+
+// the side, with the edits made to its field tables so far
+static brush_side_t &maputil_side(lua_State *state, const maputil_proxy_t &proxy)
+{
+    brush_t &brush = maputil_brush(state, proxy);
+
+    if (proxy.side >= brush.faces.size()) {
+        maputil_error(
+            "side {} of brush {} of entity {} no longer exists", proxy.side + 1, proxy.index + 1, proxy.entity + 1);
+    } else if (maputil_is_removed({maputil_proxy_type_t::side, proxy.entity, proxy.index, proxy.side})) {
+        maputil_error(
+            "side {} of brush {} of entity {} was removed", proxy.side + 1, proxy.index + 1, proxy.entity + 1);
+    }
+
+    brush_side_t &side = brush.faces[proxy.side];
+    maputil_flush_side(state, {maputil_proxy_type_t::side, proxy.entity, proxy.index, proxy.side}, side);
+    return side;
+}
 
-    // make vecs
+// converts the numeric key at `arg` to a 0-based index below `limit`
+static bool maputil_array_key(lua_State *state, int arg, size_t limit, size_t &index)
+{
+    if (lua_type(state, arg) != LUA_TNUMBER) {
+        return false;
+    }
+
+    int isnum;
+    lua_Integer i = lua_tointegerx(state, arg, &isnum);
+
+    if (!isnum || i < 1 || static_cast<size_t>(i) > limit) {
+        return false;
+    }
+
+    index = i - 1;
+    return true;
+}
+
+static void maputil_push_vecs(lua_State *state, const brush_side_t &side)
+{
     lua_createtable(state, 2, 0);
 
     for (size_t i = 0; i < 2; i++) {
@@ -289,10 +482,10 @@ static void maputil_make_brush_side(lua_State *state, const brush_side_t &side)
 
         lua_rawseti(state, -2, i + 1);
     }
+}
 
-    lua_setfield(state, -2, "vecs");
-
-    // set raw
+static void maputil_push_raw(lua_State *state, const brush_side_t &side)
+{
     lua_createtable(state, 0, 1);
 
     lua_createtable(state, 0, 4);
@@ -351,19 +544,17 @@ static void maputil_make_brush_side(lua_State *state, const brush_side_t &side)
 
     if (std::holds_alternative<texdef_quake_ed_t>(side.raw)) {
         lua_setfield(state, -2, "quaked");
-    }
-    if (std::holds_alternative<texdef_etp_t>(side.raw)) {
+    } else if (std::holds_alternative<texdef_etp_t>(side.raw)) {
         lua_setfield(state, -2, "etp");
-    }
-    if (std::holds_alternative<texdef_valve_t>(side.raw)) {
+    } else if (std::holds_alternative<texdef_valve_t>(side.raw)) {
         lua_setfield(state, -2, "valve");
     } else {
         lua_setfield(state, -2, "bp");
     }
+}
 
-    lua_setfield(state, -2, "raw");
-
-    // make plane
+static void maputil_push_plane(lua_State *state, const brush_side_t &side)
+{
     lua_createtable(state, 4, 0);
     lua_pushnumber(state, side.plane.normal[0]);
     lua_rawseti(state, -2, 1);
@@ -373,9 +564,10 @@ static void maputil_make_brush_side(lua_State *state, const brush_side_t &side)
     lua_rawseti(state, -2, 3);
     lua_pushnumber(state, side.plane.dist);
     lua_rawseti(state, -2, 4);
-    lua_setfield(state, -2, "plane");
+}
 
-    // make plane points
+static void maputil_push_plane_points(lua_State *state, const brush_side_t &side)
+{
     lua_createtable(state, 3, 0);
 
     for (size_t i = 0; i < 3; i++) {
@@ -388,78 +580,39 @@ static void maputil_make_brush_side(lua_State *state, const brush_side_t &side)
 
         lua_rawseti(state, -2, i + 1);
     }
-
-    lua_setfield(state, -2, "plane_points");
-
-    // set texture
-    lua_pushstring(state, side.texture.c_str());
-    lua_setfield(state, -2, "texture");
-
-    if (side.extended_info) {
-        // set info
-        lua_createtable(state, 0, 3);
-        lua_pushnumber(state, side.extended_info->contents);
-        lua_setfield(state, -2, "contents");
-        lua_pushnumber(state, side.extended_info->value);
-        lua_setfield(state, -2, "value");
-        lua_pushnumber(state, side.extended_info->flags);
-        lua_setfield(state, -2, "flags");
-
-        lua_setfield(state, -2, "info");
-    }
 }
 
-static void maputil_make_brush(lua_State *state, const brush_t &brush)
+static void maputil_push_info(lua_State *state, const brush_side_t &side)
 {
-    // make sides
-    lua_createtable(state, brush.faces.size(), 0);
-
-    for (size_t s = 0; s < brush.faces.size(); s++) {
-        auto &side = brush.faces[s];
+    if (!side.extended_info) {
+        lua_pushnil(state);
+        return;
+    }
 
-        maputil_make_brush_side(state, side);
+    lua_createtable(state, 0, 3);
+    lua_pushnumber(state, side.extended_info->contents);
+    lua_setfield(state, -2, "contents");
+    lua_pushnumber(state, side.extended_info->value);
+    lua_setfield(state, -2, "value");
+    lua_pushnumber(state, side.extended_info->flags);
+    lua_setfield(state, -2, "flags");
+}
 
-        // put side into sides
-        lua_rawseti(state, -2, s + 1);
+// for the values nested in the one being assigned, which is checked with
+// maputil_check_value; the C++ objects they're copied into exist by now
+static void maputil_check_table(lua_State *state, const char *what)
+{
+    if (!lua_istable(state, -1)) {
+        maputil_error("{} must be a table, not a {}", what, luaL_typename(state, -1));
     }
 }
 
-#define LUA_VERIFY_TOP_TYPE(type) Q_assert(lua_type(state, -1) == type)
-
-static void maputil_copy_dict(lua_State *state, map_entity_t &entity)
+// the value assigned at `arg` must be a table or a proxy
+static void maputil_check_value(lua_State *state, int arg)
 {
-    LUA_VERIFY_TOP_TYPE(LUA_TTABLE);
-
-    // check for dict
-    if (lua_getfield(state, -1, "dict") == LUA_TTABLE) {
-
-        // iterate kvps
-        size_t n = 0;
-
-        while (true) {
-            lua_rawgeti(state, -1, n + 1);
-
-            if (lua_type(state, -1) == LUA_TNIL) {
-                lua_pop(state, 1);
-                break;
-            }
-
-            LUA_VERIFY_TOP_TYPE(LUA_TTABLE);
-            n++;
-
-            lua_rawgeti(state, -1, 1);
-            const char *key = lua_tostring(state, -1);
-            lua_pop(state, 1);
-            lua_rawgeti(state, -1, 2);
-            const char *value = lua_tostring(state, -1);
-            lua_pop(state, 1);
-            entity.epairs.set(key, value);
-
-            lua_pop(state, 1);
-        }
+    if (!lua_istable(state, arg) && !lua_isuserdata(state, arg)) {
+        luaL_argerror(state, arg, lua_pushfstring(state, "table or proxy expected, got %s", luaL_typename(state, arg)));
     }
-
-    lua_pop(state, 1);
 }
 
 static texdef_quake_ed_t maputil_load_quaked(lua_State *state)
@@ -467,6 +620,7 @@ static texdef_quake_ed_t maputil_load_quaked(lua_State *state)
     texdef_quake_ed_t quaked;
 
     lua_getfield(state, -1, "shift");
+    maputil_check_table(state, "shift");
     for (size_t i = 0; i < 2; i++) {
         lua_rawgeti(state, -1, i + 1);
         quaked.shift[i] = lua_tonumber(state, -1);
@@ -479,6 +633,7 @@ static texdef_quake_ed_t maputil_load_quaked(lua_State *state)
     lua_pop(state, 1);
 
     lua_getfield(state, -1, "scale");
+    maputil_check_table(state, "scale");
     for (size_t i = 0; i < 2; i++) {
         lua_rawgeti(state, -1, i + 1);
         quaked.scale[i] = lua_tonumber(state, -1);
@@ -494,9 +649,11 @@ static texdef_bp_t maputil_load_bp(lua_State *state)
     texdef_bp_t bp;
 
     lua_getfield(state, -1, "axis");
+    maputil_check_table(state, "axis");
 
     for (size_t i = 0; i < 2; i++) {
         lua_rawgeti(state, -1, i + 1);
+        maputil_check_table(state, "axis row");
 
         for (size_t v = 0; v < 3; v++) {
             lua_rawgeti(state, -1, v + 1);
@@ -512,18 +669,13 @@ static texdef_bp_t maputil_load_bp(lua_State *state)
     return bp;
 }
 
-static void maputil_copy_side(lua_State *state, brush_side_t &side)
+static void maputil_load_plane_points(lua_State *state, brush_side_t &side)
 {
-    // texture
-    lua_getfield(state, -1, "texture");
-    side.texture = lua_tostring(state, -1);
-    lua_pop(state, 1);
-
-    // plane points
-    lua_getfield(state, -1, "plane_points");
+    maputil_check_table(state, "plane_points");
 
     for (size_t i = 0; i < 3; i++) {
         lua_rawgeti(state, -1, i + 1);
+        maputil_check_table(state, "plane point");
 
         for (size_t z = 0; z < 3; z++) {
             lua_rawgeti(state, -1, z + 1);
@@ -533,18 +685,20 @@ static void maputil_copy_side(lua_State *state, brush_side_t &side)
 
         lua_pop(state, 1);
     }
+}
 
-    lua_pop(state, 1);
-
-    // raw
-    lua_getfield(state, -1, "raw");
+static void maputil_load_raw(lua_State *state, brush_side_t &side)
+{
+    maputil_check_table(state, "raw");
 
     if (lua_getfield(state, -1, "quaked") != LUA_TNIL) {
+        maputil_check_table(state, "raw.quaked");
         side.raw = maputil_load_quaked(state);
     }
     lua_pop(state, 1);
 
     if (lua_getfield(state, -1, "valve") != LUA_TNIL) {
+        maputil_check_table(state, "raw.valve");
         texdef_bp_t bp = maputil_load_bp(state);
         texdef_quake_ed_t qed = maputil_load_quaked(state);
 
@@ -553,11 +707,13 @@ static void maputil_copy_side(lua_State *state, brush_side_t &side)
     lua_pop(state, 1);
 
     if (lua_getfield(state, -1, "bp") != LUA_TNIL) {
+        maputil_check_table(state, "raw.bp");
         side.raw = maputil_load_bp(state);
     }
     lua_pop(state, 1);
 
     if (lua_getfield(state, -1, "etp") != LUA_TNIL) {
+        maputil_check_table(state, "raw.etp");
         texdef_quake_ed_t qed = maputil_load_quaked(state);
 
         lua_getfield(state, -1, "tx2");
@@ -567,179 +723,1010 @@ static void maputil_copy_side(lua_State *state, brush_side_t &side)
         side.raw = texdef_etp_t{qed, b};
     }
     lua_pop(state, 1);
+}
 
-    lua_pop(state, 1);
+static void maputil_load_info(lua_State *state, brush_side_t &side)
+{
+    if (lua_type(state, -1) != LUA_TTABLE) {
+        side.extended_info = std::nullopt;
+        return;
+    }
 
-    // extra info
-    lua_getfield(state, -1, "info");
+    texinfo_quake2_t q2;
 
-    if (lua_type(state, -1) == LUA_TTABLE) {
-        texinfo_quake2_t q2;
+    lua_getfield(state, -1, "contents");
+    q2.contents = lua_tonumber(state, -1);
+    lua_pop(state, 1);
 
-        lua_getfield(state, -1, "contents");
-        q2.contents = lua_tonumber(state, -1);
-        lua_pop(state, 1);
+    lua_getfield(state, -1, "value");
+    q2.value = lua_tonumber(state, -1);
+    lua_pop(state, 1);
 
-        lua_getfield(state, -1, "value");
-        q2.value = lua_tonumber(state, -1);
-        lua_pop(state, 1);
+    lua_getfield(state, -1, "flags");
+    q2.flags = lua_tonumber(state, -1);
+    lua_pop(state, 1);
 
-        lua_getfield(state, -1, "flags");
-        q2.flags = lua_tonumber(state, -1);
-        lua_pop(state, 1);
+    side.extended_info = q2;
+}
 
-        side.extended_info = q2;
+// calls `f(first, last)` on the ranges of `elements`, a set or map keyed
+// by proxy, that hold `outer` and the elements inside it
+template<typename T, typename F>
+static void maputil_for_each_contained(T &elements, const maputil_proxy_t &outer, F f)
+{
+    // the elements of `type` in the entity, or in the brush if `in_brush`
+    auto range = [&elements, &outer, &f](maputil_proxy_type_t type, bool in_brush) {
+        const maputil_proxy_t first{type, outer.entity, in_brush ? outer.index : 0};
+        const maputil_proxy_t last =
+            in_brush ? maputil_proxy_t{type, outer.entity, outer.index + 1} : maputil_proxy_t{type, outer.entity + 1};
+        f(elements.lower_bound(first), elements.lower_bound(last));
+    };
+
+    switch (outer.type) {
+        case maputil_proxy_type_t::entities: f(elements.begin(), elements.end()); break;
+        case maputil_proxy_type_t::entity:
+            range(maputil_proxy_type_t::entity, false);
+            range(maputil_proxy_type_t::pair, false);
+            range(maputil_proxy_type_t::brush, false);
+            range(maputil_proxy_type_t::side, false);
+            break;
+        case maputil_proxy_type_t::dict: range(maputil_proxy_type_t::pair, false); break;
+        case maputil_proxy_type_t::brushes:
+            range(maputil_proxy_type_t::brush, false);
+            range(maputil_proxy_type_t::side, false);
+            break;
+        case maputil_proxy_type_t::brush:
+            range(maputil_proxy_type_t::brush, true);
+            range(maputil_proxy_type_t::side, true);
+            break;
+        default: f(elements.lower_bound(outer), elements.upper_bound(outer)); break;
     }
+}
 
-    lua_pop(state, 1);
+static void maputil_unref_fields(lua_State *state, const maputil_side_fields_t &fields)
+{
+    luaL_unref(state, LUA_REGISTRYINDEX, fields.plane_points);
+    luaL_unref(state, LUA_REGISTRYINDEX, fields.raw);
+    luaL_unref(state, LUA_REGISTRYINDEX, fields.info);
 }
 
-static void maputil_copy_brush(lua_State *state, brush_t &brush)
+// drops what's kept about `outer` and the elements inside it, which are
+// being replaced or removed
+static void maputil_forget(lua_State *state, const maputil_proxy_t &outer)
 {
-    // count sides
-    size_t num_sides = lua_count_array(state);
-    brush.faces.resize(num_sides);
+    maputil_for_each_contained(
+        maputil_removed, outer, [](auto first, auto last) { maputil_removed.erase(first, last); });
 
-    // iterate brushes
-    lua_iterate_array(state, [&brush](auto state, auto index) {
-        brush_side_t &side = brush.faces[index];
-        maputil_copy_side(state, side);
-        return true;
+    maputil_for_each_contained(maputil_side_fields, outer, [state](auto first, auto last) {
+        for (auto it = first; it != last; ++it) {
+            maputil_unref_fields(state, it->second);
+        }
+
+        maputil_side_fields.erase(first, last);
     });
 }
 
-static void maputil_copy_brushes(lua_State *state, map_entity_t &entity)
+static void maputil_remove(lua_State *state, const maputil_proxy_t &element)
+{
+    maputil_forget(state, element);
+    maputil_removed.insert(element);
+}
+
+static void maputil_flush_side(lua_State *state, const maputil_proxy_t &proxy, brush_side_t &side)
 {
-    LUA_VERIFY_TOP_TYPE(LUA_TTABLE);
+    auto it = maputil_side_fields.find(proxy);
+
+    if (it == maputil_side_fields.end()) {
+        return;
+    }
 
-    // check for dict
-    if (lua_getfield(state, -1, "brushes") == LUA_TTABLE) {
+    const maputil_side_fields_t &fields = it->second;
 
-        // count brushes
-        size_t num_brushes = lua_count_array(state);
-        entity.brushes.resize(num_brushes);
+    if (fields.plane_points != LUA_NOREF) {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, fields.plane_points);
+        maputil_load_plane_points(state, side);
+        lua_pop(state, 1);
+    }
 
-        // iterate brushes
-        lua_iterate_array(state, [&entity](auto state, auto index) {
-            brush_t &brush = entity.brushes[index];
-            maputil_copy_brush(state, brush);
-            return true;
-        });
+    if (fields.raw != LUA_NOREF) {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, fields.raw);
+        maputil_load_raw(state, side);
+        lua_pop(state, 1);
     }
 
-    lua_pop(state, 1);
+    if (fields.info != LUA_NOREF) {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, fields.info);
+        maputil_load_info(state, side);
+        lua_pop(state, 1);
+    }
 }
 
-static int l_commit_map(lua_State *state)
+// writes back the field tables of the sides inside `outer`
+static void maputil_flush_sides(lua_State *state, const maputil_proxy_t &outer)
+{
+    maputil_for_each_contained(maputil_side_fields, outer, [state](auto first, auto last) {
+        for (auto it = first; it != last; ++it) {
+            maputil_side(state, it->first);
+        }
+    });
+}
+
+// pushes the table kept for the plane_points, raw or info of a side,
+// building it the first time
+static void maputil_push_side_field(
+    lua_State *state, const maputil_proxy_t &proxy, const brush_side_t &side, const char *key)
 {
-    map_file.entities.clear();
+    maputil_side_fields_t &fields = maputil_side_fields[proxy];
+    int &ref = !strcmp(key, "plane_points") ? fields.plane_points : !strcmp(key, "raw") ? fields.raw : fields.info;
 
-    // verify entities global
-    lua_getglobal(state, "entities");
+    if (ref != LUA_NOREF) {
+        lua_rawgeti(state, LUA_REGISTRYINDEX, ref);
+        return;
+    }
+
+    if (&ref == &fields.plane_points) {
+        maputil_push_plane_points(state, side);
+    } else if (&ref == &fields.raw) {
+        maputil_push_raw(state, side);
+    } else {
+        maputil_push_info(state, side);
 
-    LUA_VERIFY_TOP_TYPE(LUA_TTABLE);
+        if (lua_isnil(state, -1)) {
+            return;
+        }
+    }
 
-    // count entities
-    size_t num_entities = lua_count_array(state);
+    lua_pushvalue(state, -1);
+    ref = luaL_ref(state, LUA_REGISTRYINDEX);
+}
 
-    // create entities
-    map_file.entities.resize(num_entities);
+// erases the elements of `array` that were removed; `element` is the
+// proxy of the one at an index
+template<typename T, typename F>
+static void maputil_erase_removed(T &array, F element)
+{
+    for (size_t i = array.size(); i-- > 0;) {
+        if (maputil_is_removed(element(i))) {
+            array.erase(array.begin() + i);
+        }
+    }
+}
 
-    for (size_t i = 0; i < num_entities; i++) {
-        auto &entity = map_file.entities[i];
+static void maputil_compact_dict(entdict_t &epairs, size_t entity)
+{
+    maputil_erase_removed(
+        epairs, [entity](size_t i) { return maputil_proxy_t{maputil_proxy_type_t::pair, entity, i}; });
+}
 
-        lua_rawgeti(state, -1, i + 1);
+static void maputil_compact_brush(brush_t &brush, size_t entity, size_t index)
+{
+    maputil_erase_removed(brush.faces,
+        [entity, index](size_t i) { return maputil_proxy_t{maputil_proxy_type_t::side, entity, index, i}; });
+}
 
-        maputil_copy_dict(state, entity);
+static void maputil_compact_brushes(std::vector<brush_t> &brushes, size_t entity)
+{
+    for (size_t i = 0; i < brushes.size(); i++) {
+        maputil_compact_brush(brushes[i], entity, i);
+    }
 
-        maputil_copy_brushes(state, entity);
+    maputil_erase_removed(
+        brushes, [entity](size_t i) { return maputil_proxy_t{maputil_proxy_type_t::brush, entity, i}; });
+}
 
-        lua_pop(state, 1);
+// erases everything that was removed, now that there are no proxies left
+// to see the indices shift
+static void maputil_compact_map()
+{
+    for (size_t i = 0; i < map_file.entities.size(); i++) {
+        maputil_compact_dict(map_file.entities[i].epairs, i);
+        maputil_compact_brushes(map_file.entities[i].brushes, i);
     }
 
-    lua_pop(state, 1);
+    maputil_erase_removed(
+        map_file.entities, [](size_t i) { return maputil_proxy_t{maputil_proxy_type_t::entity, i}; });
 
-    return 0;
+    maputil_removed.clear();
 }
 
-static inline qplane3d pop_plane_from_side(lua_State *state)
+/*
+ * The maputil_copy_* functions read the value on top of the stack, which
+ * can be a table in the layout above or the matching proxy, into `out`.
+ */
+
+static void maputil_copy_pair(lua_State *state, keyvalue_t &out)
 {
-    qplane3d plane;
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::pair)) {
+        out = maputil_pair(state, *proxy);
+        return;
+    }
 
-    lua_getfield(state, -1, "plane");
+    maputil_check_table(state, "dict entry");
 
-    for (size_t i = 0; i < 3; i++) {
-        lua_rawgeti(state, -1, i + 1);
-        plane.normal[i] = lua_tonumber(state, -1);
-        lua_pop(state, 1);
+    lua_rawgeti(state, -1, 1);
+    lua_rawgeti(state, -2, 2);
+    const char *key = lua_tostring(state, -2);
+    const char *value = lua_tostring(state, -1);
+
+    if (!key || !value) {
+        maputil_error("dict entries must be [ key, value ]");
     }
-    lua_rawgeti(state, -1, 4);
-    plane.dist = lua_tonumber(state, -1);
-    lua_pop(state, 1);
 
-    lua_pop(state, 1);
+    out = {key, value};
+    lua_pop(state, 2);
+}
 
-    return plane;
+static void maputil_copy_dict(lua_State *state, entdict_t &out)
+{
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::dict)) {
+        out = maputil_entity(state, *proxy).epairs;
+        maputil_compact_dict(out, proxy->entity);
+        return;
+    }
+
+    maputil_check_table(state, "dict");
+
+    lua_iterate_array(state, [&out](auto state, auto index) {
+        keyvalue_t pair;
+        maputil_copy_pair(state, pair);
+        out.set(pair.first, pair.second);
+        return true;
+    });
 }
 
-static int l_create_winding(lua_State *state)
+static void maputil_copy_side(lua_State *state, brush_side_t &out)
 {
-    // -3 = face
-    // -2 = brush
-    // -1 = extents
-    bool found_face = false;
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::side)) {
+        out = maputil_side(state, *proxy);
+        return;
+    }
 
-    double extents = lua_tonumber(state, -1);
-    lua_pop(state, 1);
+    maputil_check_table(state, "side");
 
-    lua_pushvalue(state, -2);
-    qplane3d side_plane = pop_plane_from_side(state);
+    // texture
+    lua_getfield(state, -1, "texture");
+    if (!lua_isstring(state, -1)) {
+        maputil_error("side texture must be a string, not a {}", luaL_typename(state, -1));
+    }
+    out.texture = lua_tostring(state, -1);
     lua_pop(state, 1);
 
-    using winding_t = polylib::winding_base_t<polylib::winding_storage_hybrid_t<double, 16>>;
-    std::optional<winding_t> winding = winding_t::from_plane(side_plane, extents);
+    // plane points
+    lua_getfield(state, -1, "plane_points");
+    maputil_load_plane_points(state, out);
+    lua_pop(state, 1);
 
-    // loop through sides on brush
-    {
-        if (lua_type(state, -1) == LUA_TTABLE) {
-            lua_iterate_array(state, [&found_face, &winding](auto state, auto index) {
-                LUA_VERIFY_TOP_TYPE(LUA_TTABLE);
-
-                // check that the face is part of the brush
-                if (lua_rawequal(state, -1, -3)) {
-                    found_face = true;
-                } else if (winding) {
-                    qplane3d plane = pop_plane_from_side(state);
-                    winding = winding->clip_front(-plane, 0.0f);
-                }
+    // raw
+    lua_getfield(state, -1, "raw");
+    maputil_load_raw(state, out);
+    lua_pop(state, 1);
 
-                return true;
-            });
-        }
+    // extra info
+    lua_getfield(state, -1, "info");
+    maputil_load_info(state, out);
+    lua_pop(state, 1);
+}
 
-        lua_pop(state, 1);
+static void maputil_copy_brush(lua_State *state, brush_t &out)
+{
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::brush)) {
+        maputil_flush_sides(state, *proxy);
+        out = maputil_brush(state, *proxy);
+        maputil_compact_brush(out, proxy->entity, proxy->index);
+        return;
     }
 
-    if (!winding) {
-        lua_pushnil(state);
-    } else {
-        lua_createtable(state, winding->size(), 0);
+    maputil_check_table(state, "brush");
 
-        for (size_t i = 0; i < winding->size(); i++) {
-            lua_createtable(state, 3, 0);
+    // count sides
+    size_t num_sides = lua_count_array(state);
+    out.faces.resize(num_sides);
 
-            auto &p = winding->at(i);
-            for (size_t v = 0; v < 3; v++) {
-                lua_pushnumber(state, p[v]);
-                lua_rawseti(state, -2, v + 1);
-            }
+    // iterate sides
+    lua_iterate_array(state, [&out](auto state, auto index) {
+        maputil_copy_side(state, out.faces[index]);
+        return true;
+    });
+}
 
-            lua_rawseti(state, -2, i + 1);
-        }
+static void maputil_copy_brushes(lua_State *state, std::vector<brush_t> &out)
+{
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::brushes)) {
+        maputil_flush_sides(state, *proxy);
+        out = maputil_entity(state, *proxy).brushes;
+        maputil_compact_brushes(out, proxy->entity);
+        return;
     }
 
-    return 1;
-}
+    maputil_check_table(state, "brushes");
+
+    // count brushes
+    size_t num_brushes = lua_count_array(state);
+    out.resize(num_brushes);
+
+    // iterate brushes
+    lua_iterate_array(state, [&out](auto state, auto index) {
+        maputil_copy_brush(state, out[index]);
+        return true;
+    });
+}
+
+static void maputil_copy_entity(lua_State *state, map_entity_t &out)
+{
+    if (auto *proxy = maputil_test_proxy(state, -1, maputil_proxy_type_t::entity)) {
+        maputil_flush_sides(state, *proxy);
+        out = maputil_entity(state, *proxy);
+        maputil_compact_dict(out.epairs, proxy->entity);
+        maputil_compact_brushes(out.brushes, proxy->entity);
+        return;
+    }
+
+    maputil_check_table(state, "entity");
+
+    if (lua_getfield(state, -1, "dict") != LUA_TNIL) {
+        maputil_copy_dict(state, out.epairs);
+    }
+    lua_pop(state, 1);
+
+    if (lua_getfield(state, -1, "brushes") != LUA_TNIL) {
+        maputil_copy_brushes(state, out.brushes);
+    }
+    lua_pop(state, 1);
+}
+
+// array[key] = value for the arrays of proxies; nil removes, #array + 1
+// appends. `element` is the proxy of the element at an index
+template<typename T, typename F>
+static int maputil_array_newindex(
+    lua_State *state, std::vector<T> &array, void (*copy)(lua_State *, T &), F element)
+{
+    size_t index;
+
+    if (!maputil_array_key(state, 2, array.size() + 1, index)) {
+        return luaL_error(state, "index must be between 1 and %d", static_cast<int>(array.size() + 1));
+    }
+
+    if (lua_isnil(state, 3)) {
+        if (index < array.size()) {
+            maputil_remove(state, element(index));
+        }
+        return 0;
+    }
+
+    maputil_check_value(state, 3);
+
+    // copied first, since it may be read from `array` itself
+    T value;
+    lua_pushvalue(state, 3);
+    copy(state, value);
+    lua_pop(state, 1);
+
+    maputil_forget(state, element(index));
+
+    if (index == array.size()) {
+        array.push_back(std::move(value));
+    } else {
+        array[index] = std::move(value);
+    }
+
+    return 0;
+}
+
+// __pairs for the arrays of proxies, going through __index and skipping
+// the removed elements, like pairs skips the holes in a table
+static int l_array_next(lua_State *state)
+{
+    lua_Integer len = luaL_len(state, 1);
+
+    for (lua_Integer i = luaL_checkinteger(state, 2) + 1; i <= len; i++) {
+        lua_pushinteger(state, i);
+
+        if (lua_geti(state, 1, i) != LUA_TNIL) {
+            return 2;
+        }
+
+        lua_pop(state, 2);
+    }
+
+    return 0;
+}
+
+static int l_array_pairs(lua_State *state)
+{
+    lua_pushcfunction(state, l_array_next);
+    lua_pushvalue(state, 1);
+    lua_pushinteger(state, 0);
+    return 3;
+}
+
+static int l_proxy_eq(lua_State *state)
+{
+    for (size_t type = 0; type < std::size(maputil_proxy_names); type++) {
+        auto *a = maputil_test_proxy(state, 1, static_cast<maputil_proxy_type_t>(type));
+        auto *b = maputil_test_proxy(state, 2, static_cast<maputil_proxy_type_t>(type));
+
+        if (a || b) {
+            lua_pushboolean(state, a && b && *a == *b);
+            return 1;
+        }
+    }
+
+    lua_pushboolean(state, false);
+    return 1;
+}
+
+static int l_entities_index(lua_State *state)
+{
+    size_t index;
+
+    if (maputil_array_key(state, 2, map_file.entities.size(), index) &&
+        !maputil_is_removed({maputil_proxy_type_t::entity, index})) {
+        maputil_push_proxy(state, {maputil_proxy_type_t::entity, index});
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_entities_newindex(lua_State *state)
+{
+    return maputil_array_newindex(state, map_file.entities, maputil_copy_entity,
+        [](size_t index) { return maputil_proxy_t{maputil_proxy_type_t::entity, index}; });
+}
+
+static int l_entities_len(lua_State *state)
+{
+    lua_pushinteger(state, map_file.entities.size());
+    return 1;
+}
+
+static int l_entity_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::entity);
+    map_entity_t &entity = maputil_entity(state, proxy);
+    const char *key = lua_tostring(state, 2);
+
+    // like the tables these replaced, there's no dict or brushes if they're empty
+    if (key && !strcmp(key, "dict") && entity.epairs.size()) {
+        maputil_push_proxy(state, {maputil_proxy_type_t::dict, proxy.entity});
+    } else if (key && !strcmp(key, "brushes") && !entity.brushes.empty()) {
+        maputil_push_proxy(state, {maputil_proxy_type_t::brushes, proxy.entity});
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_entity_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::entity);
+    const char *key = lua_tostring(state, 2);
+
+    if (key && (!strcmp(key, "dict") || !strcmp(key, "brushes")) && !lua_isnil(state, 3)) {
+        maputil_check_value(state, 3);
+    }
+
+    if (key && !strcmp(key, "dict")) {
+        entdict_t epairs;
+
+        if (!lua_isnil(state, 3)) {
+            lua_pushvalue(state, 3);
+            maputil_copy_dict(state, epairs);
+            lua_pop(state, 1);
+        }
+
+        maputil_forget(state, {maputil_proxy_type_t::dict, proxy.entity});
+        maputil_entity(state, proxy).epairs = std::move(epairs);
+    } else if (key && !strcmp(key, "brushes")) {
+        std::vector<brush_t> brushes;
+
+        if (!lua_isnil(state, 3)) {
+            lua_pushvalue(state, 3);
+            maputil_copy_brushes(state, brushes);
+            lua_pop(state, 1);
+        }
+
+        maputil_forget(state, {maputil_proxy_type_t::brushes, proxy.entity});
+        maputil_entity(state, proxy).brushes = std::move(brushes);
+    } else {
+        return luaL_error(state, "entities only have dict and brushes");
+    }
+
+    return 0;
+}
+
+// the value of `key` in the epairs of `entity`, unless it was removed
+static const std::string *maputil_get_key(size_t entity, entdict_t &epairs, const char *key)
+{
+    auto it = epairs.find(key);
+
+    if (it == epairs.end() ||
+        maputil_is_removed({maputil_proxy_type_t::pair, entity, static_cast<size_t>(it - epairs.begin())})) {
+        return nullptr;
+    }
+
+    return &it->second;
+}
+
+// sets `key` in the epairs of `entity`; a null `value` removes it
+static void maputil_set_key(lua_State *state, size_t entity, entdict_t &epairs, const char *key, const char *value)
+{
+    if (!value) {
+        if (auto it = epairs.find(key); it != epairs.end()) {
+            maputil_remove(state, {maputil_proxy_type_t::pair, entity, static_cast<size_t>(it - epairs.begin())});
+        }
+
+        return;
+    }
+
+    epairs.set(key, value);
+
+    // in case the key was removed before
+    maputil_forget(
+        state, {maputil_proxy_type_t::pair, entity, static_cast<size_t>(epairs.find(key) - epairs.begin())});
+}
+
+static int l_dict_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::dict);
+    map_entity_t &entity = maputil_entity(state, proxy);
+    size_t index;
+
+    if (maputil_array_key(state, 2, entity.epairs.size(), index)) {
+        if (maputil_is_removed({maputil_proxy_type_t::pair, proxy.entity, index})) {
+            lua_pushnil(state);
+        } else {
+            maputil_push_proxy(state, {maputil_proxy_type_t::pair, proxy.entity, index});
+        }
+    } else if (lua_type(state, 2) != LUA_TSTRING) {
+        lua_pushnil(state);
+    } else if (const std::string *value = maputil_get_key(proxy.entity, entity.epairs, lua_tostring(state, 2))) {
+        lua_pushstring(state, value->c_str());
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_dict_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::dict);
+    entdict_t &epairs = maputil_entity(state, proxy).epairs;
+
+    // by key
+    if (lua_type(state, 2) == LUA_TSTRING) {
+        maputil_set_key(state, proxy.entity, epairs, lua_tostring(state, 2),
+            lua_isnil(state, 3) ? nullptr : luaL_checkstring(state, 3));
+        return 0;
+    }
+
+    // by index
+    size_t index;
+
+    if (!maputil_array_key(state, 2, epairs.size() + 1, index)) {
+        return luaL_error(state, "index must be between 1 and %d", static_cast<int>(epairs.size() + 1));
+    }
+
+    if (lua_isnil(state, 3)) {
+        if (index < epairs.size()) {
+            maputil_remove(state, {maputil_proxy_type_t::pair, proxy.entity, index});
+        }
+        return 0;
+    }
+
+    maputil_check_value(state, 3);
+
+    keyvalue_t pair;
+    lua_pushvalue(state, 3);
+    maputil_copy_pair(state, pair);
+    lua_pop(state, 1);
+
+    if (index == epairs.size()) {
+        maputil_set_key(state, proxy.entity, epairs, pair.first.c_str(), pair.second.c_str());
+    } else {
+        maputil_forget(state, {maputil_proxy_type_t::pair, proxy.entity, index});
+        *(epairs.begin() + index) = std::move(pair);
+    }
+
+    return 0;
+}
+
+static int l_dict_len(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::dict);
+    lua_pushinteger(state, maputil_entity(state, proxy).epairs.size());
+    return 1;
+}
+
+static int l_pair_index(lua_State *state)
+{
+    const keyvalue_t &pair = maputil_pair(state, maputil_check_proxy(state, 1, maputil_proxy_type_t::pair));
+    size_t index;
+
+    if (maputil_array_key(state, 2, 2, index)) {
+        lua_pushstring(state, index == 0 ? pair.first.c_str() : pair.second.c_str());
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_pair_newindex(lua_State *state)
+{
+    keyvalue_t &pair = maputil_pair(state, maputil_check_proxy(state, 1, maputil_proxy_type_t::pair));
+    size_t index;
+
+    if (!maputil_array_key(state, 2, 2, index)) {
+        return luaL_error(state, "dict entries are [ key, value ]");
+    }
+
+    (index == 0 ? pair.first : pair.second) = luaL_checkstring(state, 3);
+    return 0;
+}
+
+static int l_pair_len(lua_State *state)
+{
+    maputil_pair(state, maputil_check_proxy(state, 1, maputil_proxy_type_t::pair));
+    lua_pushinteger(state, 2);
+    return 1;
+}
+
+static int l_brushes_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brushes);
+    size_t index;
+
+    if (maputil_array_key(state, 2, maputil_entity(state, proxy).brushes.size(), index) &&
+        !maputil_is_removed({maputil_proxy_type_t::brush, proxy.entity, index})) {
+        maputil_push_proxy(state, {maputil_proxy_type_t::brush, proxy.entity, index});
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_brushes_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brushes);
+    return maputil_array_newindex(state, maputil_entity(state, proxy).brushes, maputil_copy_brush,
+        [&proxy](size_t index) { return maputil_proxy_t{maputil_proxy_type_t::brush, proxy.entity, index}; });
+}
+
+static int l_brushes_len(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brushes);
+    lua_pushinteger(state, maputil_entity(state, proxy).brushes.size());
+    return 1;
+}
+
+static int l_brush_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brush);
+    size_t index;
+
+    if (maputil_array_key(state, 2, maputil_brush(state, proxy).faces.size(), index) &&
+        !maputil_is_removed({maputil_proxy_type_t::side, proxy.entity, proxy.index, index})) {
+        maputil_push_proxy(state, {maputil_proxy_type_t::side, proxy.entity, proxy.index, index});
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_brush_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brush);
+    return maputil_array_newindex(state, maputil_brush(state, proxy).faces, maputil_copy_side, [&proxy](size_t index) {
+        return maputil_proxy_t{maputil_proxy_type_t::side, proxy.entity, proxy.index, index};
+    });
+}
+
+static int l_brush_len(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::brush);
+    lua_pushinteger(state, maputil_brush(state, proxy).faces.size());
+    return 1;
+}
+
+static int l_side_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::side);
+    const brush_side_t &side = maputil_side(state, proxy);
+    const char *key = lua_tostring(state, 2);
+
+    if (!key) {
+        lua_pushnil(state);
+    } else if (!strcmp(key, "texture")) {
+        lua_pushstring(state, side.texture.c_str());
+    } else if (!strcmp(key, "plane_points") || !strcmp(key, "raw") || !strcmp(key, "info")) {
+        maputil_push_side_field(state, proxy, side, key);
+    } else if (!strcmp(key, "plane")) {
+        maputil_push_plane(state, side);
+    } else if (!strcmp(key, "vecs")) {
+        maputil_push_vecs(state, side);
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_side_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::side);
+    brush_side_t &side = maputil_side(state, proxy);
+    const char *key = lua_tostring(state, 2);
+
+    if (key && !strcmp(key, "texture")) {
+        side.texture = luaL_checkstring(state, 3);
+        return 0;
+    } else if (key && (!strcmp(key, "plane") || !strcmp(key, "vecs"))) {
+        return luaL_error(state, "%s is read-only", key);
+    } else if (!key || (strcmp(key, "plane_points") && strcmp(key, "raw") && strcmp(key, "info"))) {
+        return luaL_error(state, "sides only have texture, plane_points, raw, info, plane and vecs");
+    }
+
+    maputil_side_fields_t &fields = maputil_side_fields[proxy];
+    int &ref = !strcmp(key, "plane_points") ? fields.plane_points : !strcmp(key, "raw") ? fields.raw : fields.info;
+
+    luaL_unref(state, LUA_REGISTRYINDEX, ref);
+    ref = LUA_NOREF;
+
+    if (&ref == &fields.info && lua_isnil(state, 3)) {
+        side.extended_info = std::nullopt;
+        return 0;
+    }
+
+    luaL_checktype(state, 3, LUA_TTABLE);
+    lua_pushvalue(state, 3);
+
+    if (&ref == &fields.plane_points) {
+        maputil_load_plane_points(state, side);
+    } else if (&ref == &fields.raw) {
+        maputil_load_raw(state, side);
+    } else {
+        maputil_load_info(state, side);
+    }
+
+    // the table is kept like one that was read, so later edits to it count
+    ref = luaL_ref(state, LUA_REGISTRYINDEX);
+    return 0;
+}
+
+static int l_keys_index(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::keys);
+    entdict_t &epairs = maputil_entity(state, proxy).epairs;
+    const char *key = lua_tostring(state, 2);
+
+    if (const std::string *value = key ? maputil_get_key(proxy.entity, epairs, key) : nullptr) {
+        lua_pushstring(state, value->c_str());
+    } else {
+        lua_pushnil(state);
+    }
+
+    return 1;
+}
+
+static int l_keys_newindex(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::keys);
+    entdict_t &epairs = maputil_entity(state, proxy).epairs;
+    const char *key = luaL_checkstring(state, 2);
+
+    maputil_set_key(state, proxy.entity, epairs, key, lua_isnil(state, 3) ? nullptr : luaL_checkstring(state, 3));
+    return 0;
+}
+
+// upvalue 1 is the index of the next pair
+static int l_keys_next(lua_State *state)
+{
+    const maputil_proxy_t &proxy = maputil_check_proxy(state, 1, maputil_proxy_type_t::keys);
+    entdict_t &epairs = maputil_entity(state, proxy).epairs;
+    lua_Integer index = lua_tointeger(state, lua_upvalueindex(1));
+
+    while (index >= 0 && static_cast<size_t>(index) < epairs.size() &&
+           maputil_is_removed({maputil_proxy_type_t::pair, proxy.entity, static_cast<size_t>(index)})) {
+        index++;
+    }
+
+    if (index < 0 || static_cast<size_t>(index) >= epairs.size()) {
+        return 0;
+    }
+
+    lua_pushinteger(state, index + 1);
+    lua_replace(state, lua_upvalueindex(1));
+
+    const keyvalue_t &pair = *(epairs.begin() + index);
+    lua_pushstring(state, pair.first.c_str());
+    lua_pushstring(state, pair.second.c_str());
+    return 2;
+}
+
+static int l_keys_pairs(lua_State *state)
+{
+    lua_pushinteger(state, 0);
+    lua_pushcclosure(state, maputil_lua_function<l_keys_next>, 1);
+    lua_pushvalue(state, 1);
+    lua_pushnil(state);
+    return 3;
+}
+
+static void maputil_register_proxies(lua_State *state)
+{
+#define L(f) maputil_lua_function<f>
+    static const luaL_Reg entities_meta[] = {{"__index", L(l_entities_index)}, {"__newindex", L(l_entities_newindex)},
+        {"__len", L(l_entities_len)}, {"__pairs", l_array_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg entity_meta[] = {{"__index", L(l_entity_index)}, {"__newindex", L(l_entity_newindex)},
+        {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg dict_meta[] = {{"__index", L(l_dict_index)}, {"__newindex", L(l_dict_newindex)},
+        {"__len", L(l_dict_len)}, {"__pairs", l_array_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg pair_meta[] = {{"__index", L(l_pair_index)}, {"__newindex", L(l_pair_newindex)},
+        {"__len", L(l_pair_len)}, {"__pairs", l_array_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg brushes_meta[] = {{"__index", L(l_brushes_index)}, {"__newindex", L(l_brushes_newindex)},
+        {"__len", L(l_brushes_len)}, {"__pairs", l_array_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg brush_meta[] = {{"__index", L(l_brush_index)}, {"__newindex", L(l_brush_newindex)},
+        {"__len", L(l_brush_len)}, {"__pairs", l_array_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg side_meta[] = {{"__index", L(l_side_index)}, {"__newindex", L(l_side_newindex)},
+        {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+    static const luaL_Reg keys_meta[] = {{"__index", L(l_keys_index)}, {"__newindex", L(l_keys_newindex)},
+        {"__pairs", l_keys_pairs}, {"__eq", l_proxy_eq}, {nullptr, nullptr}};
+#undef L
+
+    // in maputil_proxy_type_t order
+    static const luaL_Reg *const metas[] = {
+        entities_meta, entity_meta, dict_meta, pair_meta, brushes_meta, brush_meta, side_meta, keys_meta};
+
+    for (size_t type = 0; type < std::size(metas); type++) {
+        luaL_newmetatable(state, maputil_proxy_names[type]);
+        luaL_setfuncs(state, metas[type], 0);
+        lua_pop(state, 1);
+    }
+}
+
+static int l_commit_map(lua_State *state)
+{
+    lua_getglobal(state, "entities");
+
+    // edits made through the proxies are already in map_file
+    if (maputil_test_proxy(state, -1, maputil_proxy_type_t::entities)) {
+        lua_pop(state, 1);
+        return 0;
+    }
+
+    // verify entities global
+    if (!lua_istable(state, -1)) {
+        return luaL_error(state, "entities must be a table, not a %s", luaL_typename(state, -1));
+    }
+
+    // the table can hold proxies of the current entities, so
+    // build the new ones before replacing them
+    std::vector<map_entity_t> entities(lua_count_array(state));
+
+    lua_iterate_array(state, [&entities](auto state, auto index) {
+        maputil_copy_entity(state, entities[index]);
+        return true;
+    });
+
+    lua_pop(state, 1);
+
+    maputil_forget(state, {maputil_proxy_type_t::entities});
+    map_file.entities = std::move(entities);
+
+    return 0;
+}
+
+// writes back the field tables of every side, once the script is done
+static int l_flush_sides(lua_State *state)
+{
+    maputil_flush_sides(state, {maputil_proxy_type_t::entities});
+    return 0;
+}
+
+// the plane of a side table or proxy at `index`
+static qplane3d maputil_side_plane(lua_State *state, int index)
+{
+    if (auto *proxy = maputil_test_proxy(state, index, maputil_proxy_type_t::side)) {
+        return maputil_side(state, *proxy).plane;
+    }
+
+    if (!lua_istable(state, index)) {
+        maputil_error("sides must be tables or proxies, not a {}", luaL_typename(state, index));
+    }
+
+    qplane3d plane;
+
+    lua_getfield(state, index, "plane");
+    maputil_check_table(state, "plane");
+
+    for (size_t i = 0; i < 3; i++) {
+        lua_rawgeti(state, -1, i + 1);
+        plane.normal[i] = lua_tonumber(state, -1);
+        lua_pop(state, 1);
+    }
+    lua_rawgeti(state, -1, 4);
+    plane.dist = lua_tonumber(state, -1);
+    lua_pop(state, 1);
+
+    lua_pop(state, 1);
+
+    return plane;
+}
+
+static int l_create_winding(lua_State *state)
+{
+    // 1 = face
+    // 2 = brush
+    // 3 = extents
+    double extents = lua_tonumber(state, 3);
+
+    const maputil_proxy_t *brush = maputil_test_proxy(state, 2, maputil_proxy_type_t::brush);
+
+    if (!brush && !lua_isnil(state, 2)) {
+        luaL_checktype(state, 2, LUA_TTABLE);
+    }
+
+    qplane3d side_plane = maputil_side_plane(state, 1);
+
+    using winding_t = polylib::winding_base_t<polylib::winding_storage_hybrid_t<double, 16>>;
+    std::optional<winding_t> winding = winding_t::from_plane(side_plane, extents);
+
+    // loop through sides on brush; a proxy is read directly, since indexing
+    // it through Lua could raise an error past the winding
+    if (brush) {
+        const maputil_proxy_t *face = maputil_test_proxy(state, 1, maputil_proxy_type_t::side);
+        const size_t num_sides = maputil_brush(state, *brush).faces.size();
+
+        for (size_t i = 0; i < num_sides && winding; i++) {
+            const maputil_proxy_t side{maputil_proxy_type_t::side, brush->entity, brush->index, i};
+
+            // skip the face itself, and the removed ones
+            if (!maputil_is_removed(side) && !(face && *face == side)) {
+                winding = winding->clip_front(-maputil_side(state, side).plane, 0.0f);
+            }
+        }
+    } else if (!lua_isnil(state, 2)) {
+        lua_Integer num_sides = lua_rawlen(state, 2);
+
+        for (lua_Integer i = 1; i <= num_sides && winding; i++) {
+            lua_rawgeti(state, 2, i);
+
+            // skip the face itself
+            if (!lua_isnil(state, -1) && !lua_compare(state, -1, 1, LUA_OPEQ)) {
+                qplane3d plane = maputil_side_plane(state, lua_gettop(state));
+                winding = winding->clip_front(-plane, 0.0f);
+            }
+
+            lua_pop(state, 1);
+        }
+    }
+
+    if (!winding) {
+        lua_pushnil(state);
+    } else {
+        lua_createtable(state, winding->size(), 0);
+
+        for (size_t i = 0; i < winding->size(); i++) {
+            lua_createtable(state, 3, 0);
+
+            auto &p = winding->at(i);
+            for (size_t v = 0; v < 3; v++) {
+                lua_pushnumber(state, p[v]);
+                lua_rawseti(state, -2, v + 1);
+            }
+
+            lua_rawseti(state, -2, i + 1);
+        }
+    }
+
+    return 1;
+}
 
 static int l_load_texture_meta(lua_State *state)
 {
@@ -774,10 +1761,10 @@ static void maputil_setup_globals(lua_State *state)
     lua_pushcfunction(state, l_load_json);
     lua_setglobal(state, "load_json");
 
-    lua_pushcfunction(state, l_commit_map);
+    lua_pushcfunction(state, maputil_lua_function<l_commit_map>);
     lua_setglobal(state, "commit_map");
 
-    lua_pushcfunction(state, l_create_winding);
+    lua_pushcfunction(state, maputil_lua_function<l_create_winding>);
     lua_setglobal(state, "create_winding");
 
     lua_pushcfunction(state, l_load_texture_meta);
@@ -793,57 +1780,10 @@ static void maputil_setup_globals(lua_State *state)
     lua_pushnumber(state, (int32_t)texcoord_style_t::brush_primitives);
     lua_setglobal(state, "TEXCOORD_BP");
 
-    // convert map to a Lua representation.
-    lua_createtable(state, map_file.entities.size(), 0);
-
-    for (size_t i = 0; i < map_file.entities.size(); i++) {
-        auto &entity = map_file.entities[i];
-
-        // make entity table
-        lua_createtable(state, 0, 2);
-
-        // make dict
-        if (entity.epairs.size()) {
-            lua_createtable(state, entity.epairs.size(), 0);
-
-            size_t ent = 0;
-
-            for (auto &pair : entity.epairs) {
-                lua_createtable(state, 2, 0);
-                lua_pushstring(state, pair.first.c_str());
-                lua_rawseti(state, -2, 1);
-                lua_pushstring(state, pair.second.c_str());
-                lua_rawseti(state, -2, 2);
-
-                lua_rawseti(state, -2, ent + 1);
-                ent++;
-            }
-
-            // push dict to entity
-            lua_setfield(state, -2, "dict");
-        }
-
-        // make brushes
-        if (!entity.brushes.empty()) {
-            lua_createtable(state, entity.brushes.size(), 0);
-
-            for (size_t b = 0; b < entity.brushes.size(); b++) {
-                auto &brush = entity.brushes[b];
-
-                maputil_make_brush(state, brush);
-
-                // put brush into brushes
-                lua_rawseti(state, -2, b + 1);
-            }
-
-            // push dict to entity
-            lua_setfield(state, -2, "brushes");
-        }
-
-        // put entity into entities
-        lua_rawseti(state, -2, i + 1);
-    }
+    // the map itself, through proxies
+    maputil_register_proxies(state);
 
+    maputil_push_proxy(state, {maputil_proxy_type_t::entities});
     lua_setglobal(state, "entities");
 }
 
@@ -858,6 +1798,11 @@ static lua_State *maputil_setup_lua()
 
 static void maputil_free_lua(lua_State *state)
 {
+    // the references went with the registry
+    maputil_side_fields.clear();
+    // and removals not erased yet are from a script that failed
+    maputil_removed.clear();
+
     lua_close(state);
 }
 
@@ -881,18 +1826,31 @@ static void maputil_exec_script(const fs::path &file)
     int err = luaL_loadfile(state, file.string().c_str());
 
     if (err != LUA_OK) {
-        logging::print("can't load script: {}\n", lua_tostring(state, -1));
-    } else {
-        maputil_setup_globals(state);
+        const std::string message = lua_tostring(state, -1);
+        maputil_free_lua(state);
+        FError("can't load script: {}", message);
+    }
 
-        err = lua_pcall(state, 0, 0, -2);
+    maputil_setup_globals(state);
 
-        if (err != LUA_OK) {
+    err = lua_pcall(state, 0, 0, -2);
 
-            lua_pop(state, 1);
-        }
+    // a script that stopped partway has left the map half edited, which
+    // mustn't be saved; maputil_lua_error has printed why
+    if (err != LUA_OK) {
+        maputil_free_lua(state);
+        FError("script {} failed", file.string());
     }
 
+    lua_pushcfunction(state, maputil_lua_function<l_flush_sides>);
+
+    if (lua_pcall(state, 0, 0, -2) != LUA_OK) {
+        maputil_free_lua(state);
+        FError("script {} failed", file.string());
+    }
+
+    maputil_compact_map();
+
     maputil_free_lua(state);
 #else
     logging::print("maputil not compiled with Lua support\n");
@@ -920,15 +1878,13 @@ static void maputil_exec_query(const char *query)
 
         lua_pop(state, 1);
 
-        for (auto &entity : map_file.entities) {
-            lua_createtable(state, 0, entity.epairs.size());
-
-            for (auto &kvp : entity.epairs) {
-
-                lua_pushstring(state, kvp.second.c_str());
-                lua_setfield(state, -2, kvp.first.c_str());
+        // the query can add or remove entities, so don't hold on to them
+        for (size_t i = 0; i < map_file.entities.size(); i++) {
+            if (maputil_is_removed({maputil_proxy_type_t::entity, i})) {
+                continue;
             }
 
+            maputil_push_proxy(state, {maputil_proxy_type_t::keys, i});
             lua_setglobal(state, "entity");
 
             lua_rawgeti(state, LUA_REGISTRYINDEX, ref);
@@ -941,7 +1897,8 @@ static void maputil_exec_query(const char *query)
                 int b = lua_toboolean(state, -1);
                 lua_pop(state, 1);
 
-                if (b) {
+                if (b && i < map_file.entities.size() && !maputil_is_removed({maputil_proxy_type_t::entity, i})) {
+                    auto &entity = map_file.entities[i];
                     logging::print("MATCHED: {} @ {}\n", entity.epairs.get("classname"), entity.location);
                 }
             }
@@ -950,6 +1907,15 @@ static void maputil_exec_query(const char *query)
         }
 
         luaL_unref(state, LUA_REGISTRYINDEX, ref);
+
+        lua_pushcfunction(state, maputil_lua_function<l_flush_sides>);
+
+        if (lua_pcall(state, 0, 0, 0) != LUA_OK) {
+            logging::print("can't execute query: {}\n", lua_tostring(state, -1));
+            lua_pop(state, 1);
+        }
+
+        maputil_compact_map();
     }
 
     maputil_free_lua(state);
@@ -962,6 +1928,11 @@ int maputil_main(int argc, const char **argv)
 {
     logging::preinitialize();
 
+    // in case we're run more than once, in the tests
+    map_file = {};
+    current_game = nullptr;
+    maputil_options.reset();
+
     maputil_options.preinitialize(argc, argv);
     maputil_options.initialize(argc - 1, argv + 1);
     maputil_options.postinitialize(argc, argv);
@@ -1046,5 +2017,17 @@ int maputil_main(int argc, const char **argv)
         }
     }
 
+    profiler::close();
+
     return 0;
 }
+
+int maputil_main(const std::vector<std::string> &args)
+{
+    std::vector<const char *> argPtrs;
+    for (const std::string &arg : args) {
+        argPtrs.push_back(arg.data());
+    }
+
+    return maputil_main(argPtrs.size(), argPtrs.data());
+}
@@ -25,9 +25,26 @@
 #include <cstring>
 #include <list>
 #include <common/log.hh>
+#include <common/parallel.hh>
+#include <common/profiler.hh>
 #include <qbsp/map.hh>
 #include <qbsp/qbsp.hh>
 
+// while Brush_LoadEntity finishes a brush on a worker thread, its warnings
+// are kept with the brush and printed in map order afterwards; null means
+// print straight away.
+static thread_local std::vector<std::string> *brush_warnings = nullptr;
+
+template<typename... T>
+static void brush_warning(fmt::format_string<T...> format, T &&...args)
+{
+    if (brush_warnings) {
+        brush_warnings->push_back(fmt::format(format, std::forward<T>(args)...));
+    } else {
+        logging::print(format, std::forward<T>(args)...);
+    }
+}
+
 side_t side_t::clone_non_winding_data() const
 {
     side_t result;
@@ -129,13 +146,13 @@ static void CheckFace(
     if (face->w.size() < 3) {
         if (qbsp_options.verbose.value()) {
             if (face->w.size() == 2) {
-                logging::print("WARNING: {}: partially clipped into degenerate polygon @ ({}) - ({})\n",
+                brush_warning("WARNING: {}: partially clipped into degenerate polygon @ ({}) - ({})\n",
                     sourceface.line, face->w[0], face->w[1]);
             } else if (face->w.size() == 1) {
-                logging::print(
+                brush_warning(
                     "WARNING: {}: partially clipped into degenerate polygon @ ({})\n", sourceface.line, face->w[0]);
             } else {
-                logging::print("WARNING: {}: completely clipped away\n", sourceface.line);
+                brush_warning("WARNING: {}: completely clipped away\n", sourceface.line);
             }
         }
 
@@ -165,7 +182,7 @@ static void CheckFace(
         {
             double dist = face->get_plane().distance_to(p1);
             if (fabs(dist) > qbsp_options.epsilon.value()) {
-                logging::print("WARNING: {}: Point ({:.3} {:.3} {:.3}) off plane by {:2.4}\n", sourceface.line, p1[0],
+                brush_warning("WARNING: {}: Point ({:.3} {:.3} {:.3}) off plane by {:2.4}\n", sourceface.line, p1[0],
                     p1[1], p1[2], dist);
             }
         }
@@ -174,7 +191,7 @@ static void CheckFace(
         qvec3d edgevec = p2 - p1;
         double length = qv::length(edgevec);
         if (length < qbsp_options.epsilon.value()) {
-            logging::print("WARNING: {}: Healing degenerate edge ({}) at ({:.3f} {:.3} {:.3})\n", sourceface.line,
+            brush_warning("WARNING: {}: Healing degenerate edge ({}) at ({:.3f} {:.3} {:.3})\n", sourceface.line,
                 length, p1[0], p1[1], p1[2]);
             for (size_t j = i + 1; j < face->w.size(); j++)
                 face->w[j - 1] = face->w[j];
@@ -193,7 +210,7 @@ static void CheckFace(
                 continue;
             double dist = qv::dot(face->w[j], edgenormal);
             if (dist > edgedist) {
-                logging::print("WARNING: {}: Found a non-convex face (error size {}, point: {})\n", sourceface.line,
+                brush_warning("WARNING: {}: Found a non-convex face (error size {}, point: {})\n", sourceface.line,
                     dist - edgedist, face->w[j]);
                 face->w.clear();
                 return;
@@ -287,7 +304,7 @@ bool CreateBrushWindings(bspbrush_t &brush)
             for (auto &p : *w) {
                 for (auto &v : p) {
                     if (fabs(v) > qbsp_options.worldextent.value()) {
-                        logging::print("WARNING: {}: invalid winding point\n",
+                        brush_warning("WARNING: {}: invalid winding point\n",
                             brush.mapbrush ? brush.mapbrush->line : parser_source_location{});
                         w = std::nullopt;
                         break;
@@ -546,13 +563,14 @@ static void ExpandBrush(hullbrush_t &hullbrush, const aabb3d &hull_size)
 
 /*
 ===============
-LoadBrush
+LoadBrushSides
 
-Converts a mapbrush to a bsp brush
+First step of LoadBrush: sets up the sides of the bsp brush from the
+map brush. Doesn't touch map.planes.
 ===============
 */
-std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush, contentflags_t contents,
-    hull_index_t hullnum, std::optional<std::reference_wrapper<size_t>> num_clipped)
+static bspbrush_t LoadBrushSides(
+    const mapentity_t &src, mapbrush_t &mapbrush, contentflags_t contents, hull_index_t hullnum)
 {
     // create the brush
     bspbrush_t brush{};
@@ -598,7 +616,39 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
         dst.source = &src;
     }
 
-    // expand the brushes for the hull
+    return brush;
+}
+
+/*
+===============
+CreateHullWindings
+
+Creates the unexpanded windings ExpandBrushSides starts from. Only
+reads map.planes, so brushes can be prepared in parallel. Returns
+false if the brush is invalid.
+===============
+*/
+static bool CreateHullWindings(bspbrush_t &brush, hull_index_t hullnum)
+{
+#ifndef QBSP3
+    if (hullnum.value_or(0)) {
+        return CreateBrushWindings(brush);
+    }
+#endif
+
+    return true;
+}
+
+/*
+===============
+ExpandBrushSides
+
+Moves the sides of the brush out by the hull size and adds the bevels.
+This adds to map.planes, so it must not run in parallel.
+===============
+*/
+static void ExpandBrushSides(bspbrush_t &brush, hull_index_t hullnum)
+{
     if (hullnum.value_or(0)) {
         auto hulls = qbsp_options.target_game->get_hull_sizes();
         Q_assert(hullnum < hulls.size());
@@ -623,18 +673,26 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
             mapface.bevel = false;
         }
 #else
-
-        if (!CreateBrushWindings(brush)) {
-            return std::nullopt;
-        }
-
         hullbrush_t hullbrush{brush};
         ExpandBrush(hullbrush, hull);
 #endif
     }
+}
+
+/*
+===============
+FinishBrush
 
+Last step of LoadBrush: creates the windings and bounds of a brush
+from ExpandBrushSides. Only reads map.planes, so brushes can be finished
+in parallel. Returns false if the brush is invalid.
+===============
+*/
+static bool FinishBrush(const mapentity_t &src, bspbrush_t &brush, hull_index_t hullnum,
+    std::optional<std::reference_wrapper<size_t>> num_clipped)
+{
     if (!CreateBrushWindings(brush)) {
-        return std::nullopt;
+        return false;
     }
 
     for (auto &face : brush.sides) {
@@ -673,16 +731,53 @@ std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush
         brush.bounds = {-delta, delta};
     }
 
+    return true;
+}
+
+/*
+===============
+LoadBrush
+
+Converts a mapbrush to a bsp brush
+===============
+*/
+std::optional<bspbrush_t> LoadBrush(const mapentity_t &src, mapbrush_t &mapbrush, contentflags_t contents,
+    hull_index_t hullnum, std::optional<std::reference_wrapper<size_t>> num_clipped)
+{
+    auto brush = LoadBrushSides(src, mapbrush, contents, hullnum);
+
+    if (!CreateHullWindings(brush, hullnum)) {
+        return std::nullopt;
+    }
+
+    ExpandBrushSides(brush, hullnum);
+
+    if (!FinishBrush(src, brush, hullnum, num_clipped)) {
+        return std::nullopt;
+    }
+
     return brush;
 }
 
 //=============================================================================
 
-static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, content_stats_base_t &stats,
-    bspbrush_t::container &brushes, logging::percent_clock &clock, size_t &num_clipped)
+// a brush picked by Brush_GatherEntity, with its sides set up;
+// the rest of the work is done by Brush_LoadEntity, mostly in parallel
+struct pending_brush_t
 {
-    clock.max += src.mapbrushes.size();
+    const mapentity_t *src;
+    bspbrush_t brush;
+    // hull 0 clip brushes only add to the model bounds
+    bool bounds_only;
+    // cleared by CreateHullWindings or FinishBrush
+    bool valid = true;
+    size_t num_clipped = 0;
+    std::vector<std::string> warnings;
+};
 
+static void Brush_GatherEntity(
+    mapentity_t &dst, mapentity_t &src, hull_index_t hullnum, std::vector<pending_brush_t> &pending)
+{
     bool all_detail = false;
     bool all_detail_wall = false;
     bool all_detail_fence = false;
@@ -710,8 +805,6 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
     }
 
     for (auto &mapbrush : src.mapbrushes) {
-        clock();
-
         if (map.is_world_entity(src) || IsWorldBrushEntity(src) || IsNonRemoveWorldBrushEntity(src)) {
             if (map.region) {
                 if (map.region->bounds.disjoint(mapbrush.bounds)) {
@@ -797,9 +890,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
          */
         if (hullnum.has_value() && contents.is_clip(qbsp_options.target_game)) {
             if (hullnum.value() == 0) {
-                if (auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped)) {
-                    dst.bounds += brush->bounds;
-                }
+                pending.push_back({&src, LoadBrushSides(src, mapbrush, contents, hullnum), true});
                 continue;
                 // for hull1, 2, etc., convert clip to CONTENTS_SOLID
             } else {
@@ -843,16 +934,7 @@ static void Brush_LoadEntity(mapentity_t &dst, mapentity_t &src, hull_index_t hu
         contents.set_mirrored(mapbrush.contents.mirror_inside());
         contents.set_clips_same_type(mapbrush.contents.clips_same_type());
 
-        auto brush = LoadBrush(src, mapbrush, contents, hullnum, num_clipped);
-
-        if (!brush) {
-            continue;
-        }
-
-        qbsp_options.target_game->count_contents_in_stats(brush->contents, stats);
-
-        dst.bounds += brush->bounds;
-        brushes.push_back(bspbrush_t::make_ptr(std::move(*brush)));
+        pending.push_back({&src, LoadBrushSides(src, mapbrush, contents, hullnum), false});
     }
 }
 
@@ -867,14 +949,17 @@ hullnum 0 does not contain clip brushes.
 void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::container &brushes, size_t &num_clipped)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     bool is_world_entity = map.is_world_entity(entity);
 
     auto stats = qbsp_options.target_game->create_content_stats();
-    logging::percent_clock clock(0);
-    clock.displayElapsed = is_world_entity;
 
-    Brush_LoadEntity(entity, entity, hullnum, *stats, brushes, clock, num_clipped);
+    // pick the brushes and set up their sides (and planes) serially,
+    // in map order, so plane numbering is deterministic
+    std::vector<pending_brush_t> pending;
+
+    Brush_GatherEntity(entity, entity, hullnum, pending);
 
     /*
      * If this is the world entity, find all func_group and func_detail
@@ -891,12 +976,70 @@ void Brush_LoadEntity(mapentity_t &entity, hull_index_t hullnum, bspbrush_t::con
             ProcessAreaPortal(source);
 
             if (IsWorldBrushEntity(source) || IsNonRemoveWorldBrushEntity(source)) {
-                Brush_LoadEntity(entity, source, hullnum, *stats, brushes, clock, num_clipped);
+                Brush_GatherEntity(entity, source, hullnum, pending);
+            }
+        }
+    }
+
+    // brush entities are usually small; only the world gets a progress bar
+    const auto progress = is_world_entity ? logging::progress_t::CHUNKED : logging::progress_t::NONE;
+
+    if (hullnum.value_or(0)) {
+        // the windings the hull expansion starts from
+        logging::parallel_for_each(
+            pending,
+            [&](pending_brush_t &p) {
+                brush_warnings = &p.warnings;
+                p.valid = CreateHullWindings(p.brush, hullnum);
+                brush_warnings = nullptr;
+            },
+            progress);
+
+        // the expanded planes are added serially, in map order, so plane
+        // numbering is deterministic
+        for (auto &p : pending) {
+            if (p.valid) {
+                ExpandBrushSides(p.brush, hullnum);
             }
         }
     }
 
-    clock.print();
+    // windings, bounds and face checks; the expensive part
+    logging::parallel_for_each(
+        pending,
+        [&](pending_brush_t &p) {
+            if (!p.valid) {
+                return;
+            }
+            brush_warnings = &p.warnings;
+            p.valid = FinishBrush(*p.src, p.brush, hullnum, std::ref(p.num_clipped));
+            brush_warnings = nullptr;
+        },
+        progress);
+
+    // collect the results in the original order
+    brushes.reserve(brushes.size() + pending.size());
+
+    for (auto &p : pending) {
+        for (auto &warning : p.warnings) {
+            logging::print("{}", warning);
+        }
+
+        num_clipped += p.num_clipped;
+
+        if (!p.valid) {
+            continue;
+        }
+
+        entity.bounds += p.brush.bounds;
+
+        if (p.bounds_only) {
+            continue;
+        }
+
+        qbsp_options.target_game->count_contents_in_stats(p.brush.contents, *stats);
+        brushes.push_back(bspbrush_t::make_ptr(std::move(p.brush)));
+    }
 
     logging::header("CountBrushes");
 
@@ -934,7 +1077,7 @@ bool bspbrush_t::update_bounds(bool warn_on_failures)
         if (this->bounds.mins()[i] <= -qbsp_options.worldextent.value() ||
             this->bounds.maxs()[i] >= qbsp_options.worldextent.value()) {
             if (warn_on_failures) {
-                logging::print(
+                brush_warning(
                     "WARNING: {}: brush bounds out of range\n", mapbrush ? mapbrush->line : parser_source_location());
             }
             return false;
@@ -942,7 +1085,7 @@ bool bspbrush_t::update_bounds(bool warn_on_failures)
         if (this->bounds.mins()[i] >= qbsp_options.worldextent.value() ||
             this->bounds.maxs()[i] <= -qbsp_options.worldextent.value()) {
             if (warn_on_failures) {
-                logging::print(
+                brush_warning(
                     "WARNING: {}: no visible sides on brush\n", mapbrush ? mapbrush->line : parser_source_location());
             }
             return false;
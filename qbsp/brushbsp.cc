@@ -24,6 +24,7 @@
 #include <climits>
 
 #include <common/log.hh>
+#include <common/profiler.hh>
 #include <qbsp/brush.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
@@ -71,6 +72,9 @@ struct bspstats_t : logging::stat_tracker_t
     stat &c_tinyvolumes = register_stat("tiny volumes removed after splits");
 };
 
+// total over all BrushBSP calls, for -profile
+static profiler::counter c_brushes_split{"brushes split"};
+
 /*
 ==================
 BrushFromBounds
@@ -540,6 +544,8 @@ static twosided<bspbrush_t::ptr> SplitBrush(
         return result;
     }
 
+    c_brushes_split++;
+
     // add the midwinding to both sides
     for (int i = 0; i < 2; i++) {
         side_t &cs = result[i]->sides.emplace_back();
@@ -1255,6 +1261,7 @@ BrushBSP
 void BrushBSP(tree_t &tree, mapentity_t &entity, const bspbrush_t::container &brushlist, tree_split_t split_type)
 {
     logging::header(__func__);
+    profiler::scope scope(__func__);
 
     // NOTE: entity bounds may include brushes that were deleted
     // from the brush list (e.g. clip brushes in Q1 hull 0 still need to affect the model/node bounds)
@@ -1450,6 +1457,7 @@ void ChopBrushes(bspbrush_t::container &brushes, bool allow_fragmentation)
 {
     size_t original_count = brushes.size();
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     // convert brush container to list, so we don't lose
     // track of the original ptrs and so we can re-organize things
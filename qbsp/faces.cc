@@ -22,6 +22,8 @@
 #include <qbsp/brush.hh>
 
 #include <common/log.hh>
+#include <common/parallel.hh>
+#include <common/profiler.hh>
 #include <qbsp/portals.hh>
 #include <qbsp/csg.hh>
 #include <qbsp/map.hh>
@@ -30,6 +32,9 @@
 #include <qbsp/writebsp.hh>
 
 #include <list>
+#include <numeric>
+
+#include <tbb/parallel_sort.h>
 
 struct makefaces_stats_t : logging::stat_tracker_t
 {
@@ -92,21 +97,7 @@ inline void EmitVertex(const qvec3d &vert, size_t &vert_id)
     map.bsp.dvertexes.emplace_back(vert);
 }
 
-// output final vertices
-static void EmitFaceVertices(face_t *f)
-{
-    if (ShouldOmitFace(f)) {
-        return;
-    }
-
-    f->original_vertices.resize(f->w.size());
-
-    for (size_t i = 0; i < f->w.size(); i++) {
-        EmitVertex(f->w[i], f->original_vertices[i]);
-    }
-}
-
-static void EmitVertices_R(node_t *node)
+static void CollectFaces_R(node_t *node, std::vector<face_t *> &faces)
 {
     if (node->is_leaf()) {
         return;
@@ -114,16 +105,95 @@ static void EmitVertices_R(node_t *node)
 
     auto *nodedata = node->get_nodedata();
     for (auto &f : nodedata->facelist) {
-        EmitFaceVertices(f.get());
+        if (!ShouldOmitFace(f.get())) {
+            faces.push_back(f.get());
+        }
     }
 
-    EmitVertices_R(nodedata->children[0]);
-    EmitVertices_R(nodedata->children[1]);
+    CollectFaces_R(nodedata->children[0], faces);
+    CollectFaces_R(nodedata->children[1], faces);
 }
 
+/*
+=============
+EmitVertices
+
+Outputs the final vertices of the faces, welding points within
+POINT_EQUAL_EPSILON of an already output vertex.
+
+Vertices are numbered in the order of their first use in a
+depth-first walk of the tree. The welding itself is order-dependent,
+so it stays serial, but it runs only once per distinct point: the points
+are grouped by exact coordinates with a parallel sort first, and the
+indices are copied back to the faces in parallel.
+=============
+*/
 void EmitVertices(node_t *headnode)
 {
-    EmitVertices_R(headnode);
+    profiler::scope scope(__func__);
+
+    std::vector<face_t *> faces;
+    CollectFaces_R(headnode, faces);
+
+    // offset of each face's points in `points`
+    std::vector<size_t> offsets(faces.size() + 1);
+    for (size_t i = 0; i < faces.size(); i++) {
+        offsets[i + 1] = offsets[i] + faces[i]->w.size();
+    }
+
+    std::vector<qvec3d> points(offsets.back());
+
+    logging::parallel_for(
+        static_cast<size_t>(0), faces.size(),
+        [&](size_t i) {
+            faces[i]->original_vertices.resize(faces[i]->w.size());
+            std::copy(faces[i]->w.begin(), faces[i]->w.end(), points.begin() + offsets[i]);
+        },
+        logging::progress_t::NONE);
+
+    // group equal points; within a group, the first one is the first use
+    std::vector<size_t> order(points.size());
+    std::iota(order.begin(), order.end(), 0);
+
+    tbb::parallel_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        if (points[a] != points[b]) {
+            return points[a] < points[b];
+        }
+        return a < b;
+    });
+
+    // first point of each group, and the group of each point
+    std::vector<size_t> group_first;
+    std::vector<size_t> point_group(points.size());
+
+    for (size_t i = 0; i < order.size(); i++) {
+        if (i == 0 || points[order[i]] != points[order[i - 1]]) {
+            group_first.push_back(order[i]);
+        }
+        point_group[order[i]] = group_first.size() - 1;
+    }
+
+    // weld the groups in order of first use
+    std::vector<size_t> groups_by_use(group_first.size());
+    std::iota(groups_by_use.begin(), groups_by_use.end(), 0);
+
+    tbb::parallel_sort(groups_by_use.begin(), groups_by_use.end(),
+        [&](size_t a, size_t b) { return group_first[a] < group_first[b]; });
+
+    std::vector<size_t> group_vertex(group_first.size());
+
+    for (size_t group : groups_by_use) {
+        EmitVertex(points[group_first[group]], group_vertex[group]);
+    }
+
+    logging::parallel_for(
+        static_cast<size_t>(0), faces.size(),
+        [&](size_t i) {
+            for (size_t j = 0; j < faces[i]->original_vertices.size(); j++) {
+                faces[i]->original_vertices[j] = group_vertex[point_group[offsets[i] + j]];
+            }
+        },
+        logging::progress_t::NONE);
 }
 
 //===========================================================================
@@ -148,8 +218,8 @@ inline int64_t GetEdge(size_t v1, size_t v2, const face_t *face, emit_faces_stat
 
     if (!qbsp_options.noedgereuse.value()) {
         // search for existing edges
-        if (auto it = map.hashedges.find(std::make_pair(v2, v1)); it != map.hashedges.end()) {
-            hashedge_t &existing = it->second;
+        if (hashedge_t *it = map.hashedges.find(v2, v1)) {
+            hashedge_t &existing = *it;
             // this content check is required for software renderers
             // (see q1_liquid_software test case)
             if (existing.face->contents.front.equals(qbsp_options.target_game, face->contents.front)) {
@@ -272,6 +342,7 @@ MakeFaceEdges
 size_t EmitFaces(node_t *headnode)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     Q_assert(map.hashedges.empty());
 
@@ -572,6 +643,7 @@ MakeFaces
 void MakeFaces(node_t *node)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     makefaces_stats_t stats{};
 
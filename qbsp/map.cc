@@ -42,6 +42,7 @@
 #include <common/qvec.hh>
 #include <common/ostream.hh>
 #include <common/mapfile.hh>
+#include <common/profiler.hh>
 
 #include <pareto/spatial_map.h>
 
@@ -60,8 +61,80 @@ struct planehash_t
 
 struct vertexhash_t
 {
-    // hashed vertices; generated by EmitVertices
-    pareto::spatial_map<double, 3, size_t> hash;
+    // hashed vertices; generated by EmitVertices.
+    // bucketed into a grid with POINT_EQUAL_EPSILON sized cells, so a lookup
+    // only has to check the (at most 8) cells that overlap its epsilon box.
+    static constexpr double CELL_SIZE = POINT_EQUAL_EPSILON;
+    static constexpr size_t EMPTY = std::numeric_limits<size_t>::max();
+
+    using cell_key_t = std::array<int64_t, 3>;
+
+    struct vertex_t
+    {
+        qvec3d point;
+        size_t num;
+        // next vertex in the same cell, or EMPTY
+        size_t next;
+    };
+
+    // open addressing with linear probing; unused cells have head == EMPTY
+    struct cell_t
+    {
+        cell_key_t key;
+        size_t head = EMPTY;
+    };
+
+    std::vector<vertex_t> vertices;
+    std::vector<cell_t> cells = std::vector<cell_t>(1024);
+    size_t num_cells = 0;
+
+    static inline int64_t cell_coord(double v) { return static_cast<int64_t>(std::floor(v / CELL_SIZE)); }
+
+    inline size_t slot_for(const cell_key_t &key) const
+    {
+        uint64_t h = static_cast<uint64_t>(key[0]) * 0x9e3779b97f4a7c15ull;
+        h ^= static_cast<uint64_t>(key[1]) * 0xc2b2ae3d27d4eb4full;
+        h ^= static_cast<uint64_t>(key[2]) * 0x165667b19e3779f9ull;
+        h ^= h >> 29;
+
+        const size_t mask = cells.size() - 1;
+        size_t slot = h & mask;
+
+        while (cells[slot].head != EMPTY && cells[slot].key != key) {
+            slot = (slot + 1) & mask;
+        }
+
+        return slot;
+    }
+
+    void grow()
+    {
+        std::vector<cell_t> old = std::exchange(cells, std::vector<cell_t>(cells.size() * 2));
+
+        for (auto &cell : old) {
+            if (cell.head != EMPTY) {
+                cells[slot_for(cell.key)] = cell;
+            }
+        }
+    }
+
+    void add(const qvec3d &point, size_t num)
+    {
+        if ((num_cells + 1) * 2 > cells.size()) {
+            grow();
+        }
+
+        const cell_key_t key{cell_coord(point[0]), cell_coord(point[1]), cell_coord(point[2])};
+        cell_t &cell = cells[slot_for(key)];
+
+        if (cell.head == EMPTY) {
+            cell.key = key;
+            num_cells++;
+        }
+
+        vertices.push_back({point, num, cell.head});
+        cell.head = vertices.size() - 1;
+    }
 };
 
 mapdata_t::mapdata_t()
@@ -150,26 +223,100 @@ std::optional<size_t> mapdata_t::find_emitted_hash_vector(const qvec3d &vert)
 {
     constexpr double HALF_EPSILON = POINT_EQUAL_EPSILON * 0.5;
 
-    if (auto it =
-            hashverts->hash.find_intersection({vert[0] - HALF_EPSILON, vert[1] - HALF_EPSILON, vert[2] - HALF_EPSILON},
-                {vert[0] + HALF_EPSILON, vert[1] + HALF_EPSILON, vert[2] + HALF_EPSILON});
-        it != hashverts->hash.end()) {
-        return it->second;
+    const qvec3d mins = vert - qvec3d(HALF_EPSILON), maxs = vert + qvec3d(HALF_EPSILON);
+    std::optional<size_t> result;
+
+    for (int64_t x = vertexhash_t::cell_coord(mins[0]); x <= vertexhash_t::cell_coord(maxs[0]); x++) {
+        for (int64_t y = vertexhash_t::cell_coord(mins[1]); y <= vertexhash_t::cell_coord(maxs[1]); y++) {
+            for (int64_t z = vertexhash_t::cell_coord(mins[2]); z <= vertexhash_t::cell_coord(maxs[2]); z++) {
+                const auto &cell = hashverts->cells[hashverts->slot_for({x, y, z})];
+
+                for (size_t i = cell.head; i != vertexhash_t::EMPTY; i = hashverts->vertices[i].next) {
+                    const auto &v = hashverts->vertices[i];
+
+                    if (v.point[0] >= mins[0] && v.point[0] <= maxs[0] && v.point[1] >= mins[1] &&
+                        v.point[1] <= maxs[1] && v.point[2] >= mins[2] && v.point[2] <= maxs[2]) {
+                        if (!result || v.num < *result) {
+                            result = v.num;
+                        }
+                    }
+                }
+            }
+        }
     }
 
-    return std::nullopt;
+    return result;
 }
 
 // add vector to hash
 void mapdata_t::add_hash_vector(const qvec3d &point, size_t num)
 {
-    hashverts->hash.emplace(pareto::point<double, 3>({point[0], point[1], point[2]}), num);
+    hashverts->add(point, num);
 }
 
 void mapdata_t::add_hash_edge(size_t v1, size_t v2, int64_t edge_index, const face_t *face)
 {
-    hashedges.emplace(std::make_pair(v1, v2),
-        hashedge_t{.v1 = v1, .v2 = v2, .edge_index = edge_index, .face = face, .has_been_reused = false});
+    hashedges.emplace(hashedge_t{.v1 = v1, .v2 = v2, .edge_index = edge_index, .face = face, .has_been_reused = false});
+}
+
+// edgehash_t
+
+size_t edgehash_t::slot_for(size_t v1, size_t v2) const
+{
+    uint64_t h = static_cast<uint64_t>(v1) * 0x9e3779b97f4a7c15ull;
+    h ^= static_cast<uint64_t>(v2) * 0xc2b2ae3d27d4eb4full;
+    h ^= h >> 29;
+
+    const size_t mask = slots.size() - 1;
+    size_t slot = h & mask;
+
+    while (slots[slot].v1 != EMPTY && (slots[slot].v1 != v1 || slots[slot].v2 != v2)) {
+        slot = (slot + 1) & mask;
+    }
+
+    return slot;
+}
+
+void edgehash_t::grow()
+{
+    std::vector<hashedge_t> old = std::exchange(slots, {});
+    slots.resize(std::max<size_t>(old.size() * 2, 1024), hashedge_t{.v1 = EMPTY});
+
+    for (auto &edge : old) {
+        if (edge.v1 != EMPTY) {
+            slots[slot_for(edge.v1, edge.v2)] = edge;
+        }
+    }
+}
+
+hashedge_t *edgehash_t::find(size_t v1, size_t v2)
+{
+    if (slots.empty()) {
+        return nullptr;
+    }
+
+    hashedge_t &slot = slots[slot_for(v1, v2)];
+    return slot.v1 == EMPTY ? nullptr : &slot;
+}
+
+void edgehash_t::emplace(const hashedge_t &edge)
+{
+    if ((count + 1) * 2 > slots.size()) {
+        grow();
+    }
+
+    hashedge_t &slot = slots[slot_for(edge.v1, edge.v2)];
+
+    if (slot.v1 == EMPTY) {
+        slot = edge;
+        count++;
+    }
+}
+
+void edgehash_t::clear()
+{
+    slots.clear();
+    count = 0;
 }
 
 const std::optional<img::texture_meta> &mapdata_t::load_image_meta(std::string_view name)
@@ -2063,6 +2210,7 @@ inline void WriteMapBrushMap(const fs::path &name, const std::vector<mapbrush_t>
 void ProcessMapBrushes()
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     // load external maps (needs to be before world extents are calculated)
     for (auto &source : map.entities) {
@@ -2321,6 +2469,7 @@ void ProcessMapBrushes()
 void LoadMapFile()
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     {
         texture_def_issues_t issue_stats;
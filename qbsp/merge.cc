@@ -28,6 +28,11 @@
 #include <qbsp/map.hh>
 #include <qbsp/faces.hh>
 
+#include <algorithm>
+#include <array>
+#include <unordered_map>
+#include <vector>
+
 #ifdef PARANOID
 static void CheckColinear(face_t *f)
 {
@@ -186,18 +191,143 @@ void MergeFaceToList(
     list.push_back(std::move(face));
 }
 
+/*
+ * The faces of a MergeFaceList result, indexed by the grid cells their
+ * vertices fall in (the size EmitVertices welds with). TryMerge needs a
+ * shared edge, so the only faces worth trying are the ones with a vertex
+ * within QBSP_EQUAL_EPSILON of one of the new face's.
+ */
+class merge_index_t
+{
+    static constexpr double CELL_SIZE = POINT_EQUAL_EPSILON;
+
+    using face_list_t = std::list<std::unique_ptr<face_t>>;
+    using cell_key_t = std::array<int64_t, 3>;
+
+    struct cell_hash_t
+    {
+        size_t operator()(const cell_key_t &key) const
+        {
+            uint64_t h = static_cast<uint64_t>(key[0]) * 0x9e3779b97f4a7c15ull;
+            h ^= static_cast<uint64_t>(key[1]) * 0xc2b2ae3d27d4eb4full;
+            h ^= static_cast<uint64_t>(key[2]) * 0x165667b19e3779f9ull;
+            return h ^ (h >> 29);
+        }
+    };
+
+    face_list_t &list;
+    // faces are numbered in the order they're added to the list, which
+    // faces being removed doesn't change, so lower numbers come first
+    size_t next_num = 0;
+    std::unordered_map<size_t, face_list_t::iterator> faces;
+    // numbers of faces that were removed are dropped when next looked up
+    std::unordered_map<cell_key_t, std::vector<size_t>, cell_hash_t> cells;
+
+    static inline int64_t cell_coord(double v) { return static_cast<int64_t>(std::floor(v / CELL_SIZE)); }
+
+public:
+    merge_index_t(face_list_t &list)
+        : list(list)
+    {
+    }
+
+    void add(std::unique_ptr<face_t> face)
+    {
+        const size_t num = next_num++;
+
+        for (auto &point : face->w) {
+            auto &cell = cells[{cell_coord(point[0]), cell_coord(point[1]), cell_coord(point[2])}];
+
+            if (cell.empty() || cell.back() != num) {
+                cell.push_back(num);
+            }
+        }
+
+        list.push_back(std::move(face));
+        faces.emplace(num, std::prev(list.end()));
+    }
+
+    const face_t *get(size_t num) const { return faces.at(num)->get(); }
+
+    void remove(size_t num)
+    {
+        list.erase(faces.at(num));
+        faces.erase(num);
+    }
+
+    // faces that share a vertex with `face`, in list order
+    std::vector<size_t> candidates(const face_t *face)
+    {
+        // a bit wider than the epsilon, so rounding can't miss a cell
+        constexpr double RADIUS = QBSP_EQUAL_EPSILON * 2;
+
+        std::vector<size_t> result;
+
+        for (auto &point : face->w) {
+            const qvec3d mins = point - qvec3d(RADIUS), maxs = point + qvec3d(RADIUS);
+
+            for (int64_t x = cell_coord(mins[0]); x <= cell_coord(maxs[0]); x++) {
+                for (int64_t y = cell_coord(mins[1]); y <= cell_coord(maxs[1]); y++) {
+                    for (int64_t z = cell_coord(mins[2]); z <= cell_coord(maxs[2]); z++) {
+                        auto it = cells.find({x, y, z});
+
+                        if (it == cells.end()) {
+                            continue;
+                        }
+
+                        auto &cell = it->second;
+                        std::erase_if(cell, [this](size_t num) { return !faces.contains(num); });
+                        result.insert(result.end(), cell.begin(), cell.end());
+                    }
+                }
+            }
+        }
+
+        std::sort(result.begin(), result.end());
+        result.erase(std::unique(result.begin(), result.end()), result.end());
+
+        return result;
+    }
+};
+
 /*
 ===============
 MergeFaceList
+
+Gives the same result as calling MergeFaceToList for each face, but only
+tries the faces that share a vertex with the one being merged, rather than
+the whole list each time it grows or a merge restarts the search.
 ===============
 */
 std::list<std::unique_ptr<face_t>> MergeFaceList(
     std::list<std::unique_ptr<face_t>> input, logging::stat_tracker_t::stat &num_merged)
 {
     std::list<std::unique_ptr<face_t>> result;
+    merge_index_t index(result);
+
+    for (auto &input_face : input) {
+        std::unique_ptr<face_t> face = std::move(input_face);
+        bool merged;
+
+        do {
+            merged = false;
+
+            // like MergeFaceToList, merge with the first face in the list
+            // that works, then start over with the result
+            for (size_t num : index.candidates(face.get())) {
+                std::unique_ptr<face_t> newf = TryMerge(face.get(), index.get(num));
+
+                if (newf) {
+                    index.remove(num);
+                    face = std::move(newf);
+                    num_merged++;
+                    merged = true;
+                    break;
+                }
+            }
+        } while (merged);
 
-    for (auto &face : input) {
-        MergeFaceToList(std::move(face), result, num_merged);
+        index.add(std::move(face));
     }
 
     return result;
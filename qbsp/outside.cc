@@ -29,6 +29,7 @@
 
 #include <common/log.hh>
 #include <common/ostream.hh>
+#include <common/profiler.hh>
 #include <climits>
 #include <vector>
 #include <set>
@@ -679,6 +680,8 @@ Special cases: structural fully covered by detail still needs to be marked "visi
 */
 bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes)
 {
+    profiler::scope scope(__func__);
+
     Q_assert(tree.portaltype == portaltype_t::TREE);
 
     node_t *node = tree.headnode;
@@ -813,6 +816,7 @@ bool FillOutside(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brus
 void FillBrushEntity(tree_t &tree, hull_index_t hullnum, bspbrush_t::container &brushes)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     // Clear the outside filling state on all nodes
     ClearOccupied_r(tree.headnode);
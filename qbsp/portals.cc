@@ -30,10 +30,11 @@
 #include <qbsp/tree.hh>
 #include <common/log.hh>
 #include <atomic>
+#include <iterator>
 #include <common/prtfile.hh>
+#include <common/profiler.hh>
 
 #include "tbb/task_group.h"
-#include "common/vectorutils.hh"
 
 contentflags_t ClusterContents(const node_t *node)
 {
@@ -120,7 +121,7 @@ MakeHeadnodePortals
 The created portals will face the global outside_node
 ================
 */
-std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree)
+buildportal_list_t MakeHeadnodePortals(tree_t &tree)
 {
     int i, j, n;
     std::array<buildportal_t, 6> portals{};
@@ -176,7 +177,7 @@ std::list<buildportal_t> MakeHeadnodePortals(tree_t &tree)
         }
     }
 
-    // move into std::list
+    // move into a buildportal_list_t
     return {std::make_move_iterator(portals.begin()), std::make_move_iterator(portals.end())};
 }
 
@@ -222,7 +223,7 @@ portals in the node.
 ==================
 */
 static std::optional<buildportal_t> MakeNodePortal(
-    node_t *node, const std::list<buildportal_t> &boundary_portals, portalstats_t &stats)
+    node_t *node, const buildportal_list_t &boundary_portals, portalstats_t &stats)
 {
     auto w = BaseWindingForNode(node);
 
@@ -272,8 +273,8 @@ Move or split the portals that bound node so that the node's
 children have portals instead of node.
 ==============
 */
-static twosided<std::list<buildportal_t>> SplitNodePortals(
-    const node_t *node, std::list<buildportal_t> boundary_portals, portalstats_t &stats)
+static twosided<buildportal_list_t> SplitNodePortals(
+    const node_t *node, buildportal_list_t boundary_portals, portalstats_t &stats)
 {
     auto *nodedata = node->get_nodedata();
 
@@ -281,7 +282,9 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
     node_t *f = nodedata->children[0];
     node_t *b = nodedata->children[1];
 
-    twosided<std::list<buildportal_t>> result;
+    twosided<buildportal_list_t> result;
+    result.front.reserve(boundary_portals.size());
+    result.back.reserve(boundary_portals.size());
 
     for (auto &p : boundary_portals) {
         // which side of p `node` is on
@@ -299,6 +302,35 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
         //
         // cut the portal into two portals, one on each side of the cut plane
         //
+        // most portals are entirely on one side; those keep their winding instead
+        // of getting a copy of it from clip()
+        const auto counts = p.winding.calc_sides(plane.get_plane(), nullptr, nullptr, SPLIT_WINDING_EPSILON);
+
+        if (!counts[SIDE_FRONT] || !counts[SIDE_BACK]) {
+            if (WindingIsTiny(p.winding)) {
+                stats.c_tinyportals++;
+                continue;
+            }
+
+            // an on-plane portal is kept on the front
+            if (counts[SIDE_BACK]) {
+                if (side == SIDE_FRONT)
+                    p.nodes = {b, other_node};
+                else
+                    p.nodes = {other_node, b};
+
+                result.back.push_back(std::move(p));
+            } else {
+                if (side == SIDE_FRONT)
+                    p.nodes = {f, other_node};
+                else
+                    p.nodes = {other_node, f};
+
+                result.front.push_back(std::move(p));
+            }
+            continue;
+        }
+
         auto [frontwinding, backwinding] = p.winding.clip(plane, SPLIT_WINDING_EPSILON, true);
 
         if (frontwinding && WindingIsTiny(*frontwinding)) {
@@ -363,16 +395,24 @@ static twosided<std::list<buildportal_t>> SplitNodePortals(
 MakePortalsFromBuildportals
 ================
 */
-void MakePortalsFromBuildportals(tree_t &tree, std::list<buildportal_t> &buildportals)
+void MakePortalsFromBuildportals(tree_t &tree, buildportal_chunks_t &buildportals)
 {
-    tree.portals.reserve(buildportals.size());
-
-    for (auto &buildportal : buildportals) {
-        portal_t *new_portal = tree.create_portal();
-        new_portal->plane = buildportal.plane;
-        new_portal->onnode = buildportal.onnode;
-        new_portal->winding = std::move(buildportal.winding);
-        AddPortalToNodes(new_portal, buildportal.nodes[0], buildportal.nodes[1]);
+    size_t num_portals = 0;
+
+    for (auto &chunk : buildportals) {
+        num_portals += chunk.size();
+    }
+
+    tree.portals.reserve(num_portals);
+
+    for (auto &chunk : buildportals) {
+        for (auto &buildportal : chunk) {
+            portal_t *new_portal = tree.create_portal();
+            new_portal->plane = buildportal.plane;
+            new_portal->onnode = buildportal.onnode;
+            new_portal->winding = std::move(buildportal.winding);
+            AddPortalToNodes(new_portal, buildportal.nodes[0], buildportal.nodes[1]);
+        }
     }
 }
 
@@ -434,30 +474,26 @@ ClipNodePortalToTree_r
 Given portals which are connected to `node` on one side,
 descends the tree, splitting the portals as needed until they are connected to leaf nodes.
 
-The other side of the portals will remain untouched.
+The other side of the portals will remain untouched. The fragments are
+appended to `result`, front side first.
 ==================
 */
-static std::list<buildportal_t> ClipNodePortalsToTree_r(
-    node_t *node, portaltype_t type, std::list<buildportal_t> portals, portalstats_t &stats)
+static void ClipNodePortalsToTree_r(node_t *node, portaltype_t type, buildportal_list_t portals,
+    portalstats_t &stats, buildportal_list_t &result)
 {
     if (portals.empty()) {
-        return portals;
+        return;
     }
     if (node->is_leaf() || (type == portaltype_t::VIS && node->get_nodedata()->detail_separator)) {
-        return portals;
+        std::move(portals.begin(), portals.end(), std::back_inserter(result));
+        return;
     }
     auto *nodedata = node->get_nodedata();
 
     auto boundary_portals_split = SplitNodePortals(node, std::move(portals), stats);
 
-    auto front_fragments =
-        ClipNodePortalsToTree_r(nodedata->children[0], type, std::move(boundary_portals_split.front), stats);
-    auto back_fragments =
-        ClipNodePortalsToTree_r(nodedata->children[1], type, std::move(boundary_portals_split.back), stats);
-
-    std::list<buildportal_t> merged_result = std::move(front_fragments);
-    merged_result.splice(merged_result.end(), back_fragments);
-    return merged_result;
+    ClipNodePortalsToTree_r(nodedata->children[0], type, std::move(boundary_portals_split.front), stats, result);
+    ClipNodePortalsToTree_r(nodedata->children[1], type, std::move(boundary_portals_split.back), stats, result);
 }
 
 /*
@@ -467,13 +503,19 @@ MakeTreePortals_r
 Given the list of portals bounding `node`, returns the portal list for a fully-portalized `node`.
 ==================
 */
-std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std::list<buildportal_t> boundary_portals,
+buildportal_chunks_t MakeTreePortals_r(node_t *node, portaltype_t type, buildportal_list_t boundary_portals,
     portalstats_t &stats, logging::percent_clock &clock)
 {
     clock();
 
     if (node->is_leaf() || (type == portaltype_t::VIS && node->get_nodedata()->detail_separator)) {
-        return boundary_portals;
+        buildportal_chunks_t result;
+
+        if (!boundary_portals.empty()) {
+            result.push_back(std::move(boundary_portals));
+        }
+
+        return result;
     }
 
     // make the node portal before we move out the boundary_portals
@@ -484,7 +526,7 @@ std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std:
 
     auto boundary_portals_split = SplitNodePortals(node, std::move(boundary_portals), stats);
 
-    std::list<buildportal_t> result_portals_front, result_portals_back;
+    buildportal_chunks_t result_portals_front, result_portals_back;
 
     auto *nodedata = node->get_nodedata();
 
@@ -501,23 +543,30 @@ std::list<buildportal_t> MakeTreePortals_r(node_t *node, portaltype_t type, std:
 
     // sequential part: push the nodeportal down each side of the bsp so it connects leafs
 
-    std::list<buildportal_t> result_portals_onnode;
+    buildportal_list_t result_portals_onnode;
 
     if (nodeportal) {
         // to start with, `nodeportal` is a portal between node->children[0] and node->children[1]
 
         // these portal fragments have node->children[1] on one side, and the leaf nodes from
         // node->children[0] on the other side
-        std::list<buildportal_t> half_clipped =
-            ClipNodePortalsToTree_r(nodedata->children[0], type, make_list(std::move(*nodeportal)), stats);
+        buildportal_list_t nodeportals;
+        nodeportals.push_back(std::move(*nodeportal));
+
+        buildportal_list_t half_clipped;
+        ClipNodePortalsToTree_r(nodedata->children[0], type, std::move(nodeportals), stats, half_clipped);
 
-        result_portals_onnode = ClipNodePortalsToTree_r(nodedata->children[1], type, std::move(half_clipped), stats);
+        ClipNodePortalsToTree_r(nodedata->children[1], type, std::move(half_clipped), stats, result_portals_onnode);
     }
 
     // all done, merge together the lists and return
-    std::list<buildportal_t> merged_result = std::move(result_portals_front);
+    buildportal_chunks_t merged_result = std::move(result_portals_front);
     merged_result.splice(merged_result.end(), result_portals_back);
-    merged_result.splice(merged_result.end(), result_portals_onnode);
+
+    if (!result_portals_onnode.empty()) {
+        merged_result.push_back(std::move(result_portals_onnode));
+    }
+
     return merged_result;
 }
 
@@ -529,6 +578,7 @@ MakeTreePortals
 void MakeTreePortals(tree_t &tree)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     FreeTreePortals(tree);
 
@@ -1166,6 +1216,7 @@ MarkVisibleSides
 void MarkVisibleSides(tree_t &tree, bspbrush_t::container &brushes)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     // clear all the visible flags
     MarkBrushSidesInvisible(brushes);
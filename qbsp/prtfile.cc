@@ -24,12 +24,15 @@
 #include <common/log.hh>
 #include <common/ostream.hh>
 #include <common/prtfile.hh>
+#include <common/profiler.hh>
 #include <qbsp/map.hh>
 #include <qbsp/portals.hh>
 #include <qbsp/qbsp.hh>
 #include <qbsp/tree.hh>
 
+#include <algorithm>
 #include <fstream>
+#include <numeric>
 
 /*
 ==============================================================================
@@ -66,6 +69,10 @@ static void WritePortals_r(node_t *node, prtfile_t &portalFile, bool clusters)
         front = clusters ? p->nodes[0]->viscluster : p->nodes[0]->visleafnum;
         back = clusters ? p->nodes[1]->viscluster : p->nodes[1]->visleafnum;
 
+        // between two leafs -autocluster merged
+        if (clusters && front == back)
+            continue;
+
         if (front == -1 || back == -1) {
             auto front_contents = ClusterContents(p->nodes.front);
             auto back_contents = ClusterContents(p->nodes.back);
@@ -172,6 +179,161 @@ static void NumberLeafs_r(node_t *node, portal_state_t &state, int cluster)
     CountPortals(node, state);
 }
 
+// the nodes WritePortals_r writes the portals of with clusters set
+static void CollectClusters_r(node_t *node, std::vector<node_t *> &clusters)
+{
+    if (auto *nodedata = node->get_nodedata(); nodedata && !nodedata->detail_separator) {
+        CollectClusters_r(nodedata->children[0], clusters);
+        CollectClusters_r(nodedata->children[1], clusters);
+        return;
+    }
+
+    if (node->viscluster >= 0)
+        clusters[node->viscluster] = node;
+}
+
+static void RenumberClusters_r(node_t *node, const std::vector<int> &new_clusters)
+{
+    if (auto *nodedata = node->get_nodedata()) {
+        RenumberClusters_r(nodedata->children[0], new_clusters);
+        RenumberClusters_r(nodedata->children[1], new_clusters);
+        return;
+    }
+
+    if (node->viscluster >= 0)
+        node->viscluster = new_clusters[node->viscluster];
+}
+
+static int FindCluster(std::vector<int> &parent, int i)
+{
+    while (parent[i] != i) {
+        parent[i] = parent[parent[i]];
+        i = parent[i];
+    }
+    return i;
+}
+
+// area of the box as seen along `normal`
+static double ProjectedArea(const aabb3d &bounds, const qvec3d &normal)
+{
+    const qvec3d size = bounds.size();
+    return fabs(normal[0]) * size[1] * size[2] + fabs(normal[1]) * size[0] * size[2] +
+           fabs(normal[2]) * size[0] * size[1];
+}
+
+/*
+================
+AutoCluster
+
+Outside of detail, every leaf is its own vis cluster, including the
+slivers the BSP leaves in open areas, and vis spends most of its time
+flowing through those. Merge neighbouring clusters across the portals that
+cover most of their cross-section, biggest portals first, as long as the
+result stays within -autocluster units on each axis. Any grouping gives a
+conservative PVS, since vis only flows through the portals between
+clusters; they needn't be convex (see CheckStack in vis).
+
+Returns false if nothing was merged.
+================
+*/
+static bool AutoCluster(node_t *headnode, portal_state_t &state)
+{
+    const size_t num_clusters = state.num_visclusters.count.load();
+
+    std::vector<node_t *> cluster_nodes(num_clusters);
+    CollectClusters_r(headnode, cluster_nodes);
+
+    std::vector<std::pair<double, const portal_t *>> merge_portals;
+
+    for (node_t *node : cluster_nodes) {
+        const portal_t *p, *next;
+
+        for (p = node->portals; p; p = next) {
+            next = (p->nodes[0] == node) ? p->next[0] : p->next[1];
+            if (!p->winding || p->nodes[0] != node || !Portal_VisFlood(p))
+                continue;
+
+            merge_portals.emplace_back(p->winding.area(), p);
+        }
+    }
+
+    std::stable_sort(merge_portals.begin(), merge_portals.end(),
+        [](const auto &a, const auto &b) { return a.first > b.first; });
+
+    std::vector<int> parent(num_clusters);
+    std::iota(parent.begin(), parent.end(), 0);
+
+    std::vector<aabb3d> bounds(num_clusters);
+    for (size_t i = 0; i < num_clusters; i++)
+        bounds[i] = cluster_nodes[i]->bounds;
+
+    const double maxsize = qbsp_options.autocluster.value();
+    const double minfraction = qbsp_options.autoclusterportal.value();
+
+    // detail clusters are flagged as detail, which mustn't keep them apart
+    auto merge_contents = [](const node_t *node) {
+        return qbsp_options.target_game->clear_detail(ClusterContents(node));
+    };
+
+    for (auto &[area, p] : merge_portals) {
+        // keep e.g. water in clusters of its own
+        if (!merge_contents(p->nodes[0]).equals(qbsp_options.target_game, merge_contents(p->nodes[1])))
+            continue;
+
+        const int a = FindCluster(parent, p->nodes[0]->viscluster);
+        const int b = FindCluster(parent, p->nodes[1]->viscluster);
+
+        if (a == b)
+            continue;
+
+        const aabb3d merged = bounds[a] + bounds[b];
+        const qvec3d size = merged.size();
+        if (std::max({size[0], size[1], size[2]}) > maxsize)
+            continue;
+
+        const qvec3d &normal = p->plane.get_normal();
+        if (area < minfraction * std::min(ProjectedArea(bounds[a], normal), ProjectedArea(bounds[b], normal)))
+            continue;
+
+        parent[b] = a;
+        bounds[a] = merged;
+    }
+
+    // number the merged clusters in the order of their first member
+    std::vector<int> new_for_root(num_clusters, -1);
+    std::vector<int> new_clusters(num_clusters);
+    int num_new_clusters = 0;
+
+    for (size_t i = 0; i < num_clusters; i++) {
+        int &cluster = new_for_root[FindCluster(parent, i)];
+        if (cluster < 0)
+            cluster = num_new_clusters++;
+        new_clusters[i] = cluster;
+    }
+
+    if (num_new_clusters == static_cast<int>(num_clusters))
+        return false;
+
+    // portals inside a cluster aren't written
+    for (auto &[area, p] : merge_portals) {
+        if (new_clusters[p->nodes[0]->viscluster] == new_clusters[p->nodes[1]->viscluster])
+            state.num_visportals.count--;
+    }
+
+    RenumberClusters_r(headnode, new_clusters);
+
+    // detail clusters keep their number on the separator node as well
+    for (node_t *node : cluster_nodes) {
+        if (!node->is_leaf())
+            node->viscluster = new_clusters[node->viscluster];
+    }
+
+    logging::print(logging::flag::STAT, "     {:8} clusters merged by -autocluster\n", num_clusters - num_new_clusters);
+
+    state.num_visclusters.count = num_new_clusters;
+    return true;
+}
+
 /*
 ================
 WritePortalfile
@@ -185,6 +347,13 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
      */
     NumberLeafs_r(headnode, state, -1);
 
+    if (qbsp_options.autocluster.value() > 0 && qbsp_options.target_game->id != GAME_QUAKE_II &&
+        !qbsp_options.forceprt1.value()) {
+        // written as a PRT2, the same as detail clusters
+        if (AutoCluster(headnode, state))
+            state.uses_detail = true;
+    }
+
     // write the file
     fs::path name = qbsp_options.bsp_path;
     name.replace_extension("prt");
@@ -213,7 +382,8 @@ static void WritePortalfile(node_t *headnode, portal_state_t &state)
         WritePTR2ClusterMapping_r(headnode, portalFile);
     }
 
-    WritePortalfile(name, portalFile, qbsp_options.target_version, state.uses_detail, qbsp_options.forceprt1.value());
+    WritePortalfile(name, portalFile, qbsp_options.target_version, state.uses_detail, qbsp_options.forceprt1.value(),
+        qbsp_options.binaryprt.value());
 }
 
 /*
@@ -224,6 +394,7 @@ WritePortalFile
 void WritePortalFile(tree_t &tree)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     FreeTreePortals(tree);
 
@@ -26,6 +26,7 @@
 #include <common/aabb.hh>
 #include <common/fs.hh>
 #include <common/settings.hh>
+#include <common/profiler.hh>
 
 #include <qbsp/brush.hh>
 #include <qbsp/exportobj.hh>
@@ -516,6 +517,12 @@ qbsp_settings::qbsp_settings()
       leakdist{this, "leakdist", 0, &debugging_group, "space between leakfile points (default 0: no inbetween points)"},
       forceprt1{
           this, "forceprt1", false, &debugging_group, "force a PRT1 output file even if PRT2 is required for vis"},
+      binaryprt{this, "binaryprt", false, &common_format_group,
+          "write the .prt file in a binary format that vis loads faster; map editors can't read it"},
+      autocluster{this, "autocluster", 0.0, 0.0, 8192.0, &common_format_group,
+          "on Q1 maps, merge neighbouring leafs and detail clusters into vis clusters up to this size on each axis (0 to disable)"},
+      autoclusterportal{this, "autoclusterportal", 0.5, 0.0, 1.0, &common_format_group,
+          "with -autocluster, only merge across portals covering at least this fraction of the smaller side's cross-section"},
       tjunc{this, {"tjunc", "notjunc"}, tjunclevel_t::MWT,
           {{"none", tjunclevel_t::NONE}, {"rotate", tjunclevel_t::ROTATE}, {"retopologize", tjunclevel_t::RETOPOLOGIZE},
               {"mwt", tjunclevel_t::MWT}},
@@ -1515,6 +1522,8 @@ static void CreateSingleHull(hull_index_t hullnum)
         logging::print("Processing map...\n");
     }
 
+    profiler::scope scope(hullnum.has_value() ? fmt::format("hull {}", hullnum.value()) : "hull");
+
     // for each entity in the map file that has geometry
     for (auto &entity : map.entities) {
         bool wants_logging = true;
@@ -1680,6 +1689,8 @@ ProcessFile
 */
 void ProcessFile()
 {
+    profiler::scope scope(__func__);
+
     if (qbsp_options.convertmapformat.value() != conversion_t::none) {
         ConvertMapFile();
         return;
@@ -1820,6 +1831,7 @@ int qbsp_main(int argc, const char **argv)
 
     logging::print("\n{:.3} seconds elapsed\n", (end - start));
 
+    profiler::close();
     logging::close();
 
     return 0;
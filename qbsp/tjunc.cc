@@ -879,6 +879,7 @@ static void FixFaceEdges(node_t *headnode, face_t *f, tjunc_stats_t &stats)
 }
 
 #include <common/parallel.hh>
+#include <common/profiler.hh>
 
 /*
 ==================
@@ -912,6 +913,7 @@ TJunc fixing entry point
 void TJunc(node_t *headnode)
 {
     logging::funcheader();
+    profiler::scope scope(__func__);
 
     tjunc_stats_t stats{};
     std::unordered_set<face_t *> faces;
@@ -3,8 +3,22 @@
 #include <vis/vis.hh>
 #include <common/qvec.hh>
 #include <common/polylib.hh>
+#include <common/parallel.hh>
+#include <common/bsputils.hh>
+#include <common/bspquery.hh>
+#include <common/decompile.hh>
+#include <qbsp/csg.hh>
+#include <qbsp/map.hh>
+#include <qbsp/merge.hh>
+#include <qbsp/qbsp.hh>
+#include <maputil/maputil.hh>
+#include <testmaps.hh>
+#include "test_qbsp.hh"
 
 #include <array>
+#include <fstream>
+#include <list>
+#include <memory>
 #include <vector>
 
 TEST(benchmark, winding)
@@ -158,3 +172,226 @@ TEST(benchmark, vectorMath)
     b.doNotOptimizeAway(vec0);
     b.doNotOptimizeAway(vec1);
 }
+
+TEST(benchmark, parallelFor)
+{
+    constexpr size_t count = 10'000'000;
+
+    // keep the [100%] lines out of the benchmark output
+    const auto old_mask = logging::mask;
+    logging::mask &= ~(bitflags<logging::flag>(logging::flag::PERCENT) | logging::flag::CLOCK_ELAPSED);
+
+    ankerl::nanobench::Bench b;
+    b.relative(true);
+
+    b.run("tbb::parallel_for, 10M empty items", [&]() {
+        tbb::parallel_for(static_cast<size_t>(0), count, [](size_t i) { ankerl::nanobench::doNotOptimizeAway(i); });
+    });
+    b.run("logging::parallel_for, 10M empty items", [&]() {
+        logging::parallel_for(
+            static_cast<size_t>(0), count, [](size_t i) { ankerl::nanobench::doNotOptimizeAway(i); });
+    });
+    b.run("logging::parallel_for (progress_t::NONE), 10M empty items", [&]() {
+        logging::parallel_for(
+            static_cast<size_t>(0), count, [](size_t i) { ankerl::nanobench::doNotOptimizeAway(i); },
+            logging::progress_t::NONE);
+    });
+
+    logging::mask = old_mask;
+}
+
+// random points in the bounds of q2_liquids; its tree is small enough to
+// stay in cache, so this mostly measures the work per node, not the cache
+// misses the batched walks overlap on a big map
+TEST(benchmark, bspPointQuery)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_liquids.map");
+    const bsp_point_query_t query(&bsp);
+    const dmodelh2_t *world = &bsp.dmodels[0];
+
+    ankerl::nanobench::Rng rng;
+    std::vector<qvec3d> points(100'000);
+
+    for (auto &point : points) {
+        for (int i = 0; i < 3; i++) {
+            point[i] = world->mins[i] + rng.uniform01() * (world->maxs[i] - world->mins[i]);
+        }
+    }
+
+    std::vector<const mleaf_t *> leafs(points.size());
+    auto in_solid = std::make_unique<bool[]>(points.size());
+
+    ankerl::nanobench::Bench b;
+    b.batch(points.size()).unit("query").relative(true);
+
+    b.run("BSP_FindLeafAtPoint", [&]() {
+        for (size_t i = 0; i < points.size(); i++) {
+            leafs[i] = BSP_FindLeafAtPoint(&bsp, world, points[i]);
+        }
+    });
+    b.run("bsp_point_query_t::find_leaf", [&]() {
+        for (size_t i = 0; i < points.size(); i++) {
+            leafs[i] = query.find_leaf(0, points[i]);
+        }
+    });
+    b.run("bsp_point_query_t::find_leafs", [&]() { query.find_leafs<double>(0, points, leafs); });
+    b.doNotOptimizeAway(leafs);
+
+    b.run("Light_PointInSolid", [&]() {
+        for (size_t i = 0; i < points.size(); i++) {
+            in_solid[i] = Light_PointInSolid(&bsp, world, points[i]);
+        }
+    });
+    b.run("bsp_point_query_t::point_in_solid", [&]() {
+        for (size_t i = 0; i < points.size(); i++) {
+            in_solid[i] = query.point_in_solid(0, points[i]);
+        }
+    });
+    b.run("bsp_point_query_t::points_in_solid", [&]() {
+        query.points_in_solid(0, points, std::span(in_solid.get(), points.size()));
+    });
+    b.doNotOptimizeAway(in_solid);
+}
+
+// the plane stacks decompiling q1_mountain gathers: the world's bounds, then
+// the outward-facing planes of the nodes above each solid leaf
+static void GatherDecompileStacks(const mbsp_t &bsp, int32_t nodenum, std::vector<qplane3d> &stack,
+    std::vector<std::vector<qplane3d>> &stacks)
+{
+    if (nodenum < 0) {
+        if (BSP_GetLeafFromNodeNum(&bsp, nodenum)->contents != CONTENTS_EMPTY) {
+            stacks.push_back(stack);
+        }
+        return;
+    }
+
+    const bsp2_dnode_t *node = BSP_GetNode(&bsp, nodenum);
+    const qplane3d plane(*BSP_GetPlane(&bsp, node->planenum));
+
+    for (int side = 0; side < 2; side++) {
+        stack.push_back(side == 0 ? -plane : plane);
+        GatherDecompileStacks(bsp, node->children[side], stack, stacks);
+        stack.pop_back();
+    }
+}
+
+TEST(benchmark, removeRedundantPlanes)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_mountain.map");
+    const dmodelh2_t &world = bsp.dmodels[0];
+
+    std::vector<qplane3d> stack;
+    for (int axis = 0; axis < 3; axis++) {
+        qvec3d normal{};
+        normal[axis] = 1;
+        stack.emplace_back(normal, world.maxs[axis]);
+        stack.emplace_back(-normal, -world.mins[axis]);
+    }
+
+    std::vector<std::vector<qplane3d>> stacks;
+    GatherDecompileStacks(bsp, world.headnode[0], stack, stacks);
+
+    ankerl::nanobench::Bench b;
+    b.batch(stacks.size()).unit("stack");
+
+    b.run("RemoveRedundantPlanes", [&]() {
+        for (auto &planes : stacks) {
+            std::vector<qplane3d> copy = planes;
+            RemoveRedundantPlanes(copy);
+            b.doNotOptimizeAway(copy);
+        }
+    });
+}
+
+// a floor of 1x1 faces with a few textures picked at random, so that it
+// only partly merges and the merged list stays large
+static std::list<std::unique_ptr<face_t>> MakeMergeGrid(size_t size, mapface_t &side)
+{
+    const size_t planenum = map.add_or_find_plane({{0, 0, 1}, 0});
+    ankerl::nanobench::Rng rng(1234);
+    std::list<std::unique_ptr<face_t>> faces;
+
+    for (size_t y = 0; y < size; y++) {
+        for (size_t x = 0; x < size; x++) {
+            auto face = std::make_unique<face_t>();
+            face->planenum = planenum;
+            face->texinfo = rng.bounded(4);
+            face->original_side = &side;
+            face->w = winding_t{qvec3d(x, y, 0), qvec3d(x, y + 1, 0), qvec3d(x + 1, y + 1, 0), qvec3d(x + 1, y, 0)};
+            UpdateFaceSphere(face.get());
+            faces.push_back(std::move(face));
+        }
+    }
+
+    return faces;
+}
+
+TEST(benchmark, mergeFaceList)
+{
+    // for the target game
+    LoadTestmapQ1("qbsp_simple_sealed.map");
+
+    mapface_t side;
+    logging::stat_tracker_t stats;
+    auto &num_merged = stats.register_stat("merged");
+
+    std::list<std::unique_ptr<face_t>> scan, indexed;
+
+    ankerl::nanobench::Bench b;
+    b.relative(true);
+
+    b.run("MergeFaceToList", [&]() {
+        scan.clear();
+        for (auto &face : MakeMergeGrid(64, side)) {
+            MergeFaceToList(std::move(face), scan, num_merged);
+        }
+    });
+    b.run("MergeFaceList", [&]() { indexed = MergeFaceList(MakeMergeGrid(64, side), num_merged); });
+
+    // same faces, in the same order
+    ASSERT_EQ(scan.size(), indexed.size());
+    EXPECT_LT(scan.size(), 64 * 64);
+    for (auto it1 = scan.begin(), it2 = indexed.begin(); it1 != scan.end(); ++it1, ++it2) {
+        EXPECT_EQ((*it1)->texinfo, (*it2)->texinfo);
+        ASSERT_EQ((*it1)->w.size(), (*it2)->w.size());
+        for (size_t i = 0; i < (*it1)->w.size(); i++) {
+            EXPECT_EQ((*it1)->w[i], (*it2)->w[i]);
+        }
+    }
+}
+
+TEST(benchmark, maputilScript)
+{
+#ifndef USE_LUA
+    GTEST_SKIP() << "maputil was built without Lua";
+#endif
+
+    const auto map_path = fs::path(testmaps_dir) / "E1M1-edited-ents.map";
+    const auto script_path = fs::temp_directory_path() / "benchmark-maputil.lua";
+    const auto out_path = fs::temp_directory_path() / "benchmark-maputil.map";
+
+    // a typical script, which only touches a few keys of a few entities;
+    // its cost is the difference from the run without one
+    std::ofstream(script_path) << R"(
+        for i = 1, #entities do
+            local dict = entities[i].dict
+            if dict and dict.classname == "light" then
+                dict.light = "300"
+            end
+        end
+    )";
+
+    ankerl::nanobench::Bench b;
+    b.epochs(5);
+
+    b.run("maputil load and save", [&]() {
+        maputil_main({"", "--load", map_path.string(), "--save", out_path.string()});
+    });
+    b.run("maputil load, script and save", [&]() {
+        maputil_main(
+            {"", "--load", map_path.string(), "--script", script_path.string(), "--save", out_path.string()});
+    });
+
+    fs::remove(script_path);
+    fs::remove(out_path);
+}
@@ -2,11 +2,13 @@
 
 #include <common/fs.hh>
 #include <common/decompile.hh>
+#include <common/polylib.hh>
 #include <common/bsputils.hh>
 #include <qbsp/map.hh>
 #include <bsputil/bsputil.hh>
 
 #include <fstream>
+#include <random>
 
 #include "testmaps.hh"
 #include "test_qbsp.hh"
@@ -48,6 +50,104 @@ TEST(bsputil, q1DecompilerTest)
     }
 }
 
+// the test RemoveRedundantPlanes used to run on every plane: clip a face on
+// it by all of the others
+static void RemoveRedundantPlanesReference(std::vector<qplane3d> &planes)
+{
+    auto removed = std::remove_if(planes.begin(), planes.end(), [&planes](const qplane3d &plane) {
+        std::optional<polylib::winding_t> winding = polylib::winding_t::from_plane(plane, 10e6);
+
+        for (const qplane3d &plane2 : planes) {
+            if (&plane2 == &plane)
+                continue;
+
+            winding = winding->clip_front(-plane2);
+
+            if (!winding)
+                break;
+        }
+
+        return !winding;
+    });
+    planes.erase(removed, planes.end());
+}
+
+// RemoveRedundantPlanes keeps exactly the planes the clipping test keeps,
+// including for planes too close to call that it has to check the slow way
+TEST(bsputil, removeRedundantPlanes)
+{
+    std::mt19937 engine(0);
+    std::uniform_real_distribution<double> unit(-1.0, 1.0);
+    std::uniform_real_distribution<double> dist(16.0, 128.0);
+    std::uniform_int_distribution<int> count(4, 24);
+
+    auto random_normal = [&]() {
+        qvec3d normal;
+        do {
+            normal = {unit(engine), unit(engine), unit(engine)};
+        } while (qv::length(normal) < 0.1);
+        return qv::normalize(normal);
+    };
+
+    for (int i = 0; i < 500; i++) {
+        SCOPED_TRACE(i);
+
+        std::vector<qplane3d> planes;
+
+        // half the stacks start from a box, so they're closed
+        if (i & 1) {
+            qvec3d maxs;
+
+            for (int axis = 0; axis < 3; axis++) {
+                for (double sign : {-1.0, 1.0}) {
+                    qvec3d normal{};
+                    normal[axis] = sign;
+                    planes.emplace_back(normal, dist(engine));
+                }
+
+                maxs[axis] = planes.back().dist;
+            }
+
+            // planes that only touch an edge or a corner of the box, within
+            // the epsilon one way or the other
+            for (int j = i % 3; j > 0; j--) {
+                const qvec3d normal = qv::normalize(qvec3d{1.0, 1.0, j == 1 ? 0.0 : 1.0});
+                planes.emplace_back(normal, qv::dot(normal, maxs) + unit(engine) * DEFAULT_ON_EPSILON);
+            }
+        }
+
+        for (int j = count(engine); j > 0; j--) {
+            planes.emplace_back(random_normal(), dist(engine));
+        }
+
+        // duplicates and nearly coplanar copies of some of the planes
+        std::uniform_int_distribution<size_t> pick(0, planes.size() - 1);
+        for (int j = i % 4; j > 0; j--) {
+            const qplane3d &plane = planes[pick(engine)];
+
+            switch (j) {
+                case 1: planes.push_back(plane); break;
+                case 2: planes.emplace_back(plane.normal, plane.dist + unit(engine) * 0.05); break;
+                case 3: {
+                    const qvec3d normal = qv::normalize(plane.normal + random_normal() * 1e-4);
+                    planes.emplace_back(normal, plane.dist + unit(engine) * 1e-3);
+                    break;
+                }
+            }
+        }
+
+        std::shuffle(planes.begin(), planes.end(), engine);
+
+        std::vector<qplane3d> kept = planes;
+        RemoveRedundantPlanes(kept);
+
+        std::vector<qplane3d> expected = planes;
+        RemoveRedundantPlanesReference(expected);
+
+        EXPECT_EQ(kept, expected);
+    }
+}
+
 TEST(bsputil, extractTextures)
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_extract_textures.map");
@@ -1,9 +1,12 @@
 #include <gtest/gtest.h>
 
 #include <filesystem>
+#include <fstream>
+#include <sstream>
 #include <common/bspfile.hh>
 #include <common/bspfile_q1.hh>
 #include <common/bspfile_q2.hh>
+#include <common/cmdlib.hh>
 #include <common/imglib.hh>
 #include <common/settings.hh>
 #include <testmaps.hh>
@@ -368,6 +371,88 @@ TEST(imglib, png)
     EXPECT_EQ(texture->height_scale, 1);
 }
 
+TEST(imglib, pngTextureCache)
+{
+    auto *game = bspver_q2.game;
+    auto wal_metadata_path = std::filesystem::path(testmaps_dir) / "q2_wal_metadata";
+    auto cache_path = std::filesystem::temp_directory_path() / "ericw-tools-texturecache-test";
+    std::filesystem::remove_all(cache_path);
+
+    settings::common_settings settings;
+    settings.paths.add_value(wal_metadata_path.string(), settings::source::COMMANDLINE);
+    settings.texturecache.set_value(cache_path, settings::source::COMMANDLINE);
+
+    game->init_filesystem("placeholder.map", settings);
+
+    // first load decodes the png and fills the cache
+    auto [decoded, _0, _1] = img::load_texture("e1u1/yellow32x32", false, game, settings);
+    ASSERT_TRUE(decoded);
+    ASSERT_FALSE(std::filesystem::is_empty(cache_path));
+
+    // the entry is keyed by the png's contents, so the png has to stay; mark
+    // the last pixel of the entry instead, to tell a cache hit from a decode
+    std::vector<std::filesystem::path> entries{
+        std::filesystem::directory_iterator(cache_path), std::filesystem::directory_iterator()};
+    ASSERT_EQ(entries.size(), 1);
+    {
+        std::fstream entry(entries[0], std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        entry.seekp(-static_cast<std::streamoff>(sizeof(qvec4b)), std::ios_base::end);
+        entry.write("\x01\x02\x03\x04", sizeof(qvec4b));
+        ASSERT_TRUE(entry);
+    }
+
+    // second load comes from the cache, and should be identical but for the mark
+    auto [cached, _2, _3] = img::load_texture("e1u1/yellow32x32", false, game, settings);
+    ASSERT_TRUE(cached);
+
+    EXPECT_EQ(cached->meta.name, decoded->meta.name);
+    EXPECT_EQ(cached->meta.width, decoded->meta.width);
+    EXPECT_EQ(cached->meta.height, decoded->meta.height);
+    EXPECT_EQ(cached->meta.extension, decoded->meta.extension);
+    EXPECT_EQ(cached->width, decoded->width);
+    EXPECT_EQ(cached->height, decoded->height);
+
+    ASSERT_EQ(cached->pixels.size(), decoded->pixels.size());
+    EXPECT_EQ(cached->pixels.back(), qvec4b(1, 2, 3, 4));
+    EXPECT_TRUE(std::equal(cached->pixels.begin(), cached->pixels.end() - 1, decoded->pixels.begin()));
+
+    // the average color is stored with the pixels, so it's the decoded one
+    ASSERT_TRUE(cached->pixelsAverage);
+    EXPECT_EQ(*cached->pixelsAverage, img::calculate_average(decoded->pixels));
+
+    // a header whose size doesn't fit in the file is ignored, and the png
+    // decoded again
+    {
+        std::fstream entry(entries[0], std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        entry.seekp(8); // past the magic and version
+        entry.write("\x00\x00\x01\x00\x00\x00\x01\x00", 8);
+        ASSERT_TRUE(entry);
+    }
+
+    auto [redecoded, _4, _5] = img::load_texture("e1u1/yellow32x32", false, game, settings);
+    ASSERT_TRUE(redecoded);
+    EXPECT_EQ(redecoded->width, 32);
+    EXPECT_EQ(redecoded->height, 32);
+    EXPECT_EQ(redecoded->pixels, decoded->pixels);
+
+    std::filesystem::remove_all(cache_path);
+}
+
+TEST(imglib, loaderWarningPrefix)
+{
+    std::string printed;
+    logging::set_print_callback([&](logging::flag, const char *str) { printed += str; });
+
+    // too short for a dmiptex_t
+    fs::data file = std::vector<uint8_t>(4);
+    EXPECT_FALSE(img::load_mip("short", file, false, bspver_q1.game));
+
+    logging::set_print_callback(nullptr);
+
+    // named after the loader, as logging::funcprint does
+    EXPECT_EQ(printed, "load_mip: Failed to fully load mip short. Header incomplete.\n");
+}
+
 TEST(qmat, transpose)
 {
     // clang-format off
@@ -383,6 +468,42 @@ TEST(qmat, transpose)
     EXPECT_EQ(in.transpose(), exp);
 }
 
+TEST(common, readVector)
+{
+    const std::vector<uint32_t> values{1, 2, 3, 4};
+
+    std::stringstream stream(std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+    WriteVector(stream, values);
+
+    std::vector<uint32_t> roundtrip;
+    ReadVector(stream, roundtrip);
+    EXPECT_TRUE(stream);
+    EXPECT_EQ(values, roundtrip);
+
+    {
+        SCOPED_TRACE("a count larger than the rest of the stream fails without allocating");
+        std::stringstream corrupt(std::ios_base::in | std::ios_base::out | std::ios_base::binary);
+        corrupt <= static_cast<uint32_t>(0xffffffff) <= static_cast<uint32_t>(1);
+
+        std::vector<uint32_t> result;
+        ReadVector(corrupt, result);
+        EXPECT_FALSE(corrupt);
+        EXPECT_TRUE(result.empty());
+    }
+
+    {
+        SCOPED_TRACE("a truncated vector fails");
+        std::string bytes = stream.str();
+        bytes.pop_back();
+        std::stringstream truncated(bytes, std::ios_base::in | std::ios_base::binary);
+
+        std::vector<uint32_t> result;
+        ReadVector(truncated, result);
+        EXPECT_FALSE(truncated);
+        EXPECT_TRUE(result.empty());
+    }
+}
+
 TEST(string, strcasecmp)
 {
     EXPECT_EQ('x', Q_tolower('X'));
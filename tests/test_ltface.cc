@@ -1,9 +1,15 @@
 #include <gtest/gtest.h>
 
+#include <light/checkpoint.hh>
+#include <light/entities.hh>
 #include <light/light.hh>
+#include <light/relight.hh>
 #include <light/ltface.hh>
 #include <light/surflight.hh>
+#include <light/trace_embree.hh>
+#include <light/worker.hh>
 #include <common/bspinfo.hh>
+#include <common/imglib.hh>
 #include <common/litfile.hh>
 #include <qbsp/qbsp.hh>
 #include <testmaps.hh>
@@ -11,6 +17,14 @@
 #include "test_qbsp.hh"
 #include "test_main.hh"
 
+#include <fstream>
+#include <iterator>
+#include <sstream>
+
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+#include <xmmintrin.h>
+#endif
+
 static testresults_t QbspVisLight_Common(const std::filesystem::path &name, std::vector<std::string> extra_qbsp_args,
     std::vector<std::string> extra_light_args, runvis_t run_vis)
 {
@@ -1178,6 +1192,99 @@ TEST(ltfaceQ1, switchableshadowTarget)
     CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {68, 0, 0}, in_shadow, {0, 0, 1}, &lit, &bspx, 32);
 }
 
+TEST(ltfaceQ1, shadowGroup)
+{
+    SCOPED_TRACE("stacked lights share shadow rays, and the switchable shadow still only affects style 0");
+
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_light_shadow_group.map", {});
+
+    // the red style 0 light and the blue style 5 light are at the same origin
+    ASSERT_EQ(1, GetLightShadowGroups().size());
+    EXPECT_EQ(2, GetLightShadowGroups()[0].size());
+
+    const qvec3f not_in_shadow{792, 1240, 944};
+    const qvec3f in_shadow{792, 1264, 944};
+
+    // not in shadow - red in style 0, black in style 32
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {68, 0, 0}, not_in_shadow, {0, 0, 1}, &lit, &bspx, 0);
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {0, 0, 0}, not_in_shadow, {0, 0, 1}, &lit, &bspx, 32);
+
+    // in (switchable) shadow - black in style 0, red in style 32
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {0, 0, 0}, in_shadow, {0, 0, 1}, &lit, &bspx, 0);
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {68, 0, 0}, in_shadow, {0, 0, 1}, &lit, &bspx, 32);
+
+    // the styled light isn't switched by the shadow, so it's blue either way
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {0, 0, 68}, not_in_shadow, {0, 0, 1}, &lit, &bspx, 5);
+    CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {0, 0, 68}, in_shadow, {0, 0, 1}, &lit, &bspx, 5);
+}
+
+// -extraadaptive output is close to the -extra4 reference
+static void CheckExtraAdaptive(const mbsp_t &reference, const mbsp_t &bsp)
+{
+    // same geometry, and light that only reaches a few samples of a luxel
+    // still gives it the style, so the lightmaps are laid out the same
+    for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+        EXPECT_EQ(reference.dfaces[i].styles, bsp.dfaces[i].styles) << "face " << i;
+    }
+    ASSERT_EQ(reference.dlightdata.size(), bsp.dlightdata.size());
+    ASSERT_FALSE(bsp.dlightdata.empty());
+
+    size_t total_diff = 0, num_off = 0;
+
+    for (size_t i = 0; i < bsp.dlightdata.size(); i++) {
+        const int diff = std::abs(static_cast<int>(reference.dlightdata[i]) - static_cast<int>(bsp.dlightdata[i]));
+        total_diff += diff;
+        num_off += (diff > 8);
+    }
+
+    EXPECT_LT(static_cast<double>(total_diff) / bsp.dlightdata.size(), 1.0);
+    EXPECT_LT(num_off, bsp.dlightdata.size() / 100);
+}
+
+TEST(ltfaceQ1, extraAdaptive)
+{
+    SCOPED_TRACE("-extraadaptive is close to -extra4, with fewer rays");
+
+    // -profile, to count the rays
+    const auto profile_path = fs::temp_directory_path() / "q1_light_extraadaptive.profile.json";
+
+    auto [reference, reference_bspx, reference_lit] = QbspVisLight_Q1(
+        "q1_light_switchableshadow_target.map", {"-extra4", "-profile", profile_path.string()});
+    const uint64_t reference_rays = c_rays_traced.total();
+
+    auto [bsp, bspx, lit] = QbspVisLight_Q1(
+        "q1_light_switchableshadow_target.map", {"-extra4", "-extraadaptive", "-profile", profile_path.string()});
+    const uint64_t rays = c_rays_traced.total();
+
+    fs::remove(profile_path);
+
+    CheckExtraAdaptive(reference, bsp);
+
+    // the faces are small, and some of the light only reaches their edges,
+    // so most of the luxels are supersampled anyway
+    EXPECT_LT(rays, reference_rays);
+}
+
+TEST(ltfaceQ2, extraAdaptive)
+{
+    SCOPED_TRACE("-extraadaptive is close to -extra4, with far fewer rays");
+
+    const auto profile_path = fs::temp_directory_path() / "q2_light_extraadaptive.profile.json";
+
+    auto [reference, reference_bspx] =
+        QbspVisLight_Q2("q2_light_translucency.map", {"-extra4", "-profile", profile_path.string()});
+    const uint64_t reference_rays = c_rays_traced.total();
+
+    auto [bsp, bspx] = QbspVisLight_Q2(
+        "q2_light_translucency.map", {"-extra4", "-extraadaptive", "-profile", profile_path.string()});
+    const uint64_t rays = c_rays_traced.total();
+
+    fs::remove(profile_path);
+
+    CheckExtraAdaptive(reference, bsp);
+    EXPECT_LT(rays, reference_rays / 2);
+}
+
 TEST(ltfaceQ1, surflightGroup)
 {
     auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_light_surflight_group.map", {});
@@ -1192,3 +1299,403 @@ TEST(ltfaceQ1, surflightGroup)
         CheckFaceLuxelAtPoint(&bsp, &bsp.dmodels[0], {0, 0, 75}, {720, 1376, 960}, {0, 0, 1}, &lit, &bspx);
     }
 }
+
+// the directory QbspVisLight_Q2 writes the .bsp to, which light writes its
+// side files (.lightstate, .lightcache, ...) next to
+static fs::path Q2BspDir()
+{
+    fs::path bsp_dir = fs::path(test_quake2_maps_dir);
+    if (bsp_dir.empty()) {
+        bsp_dir = fs::current_path();
+    }
+    return bsp_dir;
+}
+
+TEST(ltfaceQ2, checkpoint)
+{
+    auto [reference, reference_bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce"});
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-checkpoint", "1"});
+
+    // batching the faces doesn't change the result
+    EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+
+    // and the checkpoint is removed once the lightmaps are written
+    EXPECT_FALSE(fs::exists(Q2BspDir() / "q2_light_flush.lightstate"));
+}
+
+// runs light again on the .bsp that a QbspVisLight_Q2 call for `name` compiled
+static mbsp_t LightQ2Again(const std::filesystem::path &name, std::vector<std::string> extra_light_args)
+{
+    auto bsp_path = Q2BspDir() / name.filename();
+    bsp_path.replace_extension(".bsp");
+
+    auto wal_metadata_path = std::filesystem::path(testmaps_dir) / "q2_wal_metadata";
+
+    std::vector<std::string> light_args{"", "-nodefaultpaths", "-path", wal_metadata_path.string()};
+    for (auto &arg : extra_light_args) {
+        light_args.push_back(arg);
+    }
+    light_args.push_back(bsp_path.string());
+
+    light_main(light_args);
+
+    bspdata_t bspdata;
+    LoadBSPFile(bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    return std::move(std::get<mbsp_t>(bspdata.bsp));
+}
+
+TEST(ltfaceQ2, checkpointResume)
+{
+    auto [reference, reference_bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "2"});
+
+    const fs::path state = Q2BspDir() / "q2_light_flush.lightstate";
+    fs::remove(state);
+
+    // light stops, as if killed, when it's about to start the second bounce;
+    // the phase headers are PROGRESS messages, which -noverbose turned off
+    struct interrupted_t
+    {
+    };
+    const auto saved_mask = logging::mask;
+    logging::mask |= logging::flag::PROGRESS;
+
+    auto interrupt = [&]() {
+        logging::set_print_callback([](logging::flag, const char *str) {
+            if (string_icontains(str, "Indirect Lighting (pass 1)")) {
+                throw interrupted_t{};
+            }
+        });
+        EXPECT_THROW(LightQ2Again("q2_light_flush.map", {"-bounce", "2", "-checkpoint", "1"}), interrupted_t);
+        logging::set_print_callback(nullptr);
+    };
+
+    bool resumed = false, ignored = false;
+    auto watch = [&]() {
+        resumed = ignored = false;
+        logging::set_print_callback([&](logging::flag, const char *str) {
+            resumed = resumed || string_icontains(str, "resuming from");
+            ignored = ignored || string_icontains(str, "ignoring it");
+        });
+    };
+
+    {
+        SCOPED_TRACE("resuming after the first bounce gives the same lightmaps as a full run");
+        interrupt();
+        ASSERT_TRUE(fs::exists(state));
+
+        watch();
+        auto bsp = LightQ2Again("q2_light_flush.map", {"-bounce", "2", "-checkpoint", "1"});
+        logging::set_print_callback(nullptr);
+
+        EXPECT_TRUE(resumed);
+        EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+        EXPECT_FALSE(fs::exists(state));
+    }
+
+    {
+        SCOPED_TRACE("resuming halfway through the second bounce uses the bounce lights in the file");
+
+        // the map is too small to be split into batches, so do what light
+        // does when it's killed between two of them: light the first half of
+        // the faces for the second bounce, whose bounce lights were just
+        // made, and save the state with them
+        logging::set_print_callback([&](logging::flag, const char *str) {
+            if (!string_icontains(str, "Indirect Lighting (pass 1)")) {
+                return;
+            }
+
+            const mbsp_t *light_bsp = point_query.bsp();
+            std::span<lightsurf_t> surfaces = LightSurfaces();
+            const uint32_t faces_done = surfaces.size() / 2;
+
+            for (uint32_t i = 0; i < faces_done; i++) {
+                if (Face_IsLightmapped(light_bsp, &light_bsp->dfaces[i])) {
+#if defined(HAVE_EMBREE) && defined(__SSE2__)
+                    _MM_SET_FLUSH_ZERO_MODE(_MM_FLUSH_ZERO_ON);
+#endif
+                    IndirectLightFace(light_bsp, surfaces[i], light_options, 1);
+                }
+            }
+
+            // phase 2 is the second indirect pass
+            const uint64_t key = LightCheckpointKey(Q2BspDir() / "q2_light_flush.bsp", light_options);
+            EXPECT_TRUE(SaveLightState(state, key, {2, faces_done}, surfaces));
+            throw interrupted_t{};
+        });
+        EXPECT_THROW(LightQ2Again("q2_light_flush.map", {"-bounce", "2", "-checkpoint", "1"}), interrupted_t);
+        logging::set_print_callback(nullptr);
+        ASSERT_TRUE(fs::exists(state));
+
+        bool resumed_mid_phase = false;
+        logging::set_print_callback([&](logging::flag, const char *str) {
+            resumed_mid_phase = resumed_mid_phase || string_icontains(str, "2 phases done");
+        });
+        auto bsp = LightQ2Again("q2_light_flush.map", {"-bounce", "2", "-checkpoint", "1"});
+        logging::set_print_callback(nullptr);
+
+        EXPECT_TRUE(resumed_mid_phase);
+        EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+        EXPECT_FALSE(fs::exists(state));
+    }
+
+    {
+        SCOPED_TRACE("a truncated state file is ignored");
+        interrupt();
+        ASSERT_TRUE(fs::exists(state));
+        fs::resize_file(state, fs::file_size(state) / 2);
+
+        watch();
+        auto bsp = LightQ2Again("q2_light_flush.map", {"-bounce", "2", "-checkpoint", "1"});
+        logging::set_print_callback(nullptr);
+
+        EXPECT_FALSE(resumed);
+        EXPECT_TRUE(ignored);
+        EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+        EXPECT_FALSE(fs::exists(state));
+    }
+
+    {
+        SCOPED_TRACE("a state file saved with other options is ignored");
+        interrupt();
+        ASSERT_TRUE(fs::exists(state));
+
+        watch();
+        LightQ2Again("q2_light_flush.map", {"-bounce", "1", "-checkpoint", "1"});
+        logging::set_print_callback(nullptr);
+
+        EXPECT_FALSE(resumed);
+        EXPECT_TRUE(ignored);
+        EXPECT_FALSE(fs::exists(state));
+    }
+
+    logging::mask = saved_mask;
+}
+
+TEST(ltface, lightSurfaceStateMismatch)
+{
+    auto roundtrip = [](size_t num_lightmap_samples) {
+        lightsurf_t surf{};
+        surf.samples.resize(4);
+        surf.lightmapsByStyle.push_back({0, std::vector<lightsample_t>(num_lightmap_samples), {}});
+
+        std::ostringstream written(std::ios_base::out | std::ios_base::binary);
+        WriteLightSurfaceState(written, surf);
+
+        std::istringstream stream(written.str(), std::ios_base::in | std::ios_base::binary);
+        light_surface_state_t state;
+        return ReadLightSurfaceState(stream, surf, state);
+    };
+
+    EXPECT_TRUE(roundtrip(4));
+
+    // the occlusion matches the face, but the lightmap doesn't
+    EXPECT_FALSE(roundtrip(3));
+    EXPECT_FALSE(roundtrip(0));
+}
+
+TEST(ltfaceQ2, traceCache)
+{
+    const fs::path cache = Q2BspDir() / "q2_light_translucency.embree";
+    fs::remove(cache);
+
+    auto [reference, reference_bspx] = QbspVisLight_Q2("q2_light_translucency.map", {});
+
+    bool loaded = false;
+    logging::set_print_callback(
+        [&](logging::flag, const char *str) { loaded = loaded || string_icontains(str, "loaded triangles from"); });
+
+    // the first run builds the triangles and saves them, the second loads them
+    auto miss = LightQ2Again("q2_light_translucency.map", {"-tracecache"});
+    EXPECT_FALSE(loaded);
+    ASSERT_TRUE(fs::exists(cache));
+    // written to a temporary file first, which is renamed over the cache
+    EXPECT_FALSE(fs::exists(fs::path(cache).concat(".tmp")));
+
+    auto hit = LightQ2Again("q2_light_translucency.map", {"-tracecache"});
+    EXPECT_TRUE(loaded);
+
+    logging::set_print_callback(nullptr);
+    fs::remove(cache);
+
+    EXPECT_EQ(reference.dlightdata, miss.dlightdata);
+    EXPECT_EQ(reference.dlightdata, hit.dlightdata);
+}
+
+TEST(ltfaceQ2, incremental)
+{
+    const fs::path cache = Q2BspDir() / "q2_light_flush.lightcache";
+    fs::remove(cache);
+
+    // -profile, to count the restored faces
+    const auto profile_path = fs::temp_directory_path() / "q2_light_incremental.profile.json";
+
+    auto [reference, reference_bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce"});
+
+    // the first run lights everything and writes the cache
+    auto [cold, cold_bspx] =
+        QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-incremental", "-profile", profile_path.string()});
+    EXPECT_EQ(reference.dlightdata, cold.dlightdata);
+    EXPECT_TRUE(fs::exists(cache));
+    EXPECT_EQ(0, c_faces_restored.total());
+
+    // nothing changed, so the second one takes every face from the cache
+    auto [warm, warm_bspx] =
+        QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-incremental", "-profile", profile_path.string()});
+    EXPECT_EQ(reference.dlightdata, warm.dlightdata);
+    EXPECT_GT(c_faces_restored.total(), 0);
+
+    // a cache whose counts run past the end of the file is ignored, rather
+    // than sizing anything from them
+    const std::string good = [&]() {
+        std::ifstream stream(cache, std::ios_base::in | std::ios_base::binary);
+        return std::string{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+    }();
+
+    // the header is the magic, version, key and face count: 20 bytes; then
+    // the first face's light count, lights and state size
+    uint32_t num_lights;
+    ASSERT_GE(good.size(), 24);
+    memcpy(&num_lights, good.data() + 20, sizeof(num_lights));
+    ASSERT_GE(good.size(), 28 + num_lights * sizeof(uint64_t));
+
+    for (size_t offset : {size_t{20}, 24 + num_lights * sizeof(uint64_t)}) {
+        SCOPED_TRACE(offset);
+
+        std::string corrupt = good;
+        const uint32_t huge = 0xfffffff0;
+        memcpy(corrupt.data() + offset, &huge, sizeof(huge));
+        std::ofstream(cache, std::ios_base::out | std::ios_base::binary) << corrupt;
+
+        auto [relit, relit_bspx] =
+            QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "-incremental", "-profile", profile_path.string()});
+        EXPECT_EQ(reference.dlightdata, relit.dlightdata);
+        EXPECT_EQ(0, c_faces_restored.total());
+    }
+
+    fs::remove(cache);
+    fs::remove(profile_path);
+}
+
+// the .lightcache and .lightstate keys cover the textures light loaded from
+// disk, since translucent surfaces tint the light with them
+TEST(ltfaceQ2, incrementalTextures)
+{
+    QbspVisLight_Q2("q2_light_translucency.map", {});
+
+    bspdata_t bspdata;
+    LoadBSPFile(qbsp_options.bsp_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    const uint64_t key = LightRelightKey(bspdata, qbsp_options.bsp_path, light_options);
+    EXPECT_EQ(key, LightRelightKey(bspdata, qbsp_options.bsp_path, light_options));
+
+    auto it = std::find_if(
+        img::textures.begin(), img::textures.end(), [](auto &pair) { return !pair.second.pixels.empty(); });
+    ASSERT_NE(it, img::textures.end());
+
+    // so does the -checkpoint key
+    const uint64_t checkpoint_key = LightCheckpointKey(qbsp_options.bsp_path, light_options);
+
+    qvec4b &pixel = it->second.pixels[0];
+    pixel[0] ^= 0xff;
+    EXPECT_NE(key, LightRelightKey(bspdata, qbsp_options.bsp_path, light_options));
+    EXPECT_NE(checkpoint_key, LightCheckpointKey(qbsp_options.bsp_path, light_options));
+    pixel[0] ^= 0xff;
+}
+
+TEST(ltfaceQ2, incrementalEdits)
+{
+    // edited copies of q2_light_translucency.map, under the same file name so
+    // they share the .bsp and the .lightcache; the lights get a short linear
+    // falloff, so each one only reaches the faces near it
+    const fs::path map_dir = fs::temp_directory_path() / "q2_light_incremental";
+    fs::create_directories(map_dir);
+    const fs::path map_path = map_dir / "q2_light_translucency.map";
+
+    std::string map;
+    {
+        std::ifstream stream(fs::path(testmaps_dir) / "q2_light_translucency.map");
+        map.assign(std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>());
+    }
+    auto replace = [&map](std::string_view from, std::string_view to) {
+        const size_t pos = map.find(from);
+        ASSERT_NE(pos, std::string::npos) << from;
+        map.replace(pos, from.size(), to);
+    };
+    auto write_map = [&]() {
+        std::ofstream stream(map_path);
+        stream << map;
+    };
+
+    for (size_t pos; (pos = map.find("\"delay\" \"3\"")) != std::string::npos;) {
+        map.replace(pos, 11, "\"delay\" \"0\"");
+    }
+
+    const fs::path cache = Q2BspDir() / "q2_light_translucency.lightcache";
+    fs::remove(cache);
+
+    const auto profile_path = fs::temp_directory_path() / "q2_light_incremental.profile.json";
+
+    write_map();
+    QbspVisLight_Q2(map_path, {"-bounce", "-incremental"});
+    ASSERT_TRUE(fs::exists(cache));
+
+    // each edit relights from the cache the previous edit left, and has to
+    // come out the same as lighting the edited map from scratch
+    auto check_edit = [&](const char *what) {
+        SCOPED_TRACE(what);
+        write_map();
+
+        auto [bsp, bspx] = QbspVisLight_Q2(map_path, {"-bounce", "-incremental", "-profile", profile_path.string()});
+        const uint64_t restored = c_faces_restored.total();
+
+        auto [reference, reference_bspx] = QbspVisLight_Q2(map_path, {"-bounce"});
+
+        EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+        EXPECT_GT(restored, 0);
+    };
+
+    replace("\"origin\" \"152 -96 248\"\n\"light\" \"150\"", "\"origin\" \"152 -96 248\"\n\"light\" \"100\"");
+    check_edit("change a light's brightness");
+
+    replace("\"origin\" \"-296 -96 248\"", "\"origin\" \"-264 -64 232\"");
+    check_edit("move a light");
+
+    map += "{\n\"classname\" \"light\"\n\"origin\" \"-616 592 200\"\n\"light\" \"150\"\n\"_color\" \"1 0 0\"\n}\n";
+    check_edit("add a light");
+
+    replace("{\n\"classname\" \"light\"\n\"origin\" \"-616 -96 248\"\n\"light\" \"150\"\n\"delay\" \"0\"\n"
+            "\"_anglesense\" \"0\"\n}\n",
+        "");
+    check_edit("remove a light");
+
+    fs::remove(cache);
+    fs::remove(profile_path);
+    fs::remove_all(map_dir);
+}
+
+TEST(ltfaceQ2, workers)
+{
+    auto [reference, reference_bspx] = QbspVisLight_Q2("q2_light_flush.map", {"-bounce", "2"});
+
+    // the tests don't run from the light executable, so the workers need to be pointed at it
+    auto [bsp, bspx] = QbspVisLight_Q2("q2_light_flush.map",
+        {"-bounce", "2", "-workers", "3", "-workercommand", fmt::format("\"{}\"", LIGHT_EXECUTABLE)});
+
+    // the workers light the same faces the same way, just in other processes
+    EXPECT_EQ(reference.dlightdata, bsp.dlightdata);
+
+    // the files the run passed between the processes, and the workers'
+    // logs, are all removed with the .lightwork directory
+    const fs::path bsp_path = Q2BspDir() / "q2_light_flush.bsp";
+    EXPECT_FALSE(fs::exists(LightWorkerStatePath(bsp_path)));
+
+    for (int32_t worker = 0; worker < 3; worker++) {
+        EXPECT_FALSE(fs::exists(LightWorkerResultPath(bsp_path, worker))) << worker;
+        EXPECT_FALSE(fs::exists(LightWorkerLogPath(bsp_path, worker))) << worker;
+    }
+
+    EXPECT_FALSE(fs::exists(fs::path(bsp_path).replace_extension("lightwork")));
+}
@@ -0,0 +1,208 @@
+#include <gtest/gtest.h>
+
+#include <common/fs.hh>
+#include <common/json.hh>
+#include <common/log.hh>
+#include <common/mapfile.hh>
+#include <maputil/maputil.hh>
+
+#include <fstream>
+#include <iterator>
+
+#include "testmaps.hh"
+
+// runs the Lua `script` on a testmap with maputil, and loads the .map it saves
+static mapfile::map_file_t MaputilScript(const std::filesystem::path &name, std::string_view script)
+{
+    auto map_path = std::filesystem::path(testmaps_dir) / name;
+    auto script_path = fs::temp_directory_path() / name.stem().concat(".lua");
+    auto out_path = fs::temp_directory_path() / name.stem().concat("-maputil.map");
+
+    std::ofstream(script_path) << script;
+    fs::remove(out_path);
+
+    EXPECT_EQ(0, maputil_main({"", "--load", map_path.string(), "--script", script_path.string(), "--save",
+                     out_path.string()}));
+
+    std::ifstream stream(out_path);
+    std::string text{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+    return mapfile::parse(text, {out_path.string()});
+}
+
+static const char *Value(const mapfile::map_entity_t &entity, const char *key)
+{
+    return entity.epairs.has(key) ? entity.epairs.get(key).c_str() : "(missing)";
+}
+
+TEST(maputil, scriptEdits)
+{
+#ifndef USE_LUA
+    GTEST_SKIP() << "maputil was built without Lua";
+#endif
+
+    // q1_litwater.map is worldspawn, info_player_start, four lights, then two func_groups
+    const auto map = MaputilScript("q1_litwater.map", R"(
+        local world = entities[1]
+        local light = entities[3]
+        local group = entities[7]
+
+        -- removing while looping forwards: the indices don't shift until the script is done
+        for i = 1, #entities do
+            if entities[i].dict.classname == "light" then
+                entities[i] = nil
+            end
+        end
+
+        for i = 1, #group.brushes do
+            group.brushes[i] = nil
+        end
+
+        -- proxies still name the entities they were taken from, or fail once those are gone
+        group.dict.note = "still the first func_group"
+        world.dict.light_proxy = tostring(pcall(function() return light.dict end))
+        world.dict.hole = tostring(entities[3] == nil)
+
+        local count = 0
+        for _ in pairs(entities) do
+            count = count + 1
+        end
+        world.dict.count = tostring(count)
+
+        world.dict._tb_def = nil
+
+        -- a side's fields are kept, so editing them in place edits the side
+        local side = world.brushes[1][1]
+        side.raw.valve.shift[1] = 5
+        side.plane_points[1][3] = side.plane_points[1][3] + 8
+        side.texture = "edited"
+
+        local raw = side.raw
+        world.brushes[1][2].raw = raw
+        raw.valve.rotate = 90
+    )");
+
+    ASSERT_EQ(map.entities.size(), 4);
+    EXPECT_STREQ(Value(map.entities[1], "classname"), "info_player_start");
+    EXPECT_STREQ(Value(map.entities[2], "classname"), "func_group");
+    EXPECT_STREQ(Value(map.entities[3], "classname"), "func_group");
+
+    auto &group = map.entities[2];
+    EXPECT_STREQ(Value(group, "note"), "still the first func_group");
+    EXPECT_TRUE(group.brushes.empty());
+    EXPECT_FALSE(map.entities[3].brushes.empty());
+
+    auto &world = map.entities[0];
+    EXPECT_STREQ(Value(world, "light_proxy"), "false");
+    EXPECT_STREQ(Value(world, "hole"), "true");
+    EXPECT_STREQ(Value(world, "count"), "4");
+    EXPECT_FALSE(world.epairs.has("_tb_def"));
+    EXPECT_STREQ(Value(world, "_litwater"), "1");
+
+    auto &side = world.brushes[0].faces[0];
+    EXPECT_EQ(side.texture, "edited");
+    EXPECT_EQ(side.planepts[0], qvec3d(-416, -128, 40));
+
+    auto &raw = std::get<mapfile::texdef_valve_t>(side.raw);
+    EXPECT_EQ(raw.shift[0], 5);
+    EXPECT_EQ(raw.rotate, 90);
+
+    // the table assigned to the second side is kept too
+    auto &raw2 = std::get<mapfile::texdef_valve_t>(world.brushes[0].faces[1].raw);
+    EXPECT_EQ(raw2.shift[0], 5);
+    EXPECT_EQ(raw2.rotate, 90);
+    EXPECT_EQ(raw2.axis, raw.axis);
+}
+
+TEST(maputil, scriptTypeErrors)
+{
+#ifndef USE_LUA
+    GTEST_SKIP() << "maputil was built without Lua";
+#endif
+
+    // wrongly typed values raise Lua errors, which the script can catch,
+    // and leave what they were assigned to as it was
+    const auto map = MaputilScript("q1_litwater.map", R"(
+        local world = entities[1]
+        local function try(f)
+            local ok, err = pcall(f)
+            return ok and "ok" or err
+        end
+
+        local brush = world.brushes[1]
+        local num_brushes = #world.brushes
+
+        world.dict.dict_number = try(function() entities[2].dict = 5 end)
+        world.dict.nested_side = try(function() world.brushes[num_brushes + 1] = { { texture = 5 } } end)
+        world.dict.nested_pair = try(function() entities[2].dict = { { "classname" } } end)
+        world.dict.plane_points = try(function() brush[1].plane_points = { 1, 2, 3 } end)
+
+        local light = entities[3]
+        entities[3] = nil
+        world.dict.removed = try(function() entities[4] = light end)
+        world.dict.count = tostring(#world.brushes == num_brushes)
+    )");
+
+    ASSERT_EQ(map.entities.size(), 7);
+    auto &world = map.entities[0];
+
+    EXPECT_NE(std::string(Value(world, "dict_number")).find("table or proxy expected, got number"), std::string::npos);
+    EXPECT_NE(std::string(Value(world, "nested_side")).find("side texture must be a string"), std::string::npos);
+    EXPECT_NE(std::string(Value(world, "nested_pair")).find("dict entries must be [ key, value ]"), std::string::npos);
+    EXPECT_NE(std::string(Value(world, "plane_points")).find("plane point must be a table"), std::string::npos);
+    EXPECT_NE(std::string(Value(world, "removed")).find("was removed"), std::string::npos);
+    EXPECT_STREQ(Value(world, "count"), "true");
+
+    // the failed assignments changed nothing
+    EXPECT_STREQ(Value(map.entities[1], "classname"), "info_player_start");
+    EXPECT_EQ(std::distance(map.entities[1].epairs.begin(), map.entities[1].epairs.end()), 2);
+    EXPECT_STREQ(Value(map.entities[2], "classname"), "light");
+}
+
+TEST(maputil, scriptErrorSkipsSave)
+{
+#ifndef USE_LUA
+    GTEST_SKIP() << "maputil was built without Lua";
+#endif
+
+    auto map_path = std::filesystem::path(testmaps_dir) / "q1_litwater.map";
+    auto script_path = fs::temp_directory_path() / "q1_litwater-error.lua";
+    auto out_path = fs::temp_directory_path() / "q1_litwater-error.map";
+
+    std::ofstream(script_path) << R"(
+        entities[1].dict.half = "edited"
+        error("stop here")
+    )";
+    fs::remove(out_path);
+
+    EXPECT_THROW(maputil_main({"", "--load", map_path.string(), "--script", script_path.string(), "--save",
+                     out_path.string()}),
+        ericwtools_error);
+    EXPECT_FALSE(fs::exists(out_path));
+
+    fs::remove(script_path);
+}
+
+TEST(maputil, profile)
+{
+    auto map_path = std::filesystem::path(testmaps_dir) / "q1_litwater.map";
+    auto out_path = fs::temp_directory_path() / "q1_litwater-profile.map";
+    auto profile_path = fs::temp_directory_path() / "q1_litwater-maputil.profile.json";
+
+    fs::remove(profile_path);
+
+    EXPECT_EQ(0, maputil_main({"", "-profile", profile_path.string(), "--load", map_path.string(), "--save",
+                     out_path.string()}));
+
+    std::ifstream f(profile_path);
+    ASSERT_TRUE(f);
+    json profile = json::parse(f);
+
+    EXPECT_GT(profile.at("peak_memory").get<uint64_t>(), 0);
+
+    // only qbsp, vis and light count allocations
+    EXPECT_FALSE(profile.at("counters").contains("allocations"));
+
+    f.close();
+    fs::remove(profile_path);
+    fs::remove(out_path);
+}
@@ -7,15 +7,19 @@
 #include <qbsp/csg.hh>
 #include <common/fs.hh>
 #include <common/bsputils.hh>
+#include <common/bspquery.hh>
 #include <common/decompile.hh>
 #include <common/mapfile.hh>
 #include <common/prtfile.hh>
 #include <common/qvec.hh>
 #include <common/log.hh>
+#include <common/json.hh>
+#include <common/profiler.hh>
 #include <testmaps.hh>
 
 #include <algorithm>
 #include <fstream>
+#include <iterator>
 #include <cstring>
 #include <stdexcept>
 #include <tuple>
@@ -234,6 +238,45 @@ void CheckFilled(const mbsp_t &bsp)
     }
 }
 
+void CheckBspPointQuery(const mbsp_t &bsp, const bsp_point_query_t &query)
+{
+    for (size_t modelnum = 0; modelnum < bsp.dmodels.size(); modelnum++) {
+        const dmodelh2_t *model = &bsp.dmodels[modelnum];
+        SCOPED_TRACE(modelnum);
+
+        // grid of integer points, so plenty of them are on (or within the epsilon of) axial planes
+        std::vector<qvec3d> points;
+        for (double x = model->mins[0] - 16; x <= model->maxs[0] + 16; x += 8) {
+            for (double y = model->mins[1] - 16; y <= model->maxs[1] + 16; y += 8) {
+                for (double z = model->mins[2] - 16; z <= model->maxs[2] + 16; z += 8) {
+                    points.emplace_back(x, y, z);
+                    points.emplace_back(x + 0.05, y + 0.5, z + 3.3);
+                }
+            }
+        }
+        ASSERT_FALSE(points.empty());
+
+        std::vector<const mleaf_t *> leafs(points.size());
+        auto batch_in_solid = std::make_unique<bool[]>(points.size());
+
+        query.points_in_solid(modelnum, points, std::span(batch_in_solid.get(), points.size()));
+        query.find_leafs<double>(modelnum, points, leafs);
+
+        for (size_t i = 0; i < points.size(); i++) {
+            const qvec3d &point = points[i];
+            const bool expected_solid = Light_PointInSolid(&bsp, model, point);
+
+            ASSERT_EQ(expected_solid, query.point_in_solid(modelnum, point)) << point;
+            ASSERT_EQ(expected_solid, batch_in_solid[i]) << point;
+
+            const mleaf_t *expected_leaf = BSP_FindLeafAtPoint(&bsp, model, point);
+
+            ASSERT_EQ(expected_leaf, query.find_leaf(modelnum, point)) << point;
+            ASSERT_EQ(expected_leaf, leafs[i]) << point;
+        }
+    }
+}
+
 #if 0
 mbsp_t LoadBsp(const std::filesystem::path &path_in)
 {
@@ -536,6 +579,138 @@ TEST(testmapsQ1, optionsReset2)
     EXPECT_FALSE(qbsp_options.noskip.value());
 }
 
+TEST(testmapsQ1, profile)
+{
+    auto profile_path = std::filesystem::temp_directory_path() / "qbsp_simple_sealed.profile.json";
+
+    LoadTestmap("qbsp_simple_sealed.map", {"-profile", profile_path.string()});
+
+    // LoadTestmap doesn't go through qbsp_main, so write it here
+    profiler::close();
+    EXPECT_FALSE(profiler::enabled);
+
+    std::ifstream f(profile_path);
+    ASSERT_TRUE(f);
+    json profile = json::parse(f);
+
+    EXPECT_GT(profile.at("peak_memory").get<uint64_t>(), 0);
+    EXPECT_TRUE(profile.at("counters").contains("brushes split"));
+    // the allocations are counted by an operator new that only the qbsp, vis
+    // and light executables link, not the tests
+    EXPECT_FALSE(profile.at("counters").contains("allocations"));
+
+    bool found_brushbsp = false;
+    for (auto &stage : profile.at("stages")) {
+        if (stage.at("name").get<std::string>().ends_with("/BrushBSP")) {
+            found_brushbsp = true;
+            EXPECT_GT(stage.at("calls").get<size_t>(), 0);
+        }
+    }
+    EXPECT_TRUE(found_brushbsp);
+
+    f.close();
+    fs::remove(profile_path);
+}
+
+TEST(testmapsQ1, bspJsonSections)
+{
+    LoadTestmapQ1("qbsp_simple_sealed.map");
+
+    // LoadTestmap writes the full .json
+    const fs::path bsp_path = qbsp_options.bsp_path;
+    const json full = json::parse(std::ifstream(fs::path(bsp_path).replace_extension(".bsp.json")));
+    EXPECT_TRUE(full.contains("faces"));
+    EXPECT_TRUE(full.contains("textures"));
+
+    bspdata_t bspdata;
+    fs::path load_path = bsp_path;
+    LoadBSPFile(load_path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    serialize_bsp_options_t options;
+    options.sections = {"models", "planes", "textures"};
+    options.exclude_sections = {"textures"};
+
+    const fs::path partial_path = fs::path(bsp_path).replace_extension(".partial.json");
+    serialize_bsp(bspdata, std::get<mbsp_t>(bspdata.bsp), partial_path, options);
+
+    const json partial = json::parse(std::ifstream(partial_path));
+    EXPECT_EQ(partial.size(), 2);
+    EXPECT_EQ(partial.at("models"), full.at("models"));
+    EXPECT_EQ(partial.at("planes"), full.at("planes"));
+}
+
+// serialize_bsp streams the file in pieces; the text has to be exactly what
+// dumping the whole document at once would have printed
+TEST(testmapsQ1, bspJsonText)
+{
+    auto check = [](const fs::path &json_path) {
+        SCOPED_TRACE(json_path.string());
+
+        std::ifstream stream(json_path, std::ios_base::in | std::ios_base::binary);
+        const std::string text{std::istreambuf_iterator<char>(stream), std::istreambuf_iterator<char>()};
+
+        EXPECT_EQ(text, json::parse(text).dump(4));
+    };
+
+    // Q1 with a BSPX brush list, and Q2 with brushes and brush sides
+    LoadTestmapQ1("qbspfeatures.map", {"-wrbrushes"});
+    check(fs::path(qbsp_options.bsp_path).replace_extension(".bsp.json"));
+
+    LoadTestmapQ2("q2_detail_wall.map");
+    check(fs::path(qbsp_options.bsp_path).replace_extension(".bsp.json"));
+}
+
+TEST(testmapsQ1, lightmapAtlas)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("qbspfeatures.map");
+
+    for (const size_t max_atlas_size : {DEFAULT_LIGHTMAP_ATLAS_SIZE, size_t(64)}) {
+        SCOPED_TRACE(max_atlas_size);
+
+        const full_atlas_t atlas = build_lightmap_atlas(bsp, bspx, {}, {}, false, false, max_atlas_size);
+
+        if (max_atlas_size == DEFAULT_LIGHTMAP_ATLAS_SIZE) {
+            EXPECT_EQ(atlas.num_atlases, 1);
+            EXPECT_GT(atlas.occupancy(), 0.9);
+        } else {
+            EXPECT_GT(atlas.num_atlases, 1);
+            EXPECT_LE(atlas.atlas_size, max_atlas_size);
+        }
+
+        // recover where each face was placed, and check none of them overlap
+        std::vector<int> owner(atlas.width * atlas.height, -1);
+        size_t covered = 0;
+
+        ASSERT_EQ(atlas.facenum_to_lightmap_uvs.size(), bsp.dfaces.size());
+
+        for (size_t i = 0; i < bsp.dfaces.size(); i++) {
+            const mface_t &face = bsp.dfaces[i];
+            const faceextents_t extents(face, bsp, LMSCALE_DEFAULT);
+            const qvec2f lm = extents.worldToLMCoord(bsp.dvertexes[Face_VertexAtIndex(&bsp, &face, 0)]);
+            const qvec2f uv = atlas.facenum_to_lightmap_uvs.at(i).at(0);
+
+            const int x = std::lround(uv[0] * atlas.width - 0.5f - lm[0]);
+            const int y = std::lround(uv[1] * atlas.height - 0.5f - lm[1]);
+
+            ASSERT_GE(x, 0);
+            ASSERT_GE(y, 0);
+            ASSERT_LE(x + extents.width(), atlas.width);
+            ASSERT_LE(y + extents.height(), atlas.height);
+
+            for (int ty = y; ty < y + extents.height(); ty++) {
+                for (int tx = x; tx < x + extents.width(); tx++) {
+                    ASSERT_EQ(-1, owner[ty * atlas.width + tx]) << "face " << i;
+                    owner[ty * atlas.width + tx] = i;
+                    covered++;
+                }
+            }
+        }
+
+        EXPECT_EQ(covered, atlas.used_samples);
+    }
+}
+
 /**
  * The brushes are touching but not intersecting, so ChopBrushes shouldn't change anything.
  */
@@ -1364,6 +1539,19 @@ TEST_P(ClipFuncWallTest, testBounds)
     EXPECT_EQ(cube_bounds.grow(-1).maxs(), bsp.dmodels[1].maxs);
 }
 
+TEST(testmapsQ1, bspPointQuery)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ1("q1_clip_and_solid_func_wall.map");
+    const bsp_point_query_t query(&bsp);
+
+    CheckBspPointQuery(bsp, query);
+
+    // the func_wall's bolt9 brush is solid in hull 0; its clip brush isn't
+    EXPECT_EQ(CONTENTS_SOLID, query.find_leaf(1, qvec3d{84, 100, 70})->contents);
+    EXPECT_TRUE(query.point_in_solid(1, {84, 100, 70}));
+    EXPECT_FALSE(query.point_in_solid(1, {112, 72, 56}));
+}
+
 /**
  * Lots of features in one map, more for testing in game than automated testing
  */
@@ -1465,6 +1653,53 @@ TEST(testmapsQ1, qbspFuncDetailVariousTypes)
     EXPECT_GT(prt->portalleafs_real, 3);
 }
 
+static void CheckBinaryPrtMatchesText(const std::filesystem::path &name)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ1(name);
+    const auto [bsp_binary, bspx_binary, prt_binary] = LoadTestmapQ1(name, {"-binaryprt"});
+
+    ASSERT_TRUE(prt.has_value());
+    ASSERT_TRUE(prt_binary.has_value());
+
+    EXPECT_EQ(prt->portalleafs, prt_binary->portalleafs);
+    EXPECT_EQ(prt->portalleafs_real, prt_binary->portalleafs_real);
+
+    ASSERT_EQ(prt->portals.size(), prt_binary->portals.size());
+    for (size_t i = 0; i < prt->portals.size(); i++) {
+        EXPECT_EQ(prt->portals[i].leafnums[0], prt_binary->portals[i].leafnums[0]);
+        EXPECT_EQ(prt->portals[i].leafnums[1], prt_binary->portals[i].leafnums[1]);
+        EXPECT_TRUE(prt->portals[i].winding.directional_equal(prt_binary->portals[i].winding));
+    }
+
+    ASSERT_EQ(prt->dleafinfos.size(), prt_binary->dleafinfos.size());
+    for (size_t i = 0; i < prt->dleafinfos.size(); i++) {
+        EXPECT_EQ(prt->dleafinfos[i].cluster, prt_binary->dleafinfos[i].cluster);
+    }
+}
+
+TEST(testmapsQ1, binaryPrt)
+{
+    {
+        SCOPED_TRACE("PRT1");
+        CheckBinaryPrtMatchesText("q1_csg.map");
+    }
+    {
+        SCOPED_TRACE("PRT2");
+        CheckBinaryPrtMatchesText("qbsp_func_detail.map");
+    }
+
+    // -forceprt1 writes text for map editors, with or without detail
+    for (const char *name : {"q1_csg.map", "qbsp_func_detail.map"}) {
+        SCOPED_TRACE(name);
+        LoadTestmapQ1(name, {"-binaryprt", "-forceprt1"});
+
+        std::ifstream f(fs::path(qbsp_options.bsp_path).replace_extension("prt"));
+        std::string magic;
+        std::getline(f, magic);
+        EXPECT_EQ(magic, "PRT1");
+    }
+}
+
 TEST(testmapsQ1, angledBrush)
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ1("qbsp_angled_brush.map");
@@ -10,6 +10,7 @@
 class mapbrush_t;
 struct mapface_t;
 class mapentity_t;
+class bsp_point_query_t;
 
 const mapface_t *Mapbrush_FirstFaceWithTextureName(const mapbrush_t &brush, const std::string &texname);
 mapentity_t &LoadMap(const char *map);
@@ -22,6 +23,9 @@ std::tuple<mbsp_t, bspxentries_t, std::optional<prtfile_t>> LoadTestmapQ1(
     const std::filesystem::path &name, std::vector<std::string> extra_args = {});
 void CheckFilled(const mbsp_t &bsp, hull_index_t hullnum);
 void CheckFilled(const mbsp_t &bsp);
+// checks that `query` (built from `bsp`) agrees with BSP_FindLeafAtPoint and
+// Light_PointInSolid on a grid of points around each model
+void CheckBspPointQuery(const mbsp_t &bsp, const bsp_point_query_t &query);
 std::map<std::string, std::vector<const mface_t *>> MakeTextureToFaceMap(const mbsp_t &bsp);
 const texvecf &GetTexvecs(const char *map, const char *texname);
 std::vector<std::string> TexNames(const mbsp_t &bsp, std::vector<const mface_t *> faces);
@@ -3,9 +3,12 @@
 
 #include <qbsp/map.hh>
 #include <common/bsputils.hh>
+#include <common/bspquery.hh>
 #include <common/qvec.hh>
 
 #include <cstring>
+#include <fstream>
+#include <memory>
 #include <set>
 #include <stdexcept>
 #include <tuple>
@@ -117,6 +120,41 @@ TEST(testmapsQ2, detail)
     EXPECT_EQ(prt->portalleafs, 4);
 }
 
+TEST(testmapsQ2, binaryPrt)
+{
+    // Q2 portals are between clusters, so detail brushes give portalleafs < leafs
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_detail.map");
+    const auto [bsp_binary, bspx_binary, prt_binary] = LoadTestmapQ2("q2_detail.map", {"-binaryprt"});
+
+    ASSERT_TRUE(prt.has_value());
+    ASSERT_TRUE(prt_binary.has_value());
+
+    {
+        std::ifstream f(fs::path(qbsp_options.bsp_path).replace_extension("prt"), std::ios_base::binary);
+        std::array<char, 4> magic{};
+        f.read(magic.data(), magic.size());
+        EXPECT_EQ(std::string_view(magic.data(), magic.size()), "PRTB");
+    }
+
+    EXPECT_EQ(prt->portalleafs, 4);
+    EXPECT_EQ(prt->portalleafs, prt_binary->portalleafs);
+    EXPECT_EQ(prt_binary->portalleafs_real, 0); // not used by Q2
+
+    ASSERT_EQ(prt->portals.size(), prt_binary->portals.size());
+    for (size_t i = 0; i < prt->portals.size(); i++) {
+        EXPECT_EQ(prt->portals[i].leafnums[0], prt_binary->portals[i].leafnums[0]);
+        EXPECT_EQ(prt->portals[i].leafnums[1], prt_binary->portals[i].leafnums[1]);
+        EXPECT_TRUE(prt->portals[i].winding.directional_equal(prt_binary->portals[i].winding));
+    }
+
+    // the leaf -> cluster mapping is in the .bsp, not the portal file
+    EXPECT_TRUE(prt_binary->dleafinfos.empty());
+    ASSERT_EQ(bsp.dleafs.size(), bsp_binary.dleafs.size());
+    for (size_t i = 0; i < bsp.dleafs.size(); i++) {
+        EXPECT_EQ(bsp.dleafs[i].cluster, bsp_binary.dleafs[i].cluster);
+    }
+}
+
 TEST(testmapsQ2, Q2DetailWithNodetail)
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_detail.map", {"-nodetail"});
@@ -530,6 +568,18 @@ TEST(testmapsQ2, bmodelCollision)
     EXPECT_EQ(Q2_CONTENTS_SOLID, BSP_FindLeafAtPoint(&bsp, &bsp.dmodels[1], in_bmodel)->contents);
 }
 
+TEST(testmapsQ2, bspPointQuery)
+{
+    const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_bmodel_collision.map");
+    const bsp_point_query_t query(&bsp);
+
+    CheckBspPointQuery(bsp, query);
+
+    // same point as bmodelCollision
+    EXPECT_EQ(Q2_CONTENTS_SOLID, query.find_leaf(1, qvec3d{-544, -312, -258})->contents);
+    EXPECT_TRUE(query.point_in_solid(1, {-544, -312, -258}));
+}
+
 TEST(testmapsQ2, liquids)
 {
     const auto [bsp, bspx, prt] = LoadTestmapQ2("q2_liquids.map");
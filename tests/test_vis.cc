@@ -1,7 +1,11 @@
 #include <common/bsputils.hh>
 #include <common/qvec.hh>
 
+#include <algorithm>
+#include <map>
+#include <set>
 #include <stdexcept>
+#include <qbsp/qbsp.hh>
 #include <vis/vis.hh>
 
 #include "test_qbsp.hh"
@@ -182,3 +186,284 @@ TEST(vis, ClipStackWinding)
 
     FreeStackWinding(w1, stack);
 }
+
+TEST(vis, q1SharedRows)
+{
+    auto [bsp, bspx, lit] = QbspVisLight_Q1("q1_light_sun_artifact.map", {}, runvis_t::yes);
+
+    const auto vis = DecompressAllVis(&bsp);
+
+    // clusters that see the same leafs should point at a single copy of the row
+    std::map<std::vector<uint8_t>, int> offset_for_row;
+
+    for (auto &[visofs, row] : vis) {
+        auto [it, inserted] = offset_for_row.emplace(row, visofs);
+        EXPECT_TRUE(inserted) << "rows at " << it->second << " and " << visofs << " are identical";
+    }
+
+    EXPECT_LT(offset_for_row.size(), bsp.dleafs.size() - 1);
+}
+
+static std::unordered_map<int, std::vector<uint8_t>> RunVisQ1(
+    const fs::path &bsp_path, std::vector<std::string> extra_args = {})
+{
+    std::vector<std::string> args{"", "-noautoclean"};
+    args.insert(args.end(), extra_args.begin(), extra_args.end());
+    args.push_back(bsp_path.string());
+
+    vis_main(args);
+
+    bspdata_t bspdata;
+    fs::path path = bsp_path;
+    LoadBSPFile(path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    return DecompressAllVis(&std::get<mbsp_t>(bspdata.bsp));
+}
+
+TEST(vis, stateJournal)
+{
+    LoadTestmapQ1("q1_light_sun_artifact.map");
+    const fs::path bsp_path = qbsp_options.bsp_path;
+
+    const auto vis = RunVisQ1(bsp_path);
+
+    // rewrite the state as if vis stopped after journaling every portal but
+    // before its final snapshot, with the last record cut short
+    for (auto &p : portals) {
+        p.status = pstat_none;
+    }
+    SaveVisState();
+    for (auto &p : portals) {
+        p.status = pstat_done;
+        AppendVisState(p);
+    }
+    fs::resize_file(statejournalfile, fs::file_size(statejournalfile) - 3);
+
+    EXPECT_EQ(vis, RunVisQ1(bsp_path));
+
+    // the resumed run finishes with a full snapshot and an empty journal
+    for (auto &p : portals) {
+        EXPECT_EQ(p.status, pstat_done);
+    }
+
+    CleanVisState();
+    EXPECT_FALSE(fs::exists(statefile));
+    EXPECT_FALSE(fs::exists(statejournalfile));
+}
+
+TEST(vis, splitFlow)
+{
+    LoadTestmapQ1("q1_light_sun_artifact.map");
+    const fs::path bsp_path = qbsp_options.bsp_path;
+
+    // with more threads than portals, every portal's flow is split
+    for (const char *targetchecks : {"0.5", "0"}) {
+        const auto vis = RunVisQ1(bsp_path, {"-nostate", "-targetchecks", targetchecks, "-splitdepth", "0"});
+
+        for (const char *threads : {"1", "2", "4", "256"}) {
+            for (const char *depth : {"1", "2", "3"}) {
+                SCOPED_TRACE(fmt::format("-targetchecks {} -threads {} -splitdepth {}", targetchecks, threads, depth));
+                EXPECT_EQ(vis, RunVisQ1(bsp_path, {"-nostate", "-targetchecks", targetchecks, "-threads", threads,
+                                   "-splitdepth", depth}));
+            }
+        }
+    }
+
+    // default settings
+    EXPECT_EQ(RunVisQ1(bsp_path, {"-nostate", "-splitdepth", "0"}), RunVisQ1(bsp_path, {"-nostate", "-threads", "256"}));
+
+    CleanVisState();
+}
+
+// the decompressed row of every leaf, empty for leafs without one
+static std::vector<std::vector<uint8_t>> LeafVisQ1(const fs::path &bsp_path)
+{
+    bspdata_t bspdata;
+    fs::path path = bsp_path;
+    LoadBSPFile(path, &bspdata);
+    ConvertBSPFormat(&bspdata, &bspver_generic);
+
+    const mbsp_t &bsp = std::get<mbsp_t>(bspdata.bsp);
+    const auto vis = DecompressAllVis(&bsp);
+
+    std::vector<std::vector<uint8_t>> result;
+    for (auto &leaf : bsp.dleafs) {
+        result.push_back(leaf.visofs < 0 ? std::vector<uint8_t>{} : vis.at(leaf.visofs));
+    }
+    return result;
+}
+
+TEST(vis, q1AutoCluster)
+{
+    LoadTestmapQ1("q1_light_sun_artifact.map");
+    RunVisQ1(qbsp_options.bsp_path, {"-nostate"});
+    const auto leafvis = LeafVisQ1(qbsp_options.bsp_path);
+
+    auto [bsp, bspx, prt] = LoadTestmapQ1("q1_light_sun_artifact.map", {"-autocluster", "1024"});
+    ASSERT_TRUE(prt);
+    EXPECT_LT(prt->portalleafs, prt->portalleafs_real);
+
+    RunVisQ1(qbsp_options.bsp_path, {"-nostate"});
+    const auto clustered = LeafVisQ1(qbsp_options.bsp_path);
+    EXPECT_TRUE(nonconvex_clusters);
+
+    // merging leafs only adds to what each of them sees
+    ASSERT_EQ(leafvis.size(), clustered.size());
+    for (size_t i = 0; i < leafvis.size(); i++) {
+        SCOPED_TRACE(i);
+        ASSERT_EQ(leafvis[i].size(), clustered[i].size());
+        for (size_t j = 0; j < leafvis[i].size(); j++) {
+            EXPECT_EQ(leafvis[i][j] & ~clustered[i][j], 0);
+        }
+    }
+}
+
+TEST(vis, q1AutoClusterDetail)
+{
+    // detail clusters are convex, so vis keeps checking leafs for recursion
+    auto [bsp, bspx, prt] = LoadTestmapQ1("q1_tjunc_matrix.map");
+    ASSERT_TRUE(prt);
+    ASSERT_LT(prt->portalleafs, prt->portalleafs_real);
+
+    RunVisQ1(qbsp_options.bsp_path, {"-nostate"});
+    EXPECT_FALSE(nonconvex_clusters);
+
+    auto [clustered_bsp, clustered_bspx, clustered_prt] =
+        LoadTestmapQ1("q1_tjunc_matrix.map", {"-autocluster", "2048"});
+    ASSERT_TRUE(clustered_prt);
+    ASSERT_EQ(prt->dleafinfos.size(), clustered_prt->dleafinfos.size());
+
+    RunVisQ1(qbsp_options.bsp_path, {"-nostate"});
+    EXPECT_TRUE(nonconvex_clusters);
+
+    // some detail cluster was merged with another cluster
+    std::vector<int> cluster_leafs(prt->portalleafs);
+    for (size_t i = 1; i < prt->dleafinfos.size(); i++)
+        cluster_leafs[prt->dleafinfos[i].cluster]++;
+
+    std::map<int, std::set<int>> merged_from;
+    for (size_t i = 1; i < prt->dleafinfos.size(); i++)
+        merged_from[clustered_prt->dleafinfos[i].cluster].insert(prt->dleafinfos[i].cluster);
+
+    EXPECT_TRUE(std::any_of(merged_from.begin(), merged_from.end(), [&](const auto &clusters) {
+        return clusters.second.size() > 1 &&
+               std::any_of(clusters.second.begin(), clusters.second.end(),
+                   [&](int cluster) { return cluster_leafs[cluster] > 1; });
+    }));
+}
+
+TEST(vis, timeLimit)
+{
+    LoadTestmapQ1("q1_tjunc_matrix.map");
+    const fs::path bsp_path = qbsp_options.bsp_path;
+
+    RunVisQ1(bsp_path, {"-nostate", "-fast"});
+    const auto fast = LeafVisQ1(bsp_path);
+    RunVisQ1(bsp_path, {"-nostate"});
+    const auto full = LeafVisQ1(bsp_path);
+    ASSERT_NE(fast, full);
+
+    // what a run cut short gives lies between the two
+    auto check_between = [&](const std::vector<std::vector<uint8_t>> &timed) {
+        ASSERT_EQ(full.size(), timed.size());
+        ASSERT_EQ(fast.size(), timed.size());
+        for (size_t i = 0; i < timed.size(); i++) {
+            SCOPED_TRACE(i);
+            ASSERT_EQ(full[i].size(), timed[i].size());
+            ASSERT_EQ(fast[i].size(), timed[i].size());
+            for (size_t j = 0; j < timed[i].size(); j++) {
+                EXPECT_EQ(full[i][j] & ~timed[i][j], 0);
+                EXPECT_EQ(timed[i][j] & ~fast[i][j], 0);
+            }
+        }
+    };
+
+    // runs out of time straight away
+    CleanVisState();
+    RunVisQ1(bsp_path, {"-timelimit", "0.000001"});
+    EXPECT_TRUE(timelimit_reached);
+    check_between(LeafVisQ1(bsp_path));
+
+    // runs out of time once half of the portals have been flowed; on one
+    // thread, the portals before that one are done and the rest are not
+    CleanVisState();
+
+    const size_t stop_after = portals.size() / 2;
+    size_t flowed = 0;
+    portal_flowed_callback = [&](const visportal_t &) {
+        if (++flowed == stop_after) {
+            timelimit_reached = true;
+        }
+    };
+    RunVisQ1(bsp_path, {"-threads", "1", "-timelimit", "1000"});
+    portal_flowed_callback = nullptr;
+
+    EXPECT_TRUE(timelimit_reached);
+    EXPECT_EQ(flowed, stop_after);
+
+    const auto timed = LeafVisQ1(bsp_path);
+    check_between(timed);
+
+    // some of the vis was refined, but not all of it
+    EXPECT_NE(timed, fast);
+    EXPECT_NE(timed, full);
+
+    // the state kept the finished portals, and the next run only flows the rest
+    EXPECT_TRUE(fs::exists(statefile));
+    flowed = 0;
+    portal_flowed_callback = [&](const visportal_t &) { flowed++; };
+    RunVisQ1(bsp_path);
+    portal_flowed_callback = nullptr;
+
+    EXPECT_FALSE(timelimit_reached);
+    EXPECT_EQ(flowed, portals.size() - (stop_after - 1));
+    EXPECT_EQ(full, LeafVisQ1(bsp_path));
+
+    CleanVisState();
+}
+
+TEST(vis, splitFlowDeep)
+{
+    LoadTestmapQ1("q1_tjunc_matrix.map");
+    const fs::path bsp_path = qbsp_options.bsp_path;
+
+    // default settings
+    const auto vis = RunVisQ1(bsp_path, {"-nostate", "-splitdepth", "0"});
+
+    for (const char *threads : {"2", "4", "256"}) {
+        SCOPED_TRACE(threads);
+        EXPECT_EQ(vis, RunVisQ1(bsp_path, {"-nostate", "-threads", threads, "-splitdepth", "3"}));
+    }
+
+    // reflow every portal with and without splitting, with and without
+    // target checks; the split flow must spawn tasks and see exactly the
+    // same leafs on this map
+    vis_options.splitdepth.set_value(3, settings::source::COMMANDLINE);
+
+    for (double targetratio : {0.5, 0.0}) {
+        SCOPED_TRACE(targetratio);
+        vis_options.targetratio.set_value(targetratio, settings::source::COMMANDLINE);
+
+        int64_t splitflows = 0;
+        for (auto &p : portals) {
+            p.status = pstat_working;
+            p.visbits.clear();
+            PortalFlow(&p, false);
+            const leafbits_t unsplit = p.visbits;
+
+            p.status = pstat_working;
+            p.visbits.clear();
+            splitflows += PortalFlow(&p, true).c_splitflows;
+            p.status = pstat_done;
+
+            for (int i = 0; i < portalleafs; i++) {
+                EXPECT_EQ(unsplit[i], bool(p.visbits[i]));
+            }
+        }
+
+        EXPECT_GT(splitflows, 0);
+    }
+
+    CleanVisState();
+}
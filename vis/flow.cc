@@ -3,6 +3,10 @@
 #include <common/log.hh>
 #include <common/parallel.hh>
 #include <bit> // for std::popcount
+#include <list>
+#include <mutex>
+
+#include <tbb/task_group.h>
 
 /*
   ==============
@@ -113,9 +117,24 @@ static void ClipToSeparators(visstats_t &stats, const viswinding_t *source, cons
     }
 }
 
-static int CheckStack(leaf_t *leaf, threaddata_t *thread)
+/*
+ * Check we haven't recursed into a leaf already on the stack.
+ *
+ * Clusters qbsp -autocluster merged needn't be convex, so a line can leave
+ * one and come back into it. A line can't cross the same portal twice
+ * though, so with those only the portal is checked. Detail clusters are
+ * convex and keep the leaf check.
+ */
+static int CheckStack(const leaf_t *leaf, const pstack_t &prevstack, threaddata_t *thread)
 {
-    for (pstack_t *p = thread->pstack_head.next; p; p = p->next)
+    if (nonconvex_clusters) {
+        for (const pstack_t *p = &thread->pstack_head; p != &prevstack; p = p->next)
+            if (p->portal == prevstack.portal)
+                return 1;
+        return 0;
+    }
+
+    for (const pstack_t *p = thread->pstack_head.next; p; p = p->next)
         if (p->leaf == leaf)
             return 1;
     return 0;
@@ -345,6 +364,102 @@ static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
     return numchecks;
 }
 
+/*
+ * A branch of a portal's flow that runs as its own task (see PortalFlow).
+ * It gets its own copy of the stack from the head down to the branch,
+ * since the parent flow goes on to reuse the frames for the next
+ * branches, and its own leafvis.
+ */
+struct flowtask_t
+{
+    leafbits_t leafvis;
+    threaddata_t thread;
+    unsigned spawn_numsteps, spawn_numtargetchecks; // the parent's, when spawned
+    std::vector<std::unique_ptr<pstack_t>> frames; // below the head
+    std::vector<std::unique_ptr<leafbits_t>> mightsee;
+
+    inline flowtask_t(const leafbits_t &parentvis)
+        : leafvis(parentvis),
+          thread{leafvis}
+    {
+    }
+};
+
+struct flowsplit_t
+{
+    int depth;
+    tbb::task_group group;
+    std::mutex tasks_mutex;
+    std::list<std::unique_ptr<flowtask_t>> tasks;
+};
+
+static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevstack, int depth);
+
+/*
+  ==================
+  SpawnLeafFlow
+
+  Runs RecursiveLeafFlow(leafnum, thread, stack) as a separate task.
+  ==================
+*/
+static void SpawnLeafFlow(int leafnum, threaddata_t *thread, pstack_t &stack, int depth)
+{
+    std::vector<const pstack_t *> chain;
+    for (const pstack_t *frame = &thread->pstack_head; frame; frame = frame->next) {
+        chain.push_back(frame);
+        if (frame == &stack)
+            break;
+    }
+
+    ++thread->stats.c_splitflows;
+
+    auto task = std::make_unique<flowtask_t>(thread->leafvis);
+    task->thread.base = thread->base;
+    // the task carries on from the parent's step and target check counts, so
+    // it does target checks when the parent would have; what it adds to
+    // them is its own and is added to the flow's totals when it finishes
+    task->thread.numsteps = task->spawn_numsteps = thread->numsteps;
+    task->thread.numtargetchecks = task->spawn_numtargetchecks = thread->numtargetchecks;
+
+    std::vector<pstack_t *> copies{&task->thread.pstack_head};
+    task->thread.pstack_head = *chain[0];
+    for (size_t i = 1; i < chain.size(); i++) {
+        copies.push_back(task->frames.emplace_back(std::make_unique<pstack_t>(*chain[i])).get());
+    }
+
+    // windings on the stack may live in any frame above, so point them at the copies
+    auto rebase = [&](viswinding_t *w) {
+        for (size_t i = 0; i < chain.size(); i++) {
+            if (w >= chain[i]->windings && w < chain[i]->windings + STACK_WINDINGS) {
+                return copies[i]->windings + (w - chain[i]->windings);
+            }
+        }
+        return w;
+    };
+
+    for (size_t i = 0; i < copies.size(); i++) {
+        pstack_t *copy = copies[i];
+        copy->source = rebase(copy->source);
+        copy->pass = rebase(copy->pass);
+        copy->next = (i + 1 < copies.size()) ? copies[i + 1] : nullptr;
+
+        // the head's mightsee is the base portal's, which is only read
+        if (i > 0) {
+            copy->mightsee = task->mightsee.emplace_back(std::make_unique<leafbits_t>(*copy->mightsee)).get();
+        }
+    }
+
+    flowtask_t *t = task.get();
+    pstack_t *last = copies.back();
+
+    {
+        std::unique_lock lock(thread->split->tasks_mutex);
+        thread->split->tasks.push_back(std::move(task));
+    }
+
+    thread->split->group.run([t, last, leafnum, depth]() { RecursiveLeafFlow(leafnum, &t->thread, *last, depth); });
+}
+
 /*
   ==================
   RecursiveLeafFlow
@@ -353,10 +468,14 @@ static unsigned IterativeTargetChecks(visstats_t &stats, pstack_t *const head)
   If src_portal is NULL, this is the originating leaf
   ==================
 */
-static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevstack)
+static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevstack, int depth)
 {
     pstack_t stack;
 
+    // -timelimit has passed; the portal is left for the next run
+    if (timelimit_reached.load(std::memory_order_relaxed))
+        return;
+
     ++thread->stats.c_chains;
 
     leaf_t *leaf = &leafs[leafnum];
@@ -364,16 +483,13 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
     /*
      * Check we haven't recursed into a leaf already on the stack
      */
-    if (CheckStack(leaf, thread)) {
+    if (CheckStack(leaf, prevstack, thread)) {
         logging::funcprint("WARNING: recursion on leaf {}\n", leafnum);
         return;
     }
 
     // mark the leaf as visible
-    if (!thread->leafvis[leafnum]) {
-        thread->leafvis[leafnum] = true;
-        thread->base->numcansee++;
-    }
+    thread->leafvis[leafnum] = true;
 
     // check all target portals instead of just neighbor portals, if the time is right
     if (vis_options.targetratio.value() > 0.0 && prevstack.num_expected_targetchecks > 0 &&
@@ -474,10 +590,16 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
         if (!stack.pass)
             continue;
 
+        // branches at the split depth run as tasks of their own
+        const bool spawn = thread->split && depth + 1 == thread->split->depth;
+
         if (!prevstack.pass) {
             // the second leaf can only be blocked if coplanar
             stack.source = prevstack.source;
-            RecursiveLeafFlow(p->leaf, thread, stack);
+            if (spawn)
+                SpawnLeafFlow(p->leaf, thread, stack, depth + 1);
+            else
+                RecursiveLeafFlow(p->leaf, thread, stack, depth + 1);
             FreeStackWinding(stack.pass, stack);
             continue;
         }
@@ -502,7 +624,10 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
         thread->stats.c_portalpass++;
 
         // flow through it for real
-        RecursiveLeafFlow(p->leaf, thread, stack);
+        if (spawn)
+            SpawnLeafFlow(p->leaf, thread, stack, depth + 1);
+        else
+            RecursiveLeafFlow(p->leaf, thread, stack, depth + 1);
 
         FreeStackWinding(stack.source, stack);
         FreeStackWinding(stack.pass, stack);
@@ -512,9 +637,23 @@ static void RecursiveLeafFlow(int leafnum, threaddata_t *thread, pstack_t &prevs
 /*
   ===============
   PortalFlow
+
+  If split is set, the branches of the flow at depth -splitdepth are run
+  as separate tasks, so the last few portals can use all of the threads.
+  Each sees what's visible through its branch; the results are ORed
+  together at the end.
+
+  Each task works on its own copies of the frames above its branch, so its
+  target checks only narrow what that branch might see. A branch skips
+  only the leafs it has seen itself and may do its target checks at a
+  different step, so it can test portals in a different order than the
+  unsplit flow. ClipToSeparators leaves a frame's separator cache partly
+  filled when the first portal tested against it is clipped away, so the
+  order can change a few leafs either way, as -threads can; either result
+  only sees what some line through the portals can.
   ===============
 */
-visstats_t PortalFlow(visportal_t *p)
+visstats_t PortalFlow(visportal_t *p, bool split)
 {
     threaddata_t data{p->visbits};
 
@@ -532,7 +671,32 @@ visstats_t PortalFlow(visportal_t *p)
     data.numsteps = 0;
     data.numtargetchecks = 0;
 
-    RecursiveLeafFlow(p->leaf, &data, data.pstack_head);
+    std::unique_ptr<flowsplit_t> flowsplit;
+    if (split && vis_options.splitdepth.value() > 0) {
+        flowsplit = std::make_unique<flowsplit_t>();
+        flowsplit->depth = vis_options.splitdepth.value();
+        data.split = flowsplit.get();
+    }
+
+    RecursiveLeafFlow(p->leaf, &data, data.pstack_head, 0);
+
+    const int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
+
+    if (flowsplit) {
+        flowsplit->group.wait();
+
+        for (auto &task : flowsplit->tasks) {
+            for (int j = 0; j < numblocks; j++)
+                p->visbits.data()[j] |= task->leafvis.data()[j];
+            data.stats = data.stats + task->thread.stats;
+            data.numsteps += task->thread.numsteps - task->spawn_numsteps;
+            data.numtargetchecks += task->thread.numtargetchecks - task->spawn_numtargetchecks;
+        }
+    }
+
+    p->numcansee = 0;
+    for (int j = 0; j < numblocks; j++)
+        p->numcansee += std::popcount(p->visbits.data()[j]);
 
     return data.stats;
 }
@@ -29,8 +29,11 @@
 #include "common/fs.hh"
 #include <common/log.hh>
 #include <fstream>
+#include <mutex>
+#include <sstream>
 
 constexpr uint32_t VIS_STATE_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | '1');
+constexpr uint32_t VIS_JOURNAL_VERSION = ('T' << 24 | 'Y' << 16 | 'R' << 8 | 'J');
 
 struct dvisstate_t
 {
@@ -54,6 +57,47 @@ struct dportal_t
     auto stream_data() { return std::tie(status, might, vis, nummightsee, numcansee); }
 };
 
+/*
+ * The state is kept in two files: the .vis file is a full snapshot of every
+ * portal, and the journal next to it gets one record appended per portal
+ * completed since. Loading replays the journal on top of the snapshot; the
+ * snapshot is only rewritten (and the journal emptied) when the journal has
+ * grown as large as the snapshot, and at the start and end of the full vis.
+ */
+struct dvisjournal_t
+{
+    uint32_t version;
+    uint32_t numportals;
+    uint32_t numleafs;
+
+    auto stream_data() { return std::tie(version, numportals, numleafs); }
+};
+
+struct dportalrecord_t
+{
+    uint32_t portalnum;
+    uint32_t numcansee;
+    uint32_t vis;
+    uint32_t time_elapsed;
+    uint32_t checksum; // of the compressed visbits
+
+    auto stream_data() { return std::tie(portalnum, numcansee, vis, time_elapsed, checksum); }
+};
+
+constexpr size_t VIS_JOURNAL_HEADER_SIZE = sizeof(uint32_t) * 3;
+constexpr size_t VIS_JOURNAL_RECORD_SIZE = sizeof(uint32_t) * 5;
+
+// only guards appending to the journal, not the portals
+static std::mutex journal_mutex;
+static std::ofstream journal;
+static uint64_t journal_size, snapshot_size;
+static bool compaction_pending;
+
+static uint32_t JournalChecksum(const uint8_t *data, size_t size)
+{
+    return static_cast<uint32_t>(fnv1a_64(data, size));
+}
+
 static int CompressBits(uint8_t *out, const leafbits_t &in)
 {
     int i, rep, shift, numbytes;
@@ -131,12 +175,95 @@ static void CopyLeafBits(leafbits_t &dst, const uint8_t *src, size_t numleafs)
     }
 }
 
+/*
+  ==================
+  ResetVisJournal
+
+  Replaces the journal with an empty one. Called with journal_mutex held.
+  ==================
+*/
+static void ResetVisJournal()
+{
+    journal.close();
+    journal.clear();
+
+    journal.open(statejournalfile, std::ios_base::out | std::ios_base::trunc | std::ios_base::binary);
+    journal << endianness<std::endian::little>;
+
+    journal <= dvisjournal_t{VIS_JOURNAL_VERSION, static_cast<uint32_t>(numportals), static_cast<uint32_t>(portalleafs)};
+    journal.flush();
+
+    if (!journal)
+        FError("error writing state journal {}", statejournalfile);
+
+    journal_size = VIS_JOURNAL_HEADER_SIZE;
+    compaction_pending = false;
+}
+
+/*
+  ==================
+  AppendVisState
+
+  Appends a record for a completed portal to the journal. Returns true when
+  the journal has grown large enough that SaveVisState should compact it;
+  only one caller gets true until it has.
+  ==================
+*/
+bool AppendVisState(const visportal_t &p)
+{
+    // build the record before taking the lock
+    std::vector<uint8_t> vis((portalleafs + 7) >> 3);
+    const int vis_len = CompressBits(vis.data(), p.visbits);
+
+    std::ostringstream record(std::ios_base::out | std::ios_base::binary);
+    record << endianness<std::endian::little>;
+
+    record <= dportalrecord_t{static_cast<uint32_t>(&p - portals.data()), static_cast<uint32_t>(p.numcansee),
+                  static_cast<uint32_t>(vis_len), static_cast<uint32_t>((I_FloatTime() - starttime).count()),
+                  JournalChecksum(vis.data(), vis_len)};
+    record.write(reinterpret_cast<const char *>(vis.data()), vis_len);
+
+    const std::string data = record.str();
+
+    std::unique_lock lock(journal_mutex);
+
+    if (!journal.is_open()) {
+        journal.open(statejournalfile, std::ios_base::out | std::ios_base::app | std::ios_base::binary);
+    }
+
+    journal.write(data.data(), data.size());
+    journal.flush();
+
+    if (!journal)
+        FError("error writing state journal {}", statejournalfile);
+
+    journal_size += data.size();
+
+    if (compaction_pending || journal_size < snapshot_size) {
+        return false;
+    }
+
+    compaction_pending = true;
+    return true;
+}
+
+/*
+  ==================
+  SaveVisState
+
+  Writes a full snapshot of the portals and empties the journal. While
+  portals are being flowed, the caller must hold the portal lock, so no
+  portal completes between the two.
+  ==================
+*/
 void SaveVisState()
 {
     int vis_len, might_len;
     dvisstate_t state;
     dportal_t pstate;
 
+    statetime = I_FloatTime();
+
     std::ofstream out(statetmpfile, std::ios_base::out | std::ios_base::binary);
     out << endianness<std::endian::little>;
 
@@ -174,8 +301,11 @@ void SaveVisState()
         }
     }
 
+    const uint64_t size = out.tellp();
     out.close();
 
+    std::unique_lock lock(journal_mutex);
+
     std::error_code ec;
 
     fs::remove(statefile, ec);
@@ -185,13 +315,107 @@ void SaveVisState()
     fs::rename(statetmpfile, statefile, ec);
     if (ec)
         FError("error renaming state file ({})", ec.message());
+
+    // the records in the journal are all in the snapshot now
+    snapshot_size = size;
+    ResetVisJournal();
 }
 
 void CleanVisState()
 {
+    {
+        std::unique_lock lock(journal_mutex);
+        journal.close();
+        journal.clear();
+    }
+
     if (fs::exists(statefile)) {
         fs::remove(statefile);
     }
+    if (fs::exists(statejournalfile)) {
+        fs::remove(statejournalfile);
+    }
+}
+
+/*
+  ==================
+  ReplayVisJournal
+
+  Marks the portals recorded in the journal as done. Stops at the first
+  incomplete or damaged record, which is where a crash mid-write leaves the
+  end of the file.
+  ==================
+*/
+static void ReplayVisJournal(uint32_t snapshot_elapsed)
+{
+    std::ifstream in(statejournalfile, std::ios_base::in | std::ios_base::binary);
+
+    if (!in) {
+        return;
+    }
+
+    in >> endianness<std::endian::little>;
+
+    dvisjournal_t header;
+    in >= header;
+
+    if (!in || header.version != VIS_JOURNAL_VERSION || header.numportals != numportals ||
+        header.numleafs != portalleafs) {
+        logging::print("WARNING: state journal {} does not match, ignoring it\n", statejournalfile);
+        return;
+    }
+
+    const int numbytes = (portalleafs + 7) >> 3;
+    std::vector<uint8_t> compressed(numbytes);
+    uint32_t time_elapsed = snapshot_elapsed;
+    size_t numrecords = 0;
+
+    while (true) {
+        dportalrecord_t record;
+        in >= record;
+
+        if (!in) {
+            // end of the journal, or a record cut short
+            break;
+        }
+
+        if (record.portalnum >= portals.size() || record.vis == 0 || record.vis > numbytes) {
+            logging::print("WARNING: damaged record in state journal {}, ignoring the rest\n", statejournalfile);
+            break;
+        }
+
+        in.read(reinterpret_cast<char *>(compressed.data()), record.vis);
+
+        if (!in) {
+            break;
+        }
+
+        if (JournalChecksum(compressed.data(), record.vis) != record.checksum) {
+            logging::print("WARNING: damaged record in state journal {}, ignoring the rest\n", statejournalfile);
+            break;
+        }
+
+        visportal_t &p = portals[record.portalnum];
+
+        p.visbits.resize(portalleafs);
+
+        if (record.vis < numbytes) {
+            DecompressBits(p.visbits, compressed.data());
+        } else {
+            CopyLeafBits(p.visbits, compressed.data(), portalleafs);
+        }
+
+        p.status = pstat_done;
+        p.numcansee = record.numcansee;
+
+        time_elapsed = std::max(time_elapsed, record.time_elapsed);
+        numrecords++;
+    }
+
+    logging::print("Replayed {} portals from the state journal\n", numrecords);
+
+    /* Move back the start time by the time spent on them */
+    starttime -= duration(time_elapsed - snapshot_elapsed);
 }
 
 bool LoadVisState()
@@ -279,5 +503,7 @@ bool LoadVisState()
         }
     }
 
+    ReplayVisJournal(state.time_elapsed);
+
     return true;
 }
@@ -5,14 +5,21 @@
 #include <common/bsputils.hh>
 #include <common/fs.hh>
 #include <common/parallel.hh>
+#include <common/profiler.hh>
 
+#include <algorithm>
 #include <climits>
+#include <condition_variable>
 #include <cstdint>
 #include <bit> // for std::countr_zero
 #include <numeric> // for std::accumulate
+#include <thread>
+#include <unordered_map>
 
 #include <fmt/chrono.h>
 
+#include <tbb/global_control.h>
+
 /*
  * If the portal file is "PRT2" format, then the leafs we are dealing with are
  * really clusters of leaves. So, after the vis job is done we need to expand
@@ -21,6 +28,7 @@
 int numportals;
 int portalleafs; /* leafs (PRT1) or clusters (PRT2) */
 int portalleafs_real; /* real no. of leafs after expanding PRT2 clusters. Not used for Q2. */
+bool nonconvex_clusters; /* Q1 PRT2: some clusters aren't a BSP node's cell (qbsp -autocluster) */
 
 std::vector<visportal_t> portals; // always numportals * 2; front and back
 std::vector<leaf_t> leafs;
@@ -62,7 +70,7 @@ void vis_settings::initialize(int argc, const char **argv)
 
 settings::vis_settings vis_options;
 
-fs::path portalfile, statefile, statetmpfile;
+fs::path portalfile, statefile, statetmpfile, statejournalfile;
 
 /*
   ==================
@@ -224,6 +232,10 @@ noclip:
 static std::mutex portal_mutex;
 static std::atomic_int64_t portalIndex;
 
+std::atomic_bool timelimit_reached;
+static time_point timelimit_deadline;
+std::function<void(const visportal_t &)> portal_flowed_callback;
+
 /*
   =============
   GetNextPortal
@@ -231,22 +243,32 @@ static std::atomic_int64_t portalIndex;
   Returns the next portal for a thread to work on
   Returns the portals from the least complex, so the later ones can reuse
   the earlier information.
+  Sets remaining to the number of portals not started after it.
   =============
 */
-visportal_t *GetNextPortal()
+visportal_t *GetNextPortal(size_t &remaining)
 {
     visportal_t *ret = nullptr;
     uint32_t min = INT_MAX;
 
+    remaining = 0;
+
     portal_mutex.lock();
 
     for (auto &p : portals) {
-        if (p.nummightsee < min && p.status == pstat_none) {
-            min = p.nummightsee;
-            ret = &p;
+        if (p.status == pstat_none) {
+            remaining++;
+            if (p.nummightsee < min) {
+                min = p.nummightsee;
+                ret = &p;
+            }
         }
     }
 
+    if (remaining) {
+        remaining--;
+    }
+
     if (ret) {
         ret->status = pstat_working;
     }
@@ -349,7 +371,10 @@ static void PortalCompleted(visstats_t &stats, visportal_t *completed)
 }
 
 time_point starttime, endtime, statetime;
-static duration stateinterval;
+
+static profiler::counter c_portals_flowed{"portals flowed"};
+static profiler::counter c_portal_checks{"portal checks"};
+static profiler::counter c_portal_tests{"portal tests"};
 
 /*
   ==============
@@ -358,23 +383,44 @@ static duration stateinterval;
 */
 static visstats_t LeafThread()
 {
-    portal_mutex.lock();
-    /* Save state if sufficient time has elapsed */
-    auto now = I_FloatTime();
-    if (now > statetime + stateinterval) {
-        statetime = now;
-        SaveVisState();
-    }
-    portal_mutex.unlock();
+    if (vis_options.timelimit.value() > 0 && I_FloatTime() >= timelimit_deadline)
+        timelimit_reached = true;
+    if (timelimit_reached)
+        return {};
 
-    visportal_t *p = GetNextPortal();
+    size_t remaining;
+    visportal_t *p = GetNextPortal(remaining);
     if (!p)
         return {};
 
-    visstats_t stats = PortalFlow(p);
+    // once threads would otherwise go idle, split the portal's flow between them
+    const size_t threads = tbb::global_control::active_value(tbb::global_control::max_allowed_parallelism);
+    visstats_t stats = PortalFlow(p, remaining < threads);
+
+    if (portal_flowed_callback)
+        portal_flowed_callback(*p);
+
+    /* The flow may have been cut short; start the portal over next run */
+    if (timelimit_reached) {
+        portal_mutex.lock();
+        p->status = pstat_none;
+        portal_mutex.unlock();
+        return stats;
+    }
 
     PortalCompleted(stats, p);
 
+    /* Journal the portal; rewrite the full state once the journal is as big as it */
+    if (AppendVisState(*p)) {
+        portal_mutex.lock();
+        SaveVisState();
+        portal_mutex.unlock();
+    }
+
+    c_portals_flowed++;
+    c_portal_checks += stats.c_portalcheck;
+    c_portal_tests += stats.c_portaltest;
+
     logging::print(logging::flag::VERBOSE, "portal:{:4}  mightsee:{:4}  cansee:{:4}\n", (ptrdiff_t)(p - portals.data()),
         p->nummightsee, p->numcansee);
 
@@ -390,13 +436,18 @@ static visstats_t LeafThread()
 */
 int64_t totalvis;
 
-static std::vector<uint8_t> compressed;
+struct cluster_row_t
+{
+    std::vector<uint8_t> compressed;
+    int numvis = 0;
+};
 
-static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
+static cluster_row_t ClusterFlow(int clusternum, const mbsp_t *bsp)
 {
     /*
      * Collect visible bits from all portals into buffer
      */
+    leafbits_t buffer(portalleafs);
     leaf_t *leaf = &leafs[clusternum];
     int numblocks = (portalleafs + leafbits_t::mask) >> leafbits_t::shift;
     for (const visportal_t *p : leaf->portals) {
@@ -414,7 +465,7 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
     /*
      * Now expand the clusters into the full leaf visibility map
      */
-    int numvis = 0;
+    cluster_row_t row;
 
     uint8_t *outbuffer;
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
@@ -422,7 +473,7 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
         for (int i = 0; i < portalleafs; i++) {
             if (buffer[i]) {
                 outbuffer[i >> 3] |= nth_bit(i & 7);
-                numvis++;
+                row.numvis++;
             }
         }
     } else {
@@ -430,7 +481,7 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
         for (int i = 0; i < portalleafs_real; i++) {
             if (buffer[bsp->dleafs[i + 1].cluster]) {
                 outbuffer[i >> 3] |= nth_bit(i & 7);
-                numvis++;
+                row.numvis++;
             }
         }
     }
@@ -438,47 +489,94 @@ static void ClusterFlow(int clusternum, leafbits_t &buffer, mbsp_t *bsp)
     /*
      * compress the bit string
      */
-    logging::print(logging::flag::VERBOSE, "cluster {:4} : {:4} visible\n", clusternum, numvis);
-
-    /*
-     * increment totalvis by
-     * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
-     */
     if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        // FIXME: not sure what this is supposed to be?
-        totalvis += numvis;
+        CompressRow(outbuffer, (portalleafs + 7) >> 3, std::back_inserter(row.compressed));
     } else {
+        CompressRow(outbuffer, (portalleafs_real + 7) >> 3, std::back_inserter(row.compressed));
+    }
+
+    return row;
+}
+
+/*
+  ==================
+  ClusterFlowAll
+
+  Builds the rows of all clusters in parallel, then appends them to the
+  vismap in cluster order. Clusters whose compressed rows are identical share
+  a single copy, so the layout only depends on the rows themselves.
+  ==================
+*/
+static void ClusterFlowAll(mbsp_t *bsp)
+{
+    std::vector<cluster_row_t> rows(portalleafs);
+
+    logging::parallel_for(0, portalleafs, [&](int i) { rows[i] = ClusterFlow(i, bsp); });
+
+    // Q1: number of real leafs in each cluster
+    std::vector<int> clusterleafs;
+    if (bsp->loadversion->game->id != GAME_QUAKE_II) {
+        clusterleafs.resize(portalleafs);
         for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                totalvis += numvis;
-            }
+            clusterleafs[bsp->dleafs[i + 1].cluster]++;
         }
     }
 
-    compressed.clear();
+    // offsets of the rows written so far, by the hash of their compressed bytes
+    std::unordered_map<uint64_t, std::vector<int32_t>> offsets;
+    std::vector<int32_t> clusterofs(portalleafs);
+    size_t shared_rows = 0, shared_bytes = 0;
 
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        CompressRow(outbuffer, (portalleafs + 7) >> 3, std::back_inserter(compressed));
-    } else {
-        CompressRow(outbuffer, (portalleafs_real + 7) >> 3, std::back_inserter(compressed));
-    }
+    for (int clusternum = 0; clusternum < portalleafs; clusternum++) {
+        const cluster_row_t &row = rows[clusternum];
+
+        logging::print(logging::flag::VERBOSE, "cluster {:4} : {:4} visible\n", clusternum, row.numvis);
+
+        /*
+         * increment totalvis by
+         * (# of real leafs in this cluster) x (# of real leafs visible from this cluster)
+         */
+        if (bsp->loadversion->game->id == GAME_QUAKE_II) {
+            // FIXME: not sure what this is supposed to be?
+            totalvis += row.numvis;
+        } else {
+            totalvis += static_cast<int64_t>(clusterleafs[clusternum]) * row.numvis;
+        }
+
+        const uint64_t hash = fnv1a_64(row.compressed.data(), row.compressed.size());
+        auto &candidates = offsets[hash];
+        int32_t visofs = -1;
+
+        for (int32_t ofs : candidates) {
+            if (std::equal(row.compressed.begin(), row.compressed.end(), vismap.begin() + ofs,
+                    vismap.begin() + std::min(vismap.size(), ofs + row.compressed.size()))) {
+                visofs = ofs;
+                break;
+            }
+        }
 
-    /* leaf 0 is a common solid */
-    int32_t visofs = vismap.size();
+        if (visofs != -1) {
+            shared_rows++;
+            shared_bytes += row.compressed.size();
+        } else {
+            /* leaf 0 is a common solid */
+            visofs = vismap.size();
+            candidates.push_back(visofs);
+            std::copy(row.compressed.begin(), row.compressed.end(), std::back_inserter(vismap));
+        }
 
-    bsp->dvis.set_bit_offset(VIS_PVS, clusternum, visofs);
+        clusterofs[clusternum] = visofs;
+        bsp->dvis.set_bit_offset(VIS_PVS, clusternum, visofs);
+    }
 
     // Set pointers
     if (bsp->loadversion->game->id != GAME_QUAKE_II) {
         for (int i = 0; i < portalleafs_real; i++) {
-            if (bsp->dleafs[i + 1].cluster == clusternum) {
-                bsp->dleafs[i + 1].visofs = visofs;
-            }
+            bsp->dleafs[i + 1].visofs = clusterofs[bsp->dleafs[i + 1].cluster];
         }
     }
 
-    std::copy(compressed.begin(), compressed.end(), std::back_inserter(vismap));
+    logging::print("{} of {} clusters share a row; saved {} bytes\n", shared_rows, portalleafs, shared_bytes);
 }
 
 /*
@@ -509,20 +607,68 @@ visstats_t CalcPortalVis(const mbsp_t *bsp)
 
     portalIndex = startcount;
 
+    /* Start a fresh journal on top of the current state */
+    SaveVisState();
+
+    /* With -timelimit, a timer stops the flows in progress once it has passed */
+    std::mutex timer_mutex;
+    std::condition_variable timer_cv;
+    bool flows_done = false;
+    std::thread timer;
+
+    if (vis_options.timelimit.value() > 0) {
+        timer = std::thread([&]() {
+            std::unique_lock lock(timer_mutex);
+            if (!timer_cv.wait_until(lock, timelimit_deadline, [&]() { return flows_done; })) {
+                timelimit_reached = true;
+            }
+        });
+    }
+
     std::vector<visstats_t> stats_perportal;
     stats_perportal.resize(numportals * 2);
 
     logging::parallel_for(startcount, numportals * 2, [&](size_t i) { stats_perportal[i] = LeafThread(); });
 
+    if (timer.joinable()) {
+        {
+            std::unique_lock lock(timer_mutex);
+            flows_done = true;
+        }
+        timer_cv.notify_one();
+        timer.join();
+    }
+
     const visstats_t stats = std::accumulate(stats_perportal.begin(), stats_perportal.end(), visstats_t{});
 
     SaveVisState();
 
+    /*
+     * Portals not done in time see everything they might, as with -fast.
+     * Their mightsee was narrowed by the finished portals, but never below
+     * what a full run would give them. The state is saved without them, so
+     * running vis again carries on refining.
+     */
+    if (timelimit_reached) {
+        int32_t unfinished = 0;
+
+        for (auto &p : portals) {
+            if (p.status != pstat_done) {
+                p.visbits = p.mightsee;
+                p.status = pstat_done;
+                unfinished++;
+            }
+        }
+
+        logging::print("-timelimit reached: {} of {} portals use their rough vis\n", unfinished, numportals * 2);
+    }
+
     logging::print(logging::flag::VERBOSE, "portalcheck: {}  portaltest: {}  portalpass: {}\n", stats.c_portalcheck,
         stats.c_portaltest, stats.c_portalpass);
     logging::print(logging::flag::VERBOSE, "c_vistest: {}  c_mighttest: {}  c_mightseeupdate {}\n", stats.c_vistest,
         stats.c_mighttest, stats.c_mightseeupdate);
-    logging::print(logging::flag::VERBOSE, "c_targetcheck: {}\n", stats.c_targetcheck);
+    logging::print(logging::flag::VERBOSE, "c_targetcheck: {}  c_splitflows: {}\n", stats.c_targetcheck,
+        stats.c_splitflows);
 
     return stats;
 }
@@ -538,21 +684,23 @@ visstats_t CalcVis(mbsp_t *bsp)
         logging::print("Loaded previous state. Resuming progress...\n");
     } else {
         logging::print("Calculating Base Vis:\n");
+        profiler::scope scope("BasePortalVis");
         BasePortalVis();
     }
 
     logging::print("Calculating Full Vis:\n");
-    auto stats = CalcPortalVis(bsp);
+    visstats_t stats;
+    {
+        profiler::scope scope("CalcPortalVis");
+        stats = CalcPortalVis(bsp);
+    }
 
     //
     // assemble the leaf vis lists by oring and compressing the portal lists
     //
     logging::print("Expanding clusters...\n");
-    leafbits_t buffer(portalleafs);
-    for (int i = 0; i < portalleafs; i++) {
-        ClusterFlow(i, buffer, bsp);
-        buffer.clear();
-    }
+    profiler::scope scope("ClusterFlow");
+    ClusterFlowAll(bsp);
 
     int64_t avg = totalvis;
 
@@ -574,6 +722,40 @@ visstats_t CalcVis(mbsp_t *bsp)
 #include <fstream>
 #include <common/prtfile.hh>
 
+/*
+ * Returns the cluster of the visleafs under `nodenum`, -1 if there are none,
+ * or -2 if they're in several. For each cluster, `cells` counts the largest
+ * subtrees holding only its leafs.
+ *
+ * Detail clusters are made of the leafs under a node, so each is one such
+ * subtree, and the convex cell of that node. Clusters qbsp -autocluster
+ * merged from separate subtrees needn't be convex.
+ */
+static int ClusterCells_r(const mbsp_t *bsp, int nodenum, std::vector<int> &cells)
+{
+    if (nodenum < 0) {
+        const int leafnum = -nodenum - 1;
+        if (leafnum < 1 || leafnum > portalleafs_real)
+            return -1;
+        return bsp->dleafs[leafnum].cluster;
+    }
+
+    const auto &node = bsp->dnodes[nodenum];
+    const int front = ClusterCells_r(bsp, node.children[0], cells);
+    const int back = ClusterCells_r(bsp, node.children[1], cells);
+
+    if (front == back || back == -1)
+        return front;
+    if (front == -1)
+        return back;
+
+    if (front >= 0)
+        cells[front]++;
+    if (back >= 0)
+        cells[back]++;
+    return -2;
+}
+
 /*
   ============
   LoadPortals
@@ -585,13 +767,7 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
 
     portalleafs = prtfile.portalleafs;
     portalleafs_real = prtfile.portalleafs_real;
-
-    /* Allocate for worst case where RLE might grow the data (unlikely) */
-    if (bsp->loadversion->game->id == GAME_QUAKE_II) {
-        compressed.reserve(std::max(1, (portalleafs * 2) / 8));
-    } else {
-        compressed.reserve(std::max(1, (portalleafs_real * 2) / 8));
-    }
+    nonconvex_clusters = false;
 
     numportals = prtfile.portals.size();
 
@@ -671,6 +847,15 @@ static void LoadPortals(const fs::path &name, mbsp_t *bsp)
     for (int i = 1; i < prtfile.dleafinfos.size(); ++i) {
         bsp->dleafs[i].cluster = prtfile.dleafinfos[i].cluster;
     }
+
+    if (portalleafs != portalleafs_real) {
+        std::vector<int> cells(portalleafs);
+        const int cluster = ClusterCells_r(bsp, bsp->dmodels[0].headnode[0], cells);
+        if (cluster >= 0)
+            cells[cluster]++;
+
+        nonconvex_clusters = std::any_of(cells.begin(), cells.end(), [](int n) { return n > 1; });
+    }
 }
 
 void vis_reset()
@@ -697,17 +882,18 @@ void vis_reset()
     portalfile = fs::path();
     statefile = fs::path();
     statetmpfile = fs::path();
+    statejournalfile = fs::path();
 
     portalIndex = 0;
 
+    timelimit_reached = false;
+    timelimit_deadline = time_point();
+
     starttime = time_point();
     endtime = time_point();
     statetime = time_point();
 
-    stateinterval = duration();
-
     totalvis = 0;
-    compressed.clear();
 }
 
 int vis_main(int argc, const char **argv)
@@ -730,8 +916,8 @@ int vis_main(int argc, const char **argv)
 
     vis_options.print_summary();
 
-    stateinterval = std::chrono::minutes(5); /* 5 minutes */
     starttime = statetime = I_FloatTime();
+    timelimit_deadline = starttime + duration(vis_options.timelimit.value());
 
     LoadBSPFile(vis_options.sourceMap, &bspdata);
 
@@ -756,10 +942,14 @@ int vis_main(int argc, const char **argv)
         }
     } else {
         portalfile = fs::path(vis_options.sourceMap).replace_extension("prt");
-        LoadPortals(portalfile, &bsp);
+        {
+            profiler::scope scope("LoadPortals");
+            LoadPortals(portalfile, &bsp);
+        }
 
         statefile = fs::path(vis_options.sourceMap).replace_extension("vis");
         statetmpfile = fs::path(vis_options.sourceMap).replace_extension("vi0");
+        statejournalfile = fs::path(vis_options.sourceMap).replace_extension("vij");
 
         if (bsp.loadversion->game->id != GAME_QUAKE_II) {
             uncompressed.resize(portalleafs * leafbytes_real);
@@ -779,8 +969,10 @@ int vis_main(int argc, const char **argv)
 
     // no ambient sounds for Q2
     if (bsp.loadversion->game->id != GAME_QUAKE_II) {
+        profiler::scope scope("CalcAmbientSounds");
         CalcAmbientSounds(&bsp);
     } else {
+        profiler::scope scope("CalcPHS");
         CalcPHS(&bsp);
     }
 
@@ -792,10 +984,12 @@ int vis_main(int argc, const char **argv)
     endtime = I_FloatTime();
     logging::print("{:.2} elapsed\n", (endtime - starttime));
 
-    if (vis_options.autoclean.value()) {
+    // keep the state of an unfinished run, so it can be carried on
+    if (vis_options.autoclean.value() && !timelimit_reached) {
         CleanVisState();
     }
 
+    profiler::close();
     logging::close();
 
     return 0;